@@ -34,6 +34,10 @@
 #define CCID_ERR_BUSY			0xe0
 #define CCID_ERR_USR_MIN		0x81
 #define CCID_ERR_USR_MAX		0xc0
+/* otherwise the offset of the offending field in the message */
+#define CCID_ERR_CMD_UNSUPPORTED	0x00
+#define CCID_ERR_BAD_SLOT		0x05
+#define CCID_ERR_BAD_PROTOCOL		0x07
 
 /* Yes of course, all the world is a PC.... (or a RDR) */
 /* Bulk IN */
@@ -70,6 +74,19 @@
 #define CCID_RESULT_ERROR		(1 << 6)
 #define CCID_RESULT_TIMEOUT		(2 << 6)
 
+/* XfrBlock wLevelParameter and DataBlock bChainParameter, for chained
+ * messages at extended APDU level
+ */
+#define CCID_CHAIN_NONE			0x00
+#define CCID_CHAIN_BEGIN		0x01
+#define CCID_CHAIN_END			0x02
+#define CCID_CHAIN_MIDDLE		0x03
+#define CCID_CHAIN_CONTINUE		0x10
+
+/* IccClock bClockCommand */
+#define CCID_CLOCK_CMD_RESTART		0x00
+#define CCID_CLOCK_CMD_STOP		0x01
+
 #define CCID_SLOT_STATUS_MASK		0x03
 #define CCID_STATUS_ICC_ACTIVE		0x0
 #define CCID_STATUS_ICC_PRESENT		0x1
@@ -148,6 +165,11 @@ struct ccid_desc {
 	uint8_t		bMaxCCIDBusySlots;
 } _packed;
 
+/* bmTCCKST0/1 */
+#define CCID_CONV_INVERSE	(1<<1)
+#define CCID_T1_CRC		(1<<0)
+#define CCID_T1_CHECKSUM	(1<<4)
+
 #define CCID_PROTOCOL_T0 0x0
 struct ccid_t0 {
 	uint8_t bmFindexDindex;
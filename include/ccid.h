@@ -9,6 +9,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/uio.h>
 
 #include "compiler.h"
 
@@ -32,6 +33,12 @@
  * Represents a connection to a chip card device. Contains one or more
  * chipcard interfaces (slots or RF fields).
  *
+ * A \ref ccid_t may be used from several threads at once. Calls on the
+ * same slot are serialised, calls on different slots proceed concurrently
+ * up to the reader's limit of busy slots. Errors are kept per thread, see
+ * ccid_error(). Transaction buffers are not locked, so each thread should
+ * use its own.
+ *
  * \defgroup g_xfr CCID Transaction Buffer
  * Provides:
  *
@@ -42,6 +49,9 @@
  * \defgroup g_cci Chip Card Interface
  * Represents a slot or RF field in a chip card device and chip card (if one is
  * present).
+ *
+ * \defgroup g_sched Session Scheduler
+ * Runs jobs on the slots of many readers at once from a pool of threads.
  */
 
 /** \ingroup g_ccid
@@ -71,6 +81,36 @@ _public void libccid_free_device_list(ccidev_t *list);
 _public ccidev_t libccid_device_by_address(uint8_t bus, uint8_t addr);
 _public uint8_t libccid_device_bus(ccidev_t dev);
 _public uint8_t libccid_device_addr(ccidev_t dev);
+_public int libccid_handle_events(unsigned int msecs);
+
+/** \ingroup g_libccid
+ * A reader was attached.
+*/
+#define LIBCCID_DEVICE_ARRIVED		1
+/** \ingroup g_libccid
+ * A reader was detached.
+*/
+#define LIBCCID_DEVICE_LEFT		2
+/** \ingroup g_libccid
+ * Reader hotplug callback.
+*/
+typedef void (*libccid_hotplug_cb_t)(ccidev_t dev, unsigned int event,
+					void *priv);
+_public int libccid_set_hotplug_cb(libccid_hotplug_cb_t cb, void *priv);
+
+_public int libccid_param_cache_load(const char *fn);
+_public int libccid_param_cache_save(const char *fn);
+_public void libccid_param_cache_clear(void);
+
+_public int libccid_desc_cache_load(const char *fn);
+_public int libccid_desc_cache_save(const char *fn);
+_public void libccid_desc_cache_clear(void);
+
+/** \ingroup g_libccid
+ * Prefix each decoded trace record with its time relative to the first.
+*/
+#define CCID_DECODE_TIMESTAMPS		(1U << 0)
+_public int ccid_trace_decode(const char *fn, FILE *out, unsigned int flags);
 
 #define CCID_ERROR_IN_VALUE		1
 #define CCID_ERROR_NO_MEM		2
@@ -82,8 +122,20 @@ _public uint8_t libccid_device_addr(ccidev_t dev);
 #define CCID_ERROR_CARD_TIMEOUT		8
 #define CCID_ERROR_AUTH			9
 #define CCID_ERROR_PIN_TIMEOUT		10 /* not implemented */
+#define CCID_ERROR_BUSY			11 /* command already in flight */
+#define CCID_ERROR_TIMEOUT		12 /* no response in time, aborted */
 
+/** \ingroup g_ccid
+ * Write a compact binary trace, see ccid_trace_decode().
+*/
+#define CCID_TRACE_BINARY		(1U << 0)
+/** \ingroup g_ccid
+ * Open quickly, see ccid_probe_flags().
+*/
+#define CCID_PROBE_FAST			(1U << 1)
 _public ccid_t ccid_probe(ccidev_t dev, const char *tracefile);
+_public ccid_t ccid_probe_flags(ccidev_t dev, const char *tracefile,
+				unsigned int flags);
 _public unsigned int ccid_num_slots(ccid_t ccid);
 _public cci_t ccid_get_slot(ccid_t ccid, unsigned int i);
 _public unsigned int ccid_num_fields(ccid_t ccid);
@@ -93,14 +145,135 @@ _public void ccid_log(ccid_t ccid, const char *fmt, ...) _printf(2, 3);
 _public uint8_t ccid_bus(ccid_t ccid);
 _public uint8_t ccid_addr(ccid_t ccid);
 _public const char *ccid_name(ccid_t ccid);
+_public unsigned int ccid_idle(ccid_t ccid);
 
 _public unsigned int ccid_error(ccid_t ccid);
 
+/** \ingroup g_ccid
+ * A chip card was inserted in to a slot.
+*/
+#define CCID_EVENT_INSERTED		1
+/** \ingroup g_ccid
+ * A chip card was removed from a slot.
+*/
+#define CCID_EVENT_REMOVED		2
+/** \ingroup g_ccid
+ * The device reported a hardware error, eg. overcurrent, on a slot.
+*/
+#define CCID_EVENT_HW_ERROR		3
+
+/** \ingroup g_ccid
+ * Asynchronous slot event, as reported on the interrupt endpoint.
+*/
+struct ccid_event {
+	/** One of the CCID_EVENT_* codes */
+	unsigned int	ev_type;
+	/** Slot which the event pertains to */
+	cci_t		ev_cci;
+	/** Time of arrival, microseconds on the monotonic clock */
+	uint64_t	ev_time;
+	/** Device specific error code for CCID_EVENT_HW_ERROR */
+	uint8_t		ev_hw_error;
+};
+
+/** \ingroup g_ccid
+ * Slot event callback.
+ *
+ * Called from within the libusb event loop, ie. from libccid_handle_events()
+ * or while any other libccid call is waiting on the device.
+*/
+typedef void (*ccid_event_cb_t)(ccid_t ccid, const struct ccid_event *ev,
+				void *priv);
+_public void ccid_set_event_cb(ccid_t ccid, ccid_event_cb_t cb, void *priv);
+
+/** \ingroup g_ccid
+ * Index in to ccid_stats::st_msg for each PC_to_RDR message type.
+*/
+#define CCID_STATS_XFRBLOCK		0
+#define CCID_STATS_POWERON		1
+#define CCID_STATS_POWEROFF		2
+#define CCID_STATS_SLOTSTATUS		3
+#define CCID_STATS_GETPARAMS		4
+#define CCID_STATS_SETPARAMS		5
+#define CCID_STATS_RESETPARAMS		6
+#define CCID_STATS_ESCAPE		7
+#define CCID_STATS_OTHER		8
+#define CCID_STATS_NUM_MSG		9
+
+/** \ingroup g_ccid
+ * Number of latency histogram buckets. Bucket zero counts commands which
+ * completed in under 1us, bucket n counts those taking [2^(n-1), 2^n)us and
+ * the last bucket counts everything slower than that (ie. 4 seconds and up).
+*/
+#define CCID_STATS_NUM_LAT		24
+
+/** \ingroup g_ccid
+ * Counters for one message type.
+*/
+struct ccid_msg_stats {
+	/** Commands completed, successfully or not */
+	uint64_t	ms_count;
+	/** Commands which failed, for any reason */
+	uint64_t	ms_failed;
+	/** Bytes sent in PC_to_RDR messages, including headers */
+	uint64_t	ms_tx_bytes;
+	/** Bytes received in RDR_to_PC messages, including headers */
+	uint64_t	ms_rx_bytes;
+	/** Time extension requests received from the card */
+	uint64_t	ms_time_ext;
+	/** Sum of all latencies in microseconds */
+	uint64_t	ms_lat_total;
+	/** Worst latency seen in microseconds */
+	uint64_t	ms_lat_max;
+	/** Histogram of PC_to_RDR to final RDR_to_PC latency */
+	uint64_t	ms_lat[CCID_STATS_NUM_LAT];
+};
+
+/** \ingroup g_ccid
+ * Per-device statistics, see ccid_get_stats().
+*/
+struct ccid_stats {
+	/** Per message type counters, indexed by CCID_STATS_* */
+	struct ccid_msg_stats st_msg[CCID_STATS_NUM_MSG];
+	/** Failed commands by slot error code, indexed by CCID_ERR_* */
+	uint64_t	st_err[256];
+	/** Commands which failed at the USB level */
+	uint64_t	st_usb_err;
+	/** Commands aborted for want of a response, see cci_set_timeout() */
+	uint64_t	st_timeouts;
+};
+_public void ccid_get_stats(ccid_t ccid, struct ccid_stats *st);
+_public void ccid_reset_stats(ccid_t ccid);
+
+/** \ingroup g_ccid
+ * Delay each response by the time it took in the recording.
+*/
+#define CCID_REPLAY_TIMING		(1U << 0)
+/** \ingroup g_ccid
+ * Fail commands which differ at all from those in the recording.
+*/
+#define CCID_REPLAY_STRICT		(1U << 1)
+
+/** \ingroup g_ccid
+ * Options for ccid_replay().
+*/
+struct ccid_replay_opts {
+	/** Bitmask of CCID_REPLAY_* flags */
+	unsigned int	ro_flags;
+	/** Extra latency, in microseconds, for each message type. Indexed
+	 * by CCID_STATS_* */
+	uint32_t	ro_latency[CCID_STATS_NUM_MSG];
+};
+_public ccid_t ccid_replay(const char *fn, const struct ccid_replay_opts *opts,
+				const char *tracefile, unsigned int flags);
+
 /* Transact xfr buffers */
 _public xfr_t xfr_alloc(size_t txbuf, size_t rxbuf);
 _public void xfr_reset(xfr_t xfr);
 _public int xfr_tx_byte(xfr_t xfr, uint8_t byte);
 _public int xfr_tx_buf(xfr_t xfr, const uint8_t *ptr, size_t len);
+_public int xfr_tx_iov(xfr_t xfr, const struct iovec *iov, unsigned int cnt);
+_public uint8_t *xfr_tx_reserve(xfr_t xfr, size_t len);
 
 _public uint8_t xfr_rx_sw1(xfr_t xfr);
 _public uint8_t xfr_rx_sw2(xfr_t xfr);
@@ -108,6 +281,10 @@ _public const uint8_t *xfr_rx_data(xfr_t xfr, size_t *len);
 
 _public void xfr_free(xfr_t xfr);
 
+_public xfr_t xfr_pool_get(size_t txbuf, size_t rxbuf);
+_public void xfr_pool_put(xfr_t xfr);
+_public void xfr_pool_flush(void);
+
 /* Chip card interface */
 _public ccid_t cci_ccid(cci_t cci);
 
@@ -115,6 +292,37 @@ _public int cci_power_off(cci_t cci);
 _public int cci_transact(cci_t cci, xfr_t xfr);
 _public unsigned int cci_error(cci_t cci);
 
+/** \ingroup g_cci
+ * cci_transact() fetches responses announced with 61xx (or 9Fxx for GSM)
+ * using GET RESPONSE, and resends commands answered with 6Cxx with the
+ * correct Le.
+*/
+#define CCI_AUTO_RESPONSE	(1U << 0)
+_public void cci_set_flags(cci_t cci, unsigned int flags);
+_public unsigned int cci_flags(cci_t cci);
+
+/** \ingroup g_cci
+ * Completion callback for an asynchronous transaction.
+ *
+ * Called from within libccid_handle_events() (or cci_complete()) with the
+ * same result that cci_transact() would have returned.
+*/
+typedef void (*cci_cb_t)(cci_t cci, xfr_t xfr, int result, void *priv);
+_public int cci_submit(cci_t cci, xfr_t xfr, cci_cb_t cb, void *priv);
+_public int cci_complete(cci_t cci);
+
+/** \ingroup g_cci
+ * Time out commands to the card after twice its waiting time, commands
+ * only for the reader after a few seconds.
+*/
+#define CCI_TIMEOUT_AUTO	0U
+/** \ingroup g_cci
+ * Wait for ever.
+*/
+#define CCI_TIMEOUT_NONE	(~0U)
+_public int cci_set_timeout(cci_t cci, unsigned int ms);
+_public unsigned int cci_timeout(cci_t cci);
+
 /* contact interfaces only */
 _public int cci_wait_for_card(cci_t cci);
 
@@ -154,6 +362,8 @@ _public unsigned int cci_slot_status(cci_t cci);
 */
 #define CHIPCARD_CLOCK_STOP	0x4
 _public unsigned int cci_clock_status(cci_t cci);
+_public int cci_set_idle(cci_t cci, unsigned int clock_ms,
+				unsigned int power_ms);
 
 /** \ingroup g_cci
  * Automatically select chip card voltage.
@@ -174,6 +384,21 @@ _public unsigned int cci_clock_status(cci_t cci);
 _public const uint8_t *cci_power_on(cci_t cci, unsigned int voltage,
 				size_t *atr_len);
 
+/** \ingroup g_sched
+ * Session Scheduler
+*/
+typedef struct _ccid_sched *ccid_sched_t;
+/** \ingroup g_sched
+ * Job, called on a worker thread with the slot it was given.
+*/
+typedef void (*ccid_job_t)(cci_t cci, void *priv);
+_public ccid_sched_t ccid_sched_new(unsigned int max_threads);
+_public int ccid_sched_add(ccid_sched_t s, ccid_t ccid);
+_public int ccid_sched_submit(ccid_sched_t s, cci_t cci, ccid_job_t fn,
+				void *priv);
+_public void ccid_sched_wait(ccid_sched_t s);
+_public void ccid_sched_free(ccid_sched_t s);
+
 /* -- Utility functions */
 _public void hex_dump(const uint8_t *ptr, size_t len, size_t llen);
 _public void hex_dumpf(FILE *f, const uint8_t *ptr, size_t len, size_t llen);
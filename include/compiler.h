@@ -29,6 +29,7 @@
 #define _noreturn __attribute__((noreturn))
 #define _purefn __attribute__((pure))
 #define _printf(x,y) __attribute__((format(printf,x,y)))
+#define _unused __attribute__((unused))
 #endif
 
 #if __GNUC__ > 2
@@ -69,6 +70,10 @@
 #define _printf(x,y)
 #endif
 
+#ifndef _unused
+#define _unused
+#endif
+
 #if 1
 #undef _nonull
 #define _nonull(x...)
@@ -0,0 +1,84 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+*/
+#ifndef _VCARD_H
+#define _VCARD_H
+
+/**
+ * \defgroup g_vcard Virtual Chip Cards
+ * Software chip cards which may be inserted in to the slots of a virtual
+ * CCID, see ccid_virtual(). A card may be inserted in only one slot at a
+ * time and must outlive its insertion.
+ */
+
+/** \ingroup g_vcard
+ * Virtual Chip Card
+*/
+typedef struct _vcard *vcard_t;
+
+/* Virtual CCID */
+_public ccid_t ccid_virtual(unsigned int num_slots, const char *tracefile,
+				unsigned int flags);
+_public int ccid_virtual_insert(ccid_t ccid, unsigned int slot, vcard_t card);
+_public vcard_t ccid_virtual_remove(ccid_t ccid, unsigned int slot);
+
+/* Generic card functions */
+_public int vcard_set_atr(vcard_t card, const uint8_t *atr, size_t len);
+_public void vcard_free(vcard_t card);
+
+/** \ingroup g_vcard
+ * Transparent elementary file.
+*/
+#define VCARD_EF_TRANSPARENT	0x0
+/** \ingroup g_vcard
+ * Linear fixed elementary file.
+*/
+#define VCARD_EF_LINEAR		0x1
+/** \ingroup g_vcard
+ * Cyclic elementary file.
+*/
+#define VCARD_EF_CYCLIC		0x3
+
+/* GSM 11.11 SIM */
+_public vcard_t vcard_gsm_new(void);
+_public int vcard_gsm_add_df(vcard_t card, uint16_t parent, uint16_t id);
+_public int vcard_gsm_add_ef(vcard_t card, uint16_t parent, uint16_t id,
+				unsigned int structure, uint8_t reclen,
+				const uint8_t *data, size_t len);
+
+/** \ingroup g_vcard
+ * Match any value of a byte in a vcard_emv_rule.
+*/
+#define VCARD_ANY		0x100
+
+/** \ingroup g_vcard
+ * One entry in the command table of a virtual EMV card.
+ *
+ * The first rule to match the command header, the current state and a
+ * prefix of the command data is used to answer a command. State zero is
+ * the initial state after reset.
+*/
+struct vcard_emv_rule {
+	/** CLA, INS, P1 and P2 to match, or VCARD_ANY */
+	uint16_t	r_cla, r_ins, r_p1, r_p2;
+	/** State to match, or VCARD_ANY */
+	uint16_t	r_state;
+	/** State to enter on match, or VCARD_ANY to stay put */
+	uint16_t	r_next;
+	/** Prefix of command data to match, or NULL */
+	const uint8_t	*r_data;
+	size_t		r_data_len;
+	/** Response data, fetched with GET RESPONSE if the command has
+	 * data of its own */
+	const uint8_t	*r_rsp;
+	size_t		r_rsp_len;
+	/** Status word */
+	uint16_t	r_sw;
+};
+
+/* Table driven EMV card */
+_public vcard_t vcard_emv_new(const struct vcard_emv_rule *tbl, size_t num);
+
+#endif /* _VCARD_H */
@@ -0,0 +1,184 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Answer to reset parsing, ISO 7816-3.
+*/
+
+#include <ccid.h>
+
+#include "ccid-internal.h"
+
+#define ATR_TS_DIRECT	0x3b
+#define ATR_TS_INVERSE	0x3f
+
+#define ATR_Y_TA	(1 << 0)
+#define ATR_Y_TB	(1 << 1)
+#define ATR_Y_TC	(1 << 2)
+#define ATR_Y_TD	(1 << 3)
+
+#define ATR_TA2_IMPLICIT	(1 << 4)
+
+#define ATR_T1_CRC	(1 << 0)
+
+#define ATR_T_GLOBAL	15
+
+_private const struct _fi _fi_table[16] = {
+	{.fi = 372, .fmax = 4000},
+	{.fi = 372, .fmax = 5000},
+	{.fi = 558, .fmax = 6000},
+	{.fi = 744, .fmax = 8000},
+	{.fi = 1116, .fmax = 12000},
+	{.fi = 1488, .fmax = 16000},
+	{.fi = 1860, .fmax = 20000},
+	{.fi = 0, },
+
+	{.fi = 0, },
+	{.fi = 512, .fmax = 5000},
+	{.fi = 768, .fmax = 7500},
+	{.fi = 1024, .fmax = 10000},
+	{.fi = 1536, .fmax = 15000},
+	{.fi = 2048, .fmax = 20000},
+	{.fi = 0, },
+	{.fi = 0, },
+};
+
+_private const uint8_t _di_table[16] = {
+	0, 1, 2, 4, 8, 16, 32, 64,
+	12, 20, 0, 0, 0, 0, 0, 0
+};
+
+/* Interface bytes after the second TD are specific to the protocol which
+ * the previous TD indicated, only the first set for T=1 means anything.
+ */
+static void t1_byte(struct _atr *atr, unsigned int y, uint8_t b)
+{
+	switch(y) {
+	case ATR_Y_TA:
+		if ( b && b != 0xff )
+			atr->a_ifsc = b;
+		break;
+	case ATR_Y_TB:
+		atr->a_bwi_cwi = b;
+		break;
+	case ATR_Y_TC:
+		atr->a_crc = b & ATR_T1_CRC;
+		break;
+	}
+}
+
+static void iface_byte(struct _atr *atr, unsigned int i, unsigned int t,
+			unsigned int y, uint8_t b, int *t1_seen)
+{
+	switch(i) {
+	case 1:
+		if ( y == ATR_Y_TA )
+			atr->a_fidi = b;
+		else if ( y == ATR_Y_TC )
+			atr->a_n = b;
+		break;
+	case 2:
+		if ( y == ATR_Y_TA ) {
+			atr->a_specific = 1;
+			atr->a_specific_proto = b & 0xf;
+			atr->a_implicit = !!(b & ATR_TA2_IMPLICIT);
+		}else if ( y == ATR_Y_TC && t == 0 ) {
+			atr->a_wi = b;
+		}
+		break;
+	default:
+		if ( t == 1 && !*t1_seen )
+			t1_byte(atr, y, b);
+		else if ( t == ATR_T_GLOBAL && y == ATR_Y_TA )
+			atr->a_clock_stop = b >> 6;
+		break;
+	}
+}
+
+/* Parse an ATR, returns zero if it's malformed in which case atr is left
+ * with the defaults.
+ */
+int _atr_parse(struct _atr *atr, const uint8_t *buf, size_t len)
+{
+	const uint8_t *ptr = buf, *end = buf + len;
+	unsigned int i, y, t = 0, tck = 0;
+	int t1_seen = 0;
+	uint8_t x;
+
+	memset(atr, 0, sizeof(*atr));
+	atr->a_len = (len < ATR_MAX_LEN) ? len : ATR_MAX_LEN;
+	memcpy(atr->a_raw, buf, atr->a_len);
+	atr->a_fidi = ATR_DEFAULT_FIDI;
+	atr->a_wi = ATR_DEFAULT_WI;
+	atr->a_ifsc = T1_DEFAULT_IFSC;
+	atr->a_bwi_cwi = ATR_DEFAULT_BWI_CWI;
+	atr->a_protos = (1 << CCID_PROTOCOL_T0);
+
+	if ( len < 2 )
+		return 0;
+
+	switch(*ptr++) {
+	case ATR_TS_DIRECT:
+		break;
+	case ATR_TS_INVERSE:
+		atr->a_inverse = 1;
+		break;
+	default:
+		return 0;
+	}
+
+	y = *ptr >> 4;
+	atr->a_num_hist = *ptr & 0xf;
+	ptr++;
+
+	for(i = 1; ; i++) {
+		for(x = ATR_Y_TA; x < ATR_Y_TD; x <<= 1) {
+			if ( !(y & x) )
+				continue;
+			if ( ptr >= end )
+				return 0;
+			iface_byte(atr, i, t, x, *ptr++, &t1_seen);
+		}
+
+		if ( i >= 3 && t == 1 )
+			t1_seen = 1;
+
+		if ( !(y & ATR_Y_TD) )
+			break;
+		if ( ptr >= end )
+			return 0;
+
+		y = *ptr >> 4;
+		t = *ptr & 0xf;
+		ptr++;
+
+		if ( t )
+			tck = 1;
+		if ( t == ATR_T_GLOBAL )
+			continue;
+		if ( i == 1 )
+			atr->a_protos = 0;
+		if ( !atr->a_protos )
+			atr->a_proto = t;
+		atr->a_protos |= (1 << t);
+	}
+
+	if ( ptr + atr->a_num_hist + tck > end )
+		return 0;
+	memcpy(atr->a_hist, ptr, atr->a_num_hist);
+	ptr += atr->a_num_hist;
+
+	if ( tck ) {
+		for(x = 0, end = ptr + 1, ptr = buf + 1; ptr < end; ptr++)
+			x ^= *ptr;
+		if ( x )
+			return 0;
+	}
+
+	if ( atr->a_specific )
+		atr->a_proto = atr->a_specific_proto;
+
+	atr->a_valid = 1;
+	return 1;
+}
@@ -10,6 +10,15 @@
 
 #include "ccid-internal.h"
 
+#define AUTO_APDU_LEN		5
+#define AUTO_MAX_CMDS		64
+
+#define CLA_GSM			0xa0
+#define INS_GET_RESPONSE	0xc0
+#define SW1_GET_RESPONSE	0x61
+#define SW1_GSM_GET_RESPONSE	0x9f
+#define SW1_WRONG_LE		0x6c
+
 /** Retrieve cached chip card status.
  * \ingroup g_cci
  *
@@ -25,9 +34,18 @@ unsigned int cci_slot_status(cci_t cci)
 	return cci->i_status;
 }
 
+/** Retrieve the error from the calling thread's last failed operation.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t to query.
+ *
+ * As for ccid_error() on the CCID the slot belongs to.
+ *
+ * @return one of CCID_ERROR_*.
+ */
 unsigned int cci_error(cci_t cci)
 {
-	return cci->i_parent->d_error;
+	return ccid_error(cci->i_parent);
 }
 
 /** Return pointer to CCID to which a chip card slot belongs.
@@ -42,6 +60,171 @@ ccid_t cci_ccid(cci_t cci)
 	return cci->i_parent;
 }
 
+/** Set chip card interface flags.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t to modify.
+ * @param flags Bitmask of CCI_* flags, eg. \ref CCI_AUTO_RESPONSE.
+ */
+void cci_set_flags(cci_t cci, unsigned int flags)
+{
+	cci->i_flags = flags;
+}
+
+/** Retrieve chip card interface flags.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t to query.
+ *
+ * @return Bitmask of CCI_* flags.
+ */
+unsigned int cci_flags(cci_t cci)
+{
+	return cci->i_flags;
+}
+
+/* Response length implied by Le in a command APDU, including the status
+ * word. Zero if it doesn't parse as any of the ISO 7816-4 cases.
+ */
+static size_t apdu_rsp_len(const struct _xfr *xfr)
+{
+	const uint8_t *apdu = xfr->x_txbuf;
+	size_t len = xfr->x_txlen, lc, le;
+
+	if ( len == 4 )
+		return 2;
+	if ( len < 5 )
+		return 0;
+
+	if ( apdu[4] ) {
+		lc = apdu[4];
+		if ( len == 5 )
+			le = lc;
+		else if ( len == 5 + lc )
+			return 2;
+		else if ( len == 6 + lc )
+			le = apdu[len - 1];
+		else
+			return 0;
+		return ((le) ? le : 0x100) + 2;
+	}
+
+	if ( len == 5 )
+		return 0x100 + 2;
+	if ( len < 7 )
+		return 0;
+
+	lc = (apdu[5] << 8) | apdu[6];
+	if ( len == 7 )
+		le = lc;
+	else if ( len == 7 + lc )
+		return 2;
+	else if ( len == 9 + lc )
+		le = (apdu[len - 2] << 8) | apdu[len - 1];
+	else
+		return 0;
+	return ((le) ? le : 0x10000) + 2;
+}
+
+/* Send a short command and receive its response in to xfr after the first
+ * ofs bytes. The response header is written over the data before it, so
+ * that's saved and restored rather than moving all the data around.
+ */
+static int auto_cmd(struct _cci *cci, struct _xfr *xfr, size_t ofs,
+			const uint8_t *apdu)
+{
+	struct {
+		struct ccid_msg hdr;
+		uint8_t apdu[AUTO_APDU_LEN];
+	} _packed tx;
+	uint8_t save[sizeof(struct ccid_msg)];
+	struct ccid_msg hdr;
+	struct _xfr v;
+	int ret;
+
+	/* best effort, the transaction fails anyway if it doesn't fit */
+	_xfr_rx_grow(xfr, ofs + ((apdu[4]) ? apdu[4] : 0x100) + 2);
+
+	memcpy(tx.apdu, apdu, sizeof(tx.apdu));
+	v.x_txmax = v.x_txlen = sizeof(tx.apdu);
+	v.x_txhdr = &tx.hdr;
+	v.x_txbuf = tx.apdu;
+	v.x_rxmax = xfr->x_rxmax - ofs;
+	v.x_rxlen = 0;
+	v.x_rxbuf = xfr->x_rxbuf + ofs;
+	v.x_rxhdr = (struct ccid_msg *)(v.x_rxbuf - sizeof(hdr));
+	v.x_flags = 0;
+
+	memcpy(save, v.x_rxhdr, sizeof(save));
+	ret = (*cci->i_ops->transact)(cci, &v);
+	memcpy(&hdr, v.x_rxhdr, sizeof(hdr));
+	memcpy((void *)v.x_rxhdr, save, sizeof(save));
+	memcpy((void *)xfr->x_rxhdr, &hdr, sizeof(hdr));
+
+	xfr->x_rxlen = ofs + v.x_rxlen;
+	return ret;
+}
+
+/* GSM has its own class, proprietary classes use the interindustry one, and
+ * otherwise keep the logical channel but not secure messaging or chaining.
+ */
+static uint8_t get_response_cla(uint8_t cla)
+{
+	if ( cla == CLA_GSM )
+		return cla;
+	if ( cla & 0x80 )
+		return 0x00;
+	if ( cla & 0x40 )
+		return cla & 0x4f;
+	return cla & 0x03;
+}
+
+static int auto_response(struct _cci *cci, struct _xfr *xfr)
+{
+	uint8_t last[AUTO_APDU_LEN];
+	int have_last = 0;
+	unsigned int i;
+	size_t ofs;
+	uint8_t sw1;
+
+	if ( xfr->x_txlen == AUTO_APDU_LEN ) {
+		memcpy(last, xfr->x_txbuf, sizeof(last));
+		have_last = 1;
+	}
+
+	for(i = 0; i < AUTO_MAX_CMDS; i++) {
+		if ( xfr->x_rxlen < 2 )
+			break;
+
+		ofs = xfr->x_rxlen - 2;
+		sw1 = xfr->x_rxbuf[ofs];
+		switch(sw1) {
+		case SW1_GET_RESPONSE:
+		case SW1_GSM_GET_RESPONSE:
+			if ( xfr->x_txlen < 1 )
+				return 1;
+			last[0] = get_response_cla(xfr->x_txbuf[0]);
+			last[1] = INS_GET_RESPONSE;
+			last[2] = 0;
+			last[3] = 0;
+			have_last = 1;
+			break;
+		case SW1_WRONG_LE:
+			if ( !have_last )
+				return 1;
+			break;
+		default:
+			return 1;
+		}
+
+		last[4] = xfr->x_rxbuf[ofs + 1];
+		if ( !auto_cmd(cci, xfr, ofs, last) )
+			return 0;
+	}
+
+	return 1;
+}
+
 /** Power on a chip card slot.
  * \ingroup g_cci
  *
@@ -49,12 +232,26 @@ ccid_t cci_ccid(cci_t cci)
  * @param voltage Voltage selector.
  * @param atr_len Pointer to size_t to retrieve length of ATR message.
  *
+ * For contact cards the protocol and rate are then selected from the ATR,
+ * unless the same ATR has been seen on this model of reader before, in
+ * which case the parameters it settled on last time are used directly.
+ * See libccid_param_cache_save() to keep those between runs.
+ *
  * @return NULL for failure, pointer to ATR message otherwise.
  */
 const uint8_t *cci_power_on(cci_t cci, unsigned int voltage,
 				size_t *atr_len)
 {
-	return (*cci->i_ops->power_on)(cci, voltage, atr_len);
+	const uint8_t *ret;
+
+	_cci_lock(cci);
+	ret = (*cci->i_ops->power_on)(cci, voltage, atr_len);
+	if ( ret ) {
+		cci->i_idle = IDLE_NONE;
+		cci->i_last = _time_us();
+	}
+	_cci_unlock(cci);
+	return ret;
 }
 
 /** Perform a chip card transaction.
@@ -63,13 +260,152 @@ const uint8_t *cci_power_on(cci_t cci, unsigned int voltage,
  * @param cci \ref cci_t for this transaction.
  * @param xfr \ref xfr_t representing the transfer buffer.
  *
- * Transactions consist of a transmit followed by a recieve.
+ * Transactions consist of a transmit followed by a recieve. For contact
+ * cards, commands and responses which don't fit in one message are chained
+ * as the reader's exchange level requires: extended APDU readers chain
+ * messages, short APDU readers get extended APDUs as ISO 7816-4 command
+ * chains and T=1 cards on TPDU readers are driven by the T=1 block protocol.
+ *
+ * With \ref CCI_AUTO_RESPONSE set, GET RESPONSE and wrong length status
+ * words are dealt with here and xfr holds all of the response data along
+ * with the final status word.
+ *
+ * The receive buffer is grown up front to fit the response Le asks for, or
+ * as the response arrives if Le is absent or wrong.
+ *
+ * A card which was idled by cci_set_idle() is woken up first.
  *
  * @return zero on failure.
  */
 int cci_transact(cci_t cci, xfr_t xfr)
 {
-	return (*cci->i_ops->transact)(cci, xfr);
+	int ret;
+
+	_xfr_rx_grow(xfr, apdu_rsp_len(xfr));
+
+	_cci_lock(cci);
+	ret = (cci->i_idle == IDLE_NONE) || _cci_resume(cci);
+	if ( ret )
+		ret = (*cci->i_ops->transact)(cci, xfr);
+	if ( ret && (cci->i_flags & CCI_AUTO_RESPONSE) )
+		ret = auto_response(cci, xfr);
+	cci->i_last = _time_us();
+	_cci_unlock(cci);
+	return ret;
+}
+
+/** Submit a chip card transaction without waiting for the response.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t for this transaction.
+ * @param xfr \ref xfr_t representing the transfer buffer.
+ * @param cb Callback to invoke on completion (or NULL).
+ * @param priv Private data passed to the callback.
+ *
+ * The transaction proceeds in the background and completes from within
+ * libccid_handle_events() or cci_complete(). The xfr must not be touched
+ * until then. One transaction may be in flight per slot, and transactions on
+ * different slots run concurrently up to the reader's limit of busy slots.
+ * Interfaces which cannot be driven asynchronously complete before returning.
+ * Each transaction is a single message, no chaining is done.
+ *
+ * Fails with \ref CCID_ERROR_BUSY if another thread is using the slot,
+ * rather than waiting, since it may be called from a completion callback.
+ *
+ * @return zero on failure.
+ */
+int cci_submit(cci_t cci, xfr_t xfr, cci_cb_t cb, void *priv)
+{
+	struct _ccid_cmd *cmd = _cci_cmd(cci);
+	int ret = 1;
+
+	if ( !_cci_trylock(cci) ) {
+		_ccid_set_error(cci->i_parent, CCID_ERROR_BUSY);
+		return 0;
+	}
+
+	if ( !cmd->c_complete ) {
+		_ccid_set_error(cci->i_parent, CCID_ERROR_BUSY);
+		ret = 0;
+		goto out;
+	}
+
+	if ( cci->i_idle != IDLE_NONE && !_cci_resume(cci) ) {
+		ret = 0;
+		goto out;
+	}
+
+	cmd->c_cb = cb;
+	cmd->c_priv = priv;
+	cci->i_last = _time_us();
+
+	if ( NULL == cci->i_ops->submit ) {
+		cmd->c_result = (*cci->i_ops->transact)(cci, xfr);
+		if ( cb )
+			(*cb)(cci, xfr, cmd->c_result, priv);
+		goto out;
+	}
+
+	ret = (*cci->i_ops->submit)(cci, xfr);
+out:
+	_cci_unlock(cci);
+	return ret;
+}
+
+/** Wait for completion of a transaction started with cci_submit().
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t for this transaction.
+ *
+ * Any callback passed to cci_submit() is called before this returns. If the
+ * slot's timeout, see cci_set_timeout(), passes first then the transaction
+ * is aborted and fails with \ref CCID_ERROR_TIMEOUT. Deadlines are only
+ * enforced by a thread which waits for that transaction, not by
+ * libccid_handle_events().
+ *
+ * @return zero on failure, as per cci_transact().
+ */
+int cci_complete(cci_t cci)
+{
+	return _ccid_cmd_wait(cci->i_parent, _cci_cmd(cci));
+}
+
+/** Set how long to wait for each command to a slot before aborting it.
+ * \ingroup g_cci
+ * @param cci \ref cci_t to set the timeout for.
+ * @param ms Timeout in milliseconds, \ref CCI_TIMEOUT_AUTO or
+ *		\ref CCI_TIMEOUT_NONE.
+ *
+ * The default, \ref CCI_TIMEOUT_AUTO, works out a deadline for each
+ * command from the card's waiting time as given in the ATR or negotiated by
+ * the reader, and the reader's clock. Time extensions requested by the card
+ * push the deadline back. A command which overruns is aborted with
+ * PC_to_RDR_Abort and fails with \ref CCID_ERROR_TIMEOUT, a late response
+ * from the reader is ignored. A fixed timeout applies to every command,
+ * including those which only involve the reader such as powering on.
+ *
+ * Applies from the next command sent on the slot.
+ *
+ * @return zero on failure.
+ */
+int cci_set_timeout(cci_t cci, unsigned int ms)
+{
+	_cci_lock(cci);
+	_cci_cmd(cci)->c_policy = ms;
+	_cci_unlock(cci);
+	return 1;
+}
+
+/** Get the timeout policy of a slot.
+ * \ingroup g_cci
+ * @param cci \ref cci_t to query.
+ *
+ * @return Timeout in milliseconds as set by cci_set_timeout(), or one of
+ * \ref CCI_TIMEOUT_AUTO or \ref CCI_TIMEOUT_NONE.
+ */
+unsigned int cci_timeout(cci_t cci)
+{
+	return _cci_cmd(cci)->c_policy;
 }
 
 /** Power off a chip card slot.
@@ -81,5 +417,11 @@ int cci_transact(cci_t cci, xfr_t xfr)
  */
 int cci_power_off(cci_t cci)
 {
-	return (*cci->i_ops->power_off)(cci);
+	int ret;
+
+	_cci_lock(cci);
+	ret = (*cci->i_ops->power_off)(cci);
+	cci->i_idle = IDLE_NONE;
+	_cci_unlock(cci);
+	return ret;
 }
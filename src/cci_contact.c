@@ -10,32 +10,351 @@
 
 #include "ccid-internal.h"
 
-static int select_params(struct _cci *cci, const uint8_t *atr, size_t len)
+#define APDU_CLA_CHAIN		0x10
+#define APDU_SHORT_MAX		0xff
+
+/* Baud rate for a given Fi/Di at the reader's default clock */
+static unsigned int baud(struct _ccid *ccid, uint8_t fidi)
+{
+	const struct _fi *f = _fi_table + (fidi >> 4);
+
+	if ( !f->fi )
+		return 0;
+	return (ccid->d_desc.dwDefaultClock * 1000 / f->fi) *
+		_di_table[fidi & 0xf];
+}
+
+/* Card clock in KHz */
+static uint64_t clock_khz(const struct _ccid *ccid)
+{
+	return (ccid->d_desc.dwDefaultClock) ?
+		ccid->d_desc.dwDefaultClock : 3580;
+}
+
+/* Fi and Di from the parameters in force, or the ATR if the reader didn't
+ * say what it settled on.
+ */
+static void cur_fidi(const struct _cci *cci, unsigned int *fi,
+			unsigned int *di)
+{
+	uint8_t fidi;
+
+	fidi = (cci->i_params) ? cci->i_fidi : cci->i_atr.a_fidi;
+	*fi = _fi_table[fidi >> 4].fi;
+	*di = _di_table[fidi & 0xf];
+	if ( !*fi || !*di ) {
+		*fi = 372;
+		*di = 1;
+	}
+}
+
+/* Elementary time unit, in microseconds */
+uint64_t _cci_etu(struct _cci *cci)
+{
+	unsigned int fi, di;
+
+	cur_fidi(cci, &fi, &di);
+	return (fi * 1000ULL) / (di * clock_khz(cci->i_parent)) + 1;
+}
+
+/* Longest the card may take to answer, in microseconds: the work waiting
+ * time for T=0 or block waiting time for T=1 (ISO 7816-3 10.2 and 11.4.3).
+ */
+uint64_t _cci_wait_time(struct _cci *cci)
+{
+	const struct _atr *atr = &cci->i_atr;
+	uint64_t clk = clock_khz(cci->i_parent);
+	unsigned int fi, di, proto, wi;
+
+	cur_fidi(cci, &fi, &di);
+
+	proto = (cci->i_params) ? cci->i_proto : atr->a_proto;
+	if ( proto == CCID_PROTOCOL_T1 ) {
+		wi = (cci->i_params) ? cci->i_wi : atr->a_bwi_cwi;
+		wi >>= 4;
+		if ( wi > T1_MAX_BWI )
+			wi = T1_MAX_BWI;
+		return ((1ULL << wi) * 960 * 372 * 1000) / clk +
+			11 * _cci_etu(cci);
+	}
+
+	wi = (cci->i_params) ? cci->i_wi : atr->a_wi;
+	if ( !wi )
+		wi = ATR_DEFAULT_WI;
+	return (960ULL * wi * fi * 1000) / clk;
+}
+
+static int rate_ok(struct _ccid *ccid, unsigned int rate)
+{
+	unsigned int diff;
+	size_t i;
+
+	if ( rate > ccid->d_desc.dwMaxDataRate )
+		return 0;
+	if ( !ccid->d_num_rate )
+		return 1;
+
+	/* readers list rates rounded to taste, allow 1% either way */
+	for(i = 0; i < ccid->d_num_rate; i++) {
+		diff = (ccid->d_data_rate[i] > rate) ?
+			ccid->d_data_rate[i] - rate :
+			rate - ccid->d_data_rate[i];
+		if ( diff * 100 <= rate )
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Fastest Fi/Di which the card and reader can both do. That's the card's
+ * Fi with its Di or anything slower, at the reader's default clock.
+ */
+static uint8_t choose_fidi(struct _cci *cci)
+{
+	struct _ccid *ccid = cci->i_parent;
+	const struct _atr *atr = &cci->i_atr;
+	unsigned int f = atr->a_fidi >> 4;
+	unsigned int max_di = _di_table[atr->a_fidi & 0xf];
+	unsigned int d, rate, best_rate = 0;
+	uint8_t fidi, best = ATR_DEFAULT_FIDI;
+
+	/* specific mode, the card is already at TA1 and can't change */
+	if ( atr->a_specific )
+		return (atr->a_implicit) ? ATR_DEFAULT_FIDI : atr->a_fidi;
+
+	if ( !(ccid->d_desc.dwFeatures & CCID_BAUD) )
+		return ATR_DEFAULT_FIDI;
+	if ( !_fi_table[f].fi || !max_di )
+		return ATR_DEFAULT_FIDI;
+	if ( ccid->d_desc.dwDefaultClock > _fi_table[f].fmax )
+		return ATR_DEFAULT_FIDI;
+
+	for(d = 1; d < 16; d++) {
+		if ( !_di_table[d] || _di_table[d] > max_di )
+			continue;
+		fidi = (f << 4) | d;
+		rate = baud(ccid, fidi);
+		if ( rate > best_rate && rate_ok(ccid, rate) ) {
+			best = fidi;
+			best_rate = rate;
+		}
+	}
+
+	return best;
+}
+
+/* The card's default protocol if the reader does it, else anything else
+ * which they have in common.
+ */
+static int choose_proto(struct _cci *cci, unsigned int *proto)
+{
+	struct _ccid *ccid = cci->i_parent;
+	const struct _atr *atr = &cci->i_atr;
+	unsigned int both, t;
+
+	both = atr->a_protos & ccid->d_desc.dwProtocols &
+		((1 << CCID_PROTOCOL_T0) | (1 << CCID_PROTOCOL_T1));
+
+	if ( atr->a_specific || (both & (1 << atr->a_proto)) ) {
+		*proto = atr->a_proto;
+		return 1;
+	}
+
+	for(t = CCID_PROTOCOL_T0; t <= CCID_PROTOCOL_T1; t++) {
+		if ( both & (1 << t) ) {
+			*proto = t;
+			return 1;
+		}
+	}
+
+	_ccid_set_error(ccid, CCID_ERROR_CARD_PROTO);
+	return 0;
+}
+
+/* Tell the reader which protocol and parameters to use, it does the PPS
+ * exchange with the card.
+ */
+static int set_params(struct _cci *cci, struct _xfr *xfr, int fast)
 {
-	return 1;
-#if 0
 	struct _ccid *ccid = cci->i_parent;
-	xfr_t xfr;
+	const struct _atr *atr = &cci->i_atr;
+	struct ccid_t0 *t0;
+	struct ccid_t1 *t1;
+	unsigned int proto;
+	uint8_t fidi, conv;
 
-	xfr = xfr_alloc(256, 256);
-	if ( NULL == xfr )
+	if ( !choose_proto(cci, &proto) )
 		return 0;
 
+	fidi = (fast) ? choose_fidi(cci) : ATR_DEFAULT_FIDI;
+	conv = (atr->a_inverse) ? CCID_CONV_INVERSE : 0;
+
+	xfr_reset(xfr);
+	switch(proto) {
+	case CCID_PROTOCOL_T0:
+		t0 = (struct ccid_t0 *)xfr_tx_reserve(xfr, sizeof(*t0));
+		t0->bmFindexDindex = fidi;
+		t0->bmTCCSKST0 = conv;
+		t0->bGuardTimeT0 = atr->a_n;
+		t0->bWaitingIntegerT0 = atr->a_wi;
+		t0->bClockStop = 0;
+		break;
+	case CCID_PROTOCOL_T1:
+		t1 = (struct ccid_t1 *)xfr_tx_reserve(xfr, sizeof(*t1));
+		t1->bmFindexDindex = fidi;
+		t1->bmTCCSKST1 = CCID_T1_CHECKSUM | conv | atr->a_crc;
+		t1->bGuardTimeT1 = atr->a_n;
+		t1->bWaitingIntegerT1 = atr->a_bwi_cwi;
+		t1->bClockStop = 0;
+		t1->bIFSC = atr->a_ifsc;
+		t1->bNadValue = 0;
+		break;
+	}
+
+	trace(ccid, " o Selecting T=%u at %ubps\n", proto, baud(ccid, fidi));
+
+	if ( !_PC_to_RDR_SetParameters(ccid, cci->i_idx, xfr, proto) )
+		return 0;
+	if ( !_RDR_to_PC(ccid, cci->i_idx, xfr) )
+		return 0;
+	return _RDR_to_PC_Parameters(ccid, xfr);
+}
+
+static int get_params(struct _cci *cci, struct _xfr *xfr)
+{
+	struct _ccid *ccid = cci->i_parent;
+
+	xfr_reset(xfr);
 	if ( !_PC_to_RDR_GetParameters(ccid, cci->i_idx, xfr) )
-		goto err;
+		return 0;
 	if ( !_RDR_to_PC(ccid, cci->i_idx, xfr) )
-		goto err;
-	if ( !_RDR_to_PC_Parameters(ccid, xfr) )
-		goto err;
+		return 0;
+	return _RDR_to_PC_Parameters(ccid, xfr);
+}
+
+/* Parameters from a previous session with the same card and reader */
+static int cached_params(struct _cci *cci, struct _xfr *xfr,
+				const struct _pparams *pp)
+{
+	struct _ccid *ccid = cci->i_parent;
+	uint8_t *ptr;
+
+	trace(ccid, " o Selecting T=%u at %ubps (cached)\n", pp->p_proto,
+		baud(ccid, pp->p_buf[0]));
+
+	xfr_reset(xfr);
+	ptr = xfr_tx_reserve(xfr, pp->p_len);
+	if ( NULL == ptr ) {
+		_ccid_set_error(ccid, CCID_ERROR_NO_MEM);
+		return 0;
+	}
+	memcpy(ptr, pp->p_buf, pp->p_len);
+
+	if ( !_PC_to_RDR_SetParameters(ccid, cci->i_idx, xfr, pp->p_proto) )
+		return 0;
+	if ( !_RDR_to_PC(ccid, cci->i_idx, xfr) )
+		return 0;
+	return _RDR_to_PC_Parameters(ccid, xfr);
+}
+
+static void learn_params(struct _cci *cci, const struct _pparams *pp)
+{
+	const struct ccid_t1 *t1;
 
-	xfr_free(xfr);
+	cci->i_proto = pp->p_proto;
+	if ( pp->p_len >= sizeof(struct ccid_t0) ) {
+		/* same offsets in T=0 and T=1 parameters */
+		cci->i_fidi = pp->p_buf[0];
+		cci->i_wi = pp->p_buf[3];
+		cci->i_params = 1;
+	}
+	if ( cci->i_proto == CCID_PROTOCOL_T1 &&
+			pp->p_len >= sizeof(*t1) ) {
+		t1 = (const struct ccid_t1 *)pp->p_buf;
+		if ( t1->bIFSC )
+			cci->i_t1.t_ifsc = t1->bIFSC;
+		cci->i_t1.t_nad = t1->bNadValue;
+		cci->i_t1.t_crc = t1->bmTCCSKST1 & CCID_T1_CRC;
+	}
+}
+
+static void rx_params(const struct _xfr *xfr, struct _pparams *pp)
+{
+	pp->p_proto = xfr->x_rxhdr->in.bApp;
+	pp->p_len = (xfr->x_rxlen < sizeof(pp->p_buf)) ?
+			xfr->x_rxlen : sizeof(pp->p_buf);
+	memcpy(pp->p_buf, xfr->x_rxbuf, pp->p_len);
+}
+
+/* Readers which negotiate for themselves are left to it, otherwise we
+ * pick parameters from the ATR. Either way, at TPDU level we do the T=1
+ * block protocol ourselves, so need to know what the outcome was.
+ *
+ * Whatever the reader settled on is cached against the ATR. Next time the
+ * same card turns up we skip straight to that, including where the fast
+ * rate failed and we had to reset and fall back to the default.
+ */
+static int select_params(struct _cci *cci, int fast)
+{
+	struct _ccid *ccid = cci->i_parent;
+	struct _xfr *xfr = cci->i_blk;
+	int pps = !!(ccid->d_desc.dwFeatures & CCID_PPS_CUR);
+	struct _pparams pp;
+
+	cci->i_proto = CCID_PROTOCOL_T0;
+	cci->i_params = 0;
+	memset(&cci->i_t1, 0, sizeof(cci->i_t1));
+	cci->i_t1.t_ifsc = T1_DEFAULT_IFSC;
+
+	if ( !pps && ccid->d_level != CCID_LEVEL_TPDU )
+		return 1;
+
+	if ( fast && _pcache_lookup(ccid, &cci->i_atr, &pp) ) {
+		if ( pps ) {
+			if ( !cached_params(cci, xfr, &pp) ) {
+				_pcache_drop(ccid, &cci->i_atr);
+				return 0;
+			}
+			rx_params(xfr, &pp);
+		}
+		learn_params(cci, &pp);
+		return 1;
+	}
+
+	if ( pps ) {
+		if ( !set_params(cci, xfr, fast) )
+			return 0;
+	}else{
+		if ( !get_params(cci, xfr) )
+			return 0;
+	}
+
+	rx_params(xfr, &pp);
+	_pcache_store(ccid, &cci->i_atr, &pp);
+	learn_params(cci, &pp);
+	return 1;
+}
+
+static int do_power_on(struct _cci *cci, unsigned int voltage)
+{
+	struct _ccid *ccid = cci->i_parent;
+
+	if ( !_PC_to_RDR_IccPowerOn(ccid, cci->i_idx, cci->i_xfr, voltage) )
+		return 0;
+
+	if ( !_RDR_to_PC(ccid, cci->i_idx, cci->i_xfr) )
+		return 0;
+	
+	_RDR_to_PC_DataBlock(ccid, cci->i_xfr);
+
+	if ( !_atr_parse(&cci->i_atr, cci->i_xfr->x_rxbuf,
+				cci->i_xfr->x_rxlen) )
+		trace(ccid, " o Malformed ATR, using default parameters\n");
 	return 1;
-err:
-	xfr_free(xfr);
-	return 0;
-#endif
 }
 
+static int contact_power_off(struct _cci *cci);
+
 static const uint8_t *contact_power_on(struct _cci *cci, unsigned int voltage,
 				size_t *atr_len)
 {
@@ -44,48 +363,239 @@ static const uint8_t *contact_power_on(struct _cci *cci, unsigned int voltage,
 	if ( cci->i_ops != &_contact_ops )
 		return NULL;
 
-	if ( !_PC_to_RDR_IccPowerOn(ccid, cci->i_idx, ccid->d_xfr, voltage) )
-		return NULL;
-
-	if ( !_RDR_to_PC(ccid, cci->i_idx, ccid->d_xfr) )
+	cci->i_voltage = voltage;
+	if ( !do_power_on(cci, voltage) )
 		return NULL;
-	
-	_RDR_to_PC_DataBlock(ccid, ccid->d_xfr);
 
-	select_params(cci, ccid->d_xfr->x_rxbuf, ccid->d_xfr->x_rxlen);
+	/* A card which fails PPS needs a reset before it'll talk again */
+	if ( !select_params(cci, 1) ) {
+		trace(ccid, " o Parameter selection failed, resetting\n");
+		if ( !contact_power_off(cci) )
+			return NULL;
+		if ( !do_power_on(cci, voltage) )
+			return NULL;
+		if ( !select_params(cci, 0) )
+			return NULL;
+	}
 
 	if ( atr_len )
-		*atr_len = ccid->d_xfr->x_rxlen;
-	return ccid->d_xfr->x_rxbuf;
+		*atr_len = cci->i_xfr->x_rxlen;
+	return cci->i_xfr->x_rxbuf;
 }
 
 static int contact_power_off(struct _cci *cci)
 {
 	struct _ccid *ccid = cci->i_parent;
 
-	if ( !_PC_to_RDR_IccPowerOff(ccid, cci->i_idx, ccid->d_xfr) )
+	if ( !_PC_to_RDR_IccPowerOff(ccid, cci->i_idx, cci->i_xfr) )
 		return 0;
 
-	if ( !_RDR_to_PC(ccid, cci->i_idx, ccid->d_xfr) )
+	if ( !_RDR_to_PC(ccid, cci->i_idx, cci->i_xfr) )
 		return 0;
 	
-	return _RDR_to_PC_SlotStatus(ccid, ccid->d_xfr);
+	return _RDR_to_PC_SlotStatus(ccid, cci->i_xfr);
 }
 
-static int contact_transact(struct _cci *cci, struct _xfr *xfr)
+static int xfr_block(struct _cci *cci, struct _xfr *xfr, uint16_t level,
+			unsigned int *chain)
 {
 	struct _ccid *ccid = cci->i_parent;
+	unsigned int ret;
 
-	if ( !_PC_to_RDR_XfrBlock(ccid, cci->i_idx, xfr) )
+	if ( !_PC_to_RDR_XfrBlock_level(ccid, cci->i_idx, xfr, level, 0) )
 		return 0;
 
 	if ( !_RDR_to_PC(ccid, cci->i_idx, xfr) )
 		return 0;
 
-	_RDR_to_PC_DataBlock(ccid, xfr);
+	ret = _RDR_to_PC_DataBlock(ccid, xfr);
+	if ( chain )
+		*chain = ret;
+	return 1;
+}
+
+static int rx_append(struct _ccid *ccid, struct _xfr *xfr,
+			const struct _xfr *blk)
+{
+	if ( !_xfr_rx_append(xfr, blk->x_rxbuf, blk->x_rxlen) ) {
+		fprintf(stderr, "*** error: chained response overflows "
+			"%zu byte buffer\n", xfr->x_rxmax);
+		_ccid_set_error(ccid, CCID_ERROR_BUS);
+		return 0;
+	}
+	memcpy((void *)xfr->x_rxhdr, blk->x_rxhdr, sizeof(*xfr->x_rxhdr));
 	return 1;
 }
 
+/* Extended APDU level: commands and responses too big for one message are
+ * chained using wLevelParameter and bChainParameter.
+ */
+static int ext_transact(struct _cci *cci, struct _xfr *xfr)
+{
+	struct _ccid *ccid = cci->i_parent;
+	struct _xfr *blk = cci->i_blk;
+	size_t ofs, n, max;
+	unsigned int chain;
+	uint16_t level;
+
+	max = ccid->d_desc.dwMaxCCIDMessageLength - sizeof(struct ccid_msg);
+
+	if ( xfr->x_txlen <= max ) {
+		if ( !xfr_block(cci, xfr, CCID_CHAIN_NONE, &chain) )
+			return 0;
+	}else{
+		for(ofs = 0; ofs < xfr->x_txlen; ofs += n) {
+			n = xfr->x_txlen - ofs;
+			if ( n > max )
+				n = max;
+
+			if ( !ofs )
+				level = CCID_CHAIN_BEGIN;
+			else if ( ofs + n < xfr->x_txlen )
+				level = CCID_CHAIN_MIDDLE;
+			else
+				level = CCID_CHAIN_END;
+
+			xfr_reset(blk);
+			memcpy(blk->x_txbuf, xfr->x_txbuf + ofs, n);
+			blk->x_txlen = n;
+			if ( !xfr_block(cci, blk, level, &chain) )
+				return 0;
+
+			/* card answered early, probably an error status */
+			if ( level != CCID_CHAIN_END &&
+					chain != CCID_CHAIN_CONTINUE )
+				break;
+		}
+
+		xfr->x_rxlen = 0;
+		if ( !rx_append(ccid, xfr, blk) )
+			return 0;
+	}
+
+	while ( chain == CCID_CHAIN_BEGIN || chain == CCID_CHAIN_MIDDLE ) {
+		xfr_reset(blk);
+		if ( !xfr_block(cci, blk, CCID_CHAIN_CONTINUE, &chain) )
+			return 0;
+		if ( !rx_append(ccid, xfr, blk) )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Short APDU level: extended length commands are split using ISO 7816-4
+ * command chaining. Responses longer than 256 bytes come back 61xx.
+ */
+static int short_transact(struct _cci *cci, struct _xfr *xfr)
+{
+	struct _ccid *ccid = cci->i_parent;
+	struct _xfr *blk = cci->i_blk;
+	const uint8_t *apdu = xfr->x_txbuf;
+	size_t lc, le = 0, ofs, n;
+	int has_le;
+	uint8_t *ptr;
+
+	/* anything but a well formed extended APDU goes as is */
+	if ( xfr->x_txlen < 7 || apdu[4] )
+		return xfr_block(cci, xfr, CCID_CHAIN_NONE, NULL);
+
+	if ( xfr->x_txlen == 7 ) {
+		/* case 2E */
+		lc = 0;
+		le = (apdu[5] << 8) | apdu[6];
+		has_le = 1;
+	}else{
+		lc = (apdu[5] << 8) | apdu[6];
+		if ( !lc )
+			return xfr_block(cci, xfr, CCID_CHAIN_NONE, NULL);
+		if ( xfr->x_txlen == 7 + lc ) {
+			has_le = 0;
+		}else if ( xfr->x_txlen == 9 + lc ) {
+			le = (apdu[7 + lc] << 8) | apdu[8 + lc];
+			has_le = 1;
+		}else{
+			return xfr_block(cci, xfr, CCID_CHAIN_NONE, NULL);
+		}
+	}
+
+	/* Le of 256 or more, including 0000 meaning 65536, asks for all */
+	if ( le > APDU_SHORT_MAX + 1 || (has_le && !le) )
+		le = 0;
+
+	ofs = 0;
+	do {
+		n = lc - ofs;
+		if ( n > APDU_SHORT_MAX )
+			n = APDU_SHORT_MAX;
+
+		xfr_reset(blk);
+		ptr = blk->x_txbuf;
+		*ptr++ = (ofs + n < lc) ? (apdu[0] | APDU_CLA_CHAIN) : apdu[0];
+		memcpy(ptr, apdu + 1, 3);
+		ptr += 3;
+		if ( n ) {
+			*ptr++ = n;
+			memcpy(ptr, apdu + 7 + ofs, n);
+			ptr += n;
+		}
+		if ( has_le && ofs + n == lc )
+			*ptr++ = le;
+		blk->x_txlen = ptr - blk->x_txbuf;
+
+		if ( !xfr_block(cci, blk, CCID_CHAIN_NONE, NULL) )
+			return 0;
+
+		ofs += n;
+
+		/* card refused part of the chain, that's the answer */
+		if ( ofs < lc && (blk->x_rxlen != 2 ||
+				blk->x_rxbuf[0] != 0x90 ||
+				blk->x_rxbuf[1] != 0x00) )
+			break;
+	}while( ofs < lc );
+
+	xfr->x_rxlen = 0;
+	return rx_append(ccid, xfr, blk);
+}
+
+static int contact_transact(struct _cci *cci, struct _xfr *xfr)
+{
+	struct _ccid *ccid = cci->i_parent;
+
+	switch(ccid->d_level) {
+	case CCID_LEVEL_TPDU:
+		if ( cci->i_proto == CCID_PROTOCOL_T1 )
+			return _t1_transact(cci, xfr);
+		break;
+	case CCID_LEVEL_APDU:
+		return short_transact(cci, xfr);
+	case CCID_LEVEL_APDU_EXT:
+		return ext_transact(cci, xfr);
+	default:
+		break;
+	}
+
+	return xfr_block(cci, xfr, CCID_CHAIN_NONE, NULL);
+}
+
+static void contact_done(struct _ccid_cmd *cmd, int result)
+{
+	struct _ccid *ccid = cmd->c_ccid;
+	struct _cci *cci = ccid->d_slot + cmd->c_slot;
+
+	if ( result )
+		_RDR_to_PC_DataBlock(ccid, cmd->c_xfr);
+	if ( cmd->c_cb )
+		(*cmd->c_cb)(cci, cmd->c_xfr, result, cmd->c_priv);
+}
+
+static int contact_submit(struct _cci *cci, struct _xfr *xfr)
+{
+	_cci_cmd(cci)->c_done = contact_done;
+	return _PC_to_RDR_XfrBlock_submit(cci->i_parent, cci->i_idx, xfr);
+}
+
 /** Retrieve chip card status.
  * \ingroup g_cci
  *
@@ -98,17 +608,18 @@ static int contact_transact(struct _cci *cci, struct _xfr *xfr)
 unsigned int cci_clock_status(cci_t cci)
 {
 	struct _ccid *ccid = cci->i_parent;
+	unsigned int ret = CHIPCARD_CLOCK_ERR;
 
 	if ( cci->i_ops != &_contact_ops )
 		return CHIPCARD_NOT_PRESENT;
 
-	if ( !_PC_to_RDR_GetSlotStatus(ccid, cci->i_idx, ccid->d_xfr) )
-		return CHIPCARD_CLOCK_ERR;
+	_cci_lock(cci);
+	if ( _PC_to_RDR_GetSlotStatus(ccid, cci->i_idx, cci->i_xfr) &&
+			_RDR_to_PC(ccid, cci->i_idx, cci->i_xfr) )
+		ret = _RDR_to_PC_SlotStatus(ccid, cci->i_xfr);
+	_cci_unlock(cci);
 
-	if ( !_RDR_to_PC(ccid, cci->i_idx, ccid->d_xfr) )
-		return CHIPCARD_CLOCK_ERR;
-
-	return _RDR_to_PC_SlotStatus(ccid, ccid->d_xfr);
+	return ret;
 }
 
 /** Wait for insertion of a chip card in to the slot.
@@ -116,6 +627,9 @@ unsigned int cci_clock_status(cci_t cci)
  *
  * @param cci \ref cci_t to wait on.
  *
+ * The slot is only locked while its status is polled, so other threads may
+ * use it in between.
+ *
  * @return Always succeeds and returns 1.
  */
 int cci_wait_for_card(cci_t cci)
@@ -123,8 +637,10 @@ int cci_wait_for_card(cci_t cci)
 	struct _ccid *ccid = cci->i_parent;
 
 	do {
-		_PC_to_RDR_GetSlotStatus(ccid, cci->i_idx, ccid->d_xfr);
-		_RDR_to_PC(ccid, cci->i_idx, ccid->d_xfr);
+		_cci_lock(cci);
+		_PC_to_RDR_GetSlotStatus(ccid, cci->i_idx, cci->i_xfr);
+		_RDR_to_PC(ccid, cci->i_idx, cci->i_xfr);
+		_cci_unlock(cci);
 		if ( cci->i_status != CHIPCARD_NOT_PRESENT )
 			break;
 		_cci_wait_for_interrupt(ccid);
@@ -132,8 +648,176 @@ int cci_wait_for_card(cci_t cci)
 	return 1;
 }
 
+static int clock_cmd(struct _cci *cci, unsigned int cmd)
+{
+	struct _ccid *ccid = cci->i_parent;
+
+	if ( !_PC_to_RDR_IccClock(ccid, cci->i_idx, cci->i_xfr, cmd) )
+		return 0;
+	if ( !_RDR_to_PC(ccid, cci->i_idx, cci->i_xfr) )
+		return 0;
+	_RDR_to_PC_SlotStatus(ccid, cci->i_xfr);
+	return 1;
+}
+
+/* Bring a slot back from wherever the idle policy left it. After a power
+ * down the card has to answer with the same ATR, else it was swapped while
+ * we weren't looking. Called with the slot lock held.
+ */
+int _cci_resume(struct _cci *cci)
+{
+	struct _ccid *ccid = cci->i_parent;
+	struct _atr prev;
+
+	switch(cci->i_idle) {
+	case IDLE_CLOCK:
+		trace(ccid, " o Restarting clock after idle\n");
+		if ( !clock_cmd(cci, CCID_CLOCK_CMD_RESTART) )
+			return 0;
+		break;
+	case IDLE_POWER:
+		trace(ccid, " o Powering up after idle\n");
+		prev = cci->i_atr;
+		if ( NULL == contact_power_on(cci, cci->i_voltage, NULL) )
+			return 0;
+		if ( cci->i_atr.a_len != prev.a_len ||
+				memcmp(cci->i_atr.a_raw, prev.a_raw, prev.a_len) ) {
+			trace(ccid, " o Card changed while powered down\n");
+			cci->i_idle = IDLE_NONE;
+			_ccid_set_error(ccid, CCID_ERROR_NO_CARD);
+			return 0;
+		}
+		break;
+	default:
+		break;
+	}
+
+	cci->i_idle = IDLE_NONE;
+	return 1;
+}
+
+/* Apply the policy to one slot, returns milliseconds until it next needs
+ * looking at or zero if it doesn't.
+ */
+static unsigned int idle_slot(struct _cci *cci, uint64_t now)
+{
+	struct _ccid *ccid = cci->i_parent;
+	unsigned int next = 0;
+	uint64_t idle;
+
+	if ( cci->i_idle == IDLE_NONE && cci->i_status != CHIPCARD_ACTIVE )
+		return 0;
+
+	idle = (now - cci->i_last) / 1000;
+
+	if ( cci->i_power_ms && cci->i_idle != IDLE_POWER ) {
+		if ( idle >= cci->i_power_ms ) {
+			trace(ccid, " o Slot %u idle, powering down\n",
+				cci->i_idx);
+			if ( contact_power_off(cci) )
+				cci->i_idle = IDLE_POWER;
+			return 0;
+		}
+		next = cci->i_power_ms - idle;
+	}
+
+	/* only if the ATR says the card can take it */
+	if ( cci->i_clock_ms && cci->i_idle == IDLE_NONE &&
+			cci->i_atr.a_clock_stop ) {
+		if ( idle >= cci->i_clock_ms ) {
+			trace(ccid, " o Slot %u idle, stopping clock\n",
+				cci->i_idx);
+			if ( clock_cmd(cci, CCID_CLOCK_CMD_STOP) ) {
+				cci->i_idle = IDLE_CLOCK;
+			}else{
+				trace(ccid, " o Clock stop failed, disabled\n");
+				cci->i_clock_ms = 0;
+			}
+		}else if ( !next || cci->i_clock_ms - idle < next ) {
+			next = cci->i_clock_ms - idle;
+		}
+	}
+
+	return next;
+}
+
+/** Set the idle policy for a chip card slot.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t to set the policy for.
+ * @param clock_ms Stop the clock after this many milliseconds idle.
+ * @param power_ms Power the card down after this many milliseconds idle.
+ *
+ * Either may be zero to disable that step. The policy is applied by
+ * ccid_idle(). The clock is only stopped where the ATR says the card
+ * supports it.
+ *
+ * The next cci_transact() or cci_submit() restarts the clock or powers the
+ * card back up with the same voltage, and the parameters cached for its
+ * ATR. Powering down resets the card, so anything selected on it is lost.
+ * If a different card answers, the transaction fails with
+ * \ref CCID_ERROR_NO_CARD.
+ *
+ * @return zero on failure.
+ */
+int cci_set_idle(cci_t cci, unsigned int clock_ms, unsigned int power_ms)
+{
+	if ( cci->i_ops != &_contact_ops ) {
+		_ccid_set_error(cci->i_parent, CCID_ERROR_IN_VALUE);
+		return 0;
+	}
+
+	_cci_lock(cci);
+	cci->i_clock_ms = clock_ms;
+	cci->i_power_ms = power_ms;
+	cci->i_last = _time_us();
+	_cci_unlock(cci);
+	return 1;
+}
+
+/** Apply the idle policy to the slots of a chip card device.
+ * \ingroup g_ccid
+ *
+ * @param ccid The \ref ccid_t to check.
+ *
+ * Stops the clock or powers down cards in slots which have been idle for
+ * longer than allowed by cci_set_idle(). Slots which are in use by another
+ * thread, or have a transaction in flight, are left alone.
+ *
+ * @return Milliseconds until this should next be called, or zero if there
+ * is nothing left to do.
+ */
+unsigned int ccid_idle(ccid_t ccid)
+{
+	uint64_t now = _time_us();
+	unsigned int i, ms, next = 0;
+	struct _cci *cci;
+
+	for(i = 0; i < ccid->d_num_slots; i++) {
+		cci = ccid->d_slot + i;
+		if ( !cci->i_clock_ms && !cci->i_power_ms )
+			continue;
+
+		/* busy, so not idle */
+		ms = (cci->i_clock_ms) ? cci->i_clock_ms : cci->i_power_ms;
+
+		if ( _cci_trylock(cci) ) {
+			if ( __atomic_load_n(&_cci_cmd(cci)->c_complete,
+						__ATOMIC_ACQUIRE) )
+				ms = idle_slot(cci, now);
+			_cci_unlock(cci);
+		}
+
+		if ( ms && (!next || ms < next) )
+			next = ms;
+	}
+
+	return next;
+}
+
 _private const struct _cci_ops _contact_ops = {
 	.power_on = contact_power_on,
 	.power_off = contact_power_off,
 	.transact = contact_transact,
+	.submit = contact_submit,
 };
@@ -12,12 +12,14 @@
 
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #if HAVE_ENDIAN_H
 #include <endian.h>
 #endif
 
 #include <libusb.h>
 #include <ccid-spec.h>
+#include <list.h>
 
 #define trace(ccid, fmt, x...) \
 		do { \
@@ -34,27 +36,241 @@ struct _cci_ops {
 					size_t *atr_len);
 	int (*power_off)(struct _cci *cci);
 	int (*transact)(struct _cci *cc, struct _xfr *xfr);
+	int (*submit)(struct _cci *cc, struct _xfr *xfr);
 	void (*dtor)(struct _cci *cc);
 };
 extern const struct _cci_ops _contact_ops;
 extern const struct _cci_ops _rfid_ops;
 
+/* A command: PC_to_RDR message on the bulk OUT pipe followed by the
+ * RDR_to_PC response with matching slot and sequence number. c_error is
+ * handed to the waiting thread, since completion may be reaped by any.
+ *
+ * c_deadline is when whoever waits gives up and aborts the command, it's
+ * pushed back by time extensions. Once aborted, c_stale_seq marks a late
+ * response from the reader to be dropped.
+ */
+#define CMD_IDLE	0
+#define CMD_QUEUED	1 /* waiting for a free busy slot */
+#define CMD_TX		2 /* OUT transfer in flight */
+#define CMD_RX		3 /* waiting for response */
+#define CMD_TX_RESP	4 /* response reaped before OUT transfer */
+struct _ccid_cmd {
+	pthread_mutex_t	c_lock; /* slot lock */
+	struct _ccid	*c_ccid;
+	struct _xfr	*c_xfr;
+	struct libusb_transfer *c_urb;
+	struct list_head c_list;
+	void		(*c_done)(struct _ccid_cmd *cmd, int result);
+	cci_cb_t	c_cb;
+	void		*c_priv;
+	int		c_complete;
+	int		c_result;
+	unsigned int	c_error;
+	unsigned int	c_policy; /* cci_set_timeout() */
+	uint64_t	c_start;
+	uint64_t	c_timeout;
+	uint64_t	c_deadline;
+	uint8_t		c_state;
+	uint8_t		c_slot;
+	uint8_t		c_seq;
+	uint8_t		c_stat;
+	uint8_t		c_stale;
+	uint8_t		c_stale_seq;
+};
+
+/* Transport beneath the command layer. send() starts transmission of a
+ * command's PC_to_RDR message, the transport then reports completion of the
+ * send with _ccid_tx_done() and hands up RDR_to_PC messages and interrupt
+ * packets with _ccid_rx_msg() and _ccid_intr_msg(). Those are only called
+ * from within wait(), wait_intr() or drain() and take the bus lock
+ * themselves. send() is called with the bus lock held.
+ *
+ * wait() returns when the command completes or its deadline passes, both
+ * may be changed by another thread so are read atomically. cancel() is
+ * called with the bus lock held to forget a command which is being given
+ * up on, one still in CMD_TX must be finished with _ccid_tx_done(). The
+ * optional abort() sends the class specific ABORT request.
+ */
+struct _ccid_xport {
+	int (*send)(struct _ccid *ccid, struct _ccid_cmd *cmd);
+	void (*wait)(struct _ccid *ccid, struct _ccid_cmd *cmd);
+	void (*cancel)(struct _ccid *ccid, struct _ccid_cmd *cmd);
+	void (*abort)(struct _ccid *ccid, unsigned int slot, uint8_t seq);
+	int (*wait_intr)(struct _ccid *ccid);
+	void (*drain)(struct _ccid *ccid);
+	void (*dtor)(struct _ccid *ccid);
+};
+extern const struct _ccid_xport _usb_xport;
+extern const struct _ccid_xport _replay_xport;
+extern const struct _ccid_xport _vccid_xport;
+
+/* T=1 block protocol state, for TPDU level readers */
+#define T1_DEFAULT_IFSC	32
+#define T1_MAX_BWI	9
+struct _t1 {
+	uint8_t t_ns;
+	uint8_t t_nr;
+	uint8_t t_ifsc;
+	uint8_t t_nad;
+	uint8_t t_crc;
+};
+
+/* Parsed answer to reset, with defaults for anything absent */
+#define ATR_DEFAULT_FIDI	0x11
+#define ATR_DEFAULT_WI		10
+#define ATR_DEFAULT_BWI_CWI	0x4d
+#define ATR_MAX_HIST		15
+#define ATR_MAX_LEN		33
+struct _atr {
+	uint8_t		a_raw[ATR_MAX_LEN];
+	uint8_t		a_len;
+	uint8_t		a_valid;
+	uint8_t		a_inverse;
+	uint8_t		a_fidi;		/* TA1 */
+	uint8_t		a_n;		/* TC1: extra guard time */
+	uint8_t		a_wi;		/* TC2: T=0 waiting integer */
+	uint8_t		a_specific;	/* TA2: specific mode */
+	uint8_t		a_specific_proto;
+	uint8_t		a_implicit;
+	uint8_t		a_ifsc;		/* first TA for T=1 */
+	uint8_t		a_bwi_cwi;	/* first TB for T=1 */
+	uint8_t		a_crc;		/* first TC for T=1 */
+	uint8_t		a_clock_stop;	/* TA for T=15: clock stop indicator */
+	uint8_t		a_proto;	/* first offered, or specific */
+	uint16_t	a_protos;	/* bitmask of offered protocols */
+	uint8_t		a_num_hist;
+	uint8_t		a_hist[ATR_MAX_HIST];
+};
+
+/* Last parameters a reader settled on for a card, as the raw abProtocolData
+ * from RDR_to_PC_Parameters.
+ */
+#define PCACHE_MAX_PARAMS	7
+struct _pparams {
+	uint8_t		p_proto;
+	uint8_t		p_len;
+	uint8_t		p_buf[PCACHE_MAX_PARAMS];
+};
+
+/* What a reader told us about itself when it was probed, see dcache.c */
+#define DCACHE_MAX_SERIAL	64
+#define DCACHE_MAX_CONFIG	512
+#define DCACHE_MAX_TAB		0xff
+struct _dcache_key {
+	uint16_t	k_vid;
+	uint16_t	k_pid;
+	uint16_t	k_rel;
+	char		k_serial[DCACHE_MAX_SERIAL];
+};
+
+struct _dcache_val {
+	uint8_t		v_config[DCACHE_MAX_CONFIG];
+	size_t		v_config_len;
+	uint32_t	v_rate[DCACHE_MAX_TAB];
+	size_t		v_num_rate;
+	uint32_t	v_clock[DCACHE_MAX_TAB];
+	size_t		v_num_clock;
+};
+
+struct _fi {
+	uint16_t fi;
+	uint16_t fmax; /* KHz */
+};
+extern const struct _fi _fi_table[16];
+extern const uint8_t _di_table[16];
+
 struct _cci {
 	struct _ccid *i_parent;
 	uint8_t i_idx;
 	uint8_t i_status;
+	uint8_t i_proto;
+	unsigned int i_flags;
 	const struct _cci_ops *i_ops;
 	void *i_priv;
+	struct _atr i_atr;
+	struct _t1 i_t1;
+
+	/* power on, status and parameters, then for splitting transactions
+	 * which don't fit in one message
+	 */
+	struct _xfr *i_xfr;
+	struct _xfr *i_blk;
+
+	/* parameters in force, for working out timeouts */
+	uint8_t i_params;
+	uint8_t i_fidi;
+	uint8_t i_wi;
+
+	/* idle policy, see cci_set_idle() */
+	uint64_t i_last;
+	unsigned int i_clock_ms;
+	unsigned int i_power_ms;
+	unsigned int i_voltage;
+	uint8_t i_idle;
 };
 
+#define IDLE_NONE	0
+#define IDLE_CLOCK	1 /* clock stopped by idle policy */
+#define IDLE_POWER	2 /* powered down by idle policy */
+
 #define RFID_MAX_FIELDS 1
 
+/* Exchange level, from dwFeatures */
+#define CCID_LEVEL_TPDU		0
+#define CCID_LEVEL_APDU		1
+#define CCID_LEVEL_APDU_EXT	2
+
+/* Locking: the bus lock, d_lock, covers the command table, the transport
+ * and statistics. It is held while a message is sent and while a response
+ * is dispatched, never while waiting. Each bSlot has a lock in d_cmd which
+ * is held across everything done to a slot by one cci_* call, so that
+ * multiple message operations aren't interleaved. Slot locks are taken
+ * before the bus lock. Both are recursive because completion callbacks run
+ * with the bus lock held and may submit more work.
+ */
 struct _ccid {
+	const struct _ccid_xport *d_xport;
+	void		*d_xport_priv;
+	pthread_mutex_t	d_lock;
+
+	libusb_context	*d_ctx;
 	libusb_device_handle *d_dev;
 
+	/* Outstanding commands, indexed by bSlot */
+	struct _ccid_cmd d_cmd[CCID_MAX_SLOTS];
+	struct list_head d_queue;
+	unsigned int	d_inflight;
+
+	/* Responses are received in to d_rxbuf and demuxed from there, for
+	 * USB by a single shared bulk IN transfer. d_rxlen is how much of a
+	 * message which spans several reads has arrived so far.
+	 */
+	struct libusb_transfer *d_rx_urb;
+	uint8_t		*d_rxbuf;
+	size_t		d_rxmax;
+	size_t		d_rxlen;
+	int		d_rx_active;
+	int		d_rx_skip;
+
+	/* Interrupt endpoint listener, kept armed for the device lifetime.
+	 * d_intr_urb doubles as the request which clears a stall on it.
+	 */
+	struct libusb_transfer *d_intr_urb;
+	uint8_t		*d_intrbuf;
+	uint8_t		d_intr_setup[LIBUSB_CONTROL_SETUP_SIZE];
+	int		d_intr_active;
+	unsigned int	d_intr_count;
+	ccid_event_cb_t	d_event_cb;
+	void		*d_event_priv;
+
+	/* for device level requests, eg. escapes */
 	struct _xfr	*d_xfr;
+	unsigned int	d_level;
 
 	FILE		*d_tf;
+	struct _trace	*d_bt;
+	struct ccid_stats d_stats;
 
 	/* USB interface */
 	int 		d_inp;
@@ -81,8 +297,6 @@ struct _ccid {
 	/* CCID USB descriptor */
 	struct ccid_desc d_desc;
 
-	unsigned int	d_error;
-
 	char		*d_name;
 	uint32_t	*d_clock_freq;
 	uint32_t	*d_data_rate;
@@ -90,6 +304,13 @@ struct _ccid {
 	size_t		d_num_rate;
 };
 
+/* The receive side of an allocated xfr is a separate buffer which grows on
+ * demand, up to XFR_RX_LIMIT: the largest extended APDU response. Views on
+ * to other buffers leave XFR_RX_GROW clear.
+ */
+#define XFR_RX_GROW	(1U << 0)
+#define XFR_RX_LIMIT	(0x10000 + 2)
+#define XFR_ALIGN	64 /* cache line */
 struct _xfr {
 	size_t 		x_txmax, x_rxmax;
 	size_t 		x_txlen, x_rxlen;
@@ -97,8 +318,40 @@ struct _xfr {
 	uint8_t 	*x_txbuf;
 	const struct ccid_msg	*x_rxhdr;
 	uint8_t 	*x_rxbuf;
+	unsigned int	x_flags;
+	struct _xfr	*x_next; /* xfr_pool free list */
 };
 
+static inline struct _ccid_cmd *_cci_cmd(struct _cci *cci)
+{
+	return cci->i_parent->d_cmd + cci->i_idx;
+}
+
+static inline void _ccid_lock(struct _ccid *ccid)
+{
+	pthread_mutex_lock(&ccid->d_lock);
+}
+
+static inline void _ccid_unlock(struct _ccid *ccid)
+{
+	pthread_mutex_unlock(&ccid->d_lock);
+}
+
+static inline void _cci_lock(struct _cci *cci)
+{
+	pthread_mutex_lock(&_cci_cmd(cci)->c_lock);
+}
+
+static inline int _cci_trylock(struct _cci *cci)
+{
+	return !pthread_mutex_trylock(&_cci_cmd(cci)->c_lock);
+}
+
+static inline void _cci_unlock(struct _cci *cci)
+{
+	pthread_mutex_unlock(&_cci_cmd(cci)->c_lock);
+}
+
 #define INTF_RFID_OMNI	(1<<0)
 struct _cci_interface {
 	int c, i, a;
@@ -124,7 +377,7 @@ _private int _PC_to_RDR_GetSlotStatus(struct _ccid *ccid, unsigned int slot,
 _private int _PC_to_RDR_GetParameters(struct _ccid *ccid, unsigned int slot,
 					struct _xfr *xfr);
 _private int _PC_to_RDR_SetParameters(struct _ccid *ccid, unsigned int slot,
-					struct _xfr *xfr);
+					struct _xfr *xfr, unsigned int proto);
 _private int _PC_to_RDR_ResetParameters(struct _ccid *ccid, unsigned int slot,
 					struct _xfr *xfr);
 _private int _PC_to_RDR_IccPowerOn(struct _ccid *ccid, unsigned int slot,
@@ -132,16 +385,67 @@ _private int _PC_to_RDR_IccPowerOn(struct _ccid *ccid, unsigned int slot,
 					unsigned int voltage);
 _private int _PC_to_RDR_IccPowerOff(struct _ccid *ccid, unsigned int slot,
 					struct _xfr *xfr);
+_private int _PC_to_RDR_IccClock(struct _ccid *ccid, unsigned int slot,
+					struct _xfr *xfr, unsigned int cmd);
 _private int _PC_to_RDR_XfrBlock(struct _ccid *ccid, unsigned int slot,
 					struct _xfr *xfr);
+_private int _PC_to_RDR_XfrBlock_level(struct _ccid *ccid, unsigned int slot,
+					struct _xfr *xfr, uint16_t level,
+					uint8_t bwi);
 _private int _PC_to_RDR_Escape(struct _ccid *ccid, unsigned int slot,
 					struct _xfr *xfr);
 
+_private int _PC_to_RDR_XfrBlock_submit(struct _ccid *ccid, unsigned int slot,
+					struct _xfr *xfr);
+_private int _ccid_cmd_wait(struct _ccid *ccid, struct _ccid_cmd *cmd);
+
+_private struct _ccid *_ccid_new(const char *tracefile, unsigned int flags);
+_private int _ccid_fill_desc(struct _ccid *ccid, const uint8_t *ptr,
+				size_t len);
+_private int _ccid_start(struct _ccid *ccid, unsigned int intf_flags);
+_private void _ccid_tx_done(struct _ccid *ccid, struct _ccid_cmd *cmd,
+				int ok);
+_private void _ccid_rx_msg(struct _ccid *ccid, size_t len);
+_private void _ccid_rx_abort(struct _ccid *ccid, int rc);
+_private void _ccid_intr_msg(struct _ccid *ccid, const uint8_t *buf,
+				size_t len);
+_private void _ccid_cmd_abort(struct _ccid *ccid, struct _ccid_cmd *cmd);
+
 _private int _cci_wait_for_interrupt(struct _ccid *ccid);
+_private void _ccid_set_error(struct _ccid *ccid, unsigned int err);
+
+_private int _t1_transact(struct _cci *cci, struct _xfr *xfr);
+_private int _cci_resume(struct _cci *cci);
+_private uint64_t _cci_wait_time(struct _cci *cci);
+_private uint64_t _cci_etu(struct _cci *cci);
+
+_private int _atr_parse(struct _atr *atr, const uint8_t *buf, size_t len);
+
+_private int _pcache_lookup(const struct _ccid *ccid, const struct _atr *atr,
+				struct _pparams *pp);
+_private void _pcache_store(const struct _ccid *ccid, const struct _atr *atr,
+				const struct _pparams *pp);
+_private void _pcache_drop(const struct _ccid *ccid, const struct _atr *atr);
+
+_private int _dcache_lookup(const struct _dcache_key *k,
+				struct _dcache_val *v);
+_private void _dcache_store(const struct _dcache_key *k,
+				const struct _dcache_val *v);
+_private void _dcache_drop(const struct _dcache_key *k);
+
+_private libusb_context *_libccid_usb_ctx(void);
 
 _private struct _xfr *_xfr_do_alloc(size_t txbuf, size_t rxbuf);
+_private int _xfr_rx_grow(struct _xfr *xfr, size_t len);
 _private void _xfr_do_free(struct _xfr *xfr);
+_private int _xfr_rx_append(struct _xfr *xfr, const uint8_t *ptr, size_t len);
 
 _private void _hex_dumpf(FILE *f, const uint8_t *tmp, size_t len, size_t llen);
+_private int _unhex(const char *str, uint8_t *buf, size_t max, size_t *len);
+_private void _hex(FILE *f, const uint8_t *buf, size_t len);
+_private int _split_fields(char *str, char **tok, unsigned int num);
+_private int _load_lines(const char *fn, size_t max,
+			int(*cb)(char *line, void *priv), void *priv);
+_private uint64_t _time_us(void);
 
 #endif /* _CCID_INTERNAL_H */
@@ -10,85 +10,414 @@
 
 #include <stdarg.h>
 #include <inttypes.h>
+#include <unistd.h>
 
 #include "ccid-internal.h"
+#include "trace.h"
 
-static void usb_xfr_error(struct _ccid *ccid, int rc)
+/* Smallest bulk IN message we're prepared to receive: short APDU + SW, and
+ * the largest: extended APDU + SW, for readers which send more than their
+ * dwMaxCCIDMessageLength.
+ */
+#define RX_MIN_MSG (sizeof(struct ccid_msg) + 0x100 + 2)
+#define RX_MAX_MSG (sizeof(struct ccid_msg) + 0x10000 + 2)
+#define BLK_MIN (4 + 1 + 0xff + 1) /* largest short command APDU */
+
+/* Timeouts in microseconds: allowance for the reader on top of the card's
+ * waiting time, for commands which only involve the reader, and for the
+ * OUT transfer of a timed out command to be cancelled.
+ */
+#define CMD_SLACK_US	500000
+#define CMD_TIMEOUT_US	5000000
+#define CMD_GRACE_US	1000000
+
+/* Errors are per thread, along with the device they happened on so that
+ * one reader's error isn't reported against an other.
+ */
+static __thread struct _ccid *err_ccid;
+static __thread unsigned int err_code;
+
+void _ccid_set_error(struct _ccid *ccid, unsigned int err)
+{
+	err_ccid = ccid;
+	err_code = err;
+}
+
+/** Retrieve the last error.
+ * \ingroup g_ccid
+ * @param ccid The \ref ccid_t to query.
+ *
+ * Errors are kept per thread, this is the error from the calling thread's
+ * last failed operation on ccid.
+ *
+ * @return One of CCID_ERROR_*, or zero.
+ */
+unsigned int ccid_error(ccid_t ccid)
+{
+	return (err_ccid == ccid) ? err_code : 0;
+}
+
+static unsigned int usb_xfr_error(struct _ccid *ccid, int rc)
 {
+	if ( rc != LIBUSB_ERROR_INTERRUPTED )
+		ccid->d_stats.st_usb_err++;
+
 	switch(rc) {
 	case LIBUSB_ERROR_NO_DEVICE:
-		ccid->d_error = CCID_ERROR_DEVICE_REMOVED;
-		return;
+		return CCID_ERROR_DEVICE_REMOVED;
 	case LIBUSB_ERROR_NO_MEM:
-		ccid->d_error = CCID_ERROR_NO_MEM;
-		return;
+		return CCID_ERROR_NO_MEM;
 	default:
-		ccid->d_error = CCID_ERROR_BUS;
-		return;
+		return CCID_ERROR_BUS;
 	}
 }
 
-static size_t x_rbuflen(struct _xfr *xfr)
-{
-	return xfr->x_rxmax + sizeof(struct ccid_msg);
-}
 static size_t x_tbuflen(struct _xfr *xfr)
 {
 	return xfr->x_txlen + sizeof(struct ccid_msg);
 }
 
-int _cci_wait_for_interrupt(struct _ccid *ccid)
+static int usb_status(const struct libusb_transfer *t)
+{
+	switch(t->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return LIBUSB_SUCCESS;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_INTERRUPTED;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+/* Run the event loop until *done is set. If the event loop itself fails
+ * then the transfer is cancelled so that it is safe to re-use once the
+ * cancellation has been reaped.
+ */
+static void usb_wait(struct _ccid *ccid, struct libusb_transfer *t, int *done)
 {
-	const uint8_t *buf;
-	int ret, rc;
-	size_t len;
+	int rc;
 
-again:
-	rc = libusb_interrupt_transfer(ccid->d_dev, ccid->d_intrp,
-				(void *)ccid->d_xfr->x_rxhdr,
-				x_rbuflen(ccid->d_xfr), &ret, 250);
-	if ( rc == LIBUSB_ERROR_INTERRUPTED )
-		goto again;
-	if ( rc ) {
-		fprintf(stderr, "*** error: libusb_interrupt_transfer()\n");
-		usb_xfr_error(ccid, rc);
-		return 0;
+	while ( !*done ) {
+		rc = libusb_handle_events_completed(ccid->d_ctx, done);
+		if ( rc && rc != LIBUSB_ERROR_INTERRUPTED && t ) {
+			libusb_cancel_transfer(t);
+			t = NULL;
+		}
 	}
+}
 
-	if ( ret == 0 )
-		return 1;
+static void LIBUSB_CALL sync_done(struct libusb_transfer *t)
+{
+	int *done = t->user_data;
+	*done = 1;
+}
+
+/* Synchronous transfer on top of the async API, t must be filled in */
+static int usb_sync(struct _ccid *ccid, struct libusb_transfer *t, size_t *len)
+{
+	int done = 0, rc;
+
+	t->callback = sync_done;
+	t->user_data = &done;
+
+	rc = libusb_submit_transfer(t);
+	if ( rc )
+		return rc;
+
+	usb_wait(ccid, t, &done);
+	*len = (size_t)t->actual_length;
+	return usb_status(t);
+}
+
+static void slot_event(struct _ccid *ccid, unsigned int slot,
+			unsigned int type, uint64_t ts, uint8_t err)
+{
+	struct ccid_event ev;
+
+	if ( NULL == ccid->d_event_cb )
+		return;
+
+	ev.ev_type = type;
+	ev.ev_cci = ccid->d_slot + slot;
+	ev.ev_time = ts;
+	ev.ev_hw_error = err;
+	(*ccid->d_event_cb)(ccid, &ev, ccid->d_event_priv);
+}
+
+/* bmSlotICCState: two bits per slot, card present and changed */
+static void notify_slot_change(struct _ccid *ccid, const uint8_t *buf,
+				size_t len, uint64_t ts)
+{
+	unsigned int i, bits;
+	struct _cci *cci;
+
+	for(i = 0; i < ccid->d_num_slots; i++) {
+		if ( 1 + (i >> 2) >= len )
+			break;
+
+		bits = (buf[1 + (i >> 2)] >> ((i & 0x3) << 1)) & 0x3;
+		cci = ccid->d_slot + i;
 
-	buf = (void *)ccid->d_xfr->x_rxhdr;
-	len = (size_t)ret;
+		if ( bits & 0x1 ) {
+			if ( !(bits & 0x2) &&
+					cci->i_status != CHIPCARD_NOT_PRESENT )
+				continue;
+			trace(ccid, "     : Slot %u status changed to present\n",
+				i);
+			cci->i_status = CHIPCARD_PRESENT;
+			slot_event(ccid, i, CCID_EVENT_INSERTED, ts, 0);
+		}else{
+			if ( !(bits & 0x2) &&
+					cci->i_status == CHIPCARD_NOT_PRESENT )
+				continue;
+			trace(ccid, "     : Slot %u status changed to "
+				"NOT present\n", i);
+			cci->i_status = CHIPCARD_NOT_PRESENT;
+			slot_event(ccid, i, CCID_EVENT_REMOVED, ts, 0);
+		}
+	}
+}
 
+static void intr_packet(struct _ccid *ccid, const uint8_t *buf,
+			size_t len, uint64_t ts)
+{
 	trace(ccid, " Intr: %zu byte interrupt packet\n", len);
 	if ( len < 1 )
-		return 1;
+		return;
 
 	switch( buf[0] ) {
 	case RDR_to_PC_NotifySlotChange:
-		assert(2 == len);
-		if ( buf[1] & 0x2 ) {
-			trace(ccid, "     : Slot status changed to %s\n",
-				((buf[1] & 0x1) == 0) ? 
-					"NOT present" : "present");
-			ccid->d_slot[0].i_status =
-				((buf[1] & 0x1) == 0) ?
-					CHIPCARD_NOT_PRESENT :
-					CHIPCARD_PRESENT;
-		}
+		notify_slot_change(ccid, buf, len, ts);
 		break;
 	case RDR_to_PC_HardwareError:
 		trace(ccid, "     : HALT AND CATCH FIRE!!\n");
+		if ( len < 4 || buf[1] >= ccid->d_num_slots )
+			break;
+		trace(ccid, "     : slot %u hardware error 0x%.2x\n",
+			buf[1], buf[3]);
+		slot_event(ccid, buf[1], CCID_EVENT_HW_ERROR, ts, buf[3]);
 		break;
 	default:
 		fprintf(stderr, "*** error: unknown interrupt packet\n");
 		break;
 	}
+}
+
+static int intr_kick(struct _ccid *ccid);
+
+void _ccid_intr_msg(struct _ccid *ccid, const uint8_t *buf, size_t len)
+{
+	uint64_t ts = _time_us();
+
+	_ccid_lock(ccid);
+	if ( ccid->d_bt )
+		_trace_rec(ccid->d_bt, TRACE_INTR, 0, 0, buf, len);
+	intr_packet(ccid, buf, len, ts);
+	ccid->d_intr_count++;
+	_ccid_unlock(ccid);
+}
+
+/* The reader has gone, and the cards with it */
+static void intr_gone(struct _ccid *ccid)
+{
+	uint64_t ts = _time_us();
+	unsigned int i;
+
+	trace(ccid, " Intr: device removed\n");
+	for(i = 0; i < ccid->d_num_slots; i++) {
+		ccid->d_slot[i].i_status = CHIPCARD_NOT_PRESENT;
+		slot_event(ccid, i, CCID_EVENT_REMOVED, ts, 0);
+	}
+}
+
+static void LIBUSB_CALL halt_done(struct libusb_transfer *t)
+{
+	struct _ccid *ccid = t->user_data;
+	int rc = usb_status(t);
+
+	_ccid_lock(ccid);
+	ccid->d_intr_active = 0;
+
+	switch(rc) {
+	case LIBUSB_SUCCESS:
+		intr_kick(ccid);
+		break;
+	case LIBUSB_ERROR_INTERRUPTED:
+		/* cancelled */
+		break;
+	case LIBUSB_ERROR_NO_DEVICE:
+		usb_xfr_error(ccid, rc);
+		intr_gone(ccid);
+		break;
+	default:
+		/* cci_wait_for_card() will try again */
+		trace(ccid, " Intr: clearing halt failed (%d)\n", rc);
+		usb_xfr_error(ccid, rc);
+		break;
+	}
+	_ccid_unlock(ccid);
+}
+
+/* A stalled endpoint has to be cleared before it can be listened on again.
+ * This is called from a transfer callback, which can't wait for the
+ * synchronous libusb_clear_halt(), so the request is sent asynchronously.
+ */
+static void intr_clear_halt(struct _ccid *ccid)
+{
+	uint8_t rt;
+	int rc;
+
+	if ( !ccid->d_intrp )
+		return;
+
+	rt = (LIBUSB_ENDPOINT_OUT|
+		LIBUSB_REQUEST_TYPE_STANDARD|LIBUSB_RECIPIENT_ENDPOINT);
+	libusb_fill_control_setup(ccid->d_intr_setup, rt,
+				LIBUSB_REQUEST_CLEAR_FEATURE,
+				0, /* ENDPOINT_HALT */
+				ccid->d_intrp, 0);
+	libusb_fill_control_transfer(ccid->d_intr_urb, ccid->d_dev,
+				ccid->d_intr_setup, halt_done, ccid, 1000);
+	rc = libusb_submit_transfer(ccid->d_intr_urb);
+	if ( rc ) {
+		trace(ccid, " Intr: clearing halt failed (%d)\n", rc);
+		usb_xfr_error(ccid, rc);
+		return;
+	}
+
+	ccid->d_intr_active = 1;
+}
+
+/* Errors other than the device going away don't stop the listener, else
+ * nothing would be heard from the reader again.
+ */
+static void LIBUSB_CALL intr_done(struct libusb_transfer *t)
+{
+	struct _ccid *ccid = t->user_data;
+	int rc = usb_status(t);
+
+	_ccid_lock(ccid);
+	ccid->d_intr_active = 0;
+
+	switch(rc) {
+	case LIBUSB_SUCCESS:
+		_ccid_intr_msg(ccid, ccid->d_intrbuf, t->actual_length);
+		intr_kick(ccid);
+		break;
+	case LIBUSB_ERROR_INTERRUPTED:
+		/* cancelled */
+		break;
+	case LIBUSB_ERROR_NO_DEVICE:
+		usb_xfr_error(ccid, rc);
+		ccid->d_intr_count++;
+		intr_gone(ccid);
+		break;
+	case LIBUSB_ERROR_PIPE:
+		trace(ccid, " Intr: endpoint stalled\n");
+		usb_xfr_error(ccid, rc);
+		ccid->d_intr_count++;
+		intr_clear_halt(ccid);
+		break;
+	default:
+		trace(ccid, " Intr: transfer failed (%d)\n", rc);
+		usb_xfr_error(ccid, rc);
+		ccid->d_intr_count++;
+		intr_kick(ccid);
+		break;
+	}
+	_ccid_unlock(ccid);
+}
+
+static int intr_kick(struct _ccid *ccid)
+{
+	int rc;
+
+	if ( !ccid->d_intrp || ccid->d_intr_active )
+		return 1;
+
+	libusb_fill_interrupt_transfer(ccid->d_intr_urb, ccid->d_dev,
+				ccid->d_intrp,
+				ccid->d_intrbuf, ccid->d_max_intr,
+				intr_done, ccid, 0);
+	rc = libusb_submit_transfer(ccid->d_intr_urb);
+	if ( rc ) {
+		_ccid_set_error(ccid, usb_xfr_error(ccid, rc));
+		return 0;
+	}
+
+	ccid->d_intr_active = 1;
+	return 1;
+}
+
+/* Run the event loop until the interrupt listener has seen something or
+ * 250ms have passed.
+ */
+static int usb_wait_intr(struct _ccid *ccid)
+{
+	unsigned int count = ccid->d_intr_count;
+	uint64_t now, end;
+	struct timeval tv;
+	int ret;
+
+	if ( !ccid->d_intrp ) {
+		usleep(250000);
+		return 1;
+	}
+
+	_ccid_lock(ccid);
+	ret = intr_kick(ccid);
+	_ccid_unlock(ccid);
+	if ( !ret ) {
+		fprintf(stderr, "*** error: libusb_submit_transfer()\n");
+		return 0;
+	}
+
+	now = _time_us();
+	end = now + 250000;
+	while ( ccid->d_intr_count == count && now < end ) {
+		tv.tv_sec = (end - now) / 1000000;
+		tv.tv_usec = (end - now) % 1000000;
+		libusb_handle_events_timeout(ccid->d_ctx, &tv);
+		now = _time_us();
+	}
 
 	return 1;
 }
 
+int _cci_wait_for_interrupt(struct _ccid *ccid)
+{
+	return (*ccid->d_xport->wait_intr)(ccid);
+}
+
+/** Register a callback for slot events.
+ * \ingroup g_ccid
+ * @param ccid The \ref ccid_t to receive events for.
+ * @param cb Callback, or NULL to unregister.
+ * @param priv Opaque pointer passed to the callback.
+ *
+ * Card insertion, removal and hardware errors are reported by the device on
+ * its interrupt endpoint, which libccid listens on for as long as the device
+ * is open. Slot status is kept up to date whether or not a callback is
+ * registered. Events are only delivered while the libusb event loop is run,
+ * see libccid_handle_events(). The callback runs with the device's bus lock
+ * held, so it may use cci_submit() but nothing which waits.
+ */
+void ccid_set_event_cb(ccid_t ccid, ccid_event_cb_t cb, void *priv)
+{
+	_ccid_lock(ccid);
+	ccid->d_event_cb = cb;
+	ccid->d_event_priv = priv;
+	_ccid_unlock(ccid);
+}
+
 unsigned int _RDR_to_PC_DataBlock(struct _ccid *ccid, struct _xfr *xfr)
 {
 	assert(xfr->x_rxhdr->bMessageType == RDR_to_PC_DataBlock);
@@ -121,34 +450,6 @@ unsigned int _RDR_to_PC_SlotStatus(struct _ccid *ccid, struct _xfr *xfr)
 	}
 }
 
-static const struct {
-	uint16_t fi; /* Fi */
-	uint16_t fmax; /* Fmax (KHz) */
-} fi_table[16] = {
-	{.fi = 372, .fmax = 4000},
-	{.fi = 372, .fmax = 5000},
-	{.fi = 558, .fmax = 6000},
-	{.fi = 744, .fmax = 8000},
-	{.fi = 1116, .fmax = 12000},
-	{.fi = 1488, .fmax = 16000},
-	{.fi = 1860, .fmax = 20000},
-	{.fi = 0, },
-
-	{.fi = 0, },
-	{.fi = 512, .fmax = 5000},
-	{.fi = 768, .fmax = 7500},
-	{.fi = 1024, .fmax = 10000},
-	{.fi = 1536, .fmax = 15000},
-	{.fi = 2048, .fmax = 20000},
-	{.fi = 0, },
-	{.fi = 0, },
-};
-
-static const uint8_t di_table[16] = {
-	0, 1, 2, 4, 8, 16, 32, 64,
-	12, 20, 0, 0, 0, 0, 0, 0
-};
-
 static unsigned int guard_time(uint8_t t)
 {
 	if ( t == 0xff )
@@ -171,12 +472,13 @@ int _RDR_to_PC_Parameters(struct _ccid *ccid, struct _xfr *xfr)
 		t0 = (const struct ccid_t0 *)xfr->x_rxbuf;
 
 		trace(ccid, "     : Fi=%d Fmax = %dKHz\n",
-			fi_table[t0->bmFindexDindex >> 4].fi,
-			fi_table[t0->bmFindexDindex >> 4].fmax);
+			_fi_table[t0->bmFindexDindex >> 4].fi,
+			_fi_table[t0->bmFindexDindex >> 4].fmax);
 		trace(ccid, "     : Baud rate conversion factor Di = %d\n",
-			di_table[t0->bmFindexDindex & 0xf]);
+			_di_table[t0->bmFindexDindex & 0xf]);
 		trace(ccid, "     : %s convention\n",
-			(t0->bmTCCSKST0 & 1) ? "Inverse" : "Direct");
+			(t0->bmTCCSKST0 & CCID_CONV_INVERSE) ?
+				"Inverse" : "Direct");
 		trace(ccid, "     : Guard time: %detu\n",
 			guard_time(t0->bGuardTimeT0));
 		trace(ccid, "     : Waiting integer: %d\n",
@@ -201,18 +503,20 @@ int _RDR_to_PC_Parameters(struct _ccid *ccid, struct _xfr *xfr)
 	return 1;
 }
 
-static int _cmd_result(struct _ccid *ccid, const struct ccid_msg *msg)
+/* err is set to one of CCID_ERROR_* on failure */
+static int _cmd_result(struct _ccid *ccid, const struct ccid_msg *msg,
+			unsigned int *err)
 {
 	switch( msg->in.bStatus & CCID_STATUS_RESULT_MASK ) {
 	case CCID_RESULT_SUCCESS:
 		trace(ccid, "     : Command: SUCCESS\n");
 		return 1;
 	case CCID_RESULT_ERROR:
-		ccid->d_error = CCID_ERROR_CARD_IO;
+		*err = CCID_ERROR_CARD_IO;
 		switch ( msg->in.bError ) {
 		case CCID_ERR_ABORT:
 			trace(ccid, "     : Command: ERR: ICC Aborted\n");
-			ccid->d_error = CCID_ERROR_NO_CARD;
+			*err = CCID_ERROR_NO_CARD;
 			break;
 		case CCID_ERR_MUTE:
 			trace(ccid, "     : Command: ERR: ICC Timed Out\n");
@@ -228,25 +532,25 @@ static int _cmd_result(struct _ccid *ccid, const struct ccid_msg *msg)
 			break;
 		case CCID_ERR_BAD_TS:
 			trace(ccid, "     : Command: ERR: Bad ATR TS\n");
-			ccid->d_error = CCID_ERROR_CARD_PROTO;
+			*err = CCID_ERROR_CARD_PROTO;
 			break;
 		case CCID_ERR_BAD_TCK:
 			trace(ccid, "     : Command: ERR: Bad ATR TCK\n");
-			ccid->d_error = CCID_ERROR_CARD_PROTO;
+			*err = CCID_ERROR_CARD_PROTO;
 			break;
 		case CCID_ERR_PROTOCOL:
 			trace(ccid, "     : Command: ERR: "
 					"Unsupported Protocol\n");
-			ccid->d_error = CCID_ERROR_CARD_PROTO;
+			*err = CCID_ERROR_CARD_PROTO;
 			break;
 		case CCID_ERR_CLASS:
 			trace(ccid, "     : Command: ERR: Unsupported CLA\n");
-			ccid->d_error = CCID_ERROR_CARD_PROTO;
+			*err = CCID_ERROR_CARD_PROTO;
 			break;
 		case CCID_ERR_PROCEDURE:
 			trace(ccid, "     : Command: ERR: "
 					"Procedure Byte Conflict\n");
-			ccid->d_error = CCID_ERROR_CARD_PROTO;
+			*err = CCID_ERROR_CARD_PROTO;
 			break;
 		case CCID_ERR_DEACTIVATED:
 			trace(ccid, "     : Command: ERR: "
@@ -258,7 +562,7 @@ static int _cmd_result(struct _ccid *ccid, const struct ccid_msg *msg)
 			break;
 		case CCID_ERR_PIN_TIMEOUT:
 			trace(ccid, "     : Command: ERR: PIN timeout\n");
-			ccid->d_error = CCID_ERROR_PIN_TIMEOUT;
+			*err = CCID_ERROR_PIN_TIMEOUT;
 			break;
 		case CCID_ERR_BUSY:
 			trace(ccid, "     : Command: ERR: Slot Busy\n");
@@ -276,49 +580,13 @@ static int _cmd_result(struct _ccid *ccid, const struct ccid_msg *msg)
 	case CCID_RESULT_TIMEOUT:
 		trace(ccid, "     : Command: Time Extension Request\n");
 		trace(ccid, "     : BW1/CW1 = 0x%.2x\n", msg->in.bError);
-		ccid->d_error = CCID_ERROR_CARD_TIMEOUT;
+		*err = CCID_ERROR_CARD_TIMEOUT;
 		return 0;
 	default:
 		fprintf(stderr, "*** error: unknown command result\n");
-		ccid->d_error = CCID_ERROR_CARD_IO;
-		return 0;
-	}
-}
-
-static int do_recv(struct _ccid *ccid, struct _xfr *xfr)
-{
-	int ret, rc;
-	size_t len;
-
-again:
-	rc = libusb_bulk_transfer(ccid->d_dev, ccid->d_inp,
-				(void *)xfr->x_rxhdr,
-				x_rbuflen(xfr), &ret, 0);
-	if ( rc == LIBUSB_ERROR_INTERRUPTED )
-		goto again;
-	if ( rc ) {
-		fprintf(stderr, "*** error: libusb_bulk_read()\n");
-		usb_xfr_error(ccid, rc);
-		return 0;
-	}
-
-	len = (size_t)ret;
-
-	if ( len < sizeof(*xfr->x_rxhdr) ) {
-		fprintf(stderr, "*** error: truncated CCI msg\n");
-		ccid->d_error = CCID_ERROR_BUS;
-		return 0;
-	}
-
-	if ( sizeof(*xfr->x_rxhdr) + le32toh(xfr->x_rxhdr->dwLength) > len ) {
-		fprintf(stderr, "*** error: bad dwLength in CCI msg\n");
-		ccid->d_error = CCID_ERROR_BUS;
+		*err = CCID_ERROR_CARD_IO;
 		return 0;
 	}
-
-	xfr->x_rxlen = le32toh(xfr->x_rxhdr->dwLength);
-
-	return 1;
 }
 
 static void _chipcard_set_status(struct _cci *cc, unsigned int status)
@@ -342,47 +610,15 @@ static void _chipcard_set_status(struct _cci *cc, unsigned int status)
 	}
 }
 
-int _RDR_to_PC(struct _ccid *ccid, unsigned int slot, struct _xfr *xfr)
+static int time_extension(const struct ccid_msg *msg)
 {
-	const struct ccid_msg *msg;
-	unsigned int try = 10;
-
-again:
-	if ( !do_recv(ccid, xfr) )
-		return 0;
-
-	msg = xfr->x_rxhdr;
-
-	trace(ccid, " Recv: %zu bytes for slot %u (seq = 0x%.2x)\n",
-		xfr->x_rxlen, msg->bSlot, msg->bSeq);
-
-	if ( msg->bSlot != slot ) {
-		fprintf(stderr, "*** error: bad slot %u (expected %u)\n",
-			msg->bSlot, slot);
-		ccid->d_error = CCID_ERROR_BUS;
-		return 0;
-	}
-
-	if ( (uint8_t)(msg->bSeq + 1) != ccid->d_seq ) {
-		fprintf(stderr, "*** error: expected seq 0x%.2x got 0x%.2x\n",
-			ccid->d_seq, (uint8_t)(msg->bSeq + 1));
-		ccid->d_error = CCID_ERROR_BUS;
-		return 0;
-	}
-
-	_chipcard_set_status(&ccid->d_slot[msg->bSlot], msg->in.bStatus);
-
-	if ( xfr->x_rxhdr->in.bStatus == CCID_RESULT_TIMEOUT && --try )
-		goto again;
-
-	return _cmd_result(ccid, xfr->x_rxhdr);
+	return (msg->in.bStatus & CCID_STATUS_RESULT_MASK) ==
+		CCID_RESULT_TIMEOUT;
 }
 
-static int _PC_to_RDR(struct _ccid *ccid, unsigned int slot, struct _xfr *xfr)
+static void tx_prepare(struct _ccid *ccid, unsigned int slot,
+			struct _xfr *xfr)
 {
-	int ret, rc;
-	size_t len;
-
 	/* Escape functions may use bad slots as part of their
 	 * interface. For example this is useful in detecting the
 	 * presence or absense of specific vendor extensions
@@ -391,101 +627,935 @@ static int _PC_to_RDR(struct _ccid *ccid, unsigned int slot, struct _xfr *xfr)
 		assert(slot < ccid->d_num_slots);
 	}
 
-	xfr->x_txhdr->dwLength = le32toh(xfr->x_txlen);
+	xfr->x_txhdr->dwLength = htole32(xfr->x_txlen);
 	xfr->x_txhdr->bSlot = slot;
-	xfr->x_txhdr->bSeq = ccid->d_seq++;
 
-again:
-	rc = libusb_bulk_transfer(ccid->d_dev, ccid->d_outp,
-				(void *)xfr->x_txhdr,
-				x_tbuflen(xfr), &ret, 0);
-	if ( rc == LIBUSB_ERROR_INTERRUPTED )
-		goto again;
-	if ( rc ) {
-		fprintf(stderr, "*** error: libusb_bulk_write()\n");
-		usb_xfr_error(ccid, rc);
-		return 0;
-	}
+	/* an abort carries the sequence number of the command it aborts */
+	if ( xfr->x_txhdr->bMessageType != PC_to_RDR_Abort )
+		xfr->x_txhdr->bSeq = __atomic_fetch_add(&ccid->d_seq, 1,
+							__ATOMIC_RELAXED);
+}
 
-	len = (size_t)ret;
+/* Outstanding command table.
+ *
+ * Each bSlot value has one entry in d_cmd[], so there is at most one
+ * command per slot in flight. Up to bMaxCCIDBusySlots entries may be on the
+ * wire at once, the rest wait on d_queue in submission order. A single bulk
+ * IN transfer into d_rxbuf is kept running while anything is in flight and
+ * responses are routed back to their command by bSlot and bSeq.
+ *
+ * d_rxbuf is a whole number of max packets so that a transfer only ends
+ * early on a short packet, which ends a message. One which fills the buffer
+ * is continued with further reads, after growing the buffer if dwLength
+ * says the message is bigger, until a short packet or dwLength is reached.
+ */
+static void cmd_dequeue(struct _ccid *ccid);
 
-	if ( ret < x_tbuflen(xfr) ) {
-		fprintf(stderr, "*** error: truncated TX: %zu/%zu\n",
-			len, x_tbuflen(xfr));
-		ccid->d_error = CCID_ERROR_BUS;
-		return 0;
+static unsigned int stats_idx(uint8_t type)
+{
+	switch(type) {
+	case PC_to_RDR_XfrBlock:
+		return CCID_STATS_XFRBLOCK;
+	case PC_to_RDR_IccPowerOn:
+		return CCID_STATS_POWERON;
+	case PC_to_RDR_IccPowerOff:
+		return CCID_STATS_POWEROFF;
+	case PC_to_RDR_GetSlotStatus:
+		return CCID_STATS_SLOTSTATUS;
+	case PC_to_RDR_GetParameters:
+		return CCID_STATS_GETPARAMS;
+	case PC_to_RDR_SetParameters:
+		return CCID_STATS_SETPARAMS;
+	case PC_to_RDR_ResetParameters:
+		return CCID_STATS_RESETPARAMS;
+	case PC_to_RDR_Escape:
+		return CCID_STATS_ESCAPE;
+	default:
+		return CCID_STATS_OTHER;
 	}
-
-	return 1;
 }
 
-int _PC_to_RDR_XfrBlock(struct _ccid *ccid, unsigned int slot, struct _xfr *xfr)
+static unsigned int lat_bucket(uint64_t us)
 {
-	int ret;
+	unsigned int b;
 
-	memset(xfr->x_txhdr, 0, sizeof(*xfr->x_txhdr));
-	xfr->x_txhdr->bMessageType = PC_to_RDR_XfrBlock;
-	//xfr->x_txhdr->out.bApp[0] = 0xff; /* wait integer */
-	ret = _PC_to_RDR(ccid, slot, xfr);
-	if ( ret ) {
-		trace(ccid, " Xmit: PC_to_RDR_XfrBlock(%u)\n", slot);
-		_hex_dumpf(ccid->d_tf, xfr->x_txbuf, xfr->x_txlen, 16);
-	}
-	return ret;
+	for(b = 0; us && b < CCID_STATS_NUM_LAT - 1; b++)
+		us >>= 1;
+
+	return b;
 }
 
-int _PC_to_RDR_Escape(struct _ccid *ccid, unsigned int slot, struct _xfr *xfr)
+/* Latency is measured from submission of the PC_to_RDR message, so time
+ * spent waiting for a busy slot on d_queue is not included.
+ */
+static void stats_cmd(struct _ccid *ccid, struct _ccid_cmd *cmd, int ret)
 {
-	int ret;
-
-	memset(xfr->x_txhdr, 0, sizeof(*xfr->x_txhdr));
-	xfr->x_txhdr->bMessageType = PC_to_RDR_Escape;
-	ret = _PC_to_RDR(ccid, slot, xfr);
-	if ( ret ) {
-		trace(ccid, " Xmit: PC_to_RDR_Escape(%u)\n", slot);
-		_hex_dumpf(ccid->d_tf, xfr->x_txbuf, xfr->x_txlen, 16);
-	}
-	return ret;
+	struct ccid_msg_stats *st = ccid->d_stats.st_msg + cmd->c_stat;
+	uint64_t lat;
+
+	lat = _time_us() - cmd->c_start;
+
+	st->ms_count++;
+	if ( !ret )
+		st->ms_failed++;
+	st->ms_lat_total += lat;
+	if ( lat > st->ms_lat_max )
+		st->ms_lat_max = lat;
+	st->ms_lat[lat_bucket(lat)]++;
 }
 
-int _PC_to_RDR_GetSlotStatus(struct _ccid *ccid, unsigned int slot,
-				struct _xfr *xfr)
+static void cmd_complete(struct _ccid *ccid, struct _ccid_cmd *cmd, int ret)
 {
-	int ret;
+	if ( cmd->c_state == CMD_QUEUED ) {
+		list_del(&cmd->c_list);
+	}else{
+		ccid->d_inflight--;
+		stats_cmd(ccid, cmd, ret);
+	}
 
-	memset(xfr->x_txhdr, 0, sizeof(*xfr->x_txhdr));
-	xfr->x_txhdr->bMessageType = PC_to_RDR_GetSlotStatus;
-	ret = _PC_to_RDR(ccid, slot, xfr);
-	if ( ret )
-		trace(ccid, " Xmit: PC_to_RDR_GetSlotStatus(%u)\n", slot);
+	cmd->c_state = CMD_IDLE;
+	cmd->c_result = ret;
+	__atomic_store_n(&cmd->c_complete, 1, __ATOMIC_RELEASE);
 
-	return ret;
+	cmd_dequeue(ccid);
+
+	if ( cmd->c_done )
+		(*cmd->c_done)(cmd, ret);
 }
 
-int _PC_to_RDR_GetParameters(struct _ccid *ccid, unsigned int slot,
-				struct _xfr *xfr)
+static void LIBUSB_CALL rx_done(struct libusb_transfer *t);
+
+/* Round up to a whole number of bulk IN packets */
+static size_t rx_round(const struct _ccid *ccid, size_t len)
 {
-	int ret;
+	if ( !ccid->d_max_in )
+		return len;
+	return (len + ccid->d_max_in - 1) / ccid->d_max_in * ccid->d_max_in;
+}
 
-	memset(xfr->x_txhdr, 0, sizeof(*xfr->x_txhdr));
-	xfr->x_txhdr->bMessageType = PC_to_RDR_GetParameters;
-	ret = _PC_to_RDR(ccid, slot, xfr);
-	if ( ret )
-		trace(ccid, " Xmit: PC_to_RDR_GetParameters(%u)\n", slot);
+static int rx_kick(struct _ccid *ccid)
+{
+	int rc;
 
+	if ( ccid->d_rx_active || !ccid->d_inflight )
+		return LIBUSB_SUCCESS;
+
+	libusb_fill_bulk_transfer(ccid->d_rx_urb, ccid->d_dev, ccid->d_inp,
+				ccid->d_rxbuf + ccid->d_rxlen,
+				ccid->d_rxmax - ccid->d_rxlen,
+				rx_done, ccid, 0);
+	rc = libusb_submit_transfer(ccid->d_rx_urb);
+	if ( rc )
+		return rc;
+
+	ccid->d_rx_active = 1;
+	return LIBUSB_SUCCESS;
+}
+
+/* The receive side failed, nothing in flight can get a response now */
+void _ccid_rx_abort(struct _ccid *ccid, int rc)
+{
+	struct _ccid_cmd *cmd;
+	unsigned int i, err;
+
+	_ccid_lock(ccid);
+	err = usb_xfr_error(ccid, rc);
+
+	for(i = 0; i < CCID_MAX_SLOTS; i++) {
+		cmd = ccid->d_cmd + i;
+		switch(cmd->c_state) {
+		case CMD_TX:
+			/* completes when the OUT transfer is reaped */
+			cmd->c_state = CMD_TX_RESP;
+			cmd->c_result = 0;
+			cmd->c_error = err;
+			break;
+		case CMD_RX:
+			cmd->c_error = err;
+			cmd_complete(ccid, cmd, 0);
+			break;
+		default:
+			break;
+		}
+	}
+	_ccid_unlock(ccid);
+}
+
+static void rx_response(struct _ccid *ccid, struct _ccid_cmd *cmd, size_t len)
+{
+	const struct ccid_msg *msg = (struct ccid_msg *)ccid->d_rxbuf;
+	struct _xfr *xfr = cmd->c_xfr;
+	struct ccid_msg_stats *st = ccid->d_stats.st_msg + cmd->c_stat;
+	size_t dlen;
+	int ret = 0;
+
+	dlen = le32toh(msg->dwLength);
+	st->ms_rx_bytes += len;
+
+	/* the aborted command's own response may come before the abort's */
+	if ( xfr->x_txhdr->bMessageType == PC_to_RDR_Abort &&
+			msg->bMessageType != RDR_to_PC_SlotStatus ) {
+		trace(ccid, "     : response to aborted command dropped\n");
+		return;
+	}
+
+	if ( msg->bSeq != cmd->c_seq ) {
+		fprintf(stderr, "*** error: expected seq 0x%.2x got 0x%.2x\n",
+			cmd->c_seq, msg->bSeq);
+		cmd->c_error = CCID_ERROR_BUS;
+		goto done;
+	}
+
+	if ( sizeof(*msg) + dlen > len ) {
+		fprintf(stderr, "*** error: bad dwLength in CCI msg\n");
+		cmd->c_error = CCID_ERROR_BUS;
+		goto done;
+	}
+
+	if ( !_xfr_rx_grow(xfr, dlen) ) {
+		fprintf(stderr, "*** error: %zu byte response overflows "
+			"%zu byte buffer\n", dlen, xfr->x_rxmax);
+		cmd->c_error = CCID_ERROR_BUS;
+		goto done;
+	}
+
+	memcpy((void *)xfr->x_rxhdr, msg, sizeof(*msg) + dlen);
+	xfr->x_rxlen = dlen;
+
+	_chipcard_set_status(&ccid->d_slot[msg->bSlot], msg->in.bStatus);
+
+	/* bError is a multiplier of the card's waiting time */
+	if ( time_extension(msg) ) {
+		st->ms_time_ext++;
+		if ( cmd->c_timeout ) {
+			__atomic_store_n(&cmd->c_deadline, _time_us() +
+					cmd->c_timeout *
+					(msg->in.bError ? msg->in.bError : 1),
+					__ATOMIC_RELEASE);
+		}
+		return;
+	}
+
+	if ( xfr->x_txhdr->bMessageType != PC_to_RDR_Abort )
+		cmd->c_stale = 0;
+
+	ret = _cmd_result(ccid, xfr->x_rxhdr, &cmd->c_error);
+	if ( (msg->in.bStatus & CCID_STATUS_RESULT_MASK) == CCID_RESULT_ERROR )
+		ccid->d_stats.st_err[msg->in.bError]++;
+done:
+	if ( cmd->c_state == CMD_TX ) {
+		/* response reaped before the OUT transfer */
+		cmd->c_state = CMD_TX_RESP;
+		cmd->c_result = ret;
+		return;
+	}
+	cmd_complete(ccid, cmd, ret);
+}
+
+static void rx_msg(struct _ccid *ccid, size_t len)
+{
+	const struct ccid_msg *msg = (struct ccid_msg *)ccid->d_rxbuf;
+	struct _ccid_cmd *cmd;
+
+	if ( len < sizeof(*msg) ) {
+		fprintf(stderr, "*** error: truncated CCI msg\n");
+		return;
+	}
+
+	trace(ccid, " Recv: %"PRIu32" bytes for slot %u (seq = 0x%.2x)\n",
+		le32toh(msg->dwLength), msg->bSlot, msg->bSeq);
+	if ( ccid->d_bt )
+		_trace_rec(ccid->d_bt, TRACE_RX, msg->bSlot, msg->bSeq,
+				msg, len);
+
+	cmd = (msg->bSlot < CCID_MAX_SLOTS) ? ccid->d_cmd + msg->bSlot : NULL;
+	if ( cmd && cmd->c_stale && msg->bSeq == cmd->c_stale_seq &&
+			(cmd->c_state == CMD_IDLE || msg->bSeq != cmd->c_seq) ) {
+		trace(ccid, "     : late response to aborted command\n");
+		return;
+	}
+
+	if ( NULL == cmd ||
+			(cmd->c_state != CMD_TX && cmd->c_state != CMD_RX) ) {
+		fprintf(stderr, "*** error: unsolicited response for "
+			"slot %u\n", msg->bSlot);
+		return;
+	}
+
+	rx_response(ccid, cmd, len);
+}
+
+/* A complete RDR_to_PC message of len bytes has been received in to
+ * d_rxbuf, route it to the command it answers.
+ */
+void _ccid_rx_msg(struct _ccid *ccid, size_t len)
+{
+	_ccid_lock(ccid);
+	rx_msg(ccid, len);
+	_ccid_unlock(ccid);
+}
+
+/* Hand up what we have of a message which can't be received, so that its
+ * command fails on the bad dwLength, and throw away the rest as it comes.
+ */
+static void rx_skip(struct _ccid *ccid)
+{
+	rx_msg(ccid, ccid->d_rxlen);
+	ccid->d_rx_skip = 1;
+	ccid->d_rxlen = 0;
+}
+
+/* The read filled the buffer, so the message may carry on in to the next.
+ * Returns zero if it's complete.
+ */
+static int rx_more(struct _ccid *ccid)
+{
+	const struct ccid_msg *msg = (struct ccid_msg *)ccid->d_rxbuf;
+	size_t want;
+	uint8_t *buf;
+
+	if ( ccid->d_rxlen < ccid->d_rxmax )
+		return 0;
+
+	if ( ccid->d_rx_skip ) {
+		ccid->d_rxlen = 0;
+		return 1;
+	}
+
+	want = sizeof(*msg) + le32toh(msg->dwLength);
+	if ( want <= ccid->d_rxlen )
+		return 0;
+
+	if ( want > RX_MAX_MSG ) {
+		rx_skip(ccid);
+		return 1;
+	}
+
+	want = rx_round(ccid, want);
+	buf = realloc(ccid->d_rxbuf, want);
+	if ( NULL == buf ) {
+		rx_skip(ccid);
+		return 1;
+	}
+
+	trace(ccid, "     : receive buffer grown to %zu bytes\n", want);
+	ccid->d_rxbuf = buf;
+	ccid->d_rxmax = want;
+	return 1;
+}
+
+static void LIBUSB_CALL rx_done(struct libusb_transfer *t)
+{
+	struct _ccid *ccid = t->user_data;
+	int rc;
+
+	_ccid_lock(ccid);
+	ccid->d_rx_active = 0;
+
+	rc = usb_status(t);
+	if ( rc ) {
+		if ( rc != LIBUSB_ERROR_INTERRUPTED )
+			fprintf(stderr, "*** error: libusb_bulk_read()\n");
+		ccid->d_rxlen = 0;
+		ccid->d_rx_skip = 0;
+		_ccid_rx_abort(ccid, rc);
+		goto out;
+	}
+
+	ccid->d_rxlen += (size_t)t->actual_length;
+	if ( !rx_more(ccid) ) {
+		/* a zero length packet after a message which filled the
+		 * buffer exactly, or the tail end of one which was dropped
+		 */
+		if ( ccid->d_rxlen && !ccid->d_rx_skip )
+			rx_msg(ccid, ccid->d_rxlen);
+		ccid->d_rxlen = 0;
+		ccid->d_rx_skip = 0;
+	}
+
+	rc = rx_kick(ccid);
+	if ( rc )
+		_ccid_rx_abort(ccid, rc);
+out:
+	_ccid_unlock(ccid);
+}
+
+/* The transport has finished sending a command, successfully or not */
+void _ccid_tx_done(struct _ccid *ccid, struct _ccid_cmd *cmd, int ok)
+{
+	_ccid_lock(ccid);
+	if ( !ok )
+		cmd_complete(ccid, cmd, 0);
+	else if ( cmd->c_state == CMD_TX_RESP )
+		cmd_complete(ccid, cmd, cmd->c_result);
+	else
+		cmd->c_state = CMD_RX;
+	_ccid_unlock(ccid);
+}
+
+void _ccid_cmd_abort(struct _ccid *ccid, struct _ccid_cmd *cmd)
+{
+	_ccid_lock(ccid);
+	cmd_complete(ccid, cmd, 0);
+	_ccid_unlock(ccid);
+}
+
+static void LIBUSB_CALL tx_done(struct libusb_transfer *t)
+{
+	struct _ccid_cmd *cmd = t->user_data;
+	struct _ccid *ccid = cmd->c_ccid;
+	struct _xfr *xfr = cmd->c_xfr;
+	int rc;
+
+	_ccid_lock(ccid);
+
+	rc = usb_status(t);
+	if ( rc ) {
+		fprintf(stderr, "*** error: libusb_bulk_write()\n");
+		rc = usb_xfr_error(ccid, rc);
+		if ( !cmd->c_error )
+			cmd->c_error = rc;
+		_ccid_tx_done(ccid, cmd, 0);
+		goto out;
+	}
+
+	if ( (size_t)t->actual_length < x_tbuflen(xfr) ) {
+		fprintf(stderr, "*** error: truncated TX: %d/%zu\n",
+			t->actual_length, x_tbuflen(xfr));
+		cmd->c_error = CCID_ERROR_BUS;
+		_ccid_tx_done(ccid, cmd, 0);
+		goto out;
+	}
+
+	_ccid_tx_done(ccid, cmd, 1);
+
+	rc = rx_kick(ccid);
+	if ( rc )
+		_ccid_rx_abort(ccid, rc);
+out:
+	_ccid_unlock(ccid);
+}
+
+static int usb_send(struct _ccid *ccid, struct _ccid_cmd *cmd)
+{
+	struct _xfr *xfr = cmd->c_xfr;
+	int rc;
+
+	if ( NULL == cmd->c_urb ) {
+		cmd->c_urb = libusb_alloc_transfer(0);
+		if ( NULL == cmd->c_urb ) {
+			cmd->c_error = CCID_ERROR_NO_MEM;
+			return 0;
+		}
+	}
+
+	libusb_fill_bulk_transfer(cmd->c_urb, ccid->d_dev, ccid->d_outp,
+				(void *)xfr->x_txhdr,
+				x_tbuflen(xfr), tx_done, cmd, 0);
+	rc = libusb_submit_transfer(cmd->c_urb);
+	if ( rc ) {
+		fprintf(stderr, "*** error: libusb_submit_transfer()\n");
+		cmd->c_error = usb_xfr_error(ccid, rc);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int cmd_send(struct _ccid *ccid, struct _ccid_cmd *cmd)
+{
+	struct _xfr *xfr = cmd->c_xfr;
+
+	tx_prepare(ccid, cmd->c_slot, xfr);
+	cmd->c_seq = xfr->x_txhdr->bSeq;
+	cmd->c_stat = stats_idx(xfr->x_txhdr->bMessageType);
+	cmd->c_start = _time_us();
+	__atomic_store_n(&cmd->c_deadline,
+			(cmd->c_timeout) ? cmd->c_start + cmd->c_timeout : 0,
+			__ATOMIC_RELEASE);
+
+	if ( !(*ccid->d_xport->send)(ccid, cmd) )
+		return 0;
+
+	cmd->c_state = CMD_TX;
+	ccid->d_inflight++;
+	ccid->d_stats.st_msg[cmd->c_stat].ms_tx_bytes += x_tbuflen(xfr);
+	if ( ccid->d_bt )
+		_trace_rec(ccid->d_bt, TRACE_TX, cmd->c_slot, cmd->c_seq,
+				xfr->x_txhdr, x_tbuflen(xfr));
+	return 1;
+}
+
+static void cmd_dequeue(struct _ccid *ccid)
+{
+	struct _ccid_cmd *cmd;
+
+	while ( ccid->d_inflight < ccid->d_max_slots &&
+			!list_empty(&ccid->d_queue) ) {
+		cmd = list_entry(ccid->d_queue.next, struct _ccid_cmd, c_list);
+		list_del(&cmd->c_list);
+		if ( !cmd_send(ccid, cmd) )
+			cmd_complete(ccid, cmd, 0);
+	}
+}
+
+/* How long to wait for the response to a command before aborting it, in
+ * microseconds or zero for ever. Commands which go to the card get twice
+ * its waiting time plus the time to send a short APDU each way, others
+ * only involve the reader.
+ */
+static uint64_t cmd_timeout(struct _ccid *ccid, struct _ccid_cmd *cmd,
+				struct _xfr *xfr)
+{
+	struct _cci *cci;
+	uint64_t etu, t;
+
+	/* never wait for ever on an abort, it's cleaning up after one */
+	if ( xfr->x_txhdr->bMessageType == PC_to_RDR_Abort )
+		return CMD_TIMEOUT_US;
+
+	switch(cmd->c_policy) {
+	case CCI_TIMEOUT_NONE:
+		return 0;
+	case CCI_TIMEOUT_AUTO:
+		t = CMD_TIMEOUT_US;
+		break;
+	default:
+		t = cmd->c_policy * 1000ULL;
+		goto out;
+	}
+
+	switch(xfr->x_txhdr->bMessageType) {
+	case PC_to_RDR_XfrBlock:
+	case PC_to_RDR_T0APDU:
+	case PC_to_RDR_Secure:
+		if ( cmd->c_slot >= ccid->d_num_slots )
+			break;
+		cci = ccid->d_slot + cmd->c_slot;
+		etu = _cci_etu(cci);
+		t = 2 * _cci_wait_time(cci) +
+			(xfr->x_txlen + 258) * 12 * etu + CMD_SLACK_US;
+		break;
+	default:
+		break;
+	}
+
+out:
+	/* a block answering the card's S(WTX) gets the time it asked for */
+	if ( xfr->x_txhdr->bMessageType == PC_to_RDR_XfrBlock &&
+			xfr->x_txhdr->out.bApp[0] )
+		t *= xfr->x_txhdr->out.bApp[0];
+	return t;
+}
+
+/* Start a command on a slot, the message header must already have been
+ * filled in by the caller. Completion is signalled via cmd->c_done from
+ * within the libusb event loop. The caller holds the slot lock.
+ */
+static int cmd_issue(struct _ccid *ccid, unsigned int slot, struct _xfr *xfr)
+{
+	struct _ccid_cmd *cmd;
+	int ret = 1;
+
+	if ( slot >= CCID_MAX_SLOTS ) {
+		_ccid_set_error(ccid, CCID_ERROR_IN_VALUE);
+		return 0;
+	}
+
+	cmd = ccid->d_cmd + slot;
+
+	_ccid_lock(ccid);
+	assert(cmd->c_state == CMD_IDLE);
+
+	cmd->c_ccid = ccid;
+	cmd->c_xfr = xfr;
+	cmd->c_slot = slot;
+	cmd->c_timeout = cmd_timeout(ccid, cmd, xfr);
+	cmd->c_deadline = 0;
+	cmd->c_result = 0;
+	cmd->c_error = 0;
+	cmd->c_complete = 0;
+
+	if ( ccid->d_inflight >= ccid->d_max_slots ) {
+		cmd->c_state = CMD_QUEUED;
+		list_add_tail(&cmd->c_list, &ccid->d_queue);
+	}else if ( !cmd_send(ccid, cmd) ) {
+		cmd->c_complete = 1;
+		_ccid_set_error(ccid, cmd->c_error);
+		ret = 0;
+	}
+
+	_ccid_unlock(ccid);
 	return ret;
 }
 
-int _PC_to_RDR_SetParameters(struct _ccid *ccid, unsigned int slot,
+/* Abort a command which timed out in the reader: the ABORT control
+ * request if the transport has one, then PC_to_RDR_Abort with the same
+ * sequence number on the bulk pipe (CCID 1.1 section 5.3.1). The slot's
+ * command entry is borrowed for the latter and left looking as the timed
+ * out command did.
+ */
+static void send_abort(struct _ccid *ccid, struct _ccid_cmd *cmd,
+			struct _xfr *xfr, uint8_t seq)
+{
+	struct _xfr *ab;
+
+	trace(ccid, " Xmit: PC_to_RDR_Abort(%u, seq = 0x%.2x)\n",
+		cmd->c_slot, seq);
+
+	if ( ccid->d_xport->abort )
+		(*ccid->d_xport->abort)(ccid, cmd->c_slot, seq);
+
+	ab = xfr_pool_get(0, 0);
+	if ( NULL == ab )
+		return;
+
+	memset(ab->x_txhdr, 0, sizeof(*ab->x_txhdr));
+	ab->x_txhdr->bMessageType = PC_to_RDR_Abort;
+	ab->x_txhdr->bSeq = seq;
+
+	cmd->c_done = NULL;
+	cmd->c_cb = NULL;
+	cmd->c_priv = NULL;
+	if ( cmd_issue(ccid, cmd->c_slot, ab) )
+		_ccid_cmd_wait(ccid, cmd);
+
+	_ccid_lock(ccid);
+	cmd->c_xfr = xfr;
+	cmd->c_result = 0;
+	cmd->c_error = CCID_ERROR_TIMEOUT;
+	_ccid_unlock(ccid);
+
+	xfr_pool_put(ab);
+}
+
+/* Give up on a command whose deadline passed, returns zero if it turned
+ * out not to have. One which made it to the reader is completed and then
+ * aborted, one still being sent is cancelled and completes when the
+ * cancellation is reaped.
+ */
+static int cmd_expire(struct _ccid *ccid, struct _ccid_cmd *cmd)
+{
+	struct _xfr *xfr;
+	int abort = 0;
+	uint8_t seq;
+
+	pthread_mutex_lock(&cmd->c_lock);
+	_ccid_lock(ccid);
+
+	if ( cmd->c_complete || !cmd->c_deadline ||
+			_time_us() < cmd->c_deadline ) {
+		_ccid_unlock(ccid);
+		pthread_mutex_unlock(&cmd->c_lock);
+		return 0;
+	}
+
+	xfr = cmd->c_xfr;
+	seq = cmd->c_seq;
+
+	if ( cmd->c_error != CCID_ERROR_TIMEOUT ) {
+		trace(ccid, "     : slot %u seq 0x%.2x timed out\n",
+			cmd->c_slot, seq);
+		ccid->d_stats.st_timeouts++;
+		cmd->c_error = CCID_ERROR_TIMEOUT;
+	}
+
+	switch(cmd->c_state) {
+	case CMD_RX:
+		(*ccid->d_xport->cancel)(ccid, cmd);
+		cmd->c_stale = 1;
+		cmd->c_stale_seq = seq;
+		cmd_complete(ccid, cmd, 0);
+		abort = (xfr->x_txhdr->bMessageType != PC_to_RDR_Abort);
+		break;
+	case CMD_TX:
+	case CMD_TX_RESP:
+		(*ccid->d_xport->cancel)(ccid, cmd);
+		if ( !cmd->c_complete )
+			__atomic_store_n(&cmd->c_deadline,
+					_time_us() + CMD_GRACE_US,
+					__ATOMIC_RELEASE);
+		break;
+	default:
+		break;
+	}
+
+	_ccid_unlock(ccid);
+
+	if ( abort )
+		send_abort(ccid, cmd, xfr, seq);
+
+	pthread_mutex_unlock(&cmd->c_lock);
+	return 1;
+}
+
+/* Block until the command on a slot completes, or its deadline passes and
+ * it's aborted, and return its result. The result is picked up under the
+ * bus lock so that any completion callback has returned, and the error is
+ * passed on to this thread.
+ */
+int _ccid_cmd_wait(struct _ccid *ccid, struct _ccid_cmd *cmd)
+{
+	uint64_t deadline;
+	int ret;
+
+	while ( !__atomic_load_n(&cmd->c_complete, __ATOMIC_ACQUIRE) ) {
+		(*ccid->d_xport->wait)(ccid, cmd);
+		deadline = __atomic_load_n(&cmd->c_deadline, __ATOMIC_ACQUIRE);
+		if ( deadline && _time_us() >= deadline )
+			cmd_expire(ccid, cmd);
+	}
+
+	_ccid_lock(ccid);
+	ret = cmd->c_result;
+	if ( !ret )
+		_ccid_set_error(ccid, cmd->c_error);
+	_ccid_unlock(ccid);
+	return ret;
+}
+
+int _RDR_to_PC(struct _ccid *ccid, unsigned int slot,
+		_unused struct _xfr *xfr)
+{
+	assert(slot < CCID_MAX_SLOTS);
+	return _ccid_cmd_wait(ccid, ccid->d_cmd + slot);
+}
+
+static int _PC_to_RDR(struct _ccid *ccid, unsigned int slot, struct _xfr *xfr)
+{
+	struct _ccid_cmd *cmd;
+
+	if ( slot >= CCID_MAX_SLOTS ) {
+		_ccid_set_error(ccid, CCID_ERROR_IN_VALUE);
+		return 0;
+	}
+
+	/* Let anything outstanding on this slot finish first */
+	cmd = ccid->d_cmd + slot;
+	_ccid_cmd_wait(ccid, cmd);
+
+	cmd->c_done = NULL;
+	cmd->c_cb = NULL;
+	cmd->c_priv = NULL;
+
+	return cmd_issue(ccid, slot, xfr);
+}
+
+/* Cancel everything on the wire and wait for the cancellations to be
+ * reaped, so that the transfers may be freed.
+ */
+static void usb_drain(struct _ccid *ccid)
+{
+	struct timeval tv = {0, 100000};
+	struct _ccid_cmd *cmd;
+	unsigned int i;
+
+	for(i = 0; i < CCID_MAX_SLOTS; i++) {
+		cmd = ccid->d_cmd + i;
+		if ( cmd->c_state == CMD_TX || cmd->c_state == CMD_TX_RESP )
+			libusb_cancel_transfer(cmd->c_urb);
+	}
+
+	if ( ccid->d_rx_active )
+		libusb_cancel_transfer(ccid->d_rx_urb);
+
+	/* stop the interrupt listener re-arming itself */
+	ccid->d_intrp = 0;
+	if ( ccid->d_intr_active )
+		libusb_cancel_transfer(ccid->d_intr_urb);
+
+	while ( ccid->d_inflight || ccid->d_rx_active || ccid->d_intr_active )
+		libusb_handle_events_timeout(ccid->d_ctx, &tv);
+}
+
+/* Run the event loop until the command completes or its deadline passes */
+static void usb_xport_wait(struct _ccid *ccid, struct _ccid_cmd *cmd)
+{
+	struct timeval tv;
+	uint64_t deadline, now;
+
+	while ( !__atomic_load_n(&cmd->c_complete, __ATOMIC_ACQUIRE) ) {
+		deadline = __atomic_load_n(&cmd->c_deadline, __ATOMIC_ACQUIRE);
+		if ( !deadline ) {
+			libusb_handle_events_completed(ccid->d_ctx,
+							&cmd->c_complete);
+			continue;
+		}
+
+		now = _time_us();
+		if ( now >= deadline )
+			break;
+
+		tv.tv_sec = (deadline - now) / 1000000;
+		tv.tv_usec = (deadline - now) % 1000000;
+		libusb_handle_events_timeout_completed(ccid->d_ctx, &tv,
+							&cmd->c_complete);
+	}
+}
+
+/* Only the OUT transfer belongs to the command, the IN side is shared */
+static void usb_cancel(_unused struct _ccid *ccid, struct _ccid_cmd *cmd)
+{
+	if ( cmd->c_state == CMD_TX && cmd->c_urb )
+		libusb_cancel_transfer(cmd->c_urb);
+}
+
+static void usb_abort(struct _ccid *ccid, unsigned int slot, uint8_t seq)
+{
+	uint8_t rt;
+	int ret;
+
+	rt = (LIBUSB_ENDPOINT_OUT|
+		LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE);
+
+	ret = libusb_control_transfer(ccid->d_dev, rt, CCID_CTL_ABORT,
+					(seq << 8) | slot, ccid->d_intf,
+					NULL, 0, 1000);
+	if ( ret < 0 )
+		trace(ccid, "     : ABORT control request failed\n");
+}
+
+static void usb_dtor(struct _ccid *ccid)
+{
+	unsigned int i;
+
+	if ( ccid->d_dev )
+		libusb_close(ccid->d_dev);
+	for(i = 0; i < CCID_MAX_SLOTS; i++)
+		libusb_free_transfer(ccid->d_cmd[i].c_urb);
+	libusb_free_transfer(ccid->d_rx_urb);
+	libusb_free_transfer(ccid->d_intr_urb);
+	free(ccid->d_intrbuf);
+}
+
+const struct _ccid_xport _usb_xport = {
+	.send = usb_send,
+	.wait = usb_xport_wait,
+	.cancel = usb_cancel,
+	.abort = usb_abort,
+	.wait_intr = usb_wait_intr,
+	.drain = usb_drain,
+	.dtor = usb_dtor,
+};
+
+/* Fail anything still waiting for a busy slot then have the transport
+ * abort everything in flight.
+ */
+static void ccid_drain(struct _ccid *ccid)
+{
+	struct _ccid_cmd *cmd, *tmp;
+
+	list_for_each_entry_safe(cmd, tmp, &ccid->d_queue, c_list)
+		cmd_complete(ccid, cmd, 0);
+
+	ccid->d_event_cb = NULL;
+	(*ccid->d_xport->drain)(ccid);
+}
+
+int _PC_to_RDR_XfrBlock(struct _ccid *ccid, unsigned int slot, struct _xfr *xfr)
+{
+	return _PC_to_RDR_XfrBlock_level(ccid, slot, xfr, CCID_CHAIN_NONE, 0);
+}
+
+/* level is wLevelParameter, one of the CCID_CHAIN_* values when chaining
+ * an extended APDU
+ */
+int _PC_to_RDR_XfrBlock_level(struct _ccid *ccid, unsigned int slot,
+				struct _xfr *xfr, uint16_t level, uint8_t bwi)
+{
+	int ret;
+
+	memset(xfr->x_txhdr, 0, sizeof(*xfr->x_txhdr));
+	xfr->x_txhdr->bMessageType = PC_to_RDR_XfrBlock;
+	xfr->x_txhdr->out.bApp[0] = bwi; /* block waiting time multiplier */
+	xfr->x_txhdr->out.bApp[1] = level & 0xff;
+	xfr->x_txhdr->out.bApp[2] = level >> 8;
+	ret = _PC_to_RDR(ccid, slot, xfr);
+	if ( ret ) {
+		trace(ccid, " Xmit: PC_to_RDR_XfrBlock(%u)", slot);
+		if ( level ) {
+			trace(ccid, " level 0x%.2x", level);
+		}
+		if ( bwi ) {
+			trace(ccid, " bwi %u", bwi);
+		}
+		trace(ccid, "\n");
+		_hex_dumpf(ccid->d_tf, xfr->x_txbuf, xfr->x_txlen, 16);
+	}
+	return ret;
+}
+
+int _PC_to_RDR_XfrBlock_submit(struct _ccid *ccid, unsigned int slot,
 				struct _xfr *xfr)
 {
 	int ret;
 
 	memset(xfr->x_txhdr, 0, sizeof(*xfr->x_txhdr));
-	xfr->x_txhdr->bMessageType = PC_to_RDR_SetParameters;
+	xfr->x_txhdr->bMessageType = PC_to_RDR_XfrBlock;
+	ret = cmd_issue(ccid, slot, xfr);
+	if ( ret ) {
+		trace(ccid, " Xmit: PC_to_RDR_XfrBlock(%u) async\n", slot);
+		_hex_dumpf(ccid->d_tf, xfr->x_txbuf, xfr->x_txlen, 16);
+	}
+	return ret;
+}
+
+int _PC_to_RDR_Escape(struct _ccid *ccid, unsigned int slot, struct _xfr *xfr)
+{
+	int ret;
+
+	memset(xfr->x_txhdr, 0, sizeof(*xfr->x_txhdr));
+	xfr->x_txhdr->bMessageType = PC_to_RDR_Escape;
+	ret = _PC_to_RDR(ccid, slot, xfr);
+	if ( ret ) {
+		trace(ccid, " Xmit: PC_to_RDR_Escape(%u)\n", slot);
+		_hex_dumpf(ccid->d_tf, xfr->x_txbuf, xfr->x_txlen, 16);
+	}
+	return ret;
+}
+
+int _PC_to_RDR_GetSlotStatus(struct _ccid *ccid, unsigned int slot,
+				struct _xfr *xfr)
+{
+	int ret;
+
+	memset(xfr->x_txhdr, 0, sizeof(*xfr->x_txhdr));
+	xfr->x_txhdr->bMessageType = PC_to_RDR_GetSlotStatus;
+	ret = _PC_to_RDR(ccid, slot, xfr);
+	if ( ret )
+		trace(ccid, " Xmit: PC_to_RDR_GetSlotStatus(%u)\n", slot);
+
+	return ret;
+}
+
+int _PC_to_RDR_GetParameters(struct _ccid *ccid, unsigned int slot,
+				struct _xfr *xfr)
+{
+	int ret;
+
+	memset(xfr->x_txhdr, 0, sizeof(*xfr->x_txhdr));
+	xfr->x_txhdr->bMessageType = PC_to_RDR_GetParameters;
 	ret = _PC_to_RDR(ccid, slot, xfr);
 	if ( ret )
-		trace(ccid, " Xmit: PC_to_RDR_SetParameters(%u)\n", slot);
+		trace(ccid, " Xmit: PC_to_RDR_GetParameters(%u)\n", slot);
+
+	return ret;
+}
+
+int _PC_to_RDR_SetParameters(struct _ccid *ccid, unsigned int slot,
+				struct _xfr *xfr, unsigned int proto)
+{
+	int ret;
+
+	memset(xfr->x_txhdr, 0, sizeof(*xfr->x_txhdr));
+	xfr->x_txhdr->bMessageType = PC_to_RDR_SetParameters;
+	xfr->x_txhdr->out.bApp[0] = proto;
+	ret = _PC_to_RDR(ccid, slot, xfr);
+	if ( ret ) {
+		trace(ccid, " Xmit: PC_to_RDR_SetParameters(%u) T=%u\n",
+			slot, proto);
+		_hex_dumpf(ccid->d_tf, xfr->x_txbuf, xfr->x_txlen, 16);
+	}
 
 	return ret;
 }
@@ -504,6 +1574,24 @@ int _PC_to_RDR_ResetParameters(struct _ccid *ccid, unsigned int slot,
 	return ret;
 }
 
+static void trace_voltage(struct _ccid *ccid, unsigned int voltage)
+{
+	switch(voltage) {
+	case CHIPCARD_AUTO_VOLTAGE:
+		trace(ccid, "     : Automatic Voltage Selection\n");
+		break;
+	case CHIPCARD_5V:
+		trace(ccid, "     : 5 Volts\n");
+		break;
+	case CHIPCARD_3V:
+		trace(ccid, "     : 3 Volts\n");
+		break;
+	case CHIPCARD_1_8V:
+		trace(ccid, "     : 1.8 Volts\n");
+		break;
+	}
+}
+
 int _PC_to_RDR_IccPowerOn(struct _ccid *ccid, unsigned int slot,
 				struct _xfr *xfr,
 				unsigned int voltage)
@@ -518,38 +1606,166 @@ int _PC_to_RDR_IccPowerOn(struct _ccid *ccid, unsigned int slot,
 	ret = _PC_to_RDR(ccid, slot, xfr);
 	if ( ret ) {
 		trace(ccid, " Xmit: PC_to_RDR_IccPowerOn(%u)\n", slot);
-		switch(voltage) {
-		case CHIPCARD_AUTO_VOLTAGE:
-			trace(ccid, "     : Automatic Voltage Selection\n");
-			break;
-		case CHIPCARD_5V:
-			trace(ccid, "     : 5 Volts\n");
-			break;
-		case CHIPCARD_3V:
-			trace(ccid, "     : 3 Volts\n");
-			break;
-		case CHIPCARD_1_8V:
-			trace(ccid, "     : 1.8 Volts\n");
-			break;
-		}
+		trace_voltage(ccid, voltage);
+	}
+
+	return ret;
+}
+
+int _PC_to_RDR_IccPowerOff(struct _ccid *ccid, unsigned int slot,
+				struct _xfr *xfr)
+{
+	int ret;
+
+	memset(xfr->x_txhdr, 0, sizeof(*xfr->x_txhdr));
+	xfr->x_txhdr->bMessageType = PC_to_RDR_IccPowerOff;
+	ret = _PC_to_RDR(ccid, slot, xfr);
+	if ( ret ) {
+		trace(ccid, " Xmit: PC_to_RDR_IccPowerOff(%u)\n", slot);
+	}
+
+	return ret;
+}
+
+int _PC_to_RDR_IccClock(struct _ccid *ccid, unsigned int slot,
+				struct _xfr *xfr, unsigned int cmd)
+{
+	int ret;
+
+	memset(xfr->x_txhdr, 0, sizeof(*xfr->x_txhdr));
+	xfr->x_txhdr->bMessageType = PC_to_RDR_IccClock;
+	xfr->x_txhdr->out.bApp[0] = cmd;
+	ret = _PC_to_RDR(ccid, slot, xfr);
+	if ( ret ) {
+		trace(ccid, " Xmit: PC_to_RDR_IccClock(%u, %s)\n", slot,
+			(cmd == CCID_CLOCK_CMD_STOP) ? "stop" : "restart");
+	}
+
+	return ret;
+}
+
+static const char *msg_name(uint8_t type)
+{
+	switch(type) {
+	case PC_to_RDR_SetParameters:
+		return "PC_to_RDR_SetParameters";
+	case PC_to_RDR_IccPowerOn:
+		return "PC_to_RDR_IccPowerOn";
+	case PC_to_RDR_IccPowerOff:
+		return "PC_to_RDR_IccPowerOff";
+	case PC_to_RDR_GetSlotStatus:
+		return "PC_to_RDR_GetSlotStatus";
+	case PC_to_RDR_Escape:
+		return "PC_to_RDR_Escape";
+	case PC_to_RDR_GetParameters:
+		return "PC_to_RDR_GetParameters";
+	case PC_to_RDR_ResetParameters:
+		return "PC_to_RDR_ResetParameters";
+	case PC_to_RDR_IccClock:
+		return "PC_to_RDR_IccClock";
+	case PC_to_RDR_XfrBlock:
+		return "PC_to_RDR_XfrBlock";
+	case PC_to_RDR_Abort:
+		return "PC_to_RDR_Abort";
+	default:
+		return "PC_to_RDR_Unknown";
 	}
+}
+
+/* Binary trace decoding. The ccid here is a scratch object whose d_tf is
+ * the output, so that messages render exactly as they do in a text trace.
+ */
+void _ccid_render_tx(struct _ccid *ccid, const uint8_t *buf, size_t len)
+{
+	const struct ccid_msg *msg = (const struct ccid_msg *)buf;
+
+	if ( len < sizeof(*msg) ) {
+		trace(ccid, "*** truncated PC_to_RDR message\n");
+		return;
+	}
+
+	trace(ccid, " Xmit: %s(%u)\n", msg_name(msg->bMessageType),
+		msg->bSlot);
+
+	switch(msg->bMessageType) {
+	case PC_to_RDR_XfrBlock:
+	case PC_to_RDR_Escape:
+		_hex_dumpf(ccid->d_tf, buf + sizeof(*msg),
+				len - sizeof(*msg), 16);
+		break;
+	case PC_to_RDR_IccPowerOn:
+		trace_voltage(ccid, msg->out.bApp[0]);
+		break;
+	default:
+		break;
+	}
+}
+
+void _ccid_render_rx(struct _ccid *ccid, const uint8_t *buf, size_t len)
+{
+	const struct ccid_msg *msg = (const struct ccid_msg *)buf;
+	unsigned int err;
+	struct _xfr xfr;
+	size_t dlen;
+
+	if ( len < sizeof(*msg) ) {
+		trace(ccid, "*** truncated RDR_to_PC message\n");
+		return;
+	}
+
+	dlen = le32toh(msg->dwLength);
+	if ( dlen > len - sizeof(*msg) )
+		dlen = len - sizeof(*msg);
+
+	trace(ccid, " Recv: %"PRIu32" bytes for slot %u (seq = 0x%.2x)\n",
+		le32toh(msg->dwLength), msg->bSlot, msg->bSeq);
+
+	if ( msg->bSlot < ccid->d_num_slots )
+		_chipcard_set_status(&ccid->d_slot[msg->bSlot],
+					msg->in.bStatus);
+
+	if ( !_cmd_result(ccid, msg, &err) )
+		return;
 
-	return ret;
+	memset(&xfr, 0, sizeof(xfr));
+	xfr.x_rxhdr = msg;
+	xfr.x_rxbuf = (uint8_t *)(msg + 1);
+	xfr.x_rxlen = dlen;
+
+	switch(msg->bMessageType) {
+	case RDR_to_PC_DataBlock:
+		_RDR_to_PC_DataBlock(ccid, &xfr);
+		break;
+	case RDR_to_PC_SlotStatus:
+		_RDR_to_PC_SlotStatus(ccid, &xfr);
+		break;
+	case RDR_to_PC_Parameters:
+		_RDR_to_PC_Parameters(ccid, &xfr);
+		break;
+	default:
+		_hex_dumpf(ccid->d_tf, xfr.x_rxbuf, dlen, 16);
+		break;
+	}
 }
 
-int _PC_to_RDR_IccPowerOff(struct _ccid *ccid, unsigned int slot,
-				struct _xfr *xfr)
+static void byteswap_desc(struct ccid_desc *desc);
+
+void _ccid_render_desc(struct _ccid *ccid, const uint8_t *buf, size_t len)
 {
-	int ret;
+	const struct trace_desc *td = (const struct trace_desc *)buf;
 
-	memset(xfr->x_txhdr, 0, sizeof(*xfr->x_txhdr));
-	xfr->x_txhdr->bMessageType = PC_to_RDR_IccPowerOff;
-	ret = _PC_to_RDR(ccid, slot, xfr);
-	if ( ret ) {
-		trace(ccid, " Xmit: PC_to_RDR_IccPowerOff(%u)\n", slot);
+	if ( len < sizeof(*td) ) {
+		trace(ccid, "*** truncated device description\n");
+		return;
 	}
 
-	return ret;
+	trace(ccid, "Device: %.*s\n", (int)(len - sizeof(*td)),
+		(const char *)(td + 1));
+	trace(ccid, " o Bulk IN max=%u bytes, OUT max=%u bytes\n",
+		td->td_max_in, td->td_max_out);
+	if ( td->td_max_intr )
+		trace(ccid, " o Interrupt max=%u bytes\n", td->td_max_intr);
+	_ccid_fill_desc(ccid, td->td_desc, sizeof(td->td_desc));
 }
 
 static void byteswap_desc(struct ccid_desc *desc)
@@ -621,7 +1837,7 @@ static int get_endpoint(struct _ccid *ccid, const uint8_t *ptr, size_t len)
 	return 1;
 }
 
-static int fill_ccid_desc(struct _ccid *ccid, const uint8_t *ptr, size_t len)
+int _ccid_fill_desc(struct _ccid *ccid, const uint8_t *ptr, size_t len)
 {
 	if ( len < sizeof(ccid->d_desc) ) {
 		fprintf(stderr, "*** error: truncated CCID descriptor\n");
@@ -634,6 +1850,10 @@ static int fill_ccid_desc(struct _ccid *ccid, const uint8_t *ptr, size_t len)
 
 	ccid->d_num_slots = ccid->d_desc.bMaxSlotIndex + 1;
 	ccid->d_max_slots = ccid->d_desc.bMaxCCIDBusySlots;
+	if ( ccid->d_num_slots > CCID_MAX_SLOTS )
+		ccid->d_num_slots = CCID_MAX_SLOTS;
+	if ( ccid->d_max_slots < 1 )
+		ccid->d_max_slots = 1;
 
 	trace(ccid, " o got %zu/%zu byte desc of type 0x%.2x\n",
 		len, sizeof(ccid->d_desc), ccid->d_desc.bDescriptorType);
@@ -715,12 +1935,15 @@ static int fill_ccid_desc(struct _ccid *ccid, const uint8_t *ptr, size_t len)
 		(CCID_T1_TPDU|CCID_T1_APDU|CCID_T1_APDU_EXT) ) {
 	case CCID_T1_TPDU:
 		trace(ccid, " o Level: T=1 TPDU\n");
+		ccid->d_level = CCID_LEVEL_TPDU;
 		break;
 	case CCID_T1_APDU:
 		trace(ccid, " o Level: T=1 APDU (Short)\n");
+		ccid->d_level = CCID_LEVEL_APDU;
 		break;
 	case CCID_T1_APDU_EXT:
 		trace(ccid, " o Level: T=1 APDU (Short and Extended)\n");
+		ccid->d_level = CCID_LEVEL_APDU_EXT;
 		break;
 	default:
 		fprintf(stderr, "T=1 PDU conflict in descriptor\n");
@@ -759,18 +1982,11 @@ static int fill_ccid_desc(struct _ccid *ccid, const uint8_t *ptr, size_t len)
 	return 1;
 }
 
-static int probe_descriptors(struct _ccid *ccid)
+static int parse_descriptors(struct _ccid *ccid, const uint8_t *dbuf,
+				size_t sz)
 {
-	uint8_t dbuf[512];
-	uint8_t *ptr, *end;
-	int sz, valid_ccid = 0;
-
-	sz = libusb_get_descriptor(ccid->d_dev, LIBUSB_DT_CONFIG, 0,
-				dbuf, sizeof(dbuf));
-	if ( sz < 0 )
-		return 0;
-
-	trace(ccid, " o Fetching config descriptor\n");
+	const uint8_t *ptr, *end;
+	int valid_ccid = 0;
 
 	for(ptr = dbuf, end = ptr + sz; ptr + 2 < end; ) {
 		if ( ptr + ptr[0] > end )
@@ -789,7 +2005,7 @@ static int probe_descriptors(struct _ccid *ccid)
 			get_endpoint(ccid, ptr, ptr[0]);
 			break;
 		case CCID_DT:
-			if ( fill_ccid_desc(ccid, ptr, ptr[0]) )
+			if ( _ccid_fill_desc(ccid, ptr, ptr[0]) )
 				valid_ccid = 1;
 			break;
 		default:
@@ -809,6 +2025,22 @@ static int probe_descriptors(struct _ccid *ccid)
 	return 1;
 }
 
+/* The raw descriptor is kept in v for the descriptor cache */
+static int probe_descriptors(struct _ccid *ccid, struct _dcache_val *v)
+{
+	int sz;
+
+	sz = libusb_get_descriptor(ccid->d_dev, LIBUSB_DT_CONFIG, 0,
+				v->v_config, sizeof(v->v_config));
+	if ( sz < 0 )
+		return 0;
+
+	trace(ccid, " o Fetching config descriptor\n");
+
+	v->v_config_len = sz;
+	return parse_descriptors(ccid, v->v_config, v->v_config_len);
+}
+
 static int get_data_rates(struct _ccid *ccid)
 {
 	uint32_t buf[ccid->d_desc.bNumDataRatesSupported];
@@ -882,6 +2114,128 @@ static int get_clock_freqs(struct _ccid *ccid)
 	return 1;
 }
 
+static int load_tables(struct _ccid *ccid, const struct _dcache_val *v)
+{
+	if ( v->v_num_rate ) {
+		ccid->d_data_rate = calloc(v->v_num_rate,
+						sizeof(*ccid->d_data_rate));
+		if ( NULL == ccid->d_data_rate )
+			return 0;
+		memcpy(ccid->d_data_rate, v->v_rate,
+			v->v_num_rate * sizeof(*ccid->d_data_rate));
+		ccid->d_num_rate = v->v_num_rate;
+	}
+
+	if ( v->v_num_clock ) {
+		ccid->d_clock_freq = calloc(v->v_num_clock,
+						sizeof(*ccid->d_clock_freq));
+		if ( NULL == ccid->d_clock_freq )
+			return 0;
+		memcpy(ccid->d_clock_freq, v->v_clock,
+			v->v_num_clock * sizeof(*ccid->d_clock_freq));
+		ccid->d_num_clock = v->v_num_clock;
+	}
+
+	return 1;
+}
+
+static void save_tables(const struct _ccid *ccid, struct _dcache_val *v)
+{
+	v->v_num_rate = ccid->d_num_rate;
+	if ( v->v_num_rate > DCACHE_MAX_TAB )
+		v->v_num_rate = DCACHE_MAX_TAB;
+	memcpy(v->v_rate, ccid->d_data_rate,
+		v->v_num_rate * sizeof(*v->v_rate));
+
+	v->v_num_clock = ccid->d_num_clock;
+	if ( v->v_num_clock > DCACHE_MAX_TAB )
+		v->v_num_clock = DCACHE_MAX_TAB;
+	memcpy(v->v_clock, ccid->d_clock_freq,
+		v->v_num_clock * sizeof(*v->v_clock));
+}
+
+/* Readers are told apart by serial number, where they have one. It goes in
+ * the cache file as text so anything unprintable is replaced.
+ */
+static int dcache_key(struct _ccid *ccid, struct libusb_device *dev,
+			struct _dcache_key *k)
+{
+	struct libusb_device_descriptor d;
+	char *s;
+
+	memset(k, 0, sizeof(*k));
+
+	if ( libusb_get_device_descriptor(dev, &d) )
+		return 0;
+
+	k->k_vid = d.idVendor;
+	k->k_pid = d.idProduct;
+	k->k_rel = d.bcdDevice;
+
+	if ( !d.iSerialNumber )
+		return 1;
+
+	if ( libusb_get_string_descriptor_ascii(ccid->d_dev, d.iSerialNumber,
+					(uint8_t *)k->k_serial,
+					sizeof(k->k_serial)) < 0 )
+		return 0;
+
+	for(s = k->k_serial; *s; s++) {
+		if ( *s < 0x20 || *s > 0x7e )
+			*s = '?';
+	}
+
+	return 1;
+}
+
+/* Get the device in to the configuration, interface and alternate setting
+ * which we want. A reader left that way by its last user, or one which has
+ * only been configured, is fine without a reset.
+ */
+static int usb_setup(struct _ccid *ccid, const struct _cci_interface *intf,
+			int reset)
+{
+	int c;
+
+	if ( reset )
+		libusb_reset_device(ccid->d_dev);
+
+	if ( libusb_get_configuration(ccid->d_dev, &c) ) {
+		trace(ccid, "error getting configuration\n");
+		return 0;
+	}
+
+	if ( intf->c != c ) {
+		if ( libusb_set_configuration(ccid->d_dev, intf->c) ) {
+			trace(ccid, "error setting configuration\n");
+			return 0;
+		}
+
+		if ( libusb_get_configuration(ccid->d_dev, &c) ) {
+			trace(ccid, "error getting configuration\n");
+			return 0;
+		}
+
+		if ( c != intf->c ) {
+			trace(ccid, "raced while setting configuration "
+				"(%d != %d)\n", c, intf->c);
+			return 0;
+		}
+	}
+
+	if ( libusb_claim_interface(ccid->d_dev, intf->i) ) {
+		trace(ccid, "error claiming interface\n");
+		return 0;
+	}
+
+	if ( libusb_set_interface_alt_setting(ccid->d_dev, intf->i, intf->a) ) {
+		trace(ccid, "error setting alternate settings\n");
+		return 0;
+	}
+
+	return 1;
+}
+
 /** Connect to a physical chipcard device.
  * \ingroup g_ccid
  * @param dev \ref ccidev_t representing a physical device.
@@ -895,22 +2249,158 @@ static int get_clock_freqs(struct _ccid *ccid)
  * @return NULL on failure, valid \ref ccid_t object otherwise.
  */
 ccid_t ccid_probe(ccidev_t dev, const char *tracefile)
+{
+	return ccid_probe_flags(dev, tracefile, 0);
+}
+
+/** Connect to a physical chipcard device.
+ * \ingroup g_ccid
+ * @param dev \ref ccidev_t representing a physical device.
+ * @param tracefile filename to open for trace logging (or NULL).
+ * @param flags Bitmask of CCID_TRACE_* and CCID_PROBE_* flags.
+ *
+ * As per ccid_probe(). With CCID_TRACE_BINARY the raw CCID messages are
+ * recorded, with timestamps, in a binary trace which is written out in the
+ * background. Use ccid_trace_decode() to read it.
+ *
+ * With CCID_PROBE_FAST the device is only reset if it can't be set up as it
+ * is, and the class descriptor, clock and data rate tables are taken from
+ * the descriptor cache if this reader has been opened before, see
+ * libccid_desc_cache_load(). A reader which then fails to start is dropped
+ * from the cache, so that trying again without the flag starts afresh.
+ *
+ * @return NULL on failure, valid \ref ccid_t object otherwise.
+ */
+ccid_t ccid_probe_flags(ccidev_t dev, const char *tracefile,
+			unsigned int flags)
 {
 	struct _cci_interface intf;
 	struct _ccid *ccid = NULL;
-	unsigned int x;
-	int c;
+	struct _dcache_key key;
+	struct _dcache_val v;
+	int fast, keyed, cached = 0;
 
 	if ( !_probe_descriptors(dev, &intf) ) {
 		goto out;
 	}
 
 	/* First initialize data structures */
+	ccid = _ccid_new(tracefile, flags);
+	if ( NULL == ccid )
+		goto out;
+
+	ccid->d_xport = &_usb_xport;
+
+	if ( ccid->d_bt ) {
+		_trace_printf(ccid->d_bt, "Probe CCI on dev %u:%u %d/%d/%d\n",
+				libusb_get_bus_number(dev),
+				libusb_get_device_address(dev),
+				intf.c, intf.i, intf.a);
+		if ( intf.name )
+			_trace_printf(ccid->d_bt, "Recognised as: %s\n",
+					intf.name);
+	}
+
+	trace(ccid, "Probe CCI on dev %u:%u %d/%d/%d\n",
+		libusb_get_bus_number(dev),
+		libusb_get_device_address(dev), intf.c, intf.i, intf.a);
+	if ( intf.name )
+		trace(ccid, "Recognised as: %s\n", intf.name);
+
+	ccid->d_rx_urb = libusb_alloc_transfer(0);
+	ccid->d_intr_urb = libusb_alloc_transfer(0);
+	if ( NULL == ccid->d_rx_urb || NULL == ccid->d_intr_urb )
+		goto out_close;
+
+	ccid->d_bus = libusb_get_bus_number(dev);
+	ccid->d_addr = libusb_get_device_address(dev);
+	ccid->d_name = strdup(intf.name);
+
+	/* Second, open USB device and get it ready */
+	ccid->d_ctx = _libccid_usb_ctx();
+	if ( libusb_open(dev, &ccid->d_dev) ) {
+		goto out_close;
+	}
+
+	fast = !!(flags & CCID_PROBE_FAST);
+	if ( !usb_setup(ccid, &intf, !fast) ) {
+		if ( !fast )
+			goto out_close;
+		trace(ccid, " o Device not ready, resetting\n");
+		if ( !usb_setup(ccid, &intf, 1) )
+			goto out_close;
+	}
+
+	ccid->d_intf = intf.i;
+
+	/* Third, probe the CCID class descriptor */
+	keyed = fast && dcache_key(ccid, dev, &key);
+	if ( keyed && _dcache_lookup(&key, &v) ) {
+		trace(ccid, " o Using cached descriptors\n");
+		cached = 1;
+		if ( !parse_descriptors(ccid, v.v_config, v.v_config_len) )
+			goto out_drop;
+		if ( !load_tables(ccid, &v) )
+			goto out_close;
+	}else{
+		if( !probe_descriptors(ccid, &v) )
+			goto out_close;
+		if ( !get_data_rates(ccid) )
+			goto out_close;
+		if( !get_clock_freqs(ccid) )
+			goto out_close;
+	}
+
+	/* Fourth, setup each slot and any proprietary interfaces */
+	if ( !_ccid_start(ccid, intf.flags) )
+		goto out_drop;
+
+	/* only what a reader which started is known to be good */
+	if ( keyed && !cached ) {
+		save_tables(ccid, &v);
+		_dcache_store(&key, &v);
+	}
+
+	/* Listen for slot changes from here on in */
+	if ( ccid->d_intrp ) {
+		ccid->d_intrbuf = malloc(ccid->d_max_intr);
+		if ( NULL == ccid->d_intrbuf )
+			goto out_close;
+		if ( !intr_kick(ccid) )
+			trace(ccid, " o Interrupt endpoint not listening\n");
+	}
+
+	goto out;
+
+out_drop:
+	if ( keyed )
+		_dcache_drop(&key);
+out_close:
+	ccid_close(ccid);
+	ccid = NULL;
+	fprintf(stderr, "ccid: error probing device\n");
+out:
+	return ccid;
+}
+
+/* Allocate a device with no transport, the caller sets d_xport and then
+ * fills in the descriptor before calling _ccid_start().
+ */
+struct _ccid *_ccid_new(const char *tracefile, unsigned int flags)
+{
+	pthread_mutexattr_t attr;
+	struct _ccid *ccid;
+	unsigned int x;
+
 	ccid = calloc(1, sizeof(*ccid));
 	if ( NULL == ccid )
 		goto out;
 
-	if ( tracefile ) {
+	if ( tracefile && (flags & CCID_TRACE_BINARY) ) {
+		ccid->d_bt = _trace_open(tracefile);
+		if ( NULL == ccid->d_bt )
+			goto out_free;
+	}else if ( tracefile ) {
 		if ( !strcmp("-", tracefile) )
 			ccid->d_tf = stdout;
 		else
@@ -919,17 +2409,19 @@ ccid_t ccid_probe(ccidev_t dev, const char *tracefile)
 			goto out_free;
 	}
 
-	trace(ccid, "Probe CCI on dev %u:%u %d/%d/%d\n",
-		libusb_get_bus_number(dev),
-		libusb_get_device_address(dev), intf.c, intf.i, intf.a);
-	if ( intf.name )
-		trace(ccid, "Recognised as: %s\n", intf.name);
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&ccid->d_lock, &attr);
 
 	for(x = 0; x < CCID_MAX_SLOTS; x++) {
 		ccid->d_slot[x].i_parent = ccid;
 		ccid->d_slot[x].i_idx = x;
 		ccid->d_slot[x].i_ops = &_contact_ops;
+		ccid->d_cmd[x].c_complete = 1;
+		pthread_mutex_init(&ccid->d_cmd[x].c_lock, &attr);
 	}
+	INIT_LIST_HEAD(&ccid->d_queue);
+	pthread_mutexattr_destroy(&attr);
 
 	for(x = 0; x < RFID_MAX_FIELDS; x++) {
 		ccid->d_rf[x].i_parent = ccid;
@@ -937,92 +2429,106 @@ ccid_t ccid_probe(ccidev_t dev, const char *tracefile)
 		/* idx and ops set by proprietary initialisation routines */
 	}
 
-	/* Second, open USB device and get it ready */
-	if ( libusb_open(dev, &ccid->d_dev) ) {
-		goto out_free;
-	}
+	goto out;
 
-#if 1
-	libusb_reset_device(ccid->d_dev);
-#endif
+out_free:
+	free(ccid);
+	ccid = NULL;
+out:
+	return ccid;
+}
 
-	if ( libusb_get_configuration(ccid->d_dev, &c) ) {
-		trace(ccid, "error getting configuration\n");
-		goto out_close;
-	}
+/* Record everything needed to recreate the device from a binary trace.
+ * byteswap_desc() is its own inverse so it converts d_desc back to wire
+ * format.
+ */
+static void trace_desc(struct _ccid *ccid, unsigned int intf_flags)
+{
+	struct trace_desc *td;
+	struct ccid_desc desc;
+	size_t nlen, len;
 
-	if ( intf.c != c && libusb_set_configuration(ccid->d_dev, intf.c) ) {
-		trace(ccid, "error setting configuration\n");
-		goto out_close;
-	}
+	nlen = (ccid->d_name) ? strlen(ccid->d_name) : 0;
+	len = sizeof(*td) + nlen + 1;
 
-	if ( libusb_get_configuration(ccid->d_dev, &c) ) {
-		trace(ccid, "error getting configuration\n");
-		goto out_close;
-	}
+	td = calloc(1, len);
+	if ( NULL == td )
+		return;
 
-	if ( c != intf.c ) {
-		trace(ccid, "raced while setting configuration (%d != %d)\n",
-			c, intf.c);
-		goto out_close;
-	}
+	td->td_max_in = ccid->d_max_in;
+	td->td_max_out = ccid->d_max_out;
+	td->td_max_intr = ccid->d_max_intr;
+	td->td_flags = intf_flags;
 
-	if ( libusb_claim_interface(ccid->d_dev, intf.i) ) {
-		trace(ccid, "error claiming interface\n");
-		goto out_close;
-	}
+	memcpy(&desc, &ccid->d_desc, sizeof(desc));
+	byteswap_desc(&desc);
+	memcpy(td->td_desc, &desc, sizeof(td->td_desc));
+	if ( nlen )
+		memcpy(td + 1, ccid->d_name, nlen);
 
-	if ( libusb_set_interface_alt_setting(ccid->d_dev, intf.i, intf.a) ) {
-		trace(ccid, "error setting alternate settings\n");
-		goto out_close;
-	}
+	_trace_rec(ccid->d_bt, TRACE_DESC, 0, 0, td, len);
+	free(td);
+}
 
-	ccid->d_intf = intf.i;
+/* The descriptor has been filled in and the transport is ready, allocate
+ * buffers, get the status of each slot and set up any RF interfaces. The
+ * slot status requests all go out before waiting on any of them, so a
+ * reader with several slots isn't asked one at a time.
+ */
+int _ccid_start(struct _ccid *ccid, unsigned int intf_flags)
+{
+	struct _cci *cci;
+	unsigned int x;
+	size_t blk;
 
-	/* Third, probe the CCID class descriptor */
-	if( !probe_descriptors(ccid) ) {
-		goto out_close;
-	}
+	if ( ccid->d_bt )
+		trace_desc(ccid, intf_flags);
 
-	if ( !get_data_rates(ccid) )
-		goto out_close;
-	if( !get_clock_freqs(ccid) )
-		goto out_close;
+	ccid->d_rxmax = ccid->d_desc.dwMaxCCIDMessageLength;
+	if ( ccid->d_rxmax < RX_MIN_MSG )
+		ccid->d_rxmax = RX_MIN_MSG;
+	ccid->d_rxmax = rx_round(ccid, ccid->d_rxmax);
+	ccid->d_rxbuf = malloc(ccid->d_rxmax);
+	if ( NULL == ccid->d_rxbuf )
+		return 0;
 
-	ccid->d_xfr = _xfr_do_alloc(ccid->d_max_out, ccid->d_max_in);
+	ccid->d_xfr = xfr_pool_get(ccid->d_max_out, ccid->d_max_in);
 	if ( NULL == ccid->d_xfr )
-		goto out_close;
+		return 0;
+
+	/* a whole message's worth, and at least a short command APDU or a
+	 * maximum size T=1 block
+	 */
+	blk = ccid->d_rxmax - sizeof(struct ccid_msg);
+	if ( blk < BLK_MIN )
+		blk = BLK_MIN;
 
-	/* Fourth, setup each slot */
 	trace(ccid, "Setting up %u contact card slots\n", ccid->d_num_slots);
 	for(x = 0; x < ccid->d_num_slots; x++) {
-		if ( !_PC_to_RDR_GetSlotStatus(ccid, x, ccid->d_xfr) )
-			goto out_freebuf;
-		if ( !_RDR_to_PC(ccid, x, ccid->d_xfr) )
-			goto out_freebuf;
-		if ( !_RDR_to_PC_SlotStatus(ccid, ccid->d_xfr) )
-			goto out_freebuf;
+		cci = ccid->d_slot + x;
+		cci->i_xfr = xfr_pool_get(ccid->d_max_out, ccid->d_max_in);
+		if ( NULL == cci->i_xfr )
+			return 0;
+		cci->i_blk = xfr_pool_get(blk, blk);
+		if ( NULL == cci->i_blk )
+			return 0;
+
+		if ( !_PC_to_RDR_GetSlotStatus(ccid, x, cci->i_xfr) )
+			return 0;
 	}
 
-	/* Fifth, Initialise any proprietary interfaces */
-	if ( intf.flags & INTF_RFID_OMNI )
-		_omnikey_init_prox(ccid);
+	for(x = 0; x < ccid->d_num_slots; x++) {
+		cci = ccid->d_slot + x;
+		if ( !_RDR_to_PC(ccid, x, cci->i_xfr) )
+			return 0;
+		if ( !_RDR_to_PC_SlotStatus(ccid, cci->i_xfr) )
+			return 0;
+	}
 
-	ccid->d_bus = libusb_get_bus_number(dev);
-	ccid->d_addr = libusb_get_device_address(dev);
-	ccid->d_name = strdup(intf.name);
-	goto out;
+	if ( intf_flags & INTF_RFID_OMNI )
+		_omnikey_init_prox(ccid);
 
-out_freebuf:
-	_xfr_do_free(ccid->d_xfr);
-out_close:
-	libusb_close(ccid->d_dev);
-out_free:
-	free(ccid);
-	ccid = NULL;
-	fprintf(stderr, "ccid: error probing device\n");
-out:
-	return ccid;
+	return 1;
 }
 
 uint8_t ccid_bus(ccid_t ccid)
@@ -1040,6 +2546,32 @@ const char *ccid_name(ccid_t ccid)
 	return ccid->d_name;
 }
 
+/** Retrieve transaction statistics for a chip card device.
+ * \ingroup g_ccid
+ * @param ccid The \ref ccid_t to retrieve statistics for.
+ * @param st Buffer to receive a snapshot of the counters.
+ *
+ * Counters accumulate from ccid_probe() or the last call to
+ * ccid_reset_stats(), whichever was more recent.
+ */
+void ccid_get_stats(ccid_t ccid, struct ccid_stats *st)
+{
+	_ccid_lock(ccid);
+	memcpy(st, &ccid->d_stats, sizeof(*st));
+	_ccid_unlock(ccid);
+}
+
+/** Reset transaction statistics for a chip card device.
+ * \ingroup g_ccid
+ * @param ccid The \ref ccid_t to reset statistics for.
+ */
+void ccid_reset_stats(ccid_t ccid)
+{
+	_ccid_lock(ccid);
+	memset(&ccid->d_stats, 0, sizeof(ccid->d_stats));
+	_ccid_unlock(ccid);
+}
+
 /** Close connection to a chip card device.
  * \ingroup g_ccid
  * @param ccid The \ref ccid_t to close.
@@ -1052,18 +2584,31 @@ void ccid_close(ccid_t ccid)
 	unsigned int i;
 
 	if ( ccid ) {
-		if ( ccid->d_dev )
-			libusb_close(ccid->d_dev);
-		if ( ccid->d_tf )
-			fclose(ccid->d_tf);
-		_xfr_do_free(ccid->d_xfr);
-		free(ccid->d_name);
-
+		/* RF drivers may still trace on the way out */
 		for(i = 0; i < ccid->d_num_rf; i++) {
 			if ( NULL == ccid->d_rf[i].i_ops->dtor )
 				continue;
 			(*ccid->d_rf[i].i_ops->dtor)(ccid->d_rf + i);
 		}
+
+		if ( ccid->d_xport ) {
+			ccid_drain(ccid);
+			(*ccid->d_xport->dtor)(ccid);
+		}
+		free(ccid->d_rxbuf);
+		free(ccid->d_data_rate);
+		free(ccid->d_clock_freq);
+		if ( ccid->d_tf )
+			fclose(ccid->d_tf);
+		_trace_close(ccid->d_bt);
+		xfr_pool_put(ccid->d_xfr);
+		for(i = 0; i < CCID_MAX_SLOTS; i++) {
+			xfr_pool_put(ccid->d_slot[i].i_xfr);
+			xfr_pool_put(ccid->d_slot[i].i_blk);
+			pthread_mutex_destroy(&ccid->d_cmd[i].c_lock);
+		}
+		pthread_mutex_destroy(&ccid->d_lock);
+		free(ccid->d_name);
 	}
 	free(ccid);
 }
@@ -1130,6 +2675,13 @@ void ccid_log(ccid_t ccid, const char *fmt, ...)
 {
 	va_list va;
 
+	if ( ccid->d_bt ) {
+		va_start(va, fmt);
+		_trace_vprintf(ccid->d_bt, fmt, va);
+		va_end(va);
+		return;
+	}
+
 	if ( NULL == ccid->d_tf )
 		return;
 
@@ -12,13 +12,31 @@
 
 static libusb_context *ctx;
 
+/* Registry of attached readers, maintained by hotplug events. Those are
+ * delivered on whichever thread runs the libusb event loop, so readers_lock
+ * is held by everything which touches the registry.
+ */
+#define READER_ALLOC_CHUNK (1<<4)
+#define READER_ALLOC_MASK  (READER_ALLOC_CHUNK - 1)
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static ccidev_t *readers;
+static unsigned int num_readers;
+static int hotplug;
+static libusb_hotplug_callback_handle hotplug_handle;
+static libccid_hotplug_cb_t hotplug_cb;
+static void *hotplug_priv;
+
 struct devid {
 	uint16_t idVendor;
 	uint16_t idProduct;
 	unsigned int flags;
-	char *name;
+	const char *name;
 };
 
+/* Built in table, compiled from usb-ccid-devices */
+#include "devids.h"
+
+/* Runtime overrides, loaded from $LIBCCID_DEVICES if set */
 #define DEVID_ALLOC_CHUNK (1<<5)
 #define DEVID_ALLOC_MASK  (DEVID_ALLOC_CHUNK - 1)
 static struct devid *devid;
@@ -141,14 +159,17 @@ static unsigned int parse_flags(const char *fn, unsigned int line,
 
 static struct devid *load_device_types(unsigned int *pcnt)
 {
-	static const char * const fn =
-			CCID_UTILS_DATADIR "/" PACKAGE "/usb-ccid-devices";
+	const char *fn;
 	FILE *f;
 	char buf[512];
 	char *tok[4];
 	unsigned int cnt, line;
 	struct devid *ret;
 
+	fn = getenv("LIBCCID_DEVICES");
+	if ( NULL == fn )
+		return NULL;
+
 	f = fopen(fn, "r");
 	if ( NULL == f ) {
 		fprintf(stderr, "%s: open: %s\n", fn, strerror(errno));
@@ -197,7 +218,8 @@ static struct devid *load_device_types(unsigned int *pcnt)
 		}
 		if ( tok[2] && strlen(tok[2]) )
 			flags = parse_flags(fn, line, tok[2]);
-		append_devid(&ret, &cnt, idProduct, idVendor, flags, tok[3]);
+		append_devid(&ret, &cnt, idProduct, idVendor, flags,
+				tok[3] ? tok[3] : "Unknown device");
 	}
 
 	fclose(f);
@@ -209,7 +231,7 @@ static void zap_device_types(struct devid *d, unsigned int num)
 {
 	unsigned int i;
 	for(i = 0; i < num; i++)
-		free(d[i].name);
+		free((char *)d[i].name);
 	free(d);
 }
 
@@ -227,13 +249,6 @@ static void reload_device_types(void)
 	num_devid = count;
 }
 
-static void do_init(void)
-{
-	if ( NULL == ctx )
-		libusb_init(&ctx);
-	reload_device_types();
-}
-
 static int check_interface(struct libusb_device *dev, int c, int i, int generic)
 {
 	struct libusb_config_descriptor *conf;
@@ -274,9 +289,10 @@ out:
 	return -1;
 }
 
-static struct devid *check_vendor_dev_list(uint16_t idVendor,
+static const struct devid *check_vendor_dev_list(uint16_t idVendor,
 						uint16_t idProduct)
 {
+	const struct devid *d;
 	unsigned int i;
 
 	for(i = 0; i < num_devid; i++) {
@@ -286,6 +302,14 @@ static struct devid *check_vendor_dev_list(uint16_t idVendor,
 		}
 	}
 
+	/* empty buckets have a zero vendor ID, which USB never assigns */
+	i = (((uint32_t)idVendor << 16) | idProduct) % DEVID_HASH_SIZE;
+	for(d = devid_hash + i; d->idVendor; d = devid_hash + i) {
+		if ( d->idVendor == idVendor && d->idProduct == idProduct )
+			return d;
+		i = (i + 1) % DEVID_HASH_SIZE;
+	}
+
 	return NULL;
 }
 
@@ -298,7 +322,7 @@ static struct devid *check_vendor_dev_list(uint16_t idVendor,
 int _probe_descriptors(struct libusb_device *dev, struct _cci_interface *intf)
 {
 	struct libusb_device_descriptor d;
-	struct devid *id;
+	const struct devid *id;
 	int c, i, a;
 
 	c = i = a = 0;
@@ -343,19 +367,148 @@ success:
 	return 1;
 }
 
-/** Find first physical CCI device on the system.
+static int reader_add(ccidev_t dev)
+{
+	void *new;
+	int ret = 0;
+
+	pthread_mutex_lock(&readers_lock);
+	if ( 0 == (num_readers & READER_ALLOC_MASK) ) {
+		new = realloc(readers, sizeof(*readers) *
+				(num_readers + READER_ALLOC_CHUNK));
+		if ( NULL == new )
+			goto out;
+		readers = new;
+	}
+
+	readers[num_readers++] = libusb_ref_device(dev);
+	ret = 1;
+out:
+	pthread_mutex_unlock(&readers_lock);
+	return ret;
+}
+
+static int reader_del(ccidev_t dev)
+{
+	unsigned int i;
+	int ret = 0;
+
+	pthread_mutex_lock(&readers_lock);
+	for(i = 0; i < num_readers; i++) {
+		if ( readers[i] != dev )
+			continue;
+		libusb_unref_device(readers[i]);
+		readers[i] = readers[--num_readers];
+		ret = 1;
+		break;
+	}
+	pthread_mutex_unlock(&readers_lock);
+
+	return ret;
+}
+
+static int LIBUSB_CALL hotplug_event(_unused libusb_context *c,
+					libusb_device *dev,
+					libusb_hotplug_event ev,
+					_unused void *priv)
+{
+	switch(ev) {
+	case LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED:
+		if ( !_probe_descriptors(dev, NULL) )
+			break;
+		if ( !reader_add(dev) )
+			break;
+		if ( hotplug_cb )
+			(*hotplug_cb)(dev, LIBCCID_DEVICE_ARRIVED, hotplug_priv);
+		break;
+	case LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT:
+		if ( !reader_del(dev) )
+			break;
+		if ( hotplug_cb )
+			(*hotplug_cb)(dev, LIBCCID_DEVICE_LEFT, hotplug_priv);
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+/* Load the device table and, where libusb supports it, start tracking
+ * readers coming and going. The registry is populated straight away since
+ * libusb replays arrival of everything already attached.
+ */
+static void init_once(void)
+{
+	libusb_init(&ctx);
+	reload_device_types();
+
+	if ( !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) )
+		return;
+
+	if ( libusb_hotplug_register_callback(ctx,
+				LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+				LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+				LIBUSB_HOTPLUG_ENUMERATE,
+				LIBUSB_HOTPLUG_MATCH_ANY,
+				LIBUSB_HOTPLUG_MATCH_ANY,
+				LIBUSB_HOTPLUG_MATCH_ANY,
+				hotplug_event, NULL, &hotplug_handle) )
+		return;
+
+	hotplug = 1;
+}
+
+/* Whichever entry point gets here first sets everything up, including the
+ * context for devices opened before anything was listed.
+ */
+static void do_init(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, init_once);
+}
+
+libusb_context *_libccid_usb_ctx(void)
+{
+	do_init();
+	return ctx;
+}
+
+/* Pick up any pending hotplug events without blocking */
+static void do_update(void)
+{
+	struct timeval tv = {0, 0};
+
+	do_init();
+	if ( hotplug )
+		libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+}
+
+/** Register a callback for readers being attached and detached.
  * \ingroup g_libccid
+ * @param cb Callback, or NULL to unregister.
+ * @param priv Opaque pointer passed to the callback.
  *
- * @return Handle for the first device. Actually a libusb libusb_device pointer.
+ * The callback is passed LIBCCID_DEVICE_ARRIVED or LIBCCID_DEVICE_LEFT.
+ * Events are delivered from within libccid_handle_events(), and only where
+ * the platform supports USB hotplug notification.
+ *
+ * @return zero if hotplug notification is unavailable.
  */
-ccidev_t *libccid_get_device_list(size_t *nmemb)
+int libccid_set_hotplug_cb(libccid_hotplug_cb_t cb, void *priv)
+{
+	do_init();
+	hotplug_cb = cb;
+	hotplug_priv = priv;
+	return hotplug;
+}
+
+static ccidev_t *list_rescan(size_t *nmemb)
 {
 	libusb_device **devlist;
 	ccidev_t *ccilist;
 	ssize_t numdev, i, n;
 
-	do_init();
-
 	numdev = libusb_get_device_list(ctx, &devlist);
 	if ( numdev <= 0 ) {
 		*nmemb = 0;
@@ -363,6 +516,12 @@ ccidev_t *libccid_get_device_list(size_t *nmemb)
 	}
 
 	ccilist = calloc(numdev + 1, sizeof(*ccilist));
+	if ( NULL == ccilist ) {
+		libusb_free_device_list(devlist, 1);
+		*nmemb = 0;
+		return NULL;
+	}
+
 	for(i = n = 0; i < numdev; i++) {
 		if ( !_probe_descriptors(devlist[i], NULL) )
 			continue;
@@ -377,6 +536,44 @@ ccidev_t *libccid_get_device_list(size_t *nmemb)
 	return ccilist;
 }
 
+/** Find first physical CCI device on the system.
+ * \ingroup g_libccid
+ *
+ * @return Handle for the first device. Actually a libusb libusb_device pointer.
+ */
+ccidev_t *libccid_get_device_list(size_t *nmemb)
+{
+	ccidev_t *ccilist;
+	unsigned int i;
+
+	do_update();
+
+	if ( !hotplug )
+		return list_rescan(nmemb);
+
+	pthread_mutex_lock(&readers_lock);
+	if ( 0 == num_readers ) {
+		ccilist = NULL;
+		*nmemb = 0;
+		goto out;
+	}
+
+	ccilist = calloc(num_readers + 1, sizeof(*ccilist));
+	if ( NULL == ccilist ) {
+		*nmemb = 0;
+		goto out;
+	}
+
+	for(i = 0; i < num_readers; i++)
+		ccilist[i] = libusb_ref_device(readers[i]);
+	ccilist[i] = NULL;
+
+	*nmemb = num_readers;
+out:
+	pthread_mutex_unlock(&readers_lock);
+	return ccilist;
+}
+
 void libccid_free_device_list(ccidev_t *list)
 {
 	if ( list ) {
@@ -391,9 +588,24 @@ ccidev_t libccid_device_by_address(uint8_t bus, uint8_t addr)
 {
 	libusb_device **devlist;
 	ssize_t numdev, i;
+	unsigned int j;
 	ccidev_t ret;
 
-	do_init();
+	do_update();
+
+	if ( hotplug ) {
+		pthread_mutex_lock(&readers_lock);
+		for(ret = NULL, j = 0; j < num_readers; j++) {
+			if ( libusb_get_bus_number(readers[j]) != bus )
+				continue;
+			if ( libusb_get_device_address(readers[j]) != addr )
+				continue;
+			ret = libusb_ref_device(readers[j]);
+			break;
+		}
+		pthread_mutex_unlock(&readers_lock);
+		return ret;
+	}
 
 	numdev = libusb_get_device_list(ctx, &devlist);
 	if ( numdev <= 0 )
@@ -425,3 +637,24 @@ uint8_t libccid_device_addr(ccidev_t dev)
 {
 	return libusb_get_device_address(dev);
 }
+
+/** Dispatch completions of asynchronous transactions.
+ * \ingroup g_libccid
+ * @param msecs Maximum time to wait for events, in milliseconds.
+ *
+ * Runs the USB event loop shared by all open devices, calling the callbacks
+ * of any transactions submitted with cci_submit() which complete. A single
+ * thread may drive any number of devices this way.
+ *
+ * @return zero on error.
+ */
+int libccid_handle_events(unsigned int msecs)
+{
+	struct timeval tv;
+
+	tv.tv_sec = msecs / 1000;
+	tv.tv_usec = (msecs % 1000) * 1000;
+
+	return !libusb_handle_events_timeout_completed(_libccid_usb_ctx(),
+							&tv, NULL);
+}
@@ -0,0 +1,36 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Render binary CCID traces as text.
+*/
+
+#include <ccid.h>
+
+#include <stdio.h>
+#include <string.h>
+
+int main(int argc, char **argv)
+{
+	unsigned int flags = 0;
+	int i = 1;
+
+	if ( i < argc && !strcmp(argv[i], "-t") ) {
+		flags |= CCID_DECODE_TIMESTAMPS;
+		i++;
+	}
+
+	if ( i >= argc ) {
+		fprintf(stderr, "Usage: %s [-t] <trace> [trace ...]\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for(; i < argc; i++) {
+		if ( !ccid_trace_decode(argv[i], stdout, flags) )
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -26,84 +26,249 @@
 
 #define TMO_AUTH1 140
 
+/* Completion polling: first poll at the earliest moment the frame could be
+ * done, then back off exponentially up to the old fixed 1ms poll interval.
+*/
+#define POLL_MIN_US	50
+#define POLL_MAX_US	1000
+
+/* Minimum PICC frame delay time, (n * 128 + 84) / fc with n = 9 */
+#define FDT_MIN_US	((1236ULL * 1000000ULL) / ISO14443_FREQ_CARRIER)
+
+struct _clrc632 {
+	const struct _clrc632_ops *ops;
+	unsigned int speed;
+
+	/* current command: when it was kicked off, hardware timeout */
+	uint64_t cmd_start;
+	uint64_t tmo_us;
+
+	/* completion stats */
+	unsigned long frames;
+	unsigned long polls;
+	unsigned long sleeps;
+	unsigned int max_polls;
+};
+
 struct reg_file {
 	uint8_t reg;
 	uint8_t val;
 };
 
-static int reg_read(struct _ccid *ccid, const struct _clrc632_ops *ops,
-			uint8_t reg, uint8_t *val)
+static int reg_read(struct _ccid *ccid, void *priv, uint8_t reg, uint8_t *val)
 {
-	return (*ops->reg_read)(ccid, reg, val);
+	struct _clrc632 *rc = priv;
+	return (*rc->ops->reg_read)(ccid, reg, val);
 }
 
-static int reg_write(struct _ccid *ccid, const struct _clrc632_ops *ops,
-			uint8_t reg, uint8_t val)
+static int reg_write(struct _ccid *ccid, void *priv, uint8_t reg, uint8_t val)
 {
-	return (*ops->reg_write)(ccid, reg, val);
+	struct _clrc632 *rc = priv;
+	return (*rc->ops->reg_write)(ccid, reg, val);
 }
 
-static int fifo_read(struct _ccid *ccid, const struct _clrc632_ops *ops,
-			uint8_t *buf, size_t len)
+static int fifo_read(struct _ccid *ccid, void *priv, uint8_t *buf, size_t len)
 {
-	return (*ops->fifo_read)(ccid, buf, len);
+	struct _clrc632 *rc = priv;
+	return (*rc->ops->fifo_read)(ccid, buf, len);
 }
 
-static int fifo_write(struct _ccid *ccid, const struct _clrc632_ops *ops,
+static int fifo_write(struct _ccid *ccid, void *priv,
 			const uint8_t *buf, size_t len)
 {
-	return (*ops->fifo_write)(ccid, buf, len);
+	struct _clrc632 *rc = priv;
+	return (*rc->ops->fifo_write)(ccid, buf, len);
 }
 
-static int asic_clear_bits(struct _ccid *ccid, void *priv,
-				uint8_t reg, uint8_t bits)
+/* Register accesses are queued up in a batch and issued together, so that
+ * readers which can perform several register operations per command only
+ * pay for one round trip. Read-modify-write operations are resolved by
+ * reading all of their registers up front in one go.
+*/
+#define BATCH_MAX	32
+#define OP_RMW		0xff
+struct reg_batch {
+	unsigned int num;
+	unsigned int num_rmw;
+	struct _clrc632_op op[BATCH_MAX];
+	uint8_t mask[BATCH_MAX];
+	uint8_t cur[BATCH_MAX];
+};
+
+static void batch_init(struct reg_batch *b)
 {
-	uint8_t val;
+	b->num = 0;
+	b->num_rmw = 0;
+}
 
-	if ( !reg_read(ccid, priv, reg, &val) )
-		return 0;
+static int do_ops(struct _ccid *ccid, struct _clrc632 *rc,
+			const struct _clrc632_op *op, unsigned int num)
+{
+	unsigned int i;
 
-	if ( (val & bits) == 0 )
+	if ( 0 == num )
 		return 1;
 
-	return reg_write(ccid, priv, reg, val & ~bits);
+	if ( rc->ops->reg_batch )
+		return (*rc->ops->reg_batch)(ccid, op, num);
+
+	for(i = 0; i < num; i++) {
+		switch(op[i].op) {
+		case CLRC632_OP_READ:
+			if ( !reg_read(ccid, rc, op[i].reg, op[i].dst) )
+				return 0;
+			break;
+		case CLRC632_OP_WRITE:
+			if ( !reg_write(ccid, rc, op[i].reg, op[i].val) )
+				return 0;
+			break;
+		default:
+			assert(0);
+			return 0;
+		}
+	}
+
+	return 1;
 }
 
-static int asic_set_bits(struct _ccid *ccid, void *priv,
-			 uint8_t reg, uint8_t bits)
+static int batch_flush(struct _ccid *ccid, void *priv, struct reg_batch *b)
 {
+	struct _clrc632_op rd[BATCH_MAX];
+	unsigned int i, j, n;
 	uint8_t val;
 
-	if ( !reg_read(ccid, priv, reg, &val) )
+	if ( b->num_rmw ) {
+		for(n = i = 0; i < b->num; i++) {
+			if ( b->op[i].op != OP_RMW )
+				continue;
+			rd[n].op = CLRC632_OP_READ;
+			rd[n].reg = b->op[i].reg;
+			rd[n].dst = b->cur + i;
+			n++;
+		}
+
+		if ( !do_ops(ccid, priv, rd, n) ) {
+			batch_init(b);
+			return 0;
+		}
+
+		/* turn them in to plain writes, dropping the no-ops */
+		for(i = j = 0; i < b->num; i++) {
+			if ( b->op[i].op == OP_RMW ) {
+				val = (b->cur[i] & ~b->mask[i]) |
+					(b->op[i].val & b->mask[i]);
+				if ( val == b->cur[i] )
+					continue;
+				b->op[i].op = CLRC632_OP_WRITE;
+				b->op[i].val = val;
+			}
+			b->op[j++] = b->op[i];
+		}
+		b->num = j;
+	}
+
+	i = b->num;
+	batch_init(b);
+	return do_ops(ccid, priv, b->op, i);
+}
+
+static int batch_add(struct _ccid *ccid, void *priv, struct reg_batch *b,
+			uint8_t op, uint8_t reg, uint8_t val, uint8_t *dst)
+{
+	if ( b->num >= BATCH_MAX && !batch_flush(ccid, priv, b) )
 		return 0;
 
-	if ( (val & bits) == bits )
-		return 1;
+	b->op[b->num].op = op;
+	b->op[b->num].reg = reg;
+	b->op[b->num].val = val;
+	b->op[b->num].dst = dst;
+	b->num++;
+	return 1;
+}
+
+static int batch_read(struct _ccid *ccid, void *priv, struct reg_batch *b,
+			uint8_t reg, uint8_t *val)
+{
+	return batch_add(ccid, priv, b, CLRC632_OP_READ, reg, 0, val);
+}
+
+static int batch_write(struct _ccid *ccid, void *priv, struct reg_batch *b,
+			uint8_t reg, uint8_t val)
+{
+	return batch_add(ccid, priv, b, CLRC632_OP_WRITE, reg, val, NULL);
+}
+
+static int batch_set_mask(struct _ccid *ccid, void *priv, struct reg_batch *b,
+			uint8_t reg, uint8_t mask, uint8_t bits)
+{
+	unsigned int i;
+
+	/* The read is hoisted to the start of the batch, so anything
+	 * earlier in the batch which may affect the register must go out
+	 * first.
+	*/
+	for(i = 0; i < b->num; i++) {
+		if ( b->op[i].op == CLRC632_OP_READ )
+			continue;
+		if ( b->op[i].reg == reg || b->op[i].reg == RC632_REG_COMMAND ) {
+			if ( !batch_flush(ccid, priv, b) )
+				return 0;
+			break;
+		}
+	}
+
+	if ( !batch_add(ccid, priv, b, OP_RMW, reg, bits, NULL) )
+		return 0;
+
+	b->mask[b->num - 1] = mask;
+	b->num_rmw++;
+	return 1;
+}
+
+static int batch_set_bits(struct _ccid *ccid, void *priv, struct reg_batch *b,
+				uint8_t reg, uint8_t bits)
+{
+	return batch_set_mask(ccid, priv, b, reg, bits, bits);
+}
 
-	return reg_write(ccid, priv, reg, val | bits);
+static int batch_clear_bits(struct _ccid *ccid, void *priv,
+				struct reg_batch *b,
+				uint8_t reg, uint8_t bits)
+{
+	return batch_set_mask(ccid, priv, b, reg, bits, 0);
 }
 
 static int asic_set_mask(struct _ccid *ccid, void *priv, uint8_t reg,
 			 uint8_t mask, uint8_t bits)
 {
-	uint8_t val;
+	struct reg_batch b;
 
-	if ( !reg_read(ccid, priv, reg, &val) )
+	batch_init(&b);
+	if ( !batch_set_mask(ccid, priv, &b, reg, mask, bits) )
 		return 0;
+	return batch_flush(ccid, priv, &b);
+}
 
-	if ( (val & mask) == bits )
-		return 1;
+static int asic_clear_bits(struct _ccid *ccid, void *priv,
+				uint8_t reg, uint8_t bits)
+{
+	return asic_set_mask(ccid, priv, reg, bits, 0);
+}
 
-	return reg_write(ccid, priv, reg, (val & ~mask) | (bits & mask));
+static int asic_set_bits(struct _ccid *ccid, void *priv,
+			 uint8_t reg, uint8_t bits)
+{
+	return asic_set_mask(ccid, priv, reg, bits, bits);
 }
 
 static int reg_write_batch(struct _ccid *ccid, void *priv,
+				struct reg_batch *b,
 				const struct reg_file *r,
 				unsigned int num)
 {
 	unsigned int i;
 	for(i = 0; i < num; i++) {
-		if ( !reg_write(ccid, priv, r[i].reg, r[i].val) )
+		if ( !batch_write(ccid, priv, b, r[i].reg, r[i].val) )
 			return 0;
 	}
 	return 1;
@@ -139,39 +304,89 @@ static int rf_power(struct _ccid *ccid, void *priv, unsigned int on)
 	return ret;
 }
 
-static int flush_fifo(struct _ccid *ccid, void *priv)
-{
-	return reg_write(ccid, priv, RC632_REG_CONTROL,
-				RC632_CONTROL_FIFO_FLUSH);
-}
-
 static int clear_irqs(struct _ccid *ccid, void *priv, uint8_t bits)
 {
 	return reg_write(ccid, priv, RC632_REG_INTERRUPT_RQ,
 			(~RC632_INT_SET) & bits);
 }
 
-/* Wait until RC632 is idle or TIMER IRQ has happened */
-static int wait_idle_timer(struct _ccid *ccid, void *priv)
+/* Time on the air for a frame exchange at the current speed: 8 data bits
+ * plus parity per byte, start and end of frame, and the frame delay.
+*/
+static uint64_t frame_time(struct _clrc632 *rc, unsigned int tx_len,
+				unsigned int rx_len)
 {
-	uint8_t stat, irq, cmd;
+	uint64_t bits;
 
-	if ( !reg_read(ccid, priv, RC632_REG_INTERRUPT_EN, &irq) )
-		return 0;
+	bits = (tx_len + rx_len) * 9ULL + 4;
+	return FDT_MIN_US + (bits * 128ULL * 1000000ULL) /
+		((uint64_t)ISO14443_FREQ_CARRIER << rc->speed);
+}
 
-	if ( !reg_write(ccid, priv, RC632_REG_INTERRUPT_EN, RC632_IRQ_SET
+static void cmd_start(struct _clrc632 *rc)
+{
+	rc->cmd_start = _time_us();
+}
+
+static void frame_done(struct _ccid *ccid, struct _clrc632 *rc,
+			unsigned int polls)
+{
+	rc->frames++;
+	rc->polls += polls;
+	if ( polls > rc->max_polls )
+		rc->max_polls = polls;
+	trace(ccid, "     : command complete after %u polls, %"PRIu64" us\n",
+		polls, _time_us() - rc->cmd_start);
+}
+
+/* Wait until RC632 is idle or TIMER IRQ has happened. The command can't
+ * finish before expect microseconds have elapsed since it was started, so
+ * sleep that out before polling.
+*/
+static int wait_idle_timer(struct _ccid *ccid, void *priv, uint64_t expect)
+{
+	struct _clrc632 *rc = priv;
+	uint8_t stat, err, irq, cmd;
+	unsigned int polls, delay;
+	struct reg_batch b;
+	uint64_t elapsed;
+
+	if ( rc->tmo_us && expect > rc->tmo_us )
+		expect = rc->tmo_us;
+
+	elapsed = _time_us() - rc->cmd_start;
+	if ( expect > elapsed ) {
+		usleep(expect - elapsed);
+		rc->sleeps++;
+	}
+
+	polls = 0;
+	delay = POLL_MIN_US;
+
+	batch_init(&b);
+	if ( !batch_write(ccid, priv, &b, RC632_REG_INTERRUPT_EN,
+				RC632_IRQ_SET
 				| RC632_IRQ_TIMER
 				| RC632_IRQ_IDLE
 				| RC632_IRQ_RX ) )
 		return 0;
 
 	while (1) {
-		if ( !reg_read(ccid, priv, RC632_REG_PRIMARY_STATUS, &stat) )
+		/* snapshot all the status we might need in one go */
+		if ( !batch_read(ccid, priv, &b,
+				RC632_REG_PRIMARY_STATUS, &stat) ||
+			!batch_read(ccid, priv, &b,
+				RC632_REG_ERROR_FLAG, &err) ||
+			!batch_read(ccid, priv, &b,
+				RC632_REG_INTERRUPT_RQ, &irq) ||
+			!batch_read(ccid, priv, &b,
+				RC632_REG_COMMAND, &cmd) ||
+			!batch_flush(ccid, priv, &b) )
 			return 0;
+
+		polls++;
+
 		if (stat & RC632_STAT_ERR) {
-			uint8_t err;
-			if ( !reg_read(ccid, priv, RC632_REG_ERROR_FLAG, &err) )
-				return 0;
 			if (err & (RC632_ERR_FLAG_COL_ERR |
 				   RC632_ERR_FLAG_PARITY_ERR |
 				   RC632_ERR_FLAG_FRAMING_ERR |
@@ -180,32 +395,32 @@ static int wait_idle_timer(struct _ccid *ccid, void *priv)
 				/*   RC632_ERR_FLAG_CRC_ERR | */
 				   0)) {
 				//printf("error during wait\n");
+				frame_done(ccid, rc, polls);
 				return 0;
 			}
 		}
 		if (stat & RC632_STAT_IRQ) {
-			if ( !reg_read(ccid, priv,
-				RC632_REG_INTERRUPT_RQ, &irq) )
-				return 0;
-
 			if (irq & RC632_IRQ_TIMER && !(irq & RC632_IRQ_RX)) {
 				/* timed out */
 				//printf("..timed out\n");
+				frame_done(ccid, rc, polls);
 				clear_irqs(ccid, priv, RC632_IRQ_TIMER);
 				return 0;
 			}
 		}
 
-		if ( !reg_read(ccid, priv, RC632_REG_COMMAND, &cmd) )
-			return 0;
-
 		if (cmd == 0) {
+			frame_done(ccid, rc, polls);
 			clear_irqs(ccid, priv, RC632_IRQ_RX);
 			return 1;
 		}
 
-		/* poll every millisecond */
-		usleep(1000);
+		usleep(delay);
+		if ( delay < POLL_MAX_US ) {
+			delay <<= 1;
+			if ( delay > POLL_MAX_US )
+				delay = POLL_MAX_US;
+		}
 	}
 }
 
@@ -251,32 +466,36 @@ static void best_prescaler(uint64_t timeout, uint8_t *prescaler,
 }
 
 #define TIMER_RELAX_FACTOR 10
-static int timer_set(struct _ccid *ccid, void *priv, uint64_t timeout)
+static int timer_set(struct _ccid *ccid, void *priv, struct reg_batch *b,
+			uint64_t timeout)
 {
+	struct _clrc632 *rc = priv;
 	uint8_t prescaler, divisor;
 
 	timeout *= TIMER_RELAX_FACTOR;
+	rc->tmo_us = timeout;
 
 	best_prescaler(timeout, &prescaler, &divisor);
 
-	if ( !reg_write(ccid, priv, RC632_REG_TIMER_CLOCK,
+	if ( !batch_write(ccid, priv, b, RC632_REG_TIMER_CLOCK,
 			      prescaler & 0x1f) )
 		return 0;
 
-	if ( !reg_write(ccid, priv, RC632_REG_TIMER_CONTROL,
+	if ( !batch_write(ccid, priv, b, RC632_REG_TIMER_CONTROL,
 			      RC632_TMR_START_TX_END|RC632_TMR_STOP_RX_BEGIN) )
 		return 0;
 
 	/* clear timer irq bit */
-	if ( !clear_irqs(ccid, priv, RC632_IRQ_TIMER) )
+	if ( !batch_write(ccid, priv, b, RC632_REG_INTERRUPT_RQ,
+			(~RC632_INT_SET) & RC632_IRQ_TIMER) )
 		return 0;
 
 	/* enable timer IRQ */
-	if ( !reg_write(ccid, priv, RC632_REG_INTERRUPT_EN,
+	if ( !batch_write(ccid, priv, b, RC632_REG_INTERRUPT_EN,
 			RC632_IRQ_SET | RC632_IRQ_TIMER) )
 		return 0;
 
-	if ( !reg_write(ccid, priv, RC632_REG_TIMER_RELOAD, divisor) )
+	if ( !batch_write(ccid, priv, b, RC632_REG_TIMER_RELOAD, divisor) )
 		return 0;
 
 	return 1;
@@ -284,18 +503,20 @@ static int timer_set(struct _ccid *ccid, void *priv, uint64_t timeout)
 
 static int set_rf_mode(struct _ccid *ccid, void *priv, const struct rf_mode *rf)
 {
+	struct reg_batch b;
 	uint8_t red;
 
-	if ( !reg_write(ccid, priv, RC632_REG_BIT_FRAMING,
+	batch_init(&b);
+	if ( !batch_write(ccid, priv, &b, RC632_REG_BIT_FRAMING,
 				(rf->rx_align << 4) | (rf->tx_last_bits)) )
 		return 0;
 
 	if ( rf->flags & RF_CRYPTO1 ) {
-		if ( !asic_clear_bits(ccid, priv, RC632_REG_CONTROL,
+		if ( !batch_clear_bits(ccid, priv, &b, RC632_REG_CONTROL,
 					RC632_CONTROL_CRYPTO1_ON) )
 			return 0;
 	}else{
-		if ( !asic_set_bits(ccid, priv, RC632_REG_CONTROL,
+		if ( !batch_set_bits(ccid, priv, &b, RC632_REG_CONTROL,
 					RC632_CONTROL_CRYPTO1_ON) )
 			return 0;
 	}
@@ -310,10 +531,10 @@ static int set_rf_mode(struct _ccid *ccid, void *priv, const struct rf_mode *rf)
 	if ( !(rf->flags & RF_PARITY_EVEN) )
 		red |= RC632_CR_PARITY_ODD;
 	
-	if ( !reg_write(ccid, priv, RC632_REG_CHANNEL_REDUNDANCY, red) )
+	if ( !batch_write(ccid, priv, &b, RC632_REG_CHANNEL_REDUNDANCY, red) )
 		return 0;
 
-	return 1;
+	return batch_flush(ccid, priv, &b);
 }
 
 static int get_rf_mode(struct _ccid *ccid, void *priv, const struct rf_mode *rf)
@@ -339,9 +560,12 @@ static int transact(struct _ccid *ccid, void *priv,
 			 uint64_t timer,
 			 unsigned int toggle)
 {
+	struct _clrc632 *rc = priv;
 	int cur_tx_len;
 	uint8_t rx_avail;
 	const uint8_t *cur_tx_buf = tx_buf;
+	struct reg_batch b;
+	uint64_t expect;
 
 //	printf("%s: timeout=%"PRIu64", rx_len=%u, tx_len=%u\n",
 //		__func__, timer, *rx_len, tx_len);
@@ -351,13 +575,17 @@ static int transact(struct _ccid *ccid, void *priv,
 	else
 		cur_tx_len = tx_len;
 
-	if ( !reg_write(ccid, priv, RC632_REG_COMMAND, RC632_CMD_IDLE) )
+	batch_init(&b);
+	if ( !batch_write(ccid, priv, &b, RC632_REG_COMMAND, RC632_CMD_IDLE) )
 		return 0;
 	/* clear all interrupts */
-	if ( !reg_write(ccid, priv, RC632_REG_INTERRUPT_RQ, 0x7f) )
+	if ( !batch_write(ccid, priv, &b, RC632_REG_INTERRUPT_RQ, 0x7f) )
 		return 0;
 
-	if ( !timer_set(ccid, priv, timer) )
+	if ( !timer_set(ccid, priv, &b, timer) )
+		return 0;
+
+	if ( !batch_flush(ccid, priv, &b) )
 		return 0;
 
 	do {
@@ -368,6 +596,7 @@ static int transact(struct _ccid *ccid, void *priv,
 			if ( !reg_write(ccid, priv, RC632_REG_COMMAND,
 					RC632_CMD_TRANSCEIVE) )
 				return 0;
+			cmd_start(rc);
 		}
 
 		cur_tx_buf += cur_tx_len;
@@ -385,7 +614,13 @@ static int transact(struct _ccid *ccid, void *priv,
 	//if (toggle == 1)
 	//	tcl_toggle_pcb(ccid, priv);
 
-	if ( !wait_idle_timer(ccid, priv) ) {
+	/* Nothing can come back before we've sent the whole frame and the
+	 * shortest possible response, nor after the timer has fired on top
+	 * of the transmit time.
+	 */
+	expect = frame_time(rc, tx_len, 1);
+	rc->tmo_us += frame_time(rc, tx_len, 0);
+	if ( !wait_idle_timer(ccid, priv, expect) ) {
 		return 0;
 	}
 
@@ -427,6 +662,7 @@ static void mfc_transform_key(const uint8_t *key6, uint8_t *key12)
 static int mfc_set_key(struct _ccid *ccid, void *priv, const uint8_t *key)
 {
 	uint8_t coded_key[RFID_MIFARE_KEY_CODED_LEN];
+	struct reg_batch b;
 	uint8_t reg;
 
 	mfc_transform_key(key, coded_key);
@@ -438,14 +674,19 @@ static int mfc_set_key(struct _ccid *ccid, void *priv, const uint8_t *key)
 	if ( !fifo_write(ccid, priv, coded_key, sizeof(coded_key)) )
 		return 0;
 
-	if ( !reg_write(ccid, priv, RC632_REG_COMMAND, RC632_CMD_LOAD_KEY) )
+	batch_init(&b);
+	if ( !batch_write(ccid, priv, &b, RC632_REG_COMMAND, RC632_CMD_LOAD_KEY) )
+		return 0;
+
+	if ( !timer_set(ccid, priv, &b, TMO_AUTH1 * 10) )
 		return 0;
 
-	if ( !timer_set(ccid, priv, TMO_AUTH1 * 10) )
+	if ( !batch_flush(ccid, priv, &b) )
 		return 0;
+	cmd_start(priv);
 
 	//if ( !wait_idle(ccid, priv, TMO_AUTH1) )
-	if ( !wait_idle_timer(ccid, priv) )
+	if ( !wait_idle_timer(ccid, priv, 0) )
 		return 0;
 
 	if ( !reg_read(ccid, priv, RC632_REG_ERROR_FLAG, &reg) )
@@ -460,6 +701,7 @@ static int mfc_set_key(struct _ccid *ccid, void *priv, const uint8_t *key)
 static int mfc_set_key_ee(struct _ccid *ccid, void *priv, unsigned int addr)
 {
 	uint8_t cmd_addr[2];
+	struct reg_batch b;
 	uint8_t reg;
 
 	if (addr > 0xffff - RFID_MIFARE_KEY_CODED_LEN)
@@ -476,14 +718,19 @@ static int mfc_set_key_ee(struct _ccid *ccid, void *priv, unsigned int addr)
 	if ( !fifo_write(ccid, priv, cmd_addr, sizeof(cmd_addr)) )
 		return 0;
 
-	if ( !reg_write(ccid, priv, RC632_REG_COMMAND, RC632_CMD_LOAD_KEY_E2) )
+	batch_init(&b);
+	if ( !batch_write(ccid, priv, &b, RC632_REG_COMMAND, RC632_CMD_LOAD_KEY_E2) )
+		return 0;
+
+	if ( !timer_set(ccid, priv, &b, TMO_AUTH1) )
 		return 0;
 
-	if ( !timer_set(ccid, priv, TMO_AUTH1) )
+	if ( !batch_flush(ccid, priv, &b) )
 		return 0;
+	cmd_start(priv);
 
 	//if ( !wait_idle(ccid, priv, TMO_AUTH1) )
-	if ( !wait_idle_timer(ccid, priv) )
+	if ( !wait_idle_timer(ccid, priv, 0) )
 		return 0;
 
 	if ( !reg_read(ccid, priv, RC632_REG_ERROR_FLAG, &reg) )
@@ -505,6 +752,7 @@ static int mfc_auth(struct _ccid *ccid, void *priv, uint8_t cmd,
 			uint32_t serial_no, uint8_t block)
 {
 	struct mifare_authcmd acmd;
+	struct reg_batch b;
 	uint8_t reg;
 
 	if (cmd != RFID_CMD_MIFARE_AUTH1A && cmd != RFID_CMD_MIFARE_AUTH1B) {
@@ -534,15 +782,20 @@ static int mfc_auth(struct _ccid *ccid, void *priv, uint8_t cmd,
 	if ( !fifo_write(ccid, priv, (unsigned char *)&acmd, sizeof(acmd)) )
 		return 0;
 
-	if ( !reg_write(ccid, priv, RC632_REG_COMMAND, RC632_CMD_AUTHENT1) )
+	batch_init(&b);
+	if ( !batch_write(ccid, priv, &b, RC632_REG_COMMAND, RC632_CMD_AUTHENT1) )
 		return 0;
 
 	/* Wait until transmitter is idle */
-	if ( !timer_set(ccid, priv, TMO_AUTH1) )
+	if ( !timer_set(ccid, priv, &b, TMO_AUTH1) )
+		return 0;
+
+	if ( !batch_flush(ccid, priv, &b) )
 		return 0;
+	cmd_start(priv);
 
 	//if ( !wait_idle(ccid, priv, TMO_AUTH1) )
-	if ( !wait_idle_timer(ccid, priv) )
+	if ( !wait_idle_timer(ccid, priv, frame_time(priv, sizeof(acmd), 4)) )
 		return 0;
 
 	if ( !reg_read(ccid, priv, RC632_REG_SECONDARY_STATUS, &reg) )
@@ -553,21 +806,25 @@ static int mfc_auth(struct _ccid *ccid, void *priv, uint8_t cmd,
 	}
 
 	/* Clear Tx CRC */
-	if ( !asic_clear_bits(ccid, priv, RC632_REG_CHANNEL_REDUNDANCY,
+	if ( !batch_clear_bits(ccid, priv, &b, RC632_REG_CHANNEL_REDUNDANCY,
 				RC632_CR_TX_CRC_ENABLE) )
 		return 0;
 
 	/* Wait until transmitter is idle */
-	if ( !timer_set(ccid, priv, TMO_AUTH1) )
+	if ( !timer_set(ccid, priv, &b, TMO_AUTH1) )
 		return 0;
 
 	/* Send Authent2 Command */
-	if ( !reg_write(ccid, priv, RC632_REG_COMMAND, RC632_CMD_AUTHENT2) )
+	if ( !batch_write(ccid, priv, &b, RC632_REG_COMMAND, RC632_CMD_AUTHENT2) )
 		return 0;
 
+	if ( !batch_flush(ccid, priv, &b) )
+		return 0;
+	cmd_start(priv);
+
 	/* Wait until transmitter is idle */
 	//wait_idle(ccid, priv, TMO_AUTH1);
-	if ( !wait_idle_timer(ccid, priv) )
+	if ( !wait_idle_timer(ccid, priv, 0) )
 		return 0;
 
 	/* Check whether authentication was successful */
@@ -667,10 +924,16 @@ static const struct reg_file rf_14443a_init[] = {
 
 static int iso14443a_init(struct _ccid *ccid, void *priv)
 {
-	if ( !flush_fifo(ccid, priv) )
+	struct reg_batch b;
+
+	batch_init(&b);
+	if ( !batch_write(ccid, priv, &b, RC632_REG_CONTROL,
+				RC632_CONTROL_FIFO_FLUSH) )
 		return 0;
-	return reg_write_batch(ccid, priv, rf_14443a_init,
-				ARRAY_SIZE(rf_14443a_init));
+	if ( !reg_write_batch(ccid, priv, &b, rf_14443a_init,
+				ARRAY_SIZE(rf_14443a_init)) )
+		return 0;
+	return batch_flush(ccid, priv, &b);
 }
 
 static struct {
@@ -717,35 +980,44 @@ static struct {
 
 static int set_speed(struct _ccid *ccid, void *priv, unsigned int i)
 {
+	struct reg_batch b;
+
 	if ( i >= ARRAY_SIZE(rate) )
 		return 0;
 	
-	if ( !asic_set_mask(ccid, priv, RC632_REG_RX_CONTROL1,
+	batch_init(&b);
+	if ( !batch_set_mask(ccid, priv, &b, RC632_REG_RX_CONTROL1,
 			   RC632_RXCTRL1_SUBCP_MASK,
 			   rate[i].subc_pulses) )
 		return 0;
 
-	if ( !asic_set_mask(ccid, priv, RC632_REG_DECODER_CONTROL,
+	if ( !batch_set_mask(ccid, priv, &b, RC632_REG_DECODER_CONTROL,
 			   RC632_DECCTRL_BPSK,
 			   rate[i].rx_coding) )
 		return 0;
 
-	if ( !reg_write(ccid, priv, RC632_REG_RX_THRESHOLD, rate[i].rx_threshold) )
+	if ( !batch_write(ccid, priv, &b, RC632_REG_RX_THRESHOLD,
+				rate[i].rx_threshold) )
 		return 0;
 
 	if ( rate[i].rx_coding == RC632_DECCTRL_BPSK &&
-		!reg_write(ccid, priv, RC632_REG_BPSK_DEM_CONTROL,
+		!batch_write(ccid, priv, &b, RC632_REG_BPSK_DEM_CONTROL,
 				rate[i].bpsk_dem_ctrl) )
 		return 0;
 
-	if ( !asic_set_mask(ccid, priv, RC632_REG_CODER_CONTROL,
+	if ( !batch_set_mask(ccid, priv, &b, RC632_REG_CODER_CONTROL,
 			RC632_CDRCTRL_RATE_MASK,
 			rate[i].rate) )
 		return 0;
 
-	if ( !reg_write(ccid, priv, RC632_REG_MOD_WIDTH, rate[i].mod_width) )
+	if ( !batch_write(ccid, priv, &b, RC632_REG_MOD_WIDTH,
+				rate[i].mod_width) )
 		return 0;
 
+	if ( !batch_flush(ccid, priv, &b) )
+		return 0;
+
+	((struct _clrc632 *)priv)->speed = i;
 	return 1;
 }
 
@@ -772,6 +1044,18 @@ static unsigned int get_mru(struct _ccid *ccid, void *priv)
 	return 64;
 }
 
+static void dtor(struct _ccid *ccid, void *priv)
+{
+	struct _clrc632 *rc = priv;
+
+	if ( rc->frames ) {
+		trace(ccid, " o CLRC632: %lu commands, %lu polls, %lu sleeps, "
+			"max %u polls\n",
+			rc->frames, rc->polls, rc->sleeps, rc->max_polls);
+	}
+	free(rc);
+}
+
 static const struct rfid_layer1_ops l1_ops = {
 	.rf_power = rf_power,
 
@@ -792,28 +1076,44 @@ static const struct rfid_layer1_ops l1_ops = {
 	.get_speeds = get_speeds,
 	.mtu = get_mtu,
 	.mru = get_mru,
+
+	.dtor = dtor,
 };
 
 int _clrc632_init(struct _cci *cci, const struct _clrc632_ops *asic_ops)
 {
 	struct _ccid *ccid = cci->i_parent;
-	void *priv = (void *)asic_ops;
+	struct _clrc632 *priv;
+	struct reg_batch b;
 
-	if ( !asic_power(ccid, priv, 0) )
+	priv = calloc(1, sizeof(*priv));
+	if ( NULL == priv )
 		return 0;
 
+	priv->ops = asic_ops;
+	priv->speed = RFID_14443A_SPEED_106K;
+
+	if ( !asic_power(ccid, priv, 0) )
+		goto err;
+
 	usleep(10000);
 
 	if ( !asic_power(ccid, priv, 1) )
-		return 0;
+		goto err;
 
-	if ( !asic_set_bits(ccid, priv, RC632_REG_PAGE0, 0) )
-		return 0;
-	if ( !asic_set_bits(ccid, priv, RC632_REG_TX_CONTROL, 0x5b) )
-		return 0;
+	batch_init(&b);
+	if ( !batch_set_bits(ccid, priv, &b, RC632_REG_PAGE0, 0) )
+		goto err;
+	if ( !batch_set_bits(ccid, priv, &b, RC632_REG_TX_CONTROL, 0x5b) )
+		goto err;
+	if ( !batch_flush(ccid, priv, &b) )
+		goto err;
 
 	if ( !_rfid_init(cci, &l1_ops, priv) )
-		return 0;
+		goto err;
 
 	return 1;
+err:
+	free(priv);
+	return 0;
 }
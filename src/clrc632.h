@@ -6,11 +6,26 @@
 #ifndef _CLRC632_H
 #define _CLRC632_H
 
+#define CLRC632_OP_READ	0
+#define CLRC632_OP_WRITE	1
+struct _clrc632_op {
+	uint8_t op;
+	uint8_t reg;
+	uint8_t val;
+	uint8_t *dst;
+};
+
 struct _clrc632_ops {
 	int (*fifo_read)(struct _ccid *ccid, uint8_t *buf, size_t len);
 	int (*fifo_write)(struct _ccid *ccid, const uint8_t *buf, size_t len);
 	int (*reg_read)(struct _ccid *ccid, uint8_t reg, uint8_t *val);
 	int (*reg_write)(struct _ccid *ccid, uint8_t reg, uint8_t val);
+	/* Optional: perform a sequence of register reads and writes, in
+	 * order, in as few round trips as the reader allows. NULL means
+	 * registers are accessed one at a time.
+	 */
+	int (*reg_batch)(struct _ccid *ccid, const struct _clrc632_op *op,
+				unsigned int num);
 };
 
 _private int _clrc632_init(struct _cci *cci, const struct _clrc632_ops *ops);
@@ -2,11 +2,23 @@
  * This file is part of ccid-utils
  * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
  * Released under the terms of the GNU GPL version 3
+ *
+ * Power on every card in every reader. With -b, benchmark readers instead:
+ * each is repeatedly probed, and each card powered on, sent an APDU script
+ * and powered off, with all readers running in parallel.
 */
 
 #include <ccid.h>
 
 #include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #if 0
 static int jcop_select(cci_t cci)
@@ -109,21 +121,437 @@ out:
 	return ret;
 }
 
+#define PHASE_PROBE	0
+#define PHASE_POWER_ON	1
+#define PHASE_APDU	2
+#define PHASE_POWER_OFF	3
+#define NUM_PHASE	4
+
+static const char * const phase_name[NUM_PHASE] = {
+	[PHASE_PROBE] = "probe",
+	[PHASE_POWER_ON] = "power on",
+	[PHASE_APDU] = "apdu",
+	[PHASE_POWER_OFF] = "power off",
+};
+
+#define APDU_MAX	(4 + 3 + 0x10000 + 2)
+
+struct apdu {
+	uint8_t		*a_buf;
+	size_t		a_len;
+};
+
+/* Latencies in microseconds */
+struct samples {
+	uint64_t	*s_us;
+	size_t		s_num;
+	size_t		s_max;
+	unsigned int	s_fail;
+};
+
+struct bench {
+	ccidev_t	b_dev;
+	char		*b_name;
+	unsigned int	b_idx;
+	pthread_t	b_thread;
+	struct samples	b_phase[NUM_PHASE];
+	uint64_t	b_time;
+	unsigned long	b_apdus;
+};
+
+static struct apdu *script;
+static unsigned int script_len;
+static unsigned int iterations;
+static int tracing;
+
+/* "SELECT" with no AID, picks the default application */
+static uint8_t default_apdu[] = {0x00, 0xa4, 0x04, 0x00, 0x00};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int sample(struct samples *s, uint64_t start, int ok)
+{
+	uint64_t *new;
+	size_t max;
+
+	if ( !ok ) {
+		s->s_fail++;
+		return 0;
+	}
+
+	if ( s->s_num >= s->s_max ) {
+		max = (s->s_max) ? s->s_max * 2 : 64;
+		new = realloc(s->s_us, max * sizeof(*new));
+		if ( NULL == new )
+			return 1;
+		s->s_us = new;
+		s->s_max = max;
+	}
+
+	s->s_us[s->s_num++] = now_us() - start;
+	return 1;
+}
+
+static int add_apdu(const uint8_t *buf, size_t len)
+{
+	struct apdu *new;
+
+	new = realloc(script, (script_len + 1) * sizeof(*new));
+	if ( NULL == new )
+		return 0;
+
+	script = new;
+	script[script_len].a_buf = malloc(len);
+	if ( NULL == script[script_len].a_buf )
+		return 0;
+
+	memcpy(script[script_len].a_buf, buf, len);
+	script[script_len].a_len = len;
+	script_len++;
+	return 1;
+}
+
+/* One APDU per line in hex, whitespace is ignored as is anything after a
+ * '#'
+ */
+static int load_script(const char *fn)
+{
+	static uint8_t buf[APDU_MAX];
+	char *line, *ptr;
+	unsigned int lno, b;
+	size_t len;
+	FILE *f;
+	int ret = 0;
+
+	line = malloc(APDU_MAX * 3);
+	if ( NULL == line )
+		return 0;
+
+	f = fopen(fn, "r");
+	if ( NULL == f ) {
+		fprintf(stderr, "%s: open: %s\n", fn, strerror(errno));
+		free(line);
+		return 0;
+	}
+
+	for(lno = 1; fgets(line, APDU_MAX * 3, f); lno++) {
+		ptr = strchr(line, '#');
+		if ( ptr )
+			*ptr = '\0';
+
+		for(len = 0, ptr = line; *ptr; ) {
+			if ( isspace((uint8_t)*ptr) ) {
+				ptr++;
+				continue;
+			}
+			if ( len >= sizeof(buf) || !isxdigit((uint8_t)ptr[0]) ||
+					!isxdigit((uint8_t)ptr[1]) ) {
+				fprintf(stderr, "%s:%u: bad APDU\n", fn, lno);
+				goto out;
+			}
+			sscanf(ptr, "%2x", &b);
+			buf[len++] = b;
+			ptr += 2;
+		}
+
+		if ( !len )
+			continue;
+		if ( len < 4 ) {
+			fprintf(stderr, "%s:%u: APDU too short\n", fn, lno);
+			goto out;
+		}
+		if ( !add_apdu(buf, len) )
+			goto out;
+	}
+
+	if ( !script_len ) {
+		fprintf(stderr, "%s: no APDUs\n", fn);
+		goto out;
+	}
+
+	ret = 1;
+out:
+	fclose(f);
+	free(line);
+	return ret;
+}
+
+static void bench_cci(struct bench *b, cci_t cci, xfr_t xfr)
+{
+	unsigned int i;
+	uint64_t start;
+	int ok;
+
+	start = now_us();
+	ok = (NULL != cci_power_on(cci, CHIPCARD_AUTO_VOLTAGE, NULL));
+	if ( !sample(&b->b_phase[PHASE_POWER_ON], start, ok) )
+		return;
+
+	for(i = 0; i < script_len; i++) {
+		xfr_reset(xfr);
+		xfr_tx_buf(xfr, script[i].a_buf, script[i].a_len);
+		start = now_us();
+		ok = cci_transact(cci, xfr);
+		if ( sample(&b->b_phase[PHASE_APDU], start, ok) )
+			b->b_apdus++;
+	}
+
+	start = now_us();
+	ok = cci_power_off(cci);
+	sample(&b->b_phase[PHASE_POWER_OFF], start, ok);
+}
+
+static void *bench_reader(void *priv)
+{
+	struct bench *b = priv;
+	uint64_t begin, start;
+	unsigned int i, j;
+	char fn[128];
+	ccid_t ccid;
+	xfr_t xfr;
+
+	xfr = xfr_alloc(APDU_MAX, APDU_MAX);
+	if ( NULL == xfr )
+		return NULL;
+
+	begin = now_us();
+	for(i = 0; i < iterations; i++) {
+		/* a trace per run, else each probe would overwrite the last */
+		snprintf(fn, sizeof(fn), "cselect.%u.%u.trace", b->b_idx, i);
+
+		start = now_us();
+		ccid = ccid_probe(b->b_dev, (tracing) ? fn : NULL);
+		if ( !sample(&b->b_phase[PHASE_PROBE], start, NULL != ccid) )
+			continue;
+
+		if ( NULL == b->b_name )
+			b->b_name = strdup(ccid_name(ccid));
+
+		for(j = 0; j < ccid_num_slots(ccid); j++)
+			bench_cci(b, ccid_get_slot(ccid, j), xfr);
+		for(j = 0; j < ccid_num_fields(ccid); j++)
+			bench_cci(b, ccid_get_field(ccid, j), xfr);
+
+		ccid_close(ccid);
+	}
+	b->b_time = now_us() - begin;
+
+	xfr_free(xfr);
+	return NULL;
+}
+
+static int cmp_u64(const void *A, const void *B)
+{
+	const uint64_t *a = A, *b = B;
+
+	if ( *a < *b )
+		return -1;
+	return *a > *b;
+}
+
+static uint64_t pct(const struct samples *s, unsigned int p)
+{
+	return s->s_us[(s->s_num - 1) * p / 100];
+}
+
+static void print_phase(const char *name, struct samples *s)
+{
+	if ( !s->s_num ) {
+		printf("  %-10s %8u fail\n", name, s->s_fail);
+		return;
+	}
+
+	qsort(s->s_us, s->s_num, sizeof(*s->s_us), cmp_u64);
+	printf("  %-10s %8zu ok %5u fail  p50 %8"PRIu64"us  p90 %8"PRIu64"us "
+		" p99 %8"PRIu64"us  max %8"PRIu64"us\n",
+		name, s->s_num, s->s_fail,
+		pct(s, 50), pct(s, 90), pct(s, 99), s->s_us[s->s_num - 1]);
+}
+
+static void merge(struct samples *dst, const struct samples *src)
+{
+	uint64_t *new;
+
+	dst->s_fail += src->s_fail;
+	if ( !src->s_num )
+		return;
+
+	new = realloc(dst->s_us, (dst->s_num + src->s_num) * sizeof(*new));
+	if ( NULL == new )
+		return;
+
+	memcpy(new + dst->s_num, src->s_us, src->s_num * sizeof(*new));
+	dst->s_us = new;
+	dst->s_num += src->s_num;
+}
+
+static double rate(unsigned long cnt, uint64_t us)
+{
+	return (us) ? cnt * 1000000.0 / us : 0.0;
+}
+
+static void report(struct bench *b, size_t num_dev, uint64_t wall)
+{
+	struct samples all[NUM_PHASE];
+	unsigned long apdus = 0;
+	unsigned int p;
+	size_t i;
+
+	memset(all, 0, sizeof(all));
+
+	for(i = 0; i < num_dev; i++) {
+		printf("Reader %u at %d.%d: %s\n", b[i].b_idx,
+			libccid_device_bus(b[i].b_dev),
+			libccid_device_addr(b[i].b_dev),
+			(b[i].b_name) ? b[i].b_name : "(never probed)");
+		for(p = 0; p < NUM_PHASE; p++) {
+			merge(&all[p], &b[i].b_phase[p]);
+			print_phase(phase_name[p], &b[i].b_phase[p]);
+		}
+		printf("  %lu APDUs in %.3fs, %.1f APDUs/sec\n\n",
+			b[i].b_apdus, b[i].b_time / 1000000.0,
+			rate(b[i].b_apdus, b[i].b_time));
+		apdus += b[i].b_apdus;
+	}
+
+	printf("All %zu readers:\n", num_dev);
+	for(p = 0; p < NUM_PHASE; p++) {
+		print_phase(phase_name[p], &all[p]);
+		free(all[p].s_us);
+	}
+	printf("  %lu APDUs in %.3fs, %.1f APDUs/sec\n",
+		apdus, wall / 1000000.0, rate(apdus, wall));
+}
+
+static int bench(ccidev_t *dev, size_t num_dev)
+{
+	struct bench *b;
+	unsigned int p;
+	uint64_t wall;
+	size_t i, n;
+	int ret = 0;
+
+	if ( !num_dev ) {
+		fprintf(stderr, "No readers found\n");
+		return 0;
+	}
+
+	if ( NULL == script && !add_apdu(default_apdu, sizeof(default_apdu)) )
+		return 0;
+
+	b = calloc(num_dev, sizeof(*b));
+	if ( NULL == b )
+		return 0;
+
+	printf("Benchmarking %zu readers, %u iterations of %u APDUs\n\n",
+		num_dev, iterations, script_len);
+
+	wall = now_us();
+	for(n = 0; n < num_dev; n++) {
+		b[n].b_dev = dev[n];
+		b[n].b_idx = n;
+		if ( pthread_create(&b[n].b_thread, NULL, bench_reader, b + n) )
+			break;
+	}
+	for(i = 0; i < n; i++)
+		pthread_join(b[i].b_thread, NULL);
+	wall = now_us() - wall;
+
+	if ( n == num_dev ) {
+		report(b, num_dev, wall);
+		ret = 1;
+	}
+
+	for(i = 0; i < num_dev; i++) {
+		for(p = 0; p < NUM_PHASE; p++)
+			free(b[i].b_phase[p].s_us);
+		free(b[i].b_name);
+	}
+	free(b);
+	return ret;
+}
+
+/* A positive count with nothing trailing, strtoul() on its own takes a
+ * minus sign and ignores junk.
+ */
+static unsigned int parse_count(const char *str)
+{
+	unsigned long val;
+	char *end;
+
+	if ( !isdigit((uint8_t)*str) )
+		return 0;
+
+	errno = 0;
+	val = strtoul(str, &end, 0);
+	if ( errno || *end || val > UINT_MAX )
+		return 0;
+
+	return val;
+}
+
+static void usage(const char *cmd)
+{
+	fprintf(stderr, "Usage: %s [-b iterations [-s script] [-t]]\n", cmd);
+	fprintf(stderr, "  -b  benchmark every reader for some iterations\n");
+	fprintf(stderr, "  -s  file of APDUs in hex, one per line\n");
+	fprintf(stderr, "  -t  write a trace of each run while benchmarking\n");
+}
+
 int main(int argc, char **argv)
 {
 	ccidev_t *dev;
 	size_t num_dev, i;
+	int c, ret = EXIT_SUCCESS;
+
+	while ( (c = getopt(argc, argv, "b:s:t")) != -1 ) {
+		switch(c) {
+		case 'b':
+			iterations = parse_count(optarg);
+			if ( !iterations ) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			if ( !load_script(optarg) )
+				return EXIT_FAILURE;
+			break;
+		case 't':
+			tracing = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ( optind < argc || (!iterations && (script || tracing)) ) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
 
 	dev = libccid_get_device_list(&num_dev);
 	if ( NULL == dev )
 		return EXIT_FAILURE;
 
-	for(i = 0; i < num_dev; i++) {
-		found_ccid(dev[i]);
-		printf("\n");
+	if ( iterations ) {
+		if ( !bench(dev, num_dev) )
+			ret = EXIT_FAILURE;
+	}else{
+		for(i = 0; i < num_dev; i++) {
+			found_ccid(dev[i]);
+			printf("\n");
+		}
 	}
 
 	libccid_free_device_list(dev);
 
-	return EXIT_SUCCESS;
+	return ret;
 }
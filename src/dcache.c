@@ -0,0 +1,256 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Cache of what a reader told us about itself when it was probed: the raw
+ * configuration descriptor and the supported clock and data rate tables,
+ * keyed on vendor, product, release and serial number. Opening the same
+ * reader again with CCID_PROBE_FAST need not ask for them.
+*/
+
+#include <ccid.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "ccid-internal.h"
+
+#define DCACHE_HASH_SIZE	(1 << 6)
+#define DCACHE_HASH_MASK	(DCACHE_HASH_SIZE - 1)
+#define DCACHE_MAX_ENTRIES	1024
+
+/* A line is three words of id, the hex tables and the serial number */
+#define DCACHE_LINE_MAX		(32 + (DCACHE_MAX_CONFIG * 2) + \
+				(DCACHE_MAX_TAB * 8 * 2) + DCACHE_MAX_SERIAL)
+
+struct dcache_ent {
+	struct dcache_ent	*d_next;
+	struct _dcache_key	d_key;
+	struct _dcache_val	d_val;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dcache_ent *dcache[DCACHE_HASH_SIZE];
+static unsigned int num_ent;
+
+static unsigned int dcache_hash(const struct _dcache_key *k)
+{
+	unsigned int h;
+	const char *s;
+
+	h = (k->k_vid * 31) + k->k_pid;
+	h = (h * 31) + k->k_rel;
+	for(s = k->k_serial; *s; s++)
+		h = (h * 31) + (uint8_t)*s;
+
+	return h & DCACHE_HASH_MASK;
+}
+
+static struct dcache_ent **find(const struct _dcache_key *k)
+{
+	struct dcache_ent **p;
+
+	for(p = &dcache[dcache_hash(k)]; *p; p = &(*p)->d_next) {
+		if ( (*p)->d_key.k_vid == k->k_vid &&
+				(*p)->d_key.k_pid == k->k_pid &&
+				(*p)->d_key.k_rel == k->k_rel &&
+				!strcmp((*p)->d_key.k_serial, k->k_serial) )
+			break;
+	}
+
+	return p;
+}
+
+static int insert(const struct _dcache_key *k, const struct _dcache_val *v)
+{
+	struct dcache_ent **p, *e;
+
+	p = find(k);
+	if ( *p ) {
+		(*p)->d_val = *v;
+		return 1;
+	}
+
+	if ( num_ent >= DCACHE_MAX_ENTRIES )
+		return 0;
+
+	e = calloc(1, sizeof(*e));
+	if ( NULL == e )
+		return 0;
+
+	e->d_key = *k;
+	e->d_val = *v;
+	*p = e;
+	num_ent++;
+	return 1;
+}
+
+int _dcache_lookup(const struct _dcache_key *k, struct _dcache_val *v)
+{
+	struct dcache_ent *e;
+
+	pthread_mutex_lock(&lock);
+	e = *find(k);
+	if ( e )
+		*v = e->d_val;
+	pthread_mutex_unlock(&lock);
+
+	return (NULL != e);
+}
+
+void _dcache_store(const struct _dcache_key *k, const struct _dcache_val *v)
+{
+	pthread_mutex_lock(&lock);
+	insert(k, v);
+	pthread_mutex_unlock(&lock);
+}
+
+void _dcache_drop(const struct _dcache_key *k)
+{
+	struct dcache_ent **p, *e;
+
+	pthread_mutex_lock(&lock);
+	p = find(k);
+	e = *p;
+	if ( e ) {
+		*p = e->d_next;
+		free(e);
+		num_ent--;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static int unhex_tab(const char *str, uint32_t *tab, size_t max, size_t *num)
+{
+	unsigned int i;
+
+	for(i = 0; *str; i++, str += 8) {
+		if ( i >= max || strspn(str, "0123456789abcdefABCDEF") < 8 )
+			return 0;
+		sscanf(str, "%8"SCNx32, tab + i);
+	}
+
+	*num = i;
+	return 1;
+}
+
+static void hex_tab(FILE *f, const uint32_t *tab, size_t num)
+{
+	for(; num; num--, tab++)
+		fprintf(f, "%.8"PRIx32, *tab);
+}
+
+/** Discard every entry in the descriptor cache.
+ * \ingroup g_libccid
+ */
+void libccid_desc_cache_clear(void)
+{
+	struct dcache_ent *e, *tmp;
+	unsigned int i;
+
+	pthread_mutex_lock(&lock);
+	for(i = 0; i < DCACHE_HASH_SIZE; i++) {
+		for(e = dcache[i]; e; e = tmp) {
+			tmp = e->d_next;
+			free(e);
+		}
+		dcache[i] = NULL;
+	}
+	num_ent = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+static int load_line(char *line, _unused void *priv)
+{
+	struct _dcache_key k;
+	struct _dcache_val v;
+	unsigned int vid, pid, rel;
+	char *tok[6];
+
+	if ( !_split_fields(line, tok, 6) ||
+			sscanf(line, "%x", &vid) != 1 ||
+			sscanf(tok[0], "%x", &pid) != 1 ||
+			sscanf(tok[1], "%x", &rel) != 1 ||
+			vid > 0xffff || pid > 0xffff || rel > 0xffff ||
+			strlen(tok[5]) >= sizeof(k.k_serial) ||
+			!_unhex(tok[2], v.v_config, sizeof(v.v_config),
+				&v.v_config_len) ||
+			!v.v_config_len ||
+			!unhex_tab(tok[3], v.v_rate, DCACHE_MAX_TAB,
+				&v.v_num_rate) ||
+			!unhex_tab(tok[4], v.v_clock, DCACHE_MAX_TAB,
+				&v.v_num_clock) )
+		return 0;
+
+	memset(&k, 0, sizeof(k));
+	k.k_vid = vid;
+	k.k_pid = pid;
+	k.k_rel = rel;
+	strcpy(k.k_serial, tok[5]);
+	return (insert(&k, &v)) ? 1 : -1;
+}
+
+/** Load entries in to the descriptor cache from a file.
+ * \ingroup g_libccid
+ * @param fn Filename, as written by libccid_desc_cache_save().
+ *
+ * Each line is vendor:product:release:config:data rates:clocks:serial with
+ * the ids in hex, the configuration descriptor as hex bytes and the tables
+ * as 32bit hex words.
+ *
+ * Loading the cache saved by a previous run lets readers be opened with
+ * CCID_PROBE_FAST without asking them for their descriptors again.
+ *
+ * @return zero on failure to read the file, non-zero otherwise.
+ */
+int libccid_desc_cache_load(const char *fn)
+{
+	int ret;
+
+	pthread_mutex_lock(&lock);
+	ret = _load_lines(fn, DCACHE_LINE_MAX, load_line, NULL);
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+/** Write the descriptor cache out to a file.
+ * \ingroup g_libccid
+ * @param fn Filename, which is overwritten.
+ *
+ * @return zero on failure, non-zero otherwise.
+ */
+int libccid_desc_cache_save(const char *fn)
+{
+	struct dcache_ent *e;
+	unsigned int i;
+	FILE *f;
+	int ret;
+
+	f = fopen(fn, "w");
+	if ( NULL == f ) {
+		fprintf(stderr, "%s: open: %s\n", fn, strerror(errno));
+		return 0;
+	}
+
+	pthread_mutex_lock(&lock);
+	for(i = 0; i < DCACHE_HASH_SIZE; i++) {
+		for(e = dcache[i]; e; e = e->d_next) {
+			fprintf(f, "%.4x:%.4x:%.4x:", e->d_key.k_vid,
+				e->d_key.k_pid, e->d_key.k_rel);
+			_hex(f, e->d_val.v_config, e->d_val.v_config_len);
+			fprintf(f, ":");
+			hex_tab(f, e->d_val.v_rate, e->d_val.v_num_rate);
+			fprintf(f, ":");
+			hex_tab(f, e->d_val.v_clock, e->d_val.v_num_clock);
+			fprintf(f, ":%s\n", e->d_key.k_serial);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	ret = !ferror(f);
+	if ( fclose(f) )
+		ret = 0;
+	return ret;
+}
@@ -80,6 +80,7 @@ struct _emv {
 	/* hardware */
 	cci_t e_dev;
 	xfr_t e_xfr;
+	unsigned int e_flags; /* callers cci flags, restored on fini */
 
 	mpool_t e_data;
 	gang_t e_files;
@@ -212,6 +212,9 @@ void _emv_auth_reset(emv_t e)
 static void do_emv_fini(emv_t e)
 {
 	if ( e ) {
+		if ( e->e_dev )
+			cci_set_flags(e->e_dev, e->e_flags);
+
 		_emv_auth_reset(e);
 
 		_emv_free_applist(e);
@@ -224,7 +227,7 @@ static void do_emv_fini(emv_t e)
 		free(e->e_afl);
 
 		if ( e->e_xfr )
-			xfr_free(e->e_xfr);
+			xfr_pool_put(e->e_xfr);
 
 		free(e);
 	}
@@ -245,9 +248,11 @@ emv_t emv_init(cci_t cc)
 	e = calloc(1, sizeof(*e));
 	if ( e ) {
 		e->e_dev = cc;
+		e->e_flags = cci_flags(cc);
+		cci_set_flags(cc, e->e_flags | CCI_AUTO_RESPONSE);
 		INIT_LIST_HEAD(&e->e_apps);
 
-		e->e_xfr = xfr_alloc(1024, 1204);
+		e->e_xfr = xfr_pool_get(1024, 1204);
 		if ( NULL == e->e_xfr )
 			goto err;
 
@@ -8,39 +8,42 @@
 #include <list.h>
 #include <emv.h>
 #include <ber.h>
+#include <string.h>
+#include <errno.h>
 #include "emv-internal.h"
 
-static int do_sel(emv_t e, uint8_t p1, uint8_t p2,
-			const uint8_t *name, size_t nlen)
+/* Reset the transmit buffer and reserve len bytes of it, the caller lays out
+ * the command APDU in place.
+ */
+static uint8_t *apdu_alloc(emv_t e, size_t len)
 {
-	uint8_t sw2;
+	uint8_t *apdu;
 
-	//assert(nlen < 0x100);
 	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xa4);		/* INS: SELECT */
-	xfr_tx_byte(e->e_xfr, p1);		/* P1: Select by name */
-	xfr_tx_byte(e->e_xfr, p2);		/* P2: First/only occurance */
-	xfr_tx_byte(e->e_xfr, nlen);		/* Lc: name length */
-	xfr_tx_buf(e->e_xfr, name, nlen);	/* DATA: name */
-
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
+	apdu = xfr_tx_reserve(e->e_xfr, len);
+	if ( NULL == apdu ) {
+		errno = ENOSPC;
+		_emv_sys_error(e);
 	}
 
-	if ( xfr_rx_sw1(e->e_xfr) != 0x61 ) {
-		_emv_icc_error(e);
-		return 0;
-	}
-	sw2 = xfr_rx_sw2(e->e_xfr);
+	return apdu;
+}
 
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xc0);		/* INS: GET RESPONSE */
-	xfr_tx_byte(e->e_xfr, 0);		/* P1 */
-	xfr_tx_byte(e->e_xfr, 0);		/* P2 */
-	xfr_tx_byte(e->e_xfr, sw2);		/* Le */
+static int do_sel(emv_t e, uint8_t p1, uint8_t p2,
+			const uint8_t *name, size_t nlen)
+{
+	uint8_t *apdu;
+
+	//assert(nlen < 0x100);
+	apdu = apdu_alloc(e, 5 + nlen);
+	if ( NULL == apdu )
+		return 0;
+	apdu[0] = 0x00;			/* CLA */
+	apdu[1] = 0xa4;			/* INS: SELECT */
+	apdu[2] = p1;			/* P1: Select by name */
+	apdu[3] = p2;			/* P2: First/only occurance */
+	apdu[4] = nlen;			/* Lc: name length */
+	memcpy(apdu + 5, name, nlen);	/* DATA: name */
 
 	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
 		_emv_ccid_error(e);
@@ -67,34 +70,18 @@ int _emv_select_next(emv_t e, const uint8_t *name, size_t nlen)
 
 int _emv_read_record(emv_t e, uint8_t sfi, uint8_t record)
 {
-	uint8_t sw2, p2;
+	uint8_t *apdu, p2;
 
 	p2 = (sfi << 3) | (1 << 2);
 
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xb2);		/* INS: READ RECORD */
-	xfr_tx_byte(e->e_xfr, record);		/* P1: record index */
-	xfr_tx_byte(e->e_xfr, p2);		/* P2 */
-	xfr_tx_byte(e->e_xfr, 0);		/* Le: 0 this time around */
-
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
-
-	if ( xfr_rx_sw1(e->e_xfr) != 0x6c ) {
-		_emv_icc_error(e);
+	apdu = apdu_alloc(e, 5);
+	if ( NULL == apdu )
 		return 0;
-	}
-	sw2 = xfr_rx_sw2(e->e_xfr);
-
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xb2);		/* INS: READ RECORD */
-	xfr_tx_byte(e->e_xfr, record);		/* P1: record index */
-	xfr_tx_byte(e->e_xfr, p2); 		/* P2 */
-	xfr_tx_byte(e->e_xfr, sw2);		/* Le: got it now */
+	apdu[0] = 0x00;			/* CLA */
+	apdu[1] = 0xb2;			/* INS: READ RECORD */
+	apdu[2] = record;		/* P1: record index */
+	apdu[3] = p2;			/* P2 */
+	apdu[4] = 0;			/* Le: whatever there is */
 
 	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
 		_emv_ccid_error(e);
@@ -110,32 +97,16 @@ int _emv_read_record(emv_t e, uint8_t sfi, uint8_t record)
 }
 int _emv_get_data(emv_t e, uint8_t p1, uint8_t p2)
 {
-	uint8_t sw2;
+	uint8_t *apdu;
 
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x80);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xca);		/* INS: GET DATA*/
-	xfr_tx_byte(e->e_xfr, p1);		/* P1 */
-	xfr_tx_byte(e->e_xfr, p2);		/* P2 */
-	xfr_tx_byte(e->e_xfr, 0);		/* Le: 0 this time around */
-
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
+	apdu = apdu_alloc(e, 5);
+	if ( NULL == apdu )
 		return 0;
-	}
-
-	if ( xfr_rx_sw1(e->e_xfr) != 0x6c ) {
-		_emv_icc_error(e);
-		return 0;
-	}
-	sw2 = xfr_rx_sw2(e->e_xfr);
-
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x80);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xca);		/* INS: GET DATA */
-	xfr_tx_byte(e->e_xfr, p1);		/* P1 */
-	xfr_tx_byte(e->e_xfr, p2); 		/* P2 */
-	xfr_tx_byte(e->e_xfr, sw2);		/* Le: got it now */
+	apdu[0] = 0x80;			/* CLA */
+	apdu[1] = 0xca;			/* INS: GET DATA*/
+	apdu[2] = p1;			/* P1 */
+	apdu[3] = p2;			/* P2 */
+	apdu[4] = 0;			/* Le: whatever there is */
 
 	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
 		_emv_ccid_error(e);
@@ -152,13 +123,17 @@ int _emv_get_data(emv_t e, uint8_t p1, uint8_t p2)
 
 int _emv_verify(emv_t e, uint8_t fmt, const uint8_t *pin, uint8_t plen)
 {
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0x20);		/* INS: VERIFY */
-	xfr_tx_byte(e->e_xfr, 0);		/* P1: record index */
-	xfr_tx_byte(e->e_xfr, fmt);		/* P2 */
-	xfr_tx_byte(e->e_xfr, plen);		/* P2 */
-	xfr_tx_buf(e->e_xfr, pin, plen);
+	uint8_t *apdu;
+
+	apdu = apdu_alloc(e, 5 + plen);
+	if ( NULL == apdu )
+		return 0;
+	apdu[0] = 0x00;			/* CLA */
+	apdu[1] = 0x20;			/* INS: VERIFY */
+	apdu[2] = 0;			/* P1: record index */
+	apdu[3] = fmt;			/* P2 */
+	apdu[4] = plen;			/* P2 */
+	memcpy(apdu + 5, pin, plen);
 
 	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
 		_emv_ccid_error(e);
@@ -175,34 +150,18 @@ int _emv_verify(emv_t e, uint8_t fmt, const uint8_t *pin, uint8_t plen)
 
 int _emv_get_proc_opts(emv_t e, const uint8_t *dol, uint8_t len)
 {
-	uint8_t sw2;
-
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x80);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xa8);		/* INS: GET DATA*/
-	xfr_tx_byte(e->e_xfr, 0);		/* P1 */
-	xfr_tx_byte(e->e_xfr, 0);		/* P2 */
-	xfr_tx_byte(e->e_xfr, len);		/* Lc */
-	xfr_tx_buf(e->e_xfr, dol, len);		/* Data: PDOL */
-	xfr_tx_byte(e->e_xfr, 0);		/* Le */
-
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
+	uint8_t *apdu;
 
-	if ( xfr_rx_sw1(e->e_xfr) != 0x61 ) {
-		_emv_icc_error(e);
+	apdu = apdu_alloc(e, 6 + len);
+	if ( NULL == apdu )
 		return 0;
-	}
-	sw2 = xfr_rx_sw2(e->e_xfr);
-
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xc0);		/* INS: GET RESPONSE */
-	xfr_tx_byte(e->e_xfr, 0);		/* P1 */
-	xfr_tx_byte(e->e_xfr, 0);		/* P2 */
-	xfr_tx_byte(e->e_xfr, sw2);		/* Le */
+	apdu[0] = 0x80;			/* CLA */
+	apdu[1] = 0xa8;			/* INS: GET DATA*/
+	apdu[2] = 0;			/* P1 */
+	apdu[3] = 0;			/* P2 */
+	apdu[4] = len;			/* Lc */
+	memcpy(apdu + 5, dol, len);	/* Data: PDOL */
+	apdu[5 + len] = 0;		/* Le */
 
 	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
 		_emv_ccid_error(e);
@@ -220,34 +179,18 @@ int _emv_get_proc_opts(emv_t e, const uint8_t *dol, uint8_t len)
 int _emv_generate_ac(emv_t e, uint8_t ref,
 			const uint8_t *data, uint8_t len)
 {
-	uint8_t sw2;
+	uint8_t *apdu;
 
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x80);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xae);		/* INS: GENERATE AC */
-	xfr_tx_byte(e->e_xfr, ref);		/* P1 */
-	xfr_tx_byte(e->e_xfr, 0);		/* P2 */
-	xfr_tx_byte(e->e_xfr, len);		/* Lc */
-	xfr_tx_buf(e->e_xfr, data, len);	/* Data: */
-	xfr_tx_byte(e->e_xfr, 0);		/* Le */
-
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
+	apdu = apdu_alloc(e, 6 + len);
+	if ( NULL == apdu )
 		return 0;
-	}
-
-	if ( xfr_rx_sw1(e->e_xfr) != 0x61 ) {
-		_emv_icc_error(e);
-		return 0;
-	}
-	sw2 = xfr_rx_sw2(e->e_xfr);
-
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xc0);		/* INS: GET RESPONSE */
-	xfr_tx_byte(e->e_xfr, 0);		/* P1 */
-	xfr_tx_byte(e->e_xfr, 0);		/* P2 */
-	xfr_tx_byte(e->e_xfr, sw2);		/* Le */
+	apdu[0] = 0x80;			/* CLA */
+	apdu[1] = 0xae;			/* INS: GENERATE AC */
+	apdu[2] = ref;			/* P1 */
+	apdu[3] = 0;			/* P2 */
+	apdu[4] = len;			/* Lc */
+	memcpy(apdu + 5, data, len);	/* Data: */
+	apdu[5 + len] = 0;		/* Le */
 
 	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
 		_emv_ccid_error(e);
@@ -264,34 +207,18 @@ int _emv_generate_ac(emv_t e, uint8_t ref,
 
 _private int _emv_int_authenticate(emv_t e, const uint8_t *data, uint8_t len)
 {
-	uint8_t sw2;
-
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0x88);		/* INS: INT_AUTHENTICATE */
-	xfr_tx_byte(e->e_xfr, 0);		/* P1 */
-	xfr_tx_byte(e->e_xfr, 0);		/* P2 */
-	xfr_tx_byte(e->e_xfr, len);		/* Lc */
-	xfr_tx_buf(e->e_xfr, data, len);	/* Data: */
-	xfr_tx_byte(e->e_xfr, 0);		/* Le */
-
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
-
-	if ( xfr_rx_sw1(e->e_xfr) != 0x61 ) {
-		_emv_icc_error(e);
-		return 0;
-	}
-	sw2 = xfr_rx_sw2(e->e_xfr);
-
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xc0);		/* INS: GET RESPONSE */
-	xfr_tx_byte(e->e_xfr, 0);		/* P1 */
-	xfr_tx_byte(e->e_xfr, 0);		/* P2 */
-	xfr_tx_byte(e->e_xfr, sw2);		/* Le */
+	uint8_t *apdu;
+
+	apdu = apdu_alloc(e, 6 + len);
+	if ( NULL == apdu )
+		return 0;
+	apdu[0] = 0x00;			/* CLA */
+	apdu[1] = 0x88;			/* INS: INT_AUTHENTICATE */
+	apdu[2] = 0;			/* P1 */
+	apdu[3] = 0;			/* P2 */
+	apdu[4] = len;			/* Lc */
+	memcpy(apdu + 5, data, len);	/* Data: */
+	apdu[5 + len] = 0;		/* Le */
 
 	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
 		_emv_ccid_error(e);
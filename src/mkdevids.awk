@@ -0,0 +1,132 @@
+# This file is part of ccid-utils
+# Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+# Released under the terms of the GNU GPL version 3
+#
+# Compile usb-ccid-devices in to a static hash table for ccidev.c. Lines are
+# of the form vendor:product:flags:name. The table is open addressed with
+# linear probing, keyed on (vendor << 16 | product) modulo a prime size,
+# and the first entry for any given ID wins.
+
+function hex(s,    i, c, v)
+{
+	s = tolower(s)
+	sub(/^[ \t]+/, "", s)
+	sub(/[ \t]+$/, "", s)
+	if ( s !~ /^0x[0-9a-f]+$/ )
+		return -1
+	v = 0
+	for(i = 3; i <= length(s); i++) {
+		c = index("0123456789abcdef", substr(s, i, 1)) - 1
+		v = v * 16 + c
+	}
+	if ( v > 65535 )
+		return -1
+	return v
+}
+
+function trim(s)
+{
+	sub(/^[ \t]+/, "", s)
+	sub(/[ \t]+$/, "", s)
+	return s
+}
+
+function cflags(s,    n, i, tok, ret, t)
+{
+	ret = ""
+	n = split(s, tok, "|")
+	for(i = 1; i <= n; i++) {
+		t = trim(tok[i])
+		if ( t == "" )
+			continue
+		if ( t == "RFID_OMNI" ) {
+			ret = ret (ret == "" ? "" : "|") "INTF_RFID_OMNI"
+		}else{
+			printf("%s:%d: '%s' unknown device flag\n",
+				FILENAME, FNR, t) > "/dev/stderr"
+		}
+	}
+	return (ret == "") ? "0" : ret
+}
+
+function is_prime(n,    d)
+{
+	if ( n < 2 )
+		return 0
+	for(d = 2; d * d <= n; d++)
+		if ( n % d == 0 )
+			return 0
+	return 1
+}
+
+/^[ \t]*#/ || /^[ \t\r]*$/ {
+	next
+}
+
+{
+	line = $0
+	sub(/\r$/, "", line)
+
+	for(nf = 0; nf < 3; nf++) {
+		p = index(line, ":")
+		if ( !p )
+			break
+		tok[nf] = substr(line, 1, p - 1)
+		line = substr(line, p + 1)
+	}
+	tok[nf++] = line
+
+	if ( nf < 2 ) {
+		printf("%s:%d: badly formed line\n",
+			FILENAME, FNR) > "/dev/stderr"
+		next
+	}
+
+	vid = hex(tok[0])
+	pid = hex(tok[1])
+	if ( vid <= 0 || pid < 0 ) {
+		printf("%s:%d: bad ID number\n", FILENAME, FNR) > "/dev/stderr"
+		next
+	}
+
+	name = (nf > 3) ? trim(tok[3]) : ""
+	if ( name == "" )
+		name = "Unknown device"
+	gsub(/\\/, "\\\\", name)
+	gsub(/"/, "\\\"", name)
+
+	n++
+	e_vid[n] = vid
+	e_pid[n] = pid
+	e_flags[n] = (nf > 2) ? cflags(tok[2]) : "0"
+	e_name[n] = name
+}
+
+END {
+	for(size = 2 * n + 1; !is_prime(size); size++)
+		;
+
+	for(i = 1; i <= n; i++) {
+		key = e_vid[i] * 65536 + e_pid[i]
+		for(h = key % size; h in slot; h = (h + 1) % size) {
+			if ( slot_key[h] == key )
+				break
+		}
+		if ( h in slot )
+			continue
+		slot[h] = i
+		slot_key[h] = key
+	}
+
+	print "/* Generated from usb-ccid-devices by mkdevids.awk, do not edit */"
+	printf("#define DEVID_HASH_SIZE %d\n", size)
+	printf("static const struct devid devid_hash[DEVID_HASH_SIZE] = {\n")
+	for(h = 0; h < size; h++) {
+		if ( !(h in slot) )
+			continue
+		i = slot[h]
+		printf("\t[%d] = { 0x%.4x, 0x%.4x, %s, \"%s\" },\n",
+			h, e_vid[i], e_pid[i], e_flags[i], e_name[i])
+	}
+	printf("};\n")
+}
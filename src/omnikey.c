@@ -11,24 +11,24 @@
 #include "ccid-internal.h"
 #include "rfid.h"
 #include "clrc632.h"
+#include "clrc632-regs.h"
 
 #define RFID_SLOT 0
 
 static int fifo_read(struct _ccid *ccid, uint8_t *buf, size_t len)
 {
 	struct _xfr *xfr = ccid->d_xfr;
+	uint8_t hdr[] = {0x20, 0x00, 0x00, 0x00, len, 0x00, 0x02};
+	struct iovec iov[] = {
+		{.iov_base = hdr, .iov_len = sizeof(hdr)},
+		{.iov_base = buf, .iov_len = len},
+	};
 
 	assert(len < 0x100);
 
 	xfr_reset(xfr);
-	xfr_tx_byte(xfr, 0x20);
-	xfr_tx_byte(xfr, 0x00);
-	xfr_tx_byte(xfr, 0x00);
-	xfr_tx_byte(xfr, 0x00);
-	xfr_tx_byte(xfr, len);
-	xfr_tx_byte(xfr, 0x00);
-	xfr_tx_byte(xfr, 0x02);
-	xfr_tx_buf(xfr, buf, len);
+	if ( !xfr_tx_iov(xfr, iov, sizeof(iov)/sizeof(*iov)) )
+		return 0;
 	if ( !_PC_to_RDR_Escape(ccid, RFID_SLOT, xfr) )
 		return 0;
 
@@ -42,18 +42,17 @@ static int fifo_read(struct _ccid *ccid, uint8_t *buf, size_t len)
 static int fifo_write(struct _ccid *ccid, const uint8_t *buf, size_t len)
 {
 	struct _xfr *xfr = ccid->d_xfr;
+	uint8_t hdr[] = {0x20, 0x00, len, 0x00, 0x00, 0x03, 0x02};
+	struct iovec iov[] = {
+		{.iov_base = hdr, .iov_len = sizeof(hdr)},
+		{.iov_base = (void *)buf, .iov_len = len},
+	};
 
 	assert(len < 0x100);
 
 	xfr_reset(xfr);
-	xfr_tx_byte(xfr, 0x20);
-	xfr_tx_byte(xfr, 0x00);
-	xfr_tx_byte(xfr, len);
-	xfr_tx_byte(xfr, 0x00);
-	xfr_tx_byte(xfr, 0x00);
-	xfr_tx_byte(xfr, 0x03);
-	xfr_tx_byte(xfr, 0x02);
-	xfr_tx_buf(xfr, buf, len);
+	if ( !xfr_tx_iov(xfr, iov, sizeof(iov)/sizeof(*iov)) )
+		return 0;
 	if ( !_PC_to_RDR_Escape(ccid, RFID_SLOT, xfr) )
 		return 0;
 
@@ -66,15 +65,19 @@ static int fifo_write(struct _ccid *ccid, const uint8_t *buf, size_t len)
 static int reg_read(struct _ccid *ccid, uint8_t reg, uint8_t *val)
 {
 	struct _xfr *xfr = ccid->d_xfr;
+	uint8_t *esc;
 
 	xfr_reset(xfr);
-	xfr_tx_byte(xfr, 0x20);
-	xfr_tx_byte(xfr, 0x00);
-	xfr_tx_byte(xfr, 0x00);
-	xfr_tx_byte(xfr, 0x00);
-	xfr_tx_byte(xfr, 0x01);
-	xfr_tx_byte(xfr, 0x00);
-	xfr_tx_byte(xfr, reg);
+	esc = xfr_tx_reserve(xfr, 7);
+	if ( NULL == esc )
+		return 0;
+	esc[0] = 0x20;
+	esc[1] = 0x00;
+	esc[2] = 0x00;
+	esc[3] = 0x00;
+	esc[4] = 0x01;
+	esc[5] = 0x00;
+	esc[6] = reg;
 	if ( !_PC_to_RDR_Escape(ccid, RFID_SLOT, xfr) )
 		return 0;
 
@@ -94,17 +97,21 @@ static int reg_read(struct _ccid *ccid, uint8_t reg, uint8_t *val)
 static int reg_write(struct _ccid *ccid, uint8_t reg, uint8_t val)
 {
 	struct _xfr *xfr = ccid->d_xfr;
+	uint8_t *esc;
 
 	trace(ccid, "     : writing reg 0x%x with 0x%.2x\n", reg, val);
 	xfr_reset(xfr);
-	xfr_tx_byte(xfr, 0x20);
-	xfr_tx_byte(xfr, 0x00);
-	xfr_tx_byte(xfr, 0x01);
-	xfr_tx_byte(xfr, 0x00);
-	xfr_tx_byte(xfr, 0x00);
-	xfr_tx_byte(xfr, 0x00);
-	xfr_tx_byte(xfr, reg);
-	xfr_tx_byte(xfr, val);
+	esc = xfr_tx_reserve(xfr, 8);
+	if ( NULL == esc )
+		return 0;
+	esc[0] = 0x20;
+	esc[1] = 0x00;
+	esc[2] = 0x01;
+	esc[3] = 0x00;
+	esc[4] = 0x00;
+	esc[5] = 0x00;
+	esc[6] = reg;
+	esc[7] = val;
 	if ( !_PC_to_RDR_Escape(ccid, RFID_SLOT, xfr) )
 		return 0;
 
@@ -114,6 +121,73 @@ static int reg_write(struct _ccid *ccid, uint8_t reg, uint8_t val)
 	return 1;
 }
 
+/* Register access commands may be concatenated in to a single escape, in
+ * which case the firmware executes them in order and returns the status
+ * byte followed by the value of each register read. Not all firmware does
+ * this, so it's probed for when the RF interface is brought up.
+*/
+static int reg_batch(struct _ccid *ccid, const struct _clrc632_op *op,
+			unsigned int num)
+{
+	struct _xfr *xfr = ccid->d_xfr;
+	unsigned int i, j, k, nr;
+	uint8_t *esc;
+
+	for(i = 0; i < num; i = j) {
+		xfr_reset(xfr);
+		for(nr = 0, j = i; j < num; j++) {
+			if ( op[j].op == CLRC632_OP_READ ) {
+				if ( nr + 2 > xfr->x_rxmax )
+					break;
+				esc = xfr_tx_reserve(xfr, 7);
+				if ( NULL == esc )
+					break;
+				esc[0] = 0x20;
+				esc[1] = 0x00;
+				esc[2] = 0x00;
+				esc[3] = 0x00;
+				esc[4] = 0x01;
+				esc[5] = 0x00;
+				esc[6] = op[j].reg;
+				nr++;
+			}else{
+				esc = xfr_tx_reserve(xfr, 8);
+				if ( NULL == esc )
+					break;
+				esc[0] = 0x20;
+				esc[1] = 0x00;
+				esc[2] = 0x01;
+				esc[3] = 0x00;
+				esc[4] = 0x00;
+				esc[5] = 0x00;
+				esc[6] = op[j].reg;
+				esc[7] = op[j].val;
+			}
+		}
+
+		if ( j == i )
+			return 0;
+
+		trace(ccid, "     : batch of %u register ops (%u reads)\n",
+			j - i, nr);
+		if ( !_PC_to_RDR_Escape(ccid, RFID_SLOT, xfr) )
+			return 0;
+
+		if ( !_RDR_to_PC(ccid, RFID_SLOT, xfr) )
+			return 0;
+
+		if ( xfr->x_rxlen != nr + 1 )
+			return 0;
+
+		for(nr = 1, k = i; k < j; k++) {
+			if ( op[k].op == CLRC632_OP_READ )
+				*op[k].dst = xfr->x_rxbuf[nr++];
+		}
+	}
+
+	return 1;
+}
+
 static const struct _clrc632_ops asic_ops = {
 	.fifo_read = fifo_read,
 	.fifo_write = fifo_write,
@@ -121,6 +195,26 @@ static const struct _clrc632_ops asic_ops = {
 	.reg_write = reg_write,
 };
 
+static const struct _clrc632_ops asic_batch_ops = {
+	.fifo_read = fifo_read,
+	.fifo_write = fifo_write,
+	.reg_read = reg_read,
+	.reg_write = reg_write,
+	.reg_batch = reg_batch,
+};
+
+static int probe_batch(struct _ccid *ccid)
+{
+	uint8_t cmd, fifo;
+	struct _clrc632_op op[] = {
+		{.op = CLRC632_OP_READ, .reg = RC632_REG_COMMAND, .dst = &cmd},
+		{.op = CLRC632_OP_READ, .reg = RC632_REG_FIFO_LENGTH,
+			.dst = &fifo},
+	};
+
+	return reg_batch(ccid, op, sizeof(op)/sizeof(*op));
+}
+
 static int enable_clrc632(struct _ccid *ccid)
 {
 	struct _xfr *xfr = ccid->d_xfr;
@@ -136,13 +230,22 @@ static int enable_clrc632(struct _ccid *ccid)
 
 void _omnikey_init_prox(struct _ccid *ccid)
 {
+	const struct _clrc632_ops *ops;
+
 	trace(ccid, " o Omnikey proxcard RF interface detected\n");
 	if ( !enable_clrc632(ccid) )
 		return;
 
+	if ( probe_batch(ccid) ) {
+		trace(ccid, " o Batched register access supported\n");
+		ops = &asic_batch_ops;
+	}else{
+		ops = &asic_ops;
+	}
+
 	ccid->d_rf[ccid->d_num_rf].i_idx = RFID_SLOT;
 
-	if ( !_clrc632_init(ccid->d_rf + ccid->d_num_rf, &asic_ops) )
+	if ( !_clrc632_init(ccid->d_rf + ccid->d_num_rf, ops) )
 		return;
 
 	ccid->d_num_rf++;
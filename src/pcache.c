@@ -0,0 +1,247 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Cache of the parameters a reader settled on for a given ATR, so that a
+ * card seen before can go straight to its known-good protocol and rate.
+*/
+
+#include <ccid.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ccid-internal.h"
+
+#define PCACHE_HASH_SIZE	(1 << 8)
+#define PCACHE_HASH_MASK	(PCACHE_HASH_SIZE - 1)
+#define PCACHE_MAX_ENTRIES	4096
+
+struct pcache_ent {
+	struct pcache_ent	*p_next;
+	char			*p_name;
+	uint8_t			p_atr[ATR_MAX_LEN];
+	uint8_t			p_atr_len;
+	struct _pparams		p_params;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pcache_ent *pcache[PCACHE_HASH_SIZE];
+static unsigned int num_ent;
+
+static unsigned int pcache_hash(const char *name, const uint8_t *atr,
+				size_t len)
+{
+	unsigned int h = 0;
+
+	for(; *name; name++)
+		h = (h * 31) + (uint8_t)*name;
+	for(; len; len--, atr++)
+		h = (h * 31) + *atr;
+
+	return h & PCACHE_HASH_MASK;
+}
+
+static struct pcache_ent **find(const char *name, const uint8_t *atr,
+				size_t len)
+{
+	struct pcache_ent **p;
+
+	for(p = &pcache[pcache_hash(name, atr, len)]; *p; p = &(*p)->p_next) {
+		if ( (*p)->p_atr_len == len &&
+				!memcmp((*p)->p_atr, atr, len) &&
+				!strcmp((*p)->p_name, name) )
+			break;
+	}
+
+	return p;
+}
+
+static int insert(const char *name, const uint8_t *atr, size_t len,
+			const struct _pparams *pp)
+{
+	struct pcache_ent **p, *e;
+
+	p = find(name, atr, len);
+	if ( *p ) {
+		(*p)->p_params = *pp;
+		return 1;
+	}
+
+	if ( num_ent >= PCACHE_MAX_ENTRIES )
+		return 0;
+
+	e = calloc(1, sizeof(*e));
+	if ( NULL == e )
+		return 0;
+
+	e->p_name = strdup(name);
+	if ( NULL == e->p_name ) {
+		free(e);
+		return 0;
+	}
+
+	memcpy(e->p_atr, atr, len);
+	e->p_atr_len = len;
+	e->p_params = *pp;
+	*p = e;
+	num_ent++;
+	return 1;
+}
+
+/* Only ATRs which parsed are worth remembering, else there's nothing to
+ * distinguish one card model from another.
+ */
+static int cacheable(const struct _ccid *ccid, const struct _atr *atr)
+{
+	return ccid->d_name && atr->a_valid && atr->a_len;
+}
+
+int _pcache_lookup(const struct _ccid *ccid, const struct _atr *atr,
+			struct _pparams *pp)
+{
+	struct pcache_ent *e;
+
+	if ( !cacheable(ccid, atr) )
+		return 0;
+
+	pthread_mutex_lock(&lock);
+	e = *find(ccid->d_name, atr->a_raw, atr->a_len);
+	if ( e )
+		*pp = e->p_params;
+	pthread_mutex_unlock(&lock);
+
+	return (NULL != e);
+}
+
+void _pcache_store(const struct _ccid *ccid, const struct _atr *atr,
+			const struct _pparams *pp)
+{
+	if ( !cacheable(ccid, atr) )
+		return;
+
+	pthread_mutex_lock(&lock);
+	insert(ccid->d_name, atr->a_raw, atr->a_len, pp);
+	pthread_mutex_unlock(&lock);
+}
+
+void _pcache_drop(const struct _ccid *ccid, const struct _atr *atr)
+{
+	struct pcache_ent **p, *e;
+
+	if ( !cacheable(ccid, atr) )
+		return;
+
+	pthread_mutex_lock(&lock);
+	p = find(ccid->d_name, atr->a_raw, atr->a_len);
+	e = *p;
+	if ( e ) {
+		*p = e->p_next;
+		free(e->p_name);
+		free(e);
+		num_ent--;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/** Discard every entry in the parameter cache.
+ * \ingroup g_libccid
+ */
+void libccid_param_cache_clear(void)
+{
+	struct pcache_ent *e, *tmp;
+	unsigned int i;
+
+	pthread_mutex_lock(&lock);
+	for(i = 0; i < PCACHE_HASH_SIZE; i++) {
+		for(e = pcache[i]; e; e = tmp) {
+			tmp = e->p_next;
+			free(e->p_name);
+			free(e);
+		}
+		pcache[i] = NULL;
+	}
+	num_ent = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+static int load_line(char *line, _unused void *priv)
+{
+	struct _pparams pp;
+	uint8_t atr[ATR_MAX_LEN];
+	char *tok[3];
+	unsigned int proto;
+	size_t atr_len, plen;
+
+	if ( !_split_fields(line, tok, 3) || !tok[2][0] ||
+			sscanf(line, "%u", &proto) != 1 ||
+			proto > CCID_PROTOCOL_T1 ||
+			!_unhex(tok[0], pp.p_buf, sizeof(pp.p_buf), &plen) ||
+			!plen ||
+			!_unhex(tok[1], atr, sizeof(atr), &atr_len) ||
+			!atr_len )
+		return 0;
+
+	pp.p_proto = proto;
+	pp.p_len = plen;
+	return (insert(tok[2], atr, atr_len, &pp)) ? 1 : -1;
+}
+
+/** Load entries in to the parameter cache from a file.
+ * \ingroup g_libccid
+ * @param fn Filename, as written by libccid_param_cache_save().
+ *
+ * Each line is protocol:parameters:ATR:reader name with the parameters and
+ * ATR in hex. Entries are added to those already cached, replacing any for
+ * the same ATR and reader, and lines which don't parse are reported on
+ * stderr.
+ *
+ * @return zero on failure to read the file, non-zero otherwise.
+ */
+int libccid_param_cache_load(const char *fn)
+{
+	int ret;
+
+	pthread_mutex_lock(&lock);
+	ret = _load_lines(fn, 512, load_line, NULL);
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+/** Write the parameter cache out to a file.
+ * \ingroup g_libccid
+ * @param fn Filename, which is overwritten.
+ *
+ * @return zero on failure, non-zero otherwise.
+ */
+int libccid_param_cache_save(const char *fn)
+{
+	struct pcache_ent *e;
+	unsigned int i;
+	FILE *f;
+	int ret;
+
+	f = fopen(fn, "w");
+	if ( NULL == f ) {
+		fprintf(stderr, "%s: open: %s\n", fn, strerror(errno));
+		return 0;
+	}
+
+	pthread_mutex_lock(&lock);
+	for(i = 0; i < PCACHE_HASH_SIZE; i++) {
+		for(e = pcache[i]; e; e = e->p_next) {
+			fprintf(f, "%u:", e->p_params.p_proto);
+			_hex(f, e->p_params.p_buf, e->p_params.p_len);
+			fprintf(f, ":");
+			_hex(f, e->p_atr, e->p_atr_len);
+			fprintf(f, ":%s\n", e->p_name);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	ret = !ferror(f);
+	if ( fclose(f) )
+		ret = 0;
+	return ret;
+}
@@ -0,0 +1,235 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * T=1 block protocol (ISO 7816-3) for readers which exchange at TPDU
+ * level. APDUs are chained over I-blocks no larger than IFSC and the
+ * card's chained response is reassembled. Only LRC is supported.
+*/
+
+#include <ccid.h>
+
+#include "ccid-internal.h"
+
+#define T1_NAD		0
+#define T1_PCB		1
+#define T1_LEN		2
+#define T1_INF		3
+#define T1_HDR_LEN	3
+#define T1_MAX_INF	254
+
+#define T1_I_NS		0x40
+#define T1_I_MORE	0x20
+
+#define T1_R		0x80
+#define T1_R_NR		0x10
+#define T1_R_EDC	0x01
+#define T1_R_OTHER	0x02
+
+#define T1_S		0xc0
+#define T1_S_RESP	0x20
+#define T1_S_IFS	0x01
+#define T1_S_WTX	0x03
+
+#define T1_IS_S(pcb)	(((pcb) & 0xc0) == T1_S)
+#define T1_IS_R(pcb)	(((pcb) & 0xc0) == T1_R)
+
+#define T1_MAX_RETRY	3
+
+static uint8_t lrc(const uint8_t *buf, size_t len)
+{
+	uint8_t ret;
+
+	for(ret = 0; len; len--, buf++)
+		ret ^= *buf;
+
+	return ret;
+}
+
+/* Build a block in the transmit buffer and return its length */
+static size_t mk_block(struct _t1 *t1, struct _xfr *blk, uint8_t pcb,
+			const uint8_t *inf, size_t len)
+{
+	uint8_t *buf = blk->x_txbuf;
+
+	assert(len <= T1_MAX_INF);
+	buf[T1_NAD] = t1->t_nad;
+	buf[T1_PCB] = pcb;
+	buf[T1_LEN] = len;
+	memcpy(buf + T1_INF, inf, len);
+	buf[T1_INF + len] = lrc(buf, T1_HDR_LEN + len);
+	return T1_HDR_LEN + len + 1;
+}
+
+static size_t i_block(struct _t1 *t1, struct _xfr *blk,
+			const uint8_t *inf, size_t len, int more)
+{
+	uint8_t pcb = 0;
+
+	if ( t1->t_ns )
+		pcb |= T1_I_NS;
+	if ( more )
+		pcb |= T1_I_MORE;
+	return mk_block(t1, blk, pcb, inf, len);
+}
+
+static size_t r_block(struct _t1 *t1, struct _xfr *blk, uint8_t err)
+{
+	uint8_t pcb = T1_R | err;
+
+	if ( t1->t_nr )
+		pcb |= T1_R_NR;
+	return mk_block(t1, blk, pcb, NULL, 0);
+}
+
+static int block_ok(const struct _xfr *blk)
+{
+	const uint8_t *buf = blk->x_rxbuf;
+
+	if ( blk->x_rxlen < T1_HDR_LEN + 1 )
+		return 0;
+	if ( buf[T1_LEN] != blk->x_rxlen - (T1_HDR_LEN + 1) )
+		return 0;
+	return lrc(buf, blk->x_rxlen - 1) == buf[blk->x_rxlen - 1];
+}
+
+static size_t chunk(const struct _t1 *t1, size_t len)
+{
+	return (len < t1->t_ifsc) ? len : t1->t_ifsc;
+}
+
+/* Exchange one block, the card's block is left in the receive buffer. A
+ * non-zero wtx extends the block waiting time for this exchange only.
+ */
+static int xchg(struct _cci *cci, struct _xfr *blk, size_t len, uint8_t wtx)
+{
+	struct _ccid *ccid = cci->i_parent;
+
+	blk->x_txlen = len;
+	if ( !_PC_to_RDR_XfrBlock_level(ccid, cci->i_idx, blk,
+					CCID_CHAIN_NONE, wtx) )
+		return 0;
+	if ( !_RDR_to_PC(ccid, cci->i_idx, blk) )
+		return 0;
+	_RDR_to_PC_DataBlock(ccid, blk);
+	return 1;
+}
+
+int _t1_transact(struct _cci *cci, struct _xfr *xfr)
+{
+	struct _ccid *ccid = cci->i_parent;
+	struct _t1 *t1 = &cci->i_t1;
+	struct _xfr *blk = cci->i_blk;
+	const uint8_t *rb = blk->x_rxbuf;
+	unsigned int tries = 0;
+	size_t ofs, n, len;
+	int sending = 1;
+	uint8_t pcb, wtx = 0;
+
+	if ( t1->t_crc ) {
+		_ccid_set_error(ccid, CCID_ERROR_CARD_PROTO);
+		return 0;
+	}
+
+	xfr->x_rxlen = 0;
+	ofs = 0;
+	n = chunk(t1, xfr->x_txlen);
+	len = i_block(t1, blk, xfr->x_txbuf, n, n < xfr->x_txlen);
+
+	for(;;) {
+		if ( !xchg(cci, blk, len, wtx) )
+			return 0;
+		wtx = 0;
+
+		if ( !block_ok(blk) ) {
+			if ( ++tries > T1_MAX_RETRY )
+				goto proto_err;
+			len = r_block(t1, blk, T1_R_EDC);
+			continue;
+		}
+
+		pcb = rb[T1_PCB];
+		if ( T1_IS_S(pcb) ) {
+			switch(pcb) {
+			case T1_S | T1_S_IFS:
+				if ( rb[T1_LEN] != 1 || !rb[T1_INF] ||
+						rb[T1_INF] > T1_MAX_INF )
+					goto proto_err;
+				t1->t_ifsc = rb[T1_INF];
+				len = mk_block(t1, blk, pcb | T1_S_RESP,
+						rb + T1_INF, rb[T1_LEN]);
+				continue;
+			case T1_S | T1_S_WTX:
+				if ( rb[T1_LEN] != 1 )
+					goto proto_err;
+				wtx = rb[T1_INF];
+				len = mk_block(t1, blk, pcb | T1_S_RESP,
+						rb + T1_INF, rb[T1_LEN]);
+				continue;
+			default:
+				goto proto_err;
+			}
+		}
+
+		if ( T1_IS_R(pcb) ) {
+			/* card acknowledged a chained block and wants the next */
+			if ( sending && ofs + n < xfr->x_txlen &&
+					!(pcb & T1_R_NR) != !t1->t_ns ) {
+				t1->t_ns ^= 1;
+				ofs += n;
+				n = chunk(t1, xfr->x_txlen - ofs);
+				len = i_block(t1, blk, xfr->x_txbuf + ofs, n,
+						ofs + n < xfr->x_txlen);
+				tries = 0;
+				continue;
+			}
+
+			/* otherwise, retransmit */
+			if ( ++tries > T1_MAX_RETRY )
+				goto proto_err;
+			if ( sending )
+				len = i_block(t1, blk, xfr->x_txbuf + ofs, n,
+						ofs + n < xfr->x_txlen);
+			else
+				len = r_block(t1, blk, 0);
+			continue;
+		}
+
+		/* I-block, card can't answer before we finished chaining */
+		if ( sending && ofs + n < xfr->x_txlen )
+			goto proto_err;
+
+		if ( !(pcb & T1_I_NS) != !t1->t_nr ) {
+			if ( ++tries > T1_MAX_RETRY )
+				goto proto_err;
+			len = r_block(t1, blk, T1_R_OTHER);
+			continue;
+		}
+
+		if ( sending ) {
+			t1->t_ns ^= 1;
+			sending = 0;
+		}
+		t1->t_nr ^= 1;
+		tries = 0;
+
+		if ( !_xfr_rx_append(xfr, rb + T1_INF, rb[T1_LEN]) ) {
+			_ccid_set_error(ccid, CCID_ERROR_BUS);
+			return 0;
+		}
+
+		if ( !(pcb & T1_I_MORE) )
+			break;
+
+		len = r_block(t1, blk, 0);
+	}
+
+	memcpy((void *)xfr->x_rxhdr, blk->x_rxhdr, sizeof(*xfr->x_rxhdr));
+	return 1;
+
+proto_err:
+	trace(ccid, "     : T=1 protocol error\n");
+	_ccid_set_error(ccid, CCID_ERROR_CARD_IO);
+	return 0;
+}
@@ -479,10 +479,11 @@ static PyObject *Py_cci_New(PyTypeObject *type,
 static int cp_ccid_init(struct cp_ccid *self, PyObject *args, PyObject *kwds)
 {
 	const char *trace = NULL;
+	unsigned int flags = 0;
 	struct cp_dev *cpd;
 	ccidev_t dev;
 
-	if ( !PyArg_ParseTuple(args, "O|z", &cpd, &trace) )
+	if ( !PyArg_ParseTuple(args, "O|zI", &cpd, &trace, &flags) )
 		return -1;
 
 	if ( cpd->ob_type != &dev_pytype ) {
@@ -492,7 +493,7 @@ static int cp_ccid_init(struct cp_ccid *self, PyObject *args, PyObject *kwds)
 
 	dev = get_dev(cpd);
 
-	self->dev = ccid_probe(dev, trace);
+	self->dev = ccid_probe_flags(dev, trace, flags);
 	if ( NULL == self->dev ) {
 		PyErr_SetString(PyExc_IOError, "ccid_probe() failed");
 		return -1;
@@ -576,6 +577,133 @@ static PyObject *ccid_name_get(struct cp_ccid *self)
 	return PyString_FromString(ccid_name(self->dev));
 }
 
+static const char * const stats_names[CCID_STATS_NUM_MSG] = {
+	[CCID_STATS_XFRBLOCK] = "XfrBlock",
+	[CCID_STATS_POWERON] = "IccPowerOn",
+	[CCID_STATS_POWEROFF] = "IccPowerOff",
+	[CCID_STATS_SLOTSTATUS] = "GetSlotStatus",
+	[CCID_STATS_GETPARAMS] = "GetParameters",
+	[CCID_STATS_SETPARAMS] = "SetParameters",
+	[CCID_STATS_RESETPARAMS] = "ResetParameters",
+	[CCID_STATS_ESCAPE] = "Escape",
+	[CCID_STATS_OTHER] = "Other",
+};
+
+static int dict_set_u64(PyObject *dict, const char *key, uint64_t val)
+{
+	PyObject *obj;
+	int ret;
+
+	obj = PyLong_FromUnsignedLongLong(val);
+	if ( NULL == obj )
+		return -1;
+	ret = PyDict_SetItemString(dict, key, obj);
+	Py_DECREF(obj);
+	return ret;
+}
+
+static PyObject *msg_stats_dict(const struct ccid_msg_stats *ms)
+{
+	PyObject *dict, *lat, *elem;
+	unsigned int i;
+
+	dict = PyDict_New();
+	if ( NULL == dict )
+		return NULL;
+
+	if ( dict_set_u64(dict, "count", ms->ms_count) ||
+			dict_set_u64(dict, "failed", ms->ms_failed) ||
+			dict_set_u64(dict, "tx_bytes", ms->ms_tx_bytes) ||
+			dict_set_u64(dict, "rx_bytes", ms->ms_rx_bytes) ||
+			dict_set_u64(dict, "time_ext", ms->ms_time_ext) ||
+			dict_set_u64(dict, "lat_total", ms->ms_lat_total) ||
+			dict_set_u64(dict, "lat_max", ms->ms_lat_max) )
+		goto err;
+
+	lat = PyTuple_New(CCID_STATS_NUM_LAT);
+	if ( NULL == lat )
+		goto err;
+	for(i = 0; i < CCID_STATS_NUM_LAT; i++) {
+		elem = PyLong_FromUnsignedLongLong(ms->ms_lat[i]);
+		if ( NULL == elem ) {
+			Py_DECREF(lat);
+			goto err;
+		}
+		PyTuple_SET_ITEM(lat, i, elem);
+	}
+
+	i = PyDict_SetItemString(dict, "latency", lat);
+	Py_DECREF(lat);
+	if ( i )
+		goto err;
+
+	return dict;
+err:
+	Py_DECREF(dict);
+	return NULL;
+}
+
+static PyObject *ccid_stats_get(struct cp_ccid *self)
+{
+	struct ccid_stats st;
+	PyObject *dict, *errs, *key, *val;
+	unsigned int i;
+	int ret;
+
+	ccid_get_stats(self->dev, &st);
+
+	dict = PyDict_New();
+	if ( NULL == dict )
+		return NULL;
+
+	for(i = 0; i < CCID_STATS_NUM_MSG; i++) {
+		val = msg_stats_dict(&st.st_msg[i]);
+		if ( NULL == val )
+			goto err;
+		ret = PyDict_SetItemString(dict, stats_names[i], val);
+		Py_DECREF(val);
+		if ( ret )
+			goto err;
+	}
+
+	errs = PyDict_New();
+	if ( NULL == errs )
+		goto err;
+	ret = PyDict_SetItemString(dict, "errors", errs);
+	Py_DECREF(errs);
+	if ( ret )
+		goto err;
+
+	for(i = 0; i < 256; i++) {
+		if ( !st.st_err[i] )
+			continue;
+		key = PyInt_FromLong(i);
+		val = PyLong_FromUnsignedLongLong(st.st_err[i]);
+		ret = (key && val) ? PyDict_SetItem(errs, key, val) : -1;
+		Py_XDECREF(key);
+		Py_XDECREF(val);
+		if ( ret )
+			goto err;
+	}
+
+	if ( dict_set_u64(dict, "usb_errors", st.st_usb_err) )
+		goto err;
+	if ( dict_set_u64(dict, "timeouts", st.st_timeouts) )
+		goto err;
+
+	return dict;
+err:
+	Py_DECREF(dict);
+	return NULL;
+}
+
+static PyObject *cp_reset_stats(struct cp_ccid *self, PyObject *args)
+{
+	ccid_reset_stats(self->dev);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
 static PyGetSetDef cp_ccid_attribs[] = {
 	{"interfaces", (getter)ccid_interfaces_get, NULL,
 		"Chipcard Interfaces"},
@@ -585,12 +713,16 @@ static PyGetSetDef cp_ccid_attribs[] = {
 		"Chipcard Interfaces"},
 	{"name", (getter)ccid_name_get, NULL,
 		"Chipcard Interfaces"},
+	{"stats", (getter)ccid_stats_get, NULL,
+		"Transaction statistics"},
 	{NULL, }
 };
 
 static PyMethodDef cp_ccid_methods[] = {
 	{"log",(PyCFunction)cp_log, METH_VARARGS,
 		MODNAME ".log(string) - Log some text to the tracefile"},
+	{"reset_stats",(PyCFunction)cp_reset_stats, METH_NOARGS,
+		MODNAME ".reset_stats() - Zero transaction statistics"},
 	{NULL, }
 };
 
@@ -676,6 +808,8 @@ PyMODINIT_FUNC initccid(void)
 	_INT_CONST(m, CHIPCARD_3V);
 	_INT_CONST(m, CHIPCARD_1_8V);
 
+	_INT_CONST(m, CCID_TRACE_BINARY);
+
 	_ccid_err = PyErr_NewException(MODNAME ".CCID_Error",
 					PyExc_Exception, NULL);
 	Py_INCREF(_ccid_err);
@@ -0,0 +1,472 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Replay transport. Answers commands with the responses from a binary
+ * trace, so that everything above the CCID layer can be run and timed
+ * without the device.
+*/
+
+#include <ccid.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "ccid-internal.h"
+#include "trace.h"
+
+struct replay_pend {
+	struct _ccid_cmd	*p_cmd;
+	size_t			p_rx; /* next response to deliver */
+	uint64_t		p_due;
+	uint8_t			p_seq; /* sequence number in the recording */
+};
+
+struct replay {
+	uint8_t			*r_buf;
+	const struct trace_rec	**r_rec;
+	size_t			r_nrec;
+
+	/* Commands are matched per slot, in order */
+	size_t			r_cur[CCID_MAX_SLOTS];
+	size_t			r_intr;
+	struct replay_pend	r_pend[CCID_MAX_SLOTS];
+
+	struct ccid_replay_opts	r_opts;
+};
+
+static const uint8_t *rec_data(const struct trace_rec *rec)
+{
+	return (const uint8_t *)(rec + 1);
+}
+
+static void replay_free(struct replay *r)
+{
+	if ( r ) {
+		free(r->r_rec);
+		free(r->r_buf);
+	}
+	free(r);
+}
+
+static struct replay *replay_load(const char *fn)
+{
+	const struct trace_rec *rec;
+	struct replay *r;
+	size_t len, off, n;
+	long sz;
+	FILE *f;
+
+	r = calloc(1, sizeof(*r));
+	if ( NULL == r )
+		return NULL;
+
+	f = fopen(fn, "r");
+	if ( NULL == f )
+		goto err;
+
+	if ( fseek(f, 0, SEEK_END) || (sz = ftell(f)) < 0 ||
+			fseek(f, 0, SEEK_SET) )
+		goto err_close;
+	len = sz;
+
+	r->r_buf = malloc(len);
+	if ( NULL == r->r_buf )
+		goto err_close;
+	if ( fread(r->r_buf, 1, len, f) != len )
+		goto err_close;
+	fclose(f);
+
+	if ( len < sizeof(struct trace_hdr) ||
+			!_trace_check_hdr((struct trace_hdr *)r->r_buf) ) {
+		fprintf(stderr, "%s: not a ccid binary trace\n", fn);
+		goto err;
+	}
+
+	/* index the records, a truncated one at the end is ignored */
+	for(n = 0, off = sizeof(struct trace_hdr);
+			off + sizeof(*rec) <= len; off += rec->r_size, n++) {
+		rec = (struct trace_rec *)(r->r_buf + off);
+		if ( rec->r_size < sizeof(*rec) ||
+				rec->r_len > rec->r_size - sizeof(*rec) ) {
+			fprintf(stderr, "%s: corrupt trace record\n", fn);
+			goto err;
+		}
+		if ( off + rec->r_size > len )
+			break;
+	}
+
+	r->r_rec = calloc(n, sizeof(*r->r_rec));
+	if ( n && NULL == r->r_rec )
+		goto err;
+
+	for(r->r_nrec = 0, off = sizeof(struct trace_hdr);
+			r->r_nrec < n; off += rec->r_size) {
+		rec = (struct trace_rec *)(r->r_buf + off);
+		r->r_rec[r->r_nrec++] = rec;
+	}
+
+	return r;
+
+err_close:
+	fclose(f);
+err:
+	replay_free(r);
+	return NULL;
+}
+
+static size_t find_rec(struct replay *r, size_t i, unsigned int type,
+			unsigned int slot)
+{
+	for(; i < r->r_nrec; i++) {
+		if ( r->r_rec[i]->r_type == type && r->r_rec[i]->r_slot == slot )
+			return i;
+	}
+	return r->r_nrec;
+}
+
+static size_t find_rx(struct replay *r, size_t i, unsigned int slot,
+			uint8_t seq)
+{
+	for(i = find_rec(r, i, TRACE_RX, slot); i < r->r_nrec;
+			i = find_rec(r, i + 1, TRACE_RX, slot)) {
+		if ( r->r_rec[i]->r_seq == seq )
+			break;
+	}
+	return i;
+}
+
+/* Header bytes which legitimately differ between runs: bSlot and bSeq */
+static int msg_differs(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	const size_t slot = offsetof(struct ccid_msg, bSlot);
+	const size_t seq = offsetof(struct ccid_msg, bSeq);
+	size_t i;
+
+	for(i = 0; i < len; i++) {
+		if ( i == slot || i == seq )
+			continue;
+		if ( a[i] != b[i] )
+			return 1;
+	}
+
+	return 0;
+}
+
+static uint64_t delay(struct replay *r, struct _ccid_cmd *cmd,
+			const struct trace_rec *from,
+			const struct trace_rec *to)
+{
+	uint64_t us = r->r_opts.ro_latency[cmd->c_stat];
+
+	if ( (r->r_opts.ro_flags & CCID_REPLAY_TIMING) &&
+			to->r_time > from->r_time )
+		us += to->r_time - from->r_time;
+
+	return us;
+}
+
+static int replay_send(struct _ccid *ccid, struct _ccid_cmd *cmd)
+{
+	struct replay *r = ccid->d_xport_priv;
+	struct _xfr *xfr = cmd->c_xfr;
+	const uint8_t *msg = (const uint8_t *)xfr->x_txhdr;
+	size_t len = sizeof(*xfr->x_txhdr) + xfr->x_txlen;
+	const struct trace_rec *tx;
+	struct replay_pend *p;
+	size_t i, rx;
+
+	i = find_rec(r, r->r_cur[cmd->c_slot], TRACE_TX, cmd->c_slot);
+	if ( i >= r->r_nrec ) {
+		fprintf(stderr, "*** replay: no more commands on slot %u\n",
+			cmd->c_slot);
+		goto err;
+	}
+
+	tx = r->r_rec[i];
+	r->r_cur[cmd->c_slot] = i + 1;
+
+	if ( tx->r_len < sizeof(*xfr->x_txhdr) ||
+			rec_data(tx)[0] != xfr->x_txhdr->bMessageType ) {
+		fprintf(stderr, "*** replay: slot %u diverged from recording\n",
+			cmd->c_slot);
+		goto err;
+	}
+
+	if ( tx->r_len != len || msg_differs(rec_data(tx), msg, len) ) {
+		trace(ccid, "     : replay: command differs from recording\n");
+		if ( r->r_opts.ro_flags & CCID_REPLAY_STRICT ) {
+			fprintf(stderr, "*** replay: slot %u command differs "
+				"from recording\n", cmd->c_slot);
+			goto err;
+		}
+	}
+
+	rx = find_rx(r, i + 1, cmd->c_slot, tx->r_seq);
+	if ( rx >= r->r_nrec ) {
+		fprintf(stderr, "*** replay: no response on slot %u\n",
+			cmd->c_slot);
+		goto err;
+	}
+
+	p = r->r_pend + cmd->c_slot;
+	p->p_cmd = cmd;
+	p->p_rx = rx;
+	p->p_seq = tx->r_seq;
+	p->p_due = _time_us() + delay(r, cmd, tx, r->r_rec[rx]);
+	return 1;
+
+err:
+	cmd->c_error = CCID_ERROR_BUS;
+	return 0;
+}
+
+static void sleep_until(uint64_t due)
+{
+	struct timespec ts;
+	uint64_t now;
+
+	now = _time_us();
+	if ( due <= now )
+		return;
+
+	ts.tv_sec = (due - now) / 1000000;
+	ts.tv_nsec = ((due - now) % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+}
+
+/* Hand up the next response for a command. A time extension request is
+ * followed by the next response with the same sequence number, the
+ * command is failed if the recording ends before a final response.
+ */
+static void deliver(struct _ccid *ccid, struct replay *r,
+			struct replay_pend *p)
+{
+	struct _ccid_cmd *cmd = p->p_cmd;
+	const struct trace_rec *rec = r->r_rec[p->p_rx];
+	struct ccid_msg *msg = (struct ccid_msg *)ccid->d_rxbuf;
+	size_t next, len;
+	uint8_t seq;
+
+	if ( cmd->c_state == CMD_TX )
+		_ccid_tx_done(ccid, cmd, 1);
+
+	len = rec->r_len;
+	if ( len > ccid->d_rxmax )
+		len = ccid->d_rxmax;
+	memcpy(ccid->d_rxbuf, rec_data(rec), len);
+
+	if ( len >= sizeof(*msg) &&
+			(msg->in.bStatus & CCID_STATUS_RESULT_MASK) ==
+				CCID_RESULT_TIMEOUT ) {
+		next = find_rx(r, p->p_rx + 1, cmd->c_slot, p->p_seq);
+	}else{
+		next = r->r_nrec;
+	}
+
+	if ( next < r->r_nrec ) {
+		p->p_due = _time_us() + delay(r, cmd, rec, r->r_rec[next]);
+		p->p_rx = next;
+	}else{
+		p->p_cmd = NULL;
+	}
+
+	seq = msg->bSeq = cmd->c_seq;
+	msg->bSlot = cmd->c_slot;
+	_ccid_rx_msg(ccid, len);
+
+	/* Completion may already have sent the next command on this slot */
+	if ( cmd->c_seq != seq )
+		return;
+
+	if ( p->p_cmd && cmd->c_complete )
+		p->p_cmd = NULL;
+	else if ( NULL == p->p_cmd && !cmd->c_complete )
+		_ccid_cmd_abort(ccid, cmd);
+}
+
+/* Deliver responses as they fall due, until the command completes or its
+ * deadline passes.
+ */
+static void replay_wait(struct _ccid *ccid, struct _ccid_cmd *cmd)
+{
+	struct replay *r = ccid->d_xport_priv;
+	struct replay_pend *p, *next;
+	uint64_t due, deadline;
+	unsigned int i;
+
+	while ( !__atomic_load_n(&cmd->c_complete, __ATOMIC_ACQUIRE) ) {
+		deadline = __atomic_load_n(&cmd->c_deadline, __ATOMIC_ACQUIRE);
+		if ( deadline && _time_us() >= deadline )
+			break;
+
+		_ccid_lock(ccid);
+		for(next = NULL, i = 0; i < CCID_MAX_SLOTS; i++) {
+			p = r->r_pend + i;
+			if ( NULL == p->p_cmd )
+				continue;
+			if ( NULL == next || p->p_due < next->p_due )
+				next = p;
+		}
+
+		/* don't hold the lock while sleeping, look again after */
+		if ( next && next->p_due > _time_us() ) {
+			due = next->p_due;
+			if ( deadline && deadline < due )
+				due = deadline;
+			_ccid_unlock(ccid);
+			sleep_until(due);
+			continue;
+		}
+
+		if ( next )
+			deliver(ccid, r, next);
+		_ccid_unlock(ccid);
+
+		if ( NULL == next )
+			break;
+	}
+}
+
+static int replay_wait_intr(struct _ccid *ccid)
+{
+	struct replay *r = ccid->d_xport_priv;
+	const struct trace_rec *rec;
+	size_t i;
+
+	for(i = r->r_intr; i < r->r_nrec; i++) {
+		if ( r->r_rec[i]->r_type == TRACE_INTR )
+			break;
+	}
+
+	if ( i >= r->r_nrec ) {
+		sleep_until(_time_us() + 250000);
+		return 1;
+	}
+
+	rec = r->r_rec[i];
+	r->r_intr = i + 1;
+	_ccid_intr_msg(ccid, rec_data(rec), rec->r_len);
+	return 1;
+}
+
+static void replay_cancel(struct _ccid *ccid, struct _ccid_cmd *cmd)
+{
+	struct replay *r = ccid->d_xport_priv;
+	struct replay_pend *p = r->r_pend + cmd->c_slot;
+
+	if ( p->p_cmd != cmd )
+		return;
+
+	p->p_cmd = NULL;
+	if ( cmd->c_state == CMD_TX )
+		_ccid_tx_done(ccid, cmd, 0);
+}
+
+static void replay_drain(struct _ccid *ccid)
+{
+	struct replay *r = ccid->d_xport_priv;
+	struct _ccid_cmd *cmd;
+	unsigned int i;
+
+	for(i = 0; i < CCID_MAX_SLOTS; i++) {
+		cmd = r->r_pend[i].p_cmd;
+		if ( NULL == cmd )
+			continue;
+		r->r_pend[i].p_cmd = NULL;
+		_ccid_cmd_abort(ccid, cmd);
+	}
+}
+
+static void replay_dtor(struct _ccid *ccid)
+{
+	replay_free(ccid->d_xport_priv);
+}
+
+const struct _ccid_xport _replay_xport = {
+	.send = replay_send,
+	.wait = replay_wait,
+	.cancel = replay_cancel,
+	.wait_intr = replay_wait_intr,
+	.drain = replay_drain,
+	.dtor = replay_dtor,
+};
+
+/** Open a recorded session as if it were a chip card device.
+ * \ingroup g_ccid
+ * @param fn Binary trace, as made with CCID_TRACE_BINARY.
+ * @param opts Timing and matching options, or NULL for the defaults of
+ *             no delay and tolerating differences in command payloads.
+ * @param tracefile filename to open for trace logging (or NULL).
+ * @param flags Bitmask of CCID_TRACE_* flags.
+ *
+ * Each command sent to the returned \ref ccid_t is answered with the
+ * response which was recorded for the next command on the same slot, and
+ * cci_wait_for_card() plays back recorded interrupt packets. Commands must
+ * be of the same type, in the same order, as in the recording.
+ *
+ * @return NULL on failure, valid \ref ccid_t object otherwise.
+ */
+ccid_t ccid_replay(const char *fn, const struct ccid_replay_opts *opts,
+			const char *tracefile, unsigned int flags)
+{
+	const struct trace_desc *td = NULL;
+	struct replay *r;
+	struct _ccid *ccid;
+	size_t i;
+
+	r = replay_load(fn);
+	if ( NULL == r )
+		return NULL;
+
+	if ( opts )
+		memcpy(&r->r_opts, opts, sizeof(r->r_opts));
+
+	for(i = 0; i < r->r_nrec; i++) {
+		if ( r->r_rec[i]->r_type != TRACE_DESC )
+			continue;
+		if ( r->r_rec[i]->r_len < sizeof(*td) )
+			continue;
+		td = (const struct trace_desc *)rec_data(r->r_rec[i]);
+		break;
+	}
+
+	if ( NULL == td ) {
+		fprintf(stderr, "%s: no device description in trace\n", fn);
+		replay_free(r);
+		return NULL;
+	}
+
+	ccid = _ccid_new(tracefile, flags);
+	if ( NULL == ccid ) {
+		replay_free(r);
+		return NULL;
+	}
+
+	ccid->d_xport = &_replay_xport;
+	ccid->d_xport_priv = r;
+
+	trace(ccid, "Replay CCI from %s\n", fn);
+
+	ccid->d_max_in = td->td_max_in;
+	ccid->d_max_out = td->td_max_out;
+	ccid->d_max_intr = td->td_max_intr;
+	ccid->d_name = strndup((const char *)(td + 1),
+				r->r_rec[i]->r_len - sizeof(*td));
+	if ( NULL == ccid->d_name )
+		goto err;
+
+	if ( !_ccid_fill_desc(ccid, td->td_desc, sizeof(td->td_desc)) )
+		goto err;
+
+	if ( !_ccid_start(ccid, td->td_flags) )
+		goto err;
+
+	return ccid;
+
+err:
+	ccid_close(ccid);
+	return NULL;
+}
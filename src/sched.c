@@ -0,0 +1,323 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Session scheduler. Jobs are queued in submission order and run by a pool
+ * of worker threads on whichever slot is free, or on the one slot they
+ * asked for. Each slot runs one job at a time.
+*/
+
+#include <ccid.h>
+#include <pthread.h>
+#include <list.h>
+
+#include "ccid-internal.h"
+
+#define SCHED_ANY	(~0U)
+
+struct sched_job {
+	struct list_head	j_list;
+	ccid_job_t		j_fn;
+	void			*j_priv;
+	unsigned int		j_slot; /* index in s_slot, or SCHED_ANY */
+};
+
+struct sched_slot {
+	cci_t			s_cci;
+	int			s_busy;
+};
+
+struct _ccid_sched {
+	pthread_mutex_t		s_lock;
+	pthread_cond_t		s_work; /* a job was queued */
+	pthread_cond_t		s_idle; /* a job finished */
+	struct list_head	s_queue;
+	unsigned int		s_running;
+
+	struct sched_slot	*s_slot;
+	unsigned int		s_num_slots;
+	unsigned int		s_next; /* where to look for a free slot */
+
+	pthread_t		*s_thread;
+	unsigned int		s_num_threads;
+	unsigned int		s_max_threads;
+	int			s_stop;
+};
+
+/* Next free slot after the last one handed out, so that work is spread
+ * round all readers rather than piling on to the first.
+ */
+static int find_idle(struct _ccid_sched *s, unsigned int *idx)
+{
+	unsigned int i, n;
+
+	for(i = 0; i < s->s_num_slots; i++) {
+		n = (s->s_next + i) % s->s_num_slots;
+		if ( !s->s_slot[n].s_busy ) {
+			*idx = n;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Oldest job which can run now. One waiting for a busy slot doesn't hold
+ * up those behind it. Jobs waiting for a particular slot get it as soon as
+ * it's free, ahead of jobs for any slot, or a steady stream of those could
+ * keep them waiting for ever. Once none of them can run, no free slot has
+ * one waiting.
+ */
+static struct sched_job *pick(struct _ccid_sched *s, unsigned int *idx)
+{
+	struct sched_job *j;
+
+	list_for_each_entry(j, &s->s_queue, j_list) {
+		if ( j->j_slot == SCHED_ANY ||
+				s->s_slot[j->j_slot].s_busy )
+			continue;
+		*idx = j->j_slot;
+		return j;
+	}
+
+	list_for_each_entry(j, &s->s_queue, j_list) {
+		if ( j->j_slot != SCHED_ANY )
+			continue;
+		if ( find_idle(s, idx) )
+			return j;
+		break;
+	}
+
+	return NULL;
+}
+
+static void *worker(void *priv)
+{
+	struct _ccid_sched *s = priv;
+	struct sched_job *j;
+	unsigned int idx;
+	cci_t cci;
+
+	pthread_mutex_lock(&s->s_lock);
+	for(;;) {
+		while ( NULL == (j = pick(s, &idx)) ) {
+			if ( s->s_stop )
+				goto out;
+			pthread_cond_wait(&s->s_work, &s->s_lock);
+		}
+
+		list_del(&j->j_list);
+		s->s_slot[idx].s_busy = 1;
+		s->s_next = idx + 1;
+		s->s_running++;
+		cci = s->s_slot[idx].s_cci;
+		pthread_mutex_unlock(&s->s_lock);
+
+		(*j->j_fn)(cci, j->j_priv);
+		free(j);
+
+		pthread_mutex_lock(&s->s_lock);
+		s->s_slot[idx].s_busy = 0;
+		s->s_running--;
+		if ( !s->s_running && list_empty(&s->s_queue) )
+			pthread_cond_broadcast(&s->s_idle);
+	}
+out:
+	pthread_mutex_unlock(&s->s_lock);
+	return NULL;
+}
+
+/** Create a session scheduler.
+ * \ingroup g_sched
+ * @param max_threads Most worker threads to run, or zero for one per slot.
+ *
+ * Workers are started as readers are added with ccid_sched_add(), there is
+ * no point in more of them than there are slots.
+ *
+ * @return NULL on failure, valid \ref ccid_sched_t otherwise.
+ */
+ccid_sched_t ccid_sched_new(unsigned int max_threads)
+{
+	struct _ccid_sched *s;
+
+	s = calloc(1, sizeof(*s));
+	if ( NULL == s )
+		return NULL;
+
+	pthread_mutex_init(&s->s_lock, NULL);
+	pthread_cond_init(&s->s_work, NULL);
+	pthread_cond_init(&s->s_idle, NULL);
+	INIT_LIST_HEAD(&s->s_queue);
+	s->s_max_threads = max_threads;
+	return s;
+}
+
+static int add_slot(struct _ccid_sched *s, cci_t cci)
+{
+	struct sched_slot *new;
+
+	new = realloc(s->s_slot, (s->s_num_slots + 1) * sizeof(*new));
+	if ( NULL == new )
+		return 0;
+
+	s->s_slot = new;
+	s->s_slot[s->s_num_slots].s_cci = cci;
+	s->s_slot[s->s_num_slots].s_busy = 0;
+	s->s_num_slots++;
+	return 1;
+}
+
+static int add_thread(struct _ccid_sched *s)
+{
+	pthread_t *new;
+
+	new = realloc(s->s_thread, (s->s_num_threads + 1) * sizeof(*new));
+	if ( NULL == new )
+		return 0;
+
+	s->s_thread = new;
+	if ( pthread_create(s->s_thread + s->s_num_threads, NULL, worker, s) )
+		return 0;
+
+	s->s_num_threads++;
+	return 1;
+}
+
+/** Hand the slots and RF fields of a reader to a scheduler.
+ * \ingroup g_sched
+ * @param s \ref ccid_sched_t to add to.
+ * @param ccid \ref ccid_t whose slots jobs may run on.
+ *
+ * Jobs may be dispatched to the new slots straight away. The reader is not
+ * owned by the scheduler and must outlive it.
+ *
+ * @return zero on failure, in which case some of the slots may have been
+ * added.
+ */
+int ccid_sched_add(ccid_sched_t s, ccid_t ccid)
+{
+	unsigned int i, want;
+	int ret = 1;
+
+	pthread_mutex_lock(&s->s_lock);
+
+	for(i = 0; ret && i < ccid_num_slots(ccid); i++)
+		ret = add_slot(s, ccid_get_slot(ccid, i));
+	for(i = 0; ret && i < ccid_num_fields(ccid); i++)
+		ret = add_slot(s, ccid_get_field(ccid, i));
+
+	want = s->s_num_slots;
+	if ( s->s_max_threads && want > s->s_max_threads )
+		want = s->s_max_threads;
+	while ( ret && s->s_num_threads < want )
+		ret = add_thread(s);
+
+	/* there may be jobs which were waiting for a slot */
+	pthread_cond_broadcast(&s->s_work);
+	pthread_mutex_unlock(&s->s_lock);
+	return ret;
+}
+
+/** Queue a job.
+ * \ingroup g_sched
+ * @param s \ref ccid_sched_t to queue the job on.
+ * @param cci Slot to run the job on, or NULL for any.
+ * @param fn Function to run.
+ * @param priv Passed to fn.
+ *
+ * Jobs start in the order they were submitted, except that one waiting for
+ * a busy slot lets those behind it go first, and that when a slot comes
+ * free the jobs asking for it go before those for any slot. A job for any
+ * slot goes to the next free one after the last handed out, whether or not
+ * it has a card.
+ * Jobs run on worker threads and may submit further jobs, for instance on
+ * the same card, but must not call ccid_sched_wait().
+ *
+ * @return zero on failure, including when cci doesn't belong to a reader
+ * added to the scheduler.
+ */
+int ccid_sched_submit(ccid_sched_t s, cci_t cci, ccid_job_t fn, void *priv)
+{
+	struct sched_job *j;
+	unsigned int i;
+
+	j = calloc(1, sizeof(*j));
+	if ( NULL == j )
+		return 0;
+
+	j->j_fn = fn;
+	j->j_priv = priv;
+	j->j_slot = SCHED_ANY;
+
+	pthread_mutex_lock(&s->s_lock);
+	if ( cci ) {
+		for(i = 0; i < s->s_num_slots; i++) {
+			if ( s->s_slot[i].s_cci == cci )
+				break;
+		}
+		if ( i >= s->s_num_slots ) {
+			pthread_mutex_unlock(&s->s_lock);
+			free(j);
+			return 0;
+		}
+		j->j_slot = i;
+	}
+
+	list_add_tail(&j->j_list, &s->s_queue);
+	pthread_cond_signal(&s->s_work);
+	pthread_mutex_unlock(&s->s_lock);
+	return 1;
+}
+
+/** Wait until every queued job has run.
+ * \ingroup g_sched
+ * @param s \ref ccid_sched_t to wait for.
+ *
+ * Includes jobs submitted by other jobs in the meantime. Never returns if
+ * jobs are queued but no reader has been added.
+ */
+void ccid_sched_wait(ccid_sched_t s)
+{
+	pthread_mutex_lock(&s->s_lock);
+	while ( s->s_running || !list_empty(&s->s_queue) )
+		pthread_cond_wait(&s->s_idle, &s->s_lock);
+	pthread_mutex_unlock(&s->s_lock);
+}
+
+/** Wait for all jobs to run then stop the workers and free a scheduler.
+ * \ingroup g_sched
+ * @param s \ref ccid_sched_t to free, may be NULL.
+ *
+ * The readers which were added are left open.
+ */
+void ccid_sched_free(ccid_sched_t s)
+{
+	struct sched_job *j, *tmp;
+	unsigned int i;
+
+	if ( NULL == s )
+		return;
+
+	if ( s->s_num_slots )
+		ccid_sched_wait(s);
+
+	pthread_mutex_lock(&s->s_lock);
+	s->s_stop = 1;
+	pthread_cond_broadcast(&s->s_work);
+	pthread_mutex_unlock(&s->s_lock);
+
+	for(i = 0; i < s->s_num_threads; i++)
+		pthread_join(s->s_thread[i], NULL);
+
+	/* anything left over had nowhere to run */
+	list_for_each_entry_safe(j, tmp, &s->s_queue, j_list)
+		free(j);
+
+	pthread_cond_destroy(&s->s_idle);
+	pthread_cond_destroy(&s->s_work);
+	pthread_mutex_destroy(&s->s_lock);
+	free(s->s_thread);
+	free(s->s_slot);
+	free(s);
+}
@@ -142,6 +142,7 @@ struct _sms {
 struct _sim {
 	cci_t	s_cc;
 	xfr_t		s_xfr;
+	unsigned int	s_flags; /* callers cci flags, restored on free */
 	uint16_t	s_df;
 	uint16_t	s_ef;
 	uint8_t		s_reclen;
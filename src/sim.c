@@ -320,8 +320,10 @@ sim_t sim_new(cci_t cc)
 		goto err;
 
 	s->s_cc = cc;
+	s->s_flags = cci_flags(cc);
+	cci_set_flags(cc, s->s_flags | CCI_AUTO_RESPONSE);
 
-	s->s_xfr = xfr_alloc(502, 502);
+	s->s_xfr = xfr_pool_get(502, 502);
 	if ( NULL == s->s_xfr )
 		goto err_free;
 
@@ -341,8 +343,9 @@ sim_t sim_new(cci_t cc)
 	return s;
 
 err_free_xfr:
-	xfr_free(s->s_xfr);
+	xfr_pool_put(s->s_xfr);
 err_free:
+	cci_set_flags(cc, s->s_flags);
 	free(s);
 err:
 	return NULL;
@@ -352,9 +355,11 @@ void sim_free(sim_t s)
 {
 	if ( s ) {
 		if ( s->s_xfr )
-			xfr_free(s->s_xfr);
-		if ( s->s_cc )
+			xfr_pool_put(s->s_xfr);
+		if ( s->s_cc ) {
 			cci_power_off(s->s_cc);
+			cci_set_flags(s->s_cc, s->s_flags);
+		}
 	}
 	free(s);
 }
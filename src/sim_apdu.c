@@ -7,60 +7,51 @@
 #include <ccid.h>
 #include "sim-internal.h"
 
-static int do_select(struct _sim * s, uint16_t id)
+/* Reset the transmit buffer and lay out a command header in place */
+static uint8_t *apdu_hdr(struct _sim *s, uint8_t ins,
+				uint8_t p1, uint8_t p2, uint8_t p3,
+				size_t dlen)
 {
+	uint8_t *apdu;
+
 	xfr_reset(s->s_xfr);
-	xfr_tx_byte(s->s_xfr, SIM_CLA);
-	xfr_tx_byte(s->s_xfr, SIM_INS_SELECT);
-	xfr_tx_byte(s->s_xfr, 0); /* p1 */
-	xfr_tx_byte(s->s_xfr, 0); /* p2 */
-	xfr_tx_byte(s->s_xfr, 2); /* lc */
-	xfr_tx_byte(s->s_xfr, (id >> 8));
-	xfr_tx_byte(s->s_xfr, (id & 0xff));
-	return cci_transact(s->s_cc, s->s_xfr);
+	apdu = xfr_tx_reserve(s->s_xfr, 5 + dlen);
+	if ( NULL == apdu )
+		return NULL;
+
+	apdu[0] = SIM_CLA;
+	apdu[1] = ins;
+	apdu[2] = p1;
+	apdu[3] = p2;
+	apdu[4] = p3; /* lc or le */
+	return apdu + 5;
 }
 
-static int do_get_response(struct _sim * s, uint8_t le)
+static int do_select(struct _sim * s, uint16_t id)
 {
-	xfr_reset(s->s_xfr);
-	xfr_tx_byte(s->s_xfr, SIM_CLA);
-	xfr_tx_byte(s->s_xfr, SIM_INS_GET_RESPONSE);
-	xfr_tx_byte(s->s_xfr, 0); /* p1 */
-	xfr_tx_byte(s->s_xfr, 0); /* p2 */
-	xfr_tx_byte(s->s_xfr, le);
+	uint8_t *data;
+
+	data = apdu_hdr(s, SIM_INS_SELECT, 0, 0, 2, 2);
+	if ( NULL == data )
+		return 0;
+	data[0] = (id >> 8);
+	data[1] = (id & 0xff);
 	return cci_transact(s->s_cc, s->s_xfr);
 }
 
+/* The 9Fxx and GET RESPONSE is done for us by CCI_AUTO_RESPONSE */
 int _apdu_select(struct _sim *s, uint16_t id)
 {
-	uint8_t sw1, sw2;
-
 	if ( !do_select(s, id) )
 		return 0;
-
-	sw1 = xfr_rx_sw1(s->s_xfr);
-	if ( sw1 != SIM_SW1_SHORT )
-		return 0;
-
-	sw2 = xfr_rx_sw2(s->s_xfr);
-	if ( !do_get_response(s, sw2) )
-		return 0;
-
-	sw1 = xfr_rx_sw1(s->s_xfr);
-	if ( sw1 != SIM_SW1_SUCCESS )
-		return 0;
-
-	return 1;
+	return ( xfr_rx_sw1(s->s_xfr) == SIM_SW1_SUCCESS );
 }
 
 int _apdu_read_binary(struct _sim *s, uint16_t ofs, uint8_t len)
 {
-	xfr_reset(s->s_xfr);
-	xfr_tx_byte(s->s_xfr, SIM_CLA);
-	xfr_tx_byte(s->s_xfr, SIM_INS_READ_BINARY);
-	xfr_tx_byte(s->s_xfr, ofs >> 8); /* p1 */
-	xfr_tx_byte(s->s_xfr, ofs & 0xff); /* p2 */
-	xfr_tx_byte(s->s_xfr, len);
+	if ( NULL == apdu_hdr(s, SIM_INS_READ_BINARY,
+				ofs >> 8, ofs & 0xff, len, 0) )
+		return 0;
 	if ( !cci_transact(s->s_cc, s->s_xfr) )
 		return 0;
 	return ( xfr_rx_sw1(s->s_xfr) == 0x90 );
@@ -68,12 +59,8 @@ int _apdu_read_binary(struct _sim *s, uint16_t ofs, uint8_t len)
 
 int _apdu_read_record(struct _sim *s, uint8_t rec, uint8_t len)
 {
-	xfr_reset(s->s_xfr);
-	xfr_tx_byte(s->s_xfr, SIM_CLA);
-	xfr_tx_byte(s->s_xfr, SIM_INS_READ_RECORD);
-	xfr_tx_byte(s->s_xfr, rec);
-	xfr_tx_byte(s->s_xfr, 0x4);
-	xfr_tx_byte(s->s_xfr, len);
+	if ( NULL == apdu_hdr(s, SIM_INS_READ_RECORD, rec, 0x4, len, 0) )
+		return 0;
 	if ( !cci_transact(s->s_cc, s->s_xfr) )
 		return 0;
 	return ( xfr_rx_sw1(s->s_xfr) == 0x90 );
@@ -0,0 +1,415 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Binary trace. Records are appended to a lock-free ring buffer from
+ * whichever thread is running the event loop and written to disk by a
+ * background thread, so tracing costs a memcpy rather than formatted I/O.
+ * The decoder renders a trace file in the same format as a text trace.
+*/
+
+#include <ccid.h>
+
+#include <stdarg.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ccid-internal.h"
+#include "trace.h"
+
+#define TRACE_RING_SIZE		(1U << 20)
+#define TRACE_FLUSH_NS		20000000L
+#define TRACE_TEXT_MAX		256
+
+#define REC_ALIGN(x)		(((x) + 7U) & ~(size_t)7U)
+
+struct _trace {
+	uint8_t		*t_ring;
+	uint64_t	t_head; /* next byte to reserve, any producer */
+	uint64_t	t_tail; /* next byte to write out, flusher only */
+	uint64_t	t_drops;
+	uint64_t	t_drops_written;
+	int		t_fd;
+	int		t_stop;
+	pthread_t	t_thread;
+};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *ptr = buf;
+	ssize_t ret;
+
+	while ( len ) {
+		ret = write(fd, ptr, len);
+		if ( ret < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			return 0;
+		}
+		ptr += ret;
+		len -= ret;
+	}
+
+	return 1;
+}
+
+static void write_drops(struct _trace *t)
+{
+	struct {
+		struct trace_rec rec;
+		uint64_t count;
+	} d;
+	uint64_t drops;
+
+	drops = __atomic_load_n(&t->t_drops, __ATOMIC_RELAXED);
+	if ( drops == t->t_drops_written )
+		return;
+
+	memset(&d, 0, sizeof(d));
+	d.rec.r_size = sizeof(d);
+	d.rec.r_type = TRACE_DROP;
+	d.rec.r_time = _time_us();
+	d.rec.r_len = sizeof(d.count);
+	d.count = drops - t->t_drops_written;
+	write_all(t->t_fd, &d, sizeof(d));
+
+	t->t_drops_written = drops;
+}
+
+/* Write out committed records from the tail. Consumed space is zeroed so
+ * that r_size reads as zero in any record which is reserved but not yet
+ * committed. Stops at the first uncommitted record.
+ */
+static void ring_flush(struct _trace *t)
+{
+	struct trace_rec *r;
+	uint64_t head, tail;
+	size_t off, len;
+	uint32_t sz = 0;
+
+	head = __atomic_load_n(&t->t_head, __ATOMIC_ACQUIRE);
+	tail = t->t_tail;
+
+	while ( tail != head ) {
+		off = tail & (TRACE_RING_SIZE - 1);
+
+		for(len = 0; tail + len != head &&
+				off + len < TRACE_RING_SIZE; len += sz) {
+			r = (struct trace_rec *)(t->t_ring + off + len);
+			sz = __atomic_load_n(&r->r_size, __ATOMIC_ACQUIRE);
+			if ( !sz || r->r_type == TRACE_PAD )
+				break;
+		}
+
+		if ( len ) {
+			write_all(t->t_fd, t->t_ring + off, len);
+		}else if ( sz ) {
+			/* skip the filler at the end of the ring */
+			len = sz;
+		}else{
+			break;
+		}
+
+		memset(t->t_ring + off, 0, len);
+		tail += len;
+		__atomic_store_n(&t->t_tail, tail, __ATOMIC_RELEASE);
+	}
+
+	write_drops(t);
+}
+
+static void *flush_thread(void *priv)
+{
+	struct _trace *t = priv;
+	struct timespec ts = {.tv_sec = 0, .tv_nsec = TRACE_FLUSH_NS};
+
+	while ( !__atomic_load_n(&t->t_stop, __ATOMIC_ACQUIRE) ) {
+		ring_flush(t);
+		nanosleep(&ts, NULL);
+	}
+
+	ring_flush(t);
+	return NULL;
+}
+
+/* Reserve contiguous space for a record, if the record would straddle the
+ * end of the ring then a filler record takes up the remainder and the
+ * record starts at the beginning.
+ */
+static struct trace_rec *ring_reserve(struct _trace *t, size_t need)
+{
+	struct trace_rec *r;
+	uint64_t head, tail;
+	size_t off, gap;
+
+	head = __atomic_load_n(&t->t_head, __ATOMIC_RELAXED);
+	do {
+		tail = __atomic_load_n(&t->t_tail, __ATOMIC_ACQUIRE);
+		off = head & (TRACE_RING_SIZE - 1);
+		gap = (off + need > TRACE_RING_SIZE) ? TRACE_RING_SIZE - off : 0;
+		if ( head + gap + need - tail > TRACE_RING_SIZE ) {
+			__atomic_add_fetch(&t->t_drops, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+	}while( !__atomic_compare_exchange_n(&t->t_head, &head,
+						head + gap + need, 1,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED) );
+
+	if ( gap ) {
+		r = (struct trace_rec *)(t->t_ring + off);
+		r->r_type = TRACE_PAD;
+		__atomic_store_n(&r->r_size, gap, __ATOMIC_RELEASE);
+		off = 0;
+	}
+
+	return (struct trace_rec *)(t->t_ring + off);
+}
+
+void _trace_rec(struct _trace *t, unsigned int type,
+		unsigned int slot, unsigned int seq,
+		const void *buf, size_t len)
+{
+	struct trace_rec *r;
+	size_t need;
+
+	need = REC_ALIGN(sizeof(*r) + len);
+	if ( need > TRACE_RING_SIZE / 4 ) {
+		__atomic_add_fetch(&t->t_drops, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	r = ring_reserve(t, need);
+	if ( NULL == r )
+		return;
+
+	r->r_type = type;
+	r->r_slot = slot;
+	r->r_seq = seq;
+	r->r_time = _time_us();
+	r->r_len = len;
+	memcpy(r + 1, buf, len);
+
+	__atomic_store_n(&r->r_size, need, __ATOMIC_RELEASE);
+}
+
+void _trace_vprintf(struct _trace *t, const char *fmt, va_list va)
+{
+	char buf[TRACE_TEXT_MAX];
+	int len;
+
+	len = vsnprintf(buf, sizeof(buf), fmt, va);
+	if ( len < 0 )
+		return;
+	if ( (size_t)len >= sizeof(buf) )
+		len = sizeof(buf) - 1;
+
+	_trace_rec(t, TRACE_TEXT, 0, 0, buf, len);
+}
+
+void _trace_printf(struct _trace *t, const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	_trace_vprintf(t, fmt, va);
+	va_end(va);
+}
+
+struct _trace *_trace_open(const char *fn)
+{
+	struct _trace *t;
+	struct trace_hdr hdr;
+
+	t = calloc(1, sizeof(*t));
+	if ( NULL == t )
+		goto out;
+
+	t->t_ring = calloc(1, TRACE_RING_SIZE);
+	if ( NULL == t->t_ring )
+		goto out_free;
+
+	if ( !strcmp("-", fn) )
+		t->t_fd = dup(STDOUT_FILENO);
+	else
+		t->t_fd = open(fn, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if ( t->t_fd < 0 )
+		goto out_free_ring;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.h_magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	hdr.h_endian = TRACE_ENDIAN;
+	hdr.h_version = TRACE_VERSION;
+	if ( !write_all(t->t_fd, &hdr, sizeof(hdr)) )
+		goto out_close;
+
+	if ( pthread_create(&t->t_thread, NULL, flush_thread, t) )
+		goto out_close;
+
+	return t;
+
+out_close:
+	close(t->t_fd);
+out_free_ring:
+	free(t->t_ring);
+out_free:
+	free(t);
+	t = NULL;
+out:
+	return t;
+}
+
+void _trace_close(struct _trace *t)
+{
+	if ( NULL == t )
+		return;
+
+	__atomic_store_n(&t->t_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(t->t_thread, NULL);
+
+	close(t->t_fd);
+	free(t->t_ring);
+	free(t);
+}
+
+int _trace_check_hdr(const struct trace_hdr *hdr)
+{
+	return !memcmp(hdr->h_magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) &&
+		hdr->h_endian == TRACE_ENDIAN &&
+		hdr->h_version == TRACE_VERSION;
+}
+
+static void render(struct _ccid *ccid, const struct trace_rec *rec,
+			const uint8_t *buf, uint64_t start, unsigned int flags)
+{
+	FILE *f = ccid->d_tf;
+	uint64_t rel, cnt;
+
+	if ( flags & CCID_DECODE_TIMESTAMPS ) {
+		rel = rec->r_time - start;
+		fprintf(f, "[%"PRIu64".%06"PRIu64"]\n",
+			rel / 1000000, rel % 1000000);
+	}
+
+	switch(rec->r_type) {
+	case TRACE_TX:
+		_ccid_render_tx(ccid, buf, rec->r_len);
+		break;
+	case TRACE_RX:
+		_ccid_render_rx(ccid, buf, rec->r_len);
+		break;
+	case TRACE_INTR:
+		fprintf(f, " Intr: %"PRIu32" byte interrupt packet\n",
+			rec->r_len);
+		_hex_dumpf(f, buf, rec->r_len, 16);
+		break;
+	case TRACE_TEXT:
+		fwrite(buf, rec->r_len, 1, f);
+		break;
+	case TRACE_DESC:
+		_ccid_render_desc(ccid, buf, rec->r_len);
+		break;
+	case TRACE_DROP:
+		if ( rec->r_len < sizeof(cnt) )
+			break;
+		memcpy(&cnt, buf, sizeof(cnt));
+		fprintf(f, "*** %"PRIu64" trace records dropped\n", cnt);
+		break;
+	default:
+		fprintf(f, "*** unknown trace record type %u\n", rec->r_type);
+		break;
+	}
+}
+
+/** Render a binary trace file as text.
+ * \ingroup g_libccid
+ * @param fn Filename of a trace made with CCID_TRACE_BINARY, or "-" for
+ *           standard input.
+ * @param out Stream to write the human readable trace to.
+ * @param flags Bitmask of CCID_DECODE_* flags.
+ *
+ * The output is the same as would have been produced by a text trace of
+ * the same session. A record truncated at the end of the file, as may be
+ * left behind by a crashed process, is reported and otherwise ignored.
+ *
+ * @return zero on failure, non-zero on success.
+ */
+int ccid_trace_decode(const char *fn, FILE *out, unsigned int flags)
+{
+	struct trace_hdr hdr;
+	struct trace_rec rec;
+	struct _ccid *ccid;
+	uint8_t *buf = NULL, *nbuf;
+	size_t bufsz = 0, plen;
+	uint64_t start = 0;
+	unsigned int i;
+	int ret = 0;
+	FILE *f;
+
+	if ( !strcmp("-", fn) )
+		f = stdin;
+	else
+		f = fopen(fn, "r");
+	if ( NULL == f )
+		goto out;
+
+	if ( fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+			!_trace_check_hdr(&hdr) ) {
+		fprintf(stderr, "%s: not a ccid binary trace\n", fn);
+		goto out_close;
+	}
+
+	/* Scratch device for the text trace code to render in to */
+	ccid = calloc(1, sizeof(*ccid));
+	if ( NULL == ccid )
+		goto out_close;
+	ccid->d_tf = out;
+	ccid->d_num_slots = CCID_MAX_SLOTS;
+	for(i = 0; i < CCID_MAX_SLOTS; i++) {
+		ccid->d_slot[i].i_parent = ccid;
+		ccid->d_slot[i].i_idx = i;
+	}
+
+	while ( fread(&rec, sizeof(rec), 1, f) == 1 ) {
+		if ( rec.r_size < sizeof(rec) ||
+				rec.r_len > rec.r_size - sizeof(rec) ) {
+			fprintf(stderr, "%s: corrupt trace record\n", fn);
+			goto out_free;
+		}
+
+		plen = rec.r_size - sizeof(rec);
+		if ( plen > bufsz ) {
+			nbuf = realloc(buf, plen);
+			if ( NULL == nbuf )
+				goto out_free;
+			buf = nbuf;
+			bufsz = plen;
+		}
+
+		if ( plen && fread(buf, plen, 1, f) != 1 ) {
+			fprintf(out, "*** truncated trace record\n");
+			break;
+		}
+
+		if ( !start )
+			start = rec.r_time;
+
+		render(ccid, &rec, buf, start, flags);
+	}
+
+	ret = 1;
+
+out_free:
+	free(buf);
+	free(ccid);
+out_close:
+	if ( f != stdin )
+		fclose(f);
+out:
+	return ret;
+}
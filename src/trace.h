@@ -0,0 +1,74 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+*/
+#ifndef _CCID_TRACE_H
+#define _CCID_TRACE_H
+
+#include <stdarg.h>
+
+/* Binary trace file format. A file header followed by a stream of records,
+ * all in host byte order. Records are padded to a multiple of 8 bytes.
+ */
+#define TRACE_MAGIC		"CCIDTRC"
+#define TRACE_ENDIAN		0x01020304
+#define TRACE_VERSION		1
+struct trace_hdr {
+	uint8_t		h_magic[8];
+	uint32_t	h_endian;
+	uint32_t	h_version;
+};
+
+#define TRACE_PAD	0 /* ring buffer filler, never written to disk */
+#define TRACE_TX	1 /* PC_to_RDR message, including header */
+#define TRACE_RX	2 /* RDR_to_PC message, including header */
+#define TRACE_INTR	3 /* interrupt endpoint packet */
+#define TRACE_TEXT	4 /* ccid_log() message */
+#define TRACE_DROP	5 /* uint64_t count of records lost to overflow */
+#define TRACE_DESC	6 /* struct trace_desc */
+struct trace_rec {
+	/* total record size, zero in the ring until the record is committed */
+	uint32_t	r_size;
+	uint8_t		r_type;
+	uint8_t		r_slot;
+	uint8_t		r_seq;
+	uint8_t		_pad0;
+	uint64_t	r_time;
+	uint32_t	r_len;
+	uint32_t	_pad1;
+};
+
+/* Device description, enough to replay a trace without the device. The
+ * CCID class descriptor is as it was on the wire, ie. little endian. It is
+ * followed by the NUL terminated device name.
+ */
+struct trace_desc {
+	uint16_t	td_max_in;
+	uint16_t	td_max_out;
+	uint16_t	td_max_intr;
+	uint16_t	td_flags;
+	uint8_t		td_desc[sizeof(struct ccid_desc)];
+};
+
+struct _trace;
+
+_private int _trace_check_hdr(const struct trace_hdr *hdr);
+
+_private struct _trace *_trace_open(const char *fn);
+_private void _trace_close(struct _trace *t);
+_private void _trace_rec(struct _trace *t, unsigned int type,
+			unsigned int slot, unsigned int seq,
+			const void *buf, size_t len);
+_private void _trace_vprintf(struct _trace *t, const char *fmt, va_list va);
+_private void _trace_printf(struct _trace *t, const char *fmt, ...)
+			_printf(2, 3);
+
+_private void _ccid_render_tx(struct _ccid *ccid,
+				const uint8_t *buf, size_t len);
+_private void _ccid_render_rx(struct _ccid *ccid,
+				const uint8_t *buf, size_t len);
+_private void _ccid_render_desc(struct _ccid *ccid,
+				const uint8_t *buf, size_t len);
+
+#endif /* _CCID_TRACE_H */
@@ -7,6 +7,8 @@
 #include "ccid-internal.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <time.h>
 
 void _hex_dumpf(FILE *f, const uint8_t *tmp, size_t len, size_t llen)
 {
@@ -53,3 +55,102 @@ void hex_dump(const uint8_t *ptr, size_t len, size_t llen)
 {
 	_hex_dumpf(stdout, ptr, len, llen);
 }
+
+/* Decode a string of hex byte pairs, failing if it's odd length, has
+ * anything other than hex digits or is more than max bytes.
+ */
+int _unhex(const char *str, uint8_t *buf, size_t max, size_t *len)
+{
+	unsigned int b;
+	size_t i;
+
+	for(i = 0; str[0] && str[1]; i++, str += 2) {
+		if ( i >= max || !isxdigit((uint8_t)str[0]) ||
+				!isxdigit((uint8_t)str[1]) )
+			return 0;
+		sscanf(str, "%2x", &b);
+		buf[i] = b;
+	}
+
+	*len = i;
+	return !*str;
+}
+
+void _hex(FILE *f, const uint8_t *buf, size_t len)
+{
+	for(; len; len--, buf++)
+		fprintf(f, "%.2x", *buf);
+}
+
+/* Split off num colon separated fields following the first one, which is
+ * left at the start of str.
+ */
+int _split_fields(char *str, char **tok, unsigned int num)
+{
+	unsigned int i;
+
+	for(i = 0; i < num; i++) {
+		tok[i] = strchr((i) ? tok[i - 1] : str, ':');
+		if ( NULL == tok[i] )
+			return 0;
+		*tok[i]++ = '\0';
+	}
+
+	return 1;
+}
+
+/* Feed the lines of a cache file, less comments, blank lines and the
+ * newline, to cb. It returns zero for a line it couldn't make sense of, or
+ * less than zero to stop reading.
+ */
+int _load_lines(const char *fn, size_t max,
+		int(*cb)(char *line, void *priv), void *priv)
+{
+	char *buf, *lf;
+	unsigned int line;
+	FILE *f;
+	int rc;
+
+	buf = malloc(max);
+	if ( NULL == buf )
+		return 0;
+
+	f = fopen(fn, "r");
+	if ( NULL == f ) {
+		fprintf(stderr, "%s: open: %s\n", fn, strerror(errno));
+		free(buf);
+		return 0;
+	}
+
+	for(line = 1; fgets(buf, max, f); line++) {
+		if ( buf[0] == '#' || buf[0] == '\r' || buf[0] == '\n' )
+			continue;
+
+		lf = strchr(buf, '\n');
+		if ( NULL == lf ) {
+			fprintf(stderr,
+				"%s:%u: line exceeded max line length (%zu)\n",
+				fn, line, max);
+			break;
+		}
+		*lf = '\0';
+
+		rc = (*cb)(buf, priv);
+		if ( rc < 0 )
+			break;
+		if ( !rc )
+			fprintf(stderr, "%s:%u: bad entry\n", fn, line);
+	}
+
+	fclose(f);
+	free(buf);
+	return 1;
+}
+
+uint64_t _time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,56 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+*/
+#ifndef _VCARD_INTERNAL_H
+#define _VCARD_INTERNAL_H
+
+#define VCARD_MAX_ATR		33
+#define VCARD_MAX_RSP		256
+
+/* Response APDU being built by a card, data followed by SW1 SW2 */
+struct _vcard_rsp {
+	uint8_t		*r_buf;
+	size_t		r_len;
+	size_t		r_max;
+};
+
+struct _vcard_ops {
+	void (*reset)(struct _vcard *card);
+	/* apdu is at least 4 bytes, with P3 absent if it's exactly 4 */
+	void (*apdu)(struct _vcard *card, const uint8_t *apdu, size_t len,
+			struct _vcard_rsp *rsp);
+	void (*dtor)(struct _vcard *card);
+};
+
+struct _vcard {
+	const struct _vcard_ops *v_ops;
+	int		v_inserted;
+	uint8_t		v_atr[VCARD_MAX_ATR];
+	size_t		v_atr_len;
+
+	/* Outgoing data held for GET RESPONSE by the previous command
+	 * (v_rsp_len) or by the current one (v_rsp_next)
+	 */
+	uint8_t		v_rsp[VCARD_MAX_RSP];
+	size_t		v_rsp_len;
+	size_t		v_rsp_next;
+	uint8_t		v_rsp_sw1;
+};
+
+_private void _vcard_init(struct _vcard *card, const struct _vcard_ops *ops,
+				const uint8_t *atr, size_t atr_len);
+_private void _vcard_reset(struct _vcard *card);
+_private void _vcard_apdu(struct _vcard *card, const uint8_t *apdu,
+				size_t len, struct _vcard_rsp *rsp);
+
+_private void _vcard_sw(struct _vcard_rsp *rsp, uint16_t sw);
+_private void _vcard_data(struct _vcard_rsp *rsp, const uint8_t *data,
+				size_t len, uint16_t sw);
+_private void _vcard_hold(struct _vcard *card, struct _vcard_rsp *rsp,
+				const uint8_t *data, size_t len, uint8_t sw1);
+_private int _vcard_get_response(struct _vcard *card, uint8_t le,
+				struct _vcard_rsp *rsp);
+
+#endif /* _VCARD_INTERNAL_H */
@@ -0,0 +1,135 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Functionality common to all virtual chip cards.
+*/
+
+#include <ccid.h>
+#include <vcard.h>
+
+#include "ccid-internal.h"
+#include "vcard-internal.h"
+
+void _vcard_init(struct _vcard *card, const struct _vcard_ops *ops,
+			const uint8_t *atr, size_t atr_len)
+{
+	card->v_ops = ops;
+	vcard_set_atr(card, atr, atr_len);
+}
+
+void _vcard_reset(struct _vcard *card)
+{
+	card->v_rsp_len = 0;
+	card->v_rsp_next = 0;
+	if ( card->v_ops->reset )
+		(*card->v_ops->reset)(card);
+}
+
+void _vcard_apdu(struct _vcard *card, const uint8_t *apdu, size_t len,
+			struct _vcard_rsp *rsp)
+{
+	/* held response data is only good for the very next command */
+	card->v_rsp_len = card->v_rsp_next;
+	card->v_rsp_next = 0;
+
+	/* a case 1 command may leave out P3, handlers check for that */
+	if ( len < 4 ) {
+		_vcard_sw(rsp, 0x6700);
+		return;
+	}
+
+	(*card->v_ops->apdu)(card, apdu, len, rsp);
+}
+
+void _vcard_sw(struct _vcard_rsp *rsp, uint16_t sw)
+{
+	rsp->r_buf[rsp->r_len++] = sw >> 8;
+	rsp->r_buf[rsp->r_len++] = sw & 0xff;
+}
+
+void _vcard_data(struct _vcard_rsp *rsp, const uint8_t *data, size_t len,
+			uint16_t sw)
+{
+	assert(rsp->r_len + len + 2 <= rsp->r_max);
+	memcpy(rsp->r_buf + rsp->r_len, data, len);
+	rsp->r_len += len;
+	_vcard_sw(rsp, sw);
+}
+
+/* Answer a command which has outgoing data of its own with SW1 = sw1 and
+ * SW2 = length, the data is then retrieved by GET RESPONSE.
+ */
+void _vcard_hold(struct _vcard *card, struct _vcard_rsp *rsp,
+			const uint8_t *data, size_t len, uint8_t sw1)
+{
+	assert(len <= sizeof(card->v_rsp));
+	memcpy(card->v_rsp, data, len);
+	card->v_rsp_next = len;
+	card->v_rsp_sw1 = sw1;
+	_vcard_sw(rsp, (sw1 << 8) | (len & 0xff));
+}
+
+/* Returns zero if there is nothing to get */
+int _vcard_get_response(struct _vcard *card, uint8_t le,
+			struct _vcard_rsp *rsp)
+{
+	size_t len = (le) ? le : 256;
+
+	if ( !card->v_rsp_len )
+		return 0;
+
+	if ( len > card->v_rsp_len ) {
+		card->v_rsp_next = card->v_rsp_len;
+		_vcard_sw(rsp, 0x6c00 | (card->v_rsp_len & 0xff));
+		return 1;
+	}
+
+	if ( len == card->v_rsp_len ) {
+		_vcard_data(rsp, card->v_rsp, len, 0x9000);
+		return 1;
+	}
+
+	/* partial read, the rest is left for another GET RESPONSE */
+	memcpy(rsp->r_buf + rsp->r_len, card->v_rsp, len);
+	rsp->r_len += len;
+	memmove(card->v_rsp, card->v_rsp + len, card->v_rsp_len - len);
+	card->v_rsp_next = card->v_rsp_len - len;
+	_vcard_sw(rsp, (card->v_rsp_sw1 << 8) | (card->v_rsp_next & 0xff));
+	return 1;
+}
+
+/** Set the answer to reset of a virtual chip card.
+ * \ingroup g_vcard
+ * @param card The \ref vcard_t to modify.
+ * @param atr The ATR.
+ * @param len Length of the ATR, 2 to 33 bytes.
+ *
+ * Takes effect at the next power on.
+ *
+ * @return zero on error.
+ */
+int vcard_set_atr(vcard_t card, const uint8_t *atr, size_t len)
+{
+	if ( len < 2 || len > sizeof(card->v_atr) )
+		return 0;
+
+	memcpy(card->v_atr, atr, len);
+	card->v_atr_len = len;
+	return 1;
+}
+
+/** Free a virtual chip card.
+ * \ingroup g_vcard
+ * @param card The \ref vcard_t to free, it must not be in a slot.
+ */
+void vcard_free(vcard_t card)
+{
+	if ( card ) {
+		assert(!card->v_inserted);
+		if ( card->v_ops->dtor )
+			(*card->v_ops->dtor)(card);
+	}
+	free(card);
+}
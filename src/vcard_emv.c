@@ -0,0 +1,173 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Virtual EMV card. Commands are answered from a table supplied by the
+ * caller, with T=0 style GET RESPONSE and wrong length handling.
+*/
+
+#include <ccid.h>
+#include <vcard.h>
+
+#include "ccid-internal.h"
+#include "vcard-internal.h"
+
+#define EMV_INS_SELECT		0xa4
+#define EMV_INS_READ_RECORD	0xb2
+#define EMV_INS_GET_RESPONSE	0xc0
+
+struct emv_card {
+	struct _vcard			e_card;
+	const struct vcard_emv_rule	*e_tbl;
+	size_t				e_num;
+	unsigned int			e_state;
+};
+
+static const uint8_t emv_atr[] = {0x3b, 0x04, 'V', 'E', 'M', 'V'};
+
+static struct emv_card *emv_card(struct _vcard *card)
+{
+	return (struct emv_card *)card;
+}
+
+static void emv_reset(struct _vcard *card)
+{
+	emv_card(card)->e_state = 0;
+}
+
+static int match(uint16_t want, unsigned int val)
+{
+	return want == VCARD_ANY || want == val;
+}
+
+static const struct vcard_emv_rule *lookup(struct emv_card *e,
+						const uint8_t *apdu,
+						const uint8_t *data,
+						size_t dlen)
+{
+	const struct vcard_emv_rule *r;
+	size_t i;
+
+	for(i = 0; i < e->e_num; i++) {
+		r = e->e_tbl + i;
+		if ( !match(r->r_cla, apdu[0]) || !match(r->r_ins, apdu[1]) ||
+				!match(r->r_p1, apdu[2]) ||
+				!match(r->r_p2, apdu[3]) ||
+				!match(r->r_state, e->e_state) )
+			continue;
+		if ( r->r_data && (dlen < r->r_data_len ||
+				memcmp(r->r_data, data, r->r_data_len)) )
+			continue;
+		return r;
+	}
+
+	return NULL;
+}
+
+static void emv_apdu(struct _vcard *card, const uint8_t *apdu, size_t len,
+			struct _vcard_rsp *rsp)
+{
+	struct emv_card *e = emv_card(card);
+	const struct vcard_emv_rule *r;
+	const uint8_t *data = NULL;
+	size_t dlen = 0, le;
+
+	if ( apdu[0] == 0x00 && apdu[1] == EMV_INS_GET_RESPONSE ) {
+		if ( len < 5 )
+			_vcard_sw(rsp, 0x6700);
+		else if ( !_vcard_get_response(card, apdu[4], rsp) )
+			_vcard_sw(rsp, 0x6985);
+		return;
+	}
+
+	/* case 3 or 4, Lc and data. Otherwise case 2 and P3 is Le, or case 1
+	 * with no P3 at all
+	 */
+	if ( len > 5 ) {
+		data = apdu + 5;
+		dlen = apdu[4];
+		if ( dlen > len - 5 )
+			dlen = len - 5;
+	}
+
+	r = lookup(e, apdu, data, dlen);
+	if ( NULL == r ) {
+		switch(apdu[1]) {
+		case EMV_INS_SELECT:
+			_vcard_sw(rsp, 0x6a82);
+			break;
+		case EMV_INS_READ_RECORD:
+			_vcard_sw(rsp, 0x6a83);
+			break;
+		default:
+			_vcard_sw(rsp, 0x6d00);
+			break;
+		}
+		return;
+	}
+
+	if ( r->r_next != VCARD_ANY )
+		e->e_state = r->r_next;
+
+	if ( !r->r_rsp_len ) {
+		_vcard_sw(rsp, r->r_sw);
+		return;
+	}
+
+	if ( data ) {
+		if ( r->r_sw == 0x9000 )
+			_vcard_hold(card, rsp, r->r_rsp, r->r_rsp_len, 0x61);
+		else
+			_vcard_sw(rsp, r->r_sw);
+		return;
+	}
+
+	if ( len < 5 )
+		le = 0;
+	else
+		le = (apdu[4]) ? apdu[4] : 256;
+	if ( le != r->r_rsp_len ) {
+		_vcard_sw(rsp, 0x6c00 | (r->r_rsp_len & 0xff));
+		return;
+	}
+
+	_vcard_data(rsp, r->r_rsp, r->r_rsp_len, r->r_sw);
+}
+
+static const struct _vcard_ops emv_ops = {
+	.reset = emv_reset,
+	.apdu = emv_apdu,
+};
+
+/** Create a table driven virtual EMV card.
+ * \ingroup g_vcard
+ * @param tbl Array of rules, which is not copied and must outlive the card.
+ * @param num Number of entries in tbl.
+ *
+ * Commands which carry data and have a response are answered with 61xx
+ * and the response fetched with GET RESPONSE. Commands without data get
+ * 6Cxx unless Le is the exact length of the response. Unmatched commands
+ * get 6A82 for SELECT, 6A83 for READ RECORD and 6D00 otherwise.
+ *
+ * @return NULL on failure, valid \ref vcard_t object otherwise.
+ */
+vcard_t vcard_emv_new(const struct vcard_emv_rule *tbl, size_t num)
+{
+	struct emv_card *e;
+	size_t i;
+
+	for(i = 0; i < num; i++) {
+		if ( tbl[i].r_rsp_len > VCARD_MAX_RSP )
+			return NULL;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if ( NULL == e )
+		return NULL;
+
+	_vcard_init(&e->e_card, &emv_ops, emv_atr, sizeof(emv_atr));
+	e->e_tbl = tbl;
+	e->e_num = num;
+	return &e->e_card;
+}
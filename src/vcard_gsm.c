@@ -0,0 +1,508 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Virtual GSM 11.11 SIM: a file system of DF's and EF's with SELECT, GET
+ * RESPONSE, STATUS and the binary and record read/update commands. There
+ * are no secret codes, all access conditions are ALWays.
+*/
+
+#include <ccid.h>
+#include <vcard.h>
+
+#include "ccid-internal.h"
+#include "vcard-internal.h"
+
+#define GSM_CLA			0xa0
+
+#define GSM_INS_SELECT		0xa4
+#define GSM_INS_STATUS		0xf2
+#define GSM_INS_READ_BINARY	0xb0
+#define GSM_INS_UPDATE_BINARY	0xd6
+#define GSM_INS_READ_RECORD	0xb2
+#define GSM_INS_UPDATE_RECORD	0xdc
+#define GSM_INS_GET_RESPONSE	0xc0
+
+#define GSM_SW1_RSP		0x9f
+#define GSM_SW_OK		0x9000
+#define GSM_SW_NO_EF		0x9400
+#define GSM_SW_RANGE		0x9402
+#define GSM_SW_NOT_FOUND	0x9404
+#define GSM_SW_INCONSISTENT	0x9408
+#define GSM_SW_BAD_P3		0x6700
+#define GSM_SW_BAD_P1P2		0x6b00
+#define GSM_SW_BAD_INS		0x6d00
+#define GSM_SW_BAD_CLA		0x6e00
+#define GSM_SW_TECH		0x6f00
+
+#define GSM_MF			0x3f00
+
+/* File types, as in the FCI */
+#define GSM_TYPE_MF		0x01
+#define GSM_TYPE_DF		0x02
+#define GSM_TYPE_EF		0x04
+
+#define GSM_NONE		(~0U)
+
+#define DF_FCI_LEN		22
+#define EF_FCI_LEN		15
+
+struct gsm_file {
+	unsigned int	f_parent;
+	uint16_t	f_id;
+	uint8_t		f_type;
+	uint8_t		f_struct;
+	uint8_t		f_reclen;
+	uint8_t		*f_data;
+	size_t		f_len;
+};
+
+struct gsm_card {
+	struct _vcard	g_card;
+	struct gsm_file	*g_file;
+	unsigned int	g_num_files;
+	unsigned int	g_df;
+	unsigned int	g_ef;
+	unsigned int	g_rec;
+};
+
+static const uint8_t gsm_atr[] = {0x3b, 0x04, 'V', 'S', 'I', 'M'};
+
+static struct gsm_card *gsm_card(struct _vcard *card)
+{
+	return (struct gsm_card *)card;
+}
+
+static void gsm_reset(struct _vcard *card)
+{
+	struct gsm_card *g = gsm_card(card);
+
+	g->g_df = 0;
+	g->g_ef = GSM_NONE;
+	g->g_rec = 0;
+}
+
+static int is_df(const struct gsm_file *f)
+{
+	return f->f_type != GSM_TYPE_EF;
+}
+
+/* GSM 11.11 6.5: MF, the current DF, its parent, its children and its
+ * sibling DF's.
+ */
+static int selectable(struct gsm_card *g, unsigned int i)
+{
+	const struct gsm_file *f = g->g_file + i;
+	const struct gsm_file *cur = g->g_file + g->g_df;
+
+	if ( f->f_type == GSM_TYPE_MF || i == g->g_df )
+		return 1;
+	if ( f->f_parent == g->g_df )
+		return 1;
+	if ( i == cur->f_parent )
+		return 1;
+	if ( is_df(f) && f->f_parent == cur->f_parent )
+		return 1;
+	return 0;
+}
+
+static size_t fci(struct gsm_card *g, unsigned int i, uint8_t *buf)
+{
+	const struct gsm_file *f = g->g_file + i;
+	unsigned int j, num_df = 0, num_ef = 0;
+
+	if ( !is_df(f) ) {
+		memset(buf, 0, EF_FCI_LEN);
+		buf[2] = f->f_len >> 8;
+		buf[3] = f->f_len & 0xff;
+		buf[4] = f->f_id >> 8;
+		buf[5] = f->f_id & 0xff;
+		buf[6] = GSM_TYPE_EF;
+		buf[11] = 0x01; /* not invalidated */
+		buf[12] = 2;
+		buf[13] = f->f_struct;
+		buf[14] = f->f_reclen;
+		return EF_FCI_LEN;
+	}
+
+	for(j = 1; j < g->g_num_files; j++) {
+		if ( g->g_file[j].f_parent != i )
+			continue;
+		if ( is_df(g->g_file + j) )
+			num_df++;
+		else
+			num_ef++;
+	}
+
+	memset(buf, 0, DF_FCI_LEN);
+	buf[4] = f->f_id >> 8;
+	buf[5] = f->f_id & 0xff;
+	buf[6] = f->f_type;
+	buf[12] = DF_FCI_LEN - 13;
+	buf[14] = num_df;
+	buf[15] = num_ef;
+	buf[16] = 4; /* CHV1, CHV2 and their unblock codes */
+	buf[18] = buf[19] = buf[20] = buf[21] = 0x83; /* initialised, 3 tries */
+	return DF_FCI_LEN;
+}
+
+static void do_select(struct gsm_card *g, const uint8_t *apdu, size_t len,
+			struct _vcard_rsp *rsp)
+{
+	uint8_t buf[DF_FCI_LEN];
+	unsigned int i;
+	uint16_t id;
+
+	if ( len < 7 || apdu[4] != 2 ) {
+		_vcard_sw(rsp, GSM_SW_BAD_P3 | 2);
+		return;
+	}
+
+	id = (apdu[5] << 8) | apdu[6];
+	for(i = 0; i < g->g_num_files; i++) {
+		if ( g->g_file[i].f_id == id && selectable(g, i) )
+			break;
+	}
+
+	if ( i >= g->g_num_files ) {
+		_vcard_sw(rsp, GSM_SW_NOT_FOUND);
+		return;
+	}
+
+	if ( is_df(g->g_file + i) ) {
+		g->g_df = i;
+		g->g_ef = GSM_NONE;
+	}else{
+		g->g_ef = i;
+		g->g_rec = 0;
+	}
+
+	_vcard_hold(&g->g_card, rsp, buf, fci(g, i, buf), GSM_SW1_RSP);
+}
+
+static void do_status(struct gsm_card *g, const uint8_t *apdu, size_t alen,
+			struct _vcard_rsp *rsp)
+{
+	uint8_t buf[DF_FCI_LEN];
+	size_t len;
+
+	/* without P3 nothing is expected back */
+	len = fci(g, g->g_df, buf);
+	if ( alen < 5 )
+		len = 0;
+	else if ( apdu[4] < len )
+		len = apdu[4];
+	_vcard_data(rsp, buf, len, GSM_SW_OK);
+}
+
+static struct gsm_file *cur_ef(struct gsm_card *g, unsigned int ef_struct,
+				struct _vcard_rsp *rsp)
+{
+	struct gsm_file *f;
+
+	if ( g->g_ef == GSM_NONE ) {
+		_vcard_sw(rsp, GSM_SW_NO_EF);
+		return NULL;
+	}
+
+	f = g->g_file + g->g_ef;
+	if ( (f->f_struct == VCARD_EF_TRANSPARENT) !=
+			(ef_struct == VCARD_EF_TRANSPARENT) ) {
+		_vcard_sw(rsp, GSM_SW_INCONSISTENT);
+		return NULL;
+	}
+
+	return f;
+}
+
+static void do_binary(struct gsm_card *g, const uint8_t *apdu, size_t len,
+			struct _vcard_rsp *rsp)
+{
+	struct gsm_file *f;
+	size_t ofs, n;
+
+	f = cur_ef(g, VCARD_EF_TRANSPARENT, rsp);
+	if ( NULL == f )
+		return;
+
+	if ( len < 5 ) {
+		_vcard_sw(rsp, GSM_SW_BAD_P3);
+		return;
+	}
+
+	ofs = (apdu[2] << 8) | apdu[3];
+	n = (apdu[4]) ? apdu[4] : 256;
+	if ( ofs >= f->f_len ) {
+		_vcard_sw(rsp, GSM_SW_RANGE);
+		return;
+	}
+	if ( ofs + n > f->f_len ) {
+		_vcard_sw(rsp, GSM_SW_BAD_P3 | ((f->f_len - ofs) & 0xff));
+		return;
+	}
+
+	if ( apdu[1] == GSM_INS_READ_BINARY ) {
+		_vcard_data(rsp, f->f_data + ofs, n, GSM_SW_OK);
+		return;
+	}
+
+	if ( len < 5 + n ) {
+		_vcard_sw(rsp, GSM_SW_BAD_P3);
+		return;
+	}
+
+	memcpy(f->f_data + ofs, apdu + 5, n);
+	_vcard_sw(rsp, GSM_SW_OK);
+}
+
+static void do_record(struct gsm_card *g, const uint8_t *apdu, size_t len,
+			struct _vcard_rsp *rsp)
+{
+	struct gsm_file *f;
+	unsigned int num, rec;
+	uint8_t *ptr;
+
+	f = cur_ef(g, VCARD_EF_LINEAR, rsp);
+	if ( NULL == f )
+		return;
+
+	num = f->f_len / f->f_reclen;
+
+	switch(apdu[3]) {
+	case 0x02: /* next */
+		rec = (g->g_rec < num) ? g->g_rec + 1 : 0;
+		break;
+	case 0x03: /* previous */
+		rec = (g->g_rec > 1) ? g->g_rec - 1 : 0;
+		break;
+	case 0x04: /* absolute or current */
+		rec = (apdu[2]) ? apdu[2] : g->g_rec;
+		break;
+	default:
+		_vcard_sw(rsp, GSM_SW_BAD_P1P2);
+		return;
+	}
+
+	if ( len < 5 || apdu[4] != f->f_reclen ) {
+		_vcard_sw(rsp, GSM_SW_BAD_P3 | f->f_reclen);
+		return;
+	}
+
+	if ( apdu[1] == GSM_INS_UPDATE_RECORD && len < 5U + f->f_reclen ) {
+		_vcard_sw(rsp, GSM_SW_BAD_P3);
+		return;
+	}
+
+	/* update previous on a cyclic file writes the oldest record which
+	 * then becomes the first
+	 */
+	if ( apdu[1] == GSM_INS_UPDATE_RECORD && apdu[3] == 0x03 &&
+			f->f_struct == VCARD_EF_CYCLIC ) {
+		memmove(f->f_data + f->f_reclen, f->f_data,
+			f->f_len - f->f_reclen);
+		rec = 1;
+	}
+
+	if ( rec < 1 || rec > num ) {
+		_vcard_sw(rsp, GSM_SW_RANGE);
+		return;
+	}
+
+	g->g_rec = rec;
+	ptr = f->f_data + (rec - 1) * f->f_reclen;
+
+	if ( apdu[1] == GSM_INS_READ_RECORD ) {
+		_vcard_data(rsp, ptr, f->f_reclen, GSM_SW_OK);
+		return;
+	}
+
+	memcpy(ptr, apdu + 5, f->f_reclen);
+	_vcard_sw(rsp, GSM_SW_OK);
+}
+
+static void gsm_apdu(struct _vcard *card, const uint8_t *apdu, size_t len,
+			struct _vcard_rsp *rsp)
+{
+	struct gsm_card *g = gsm_card(card);
+
+	if ( apdu[0] != GSM_CLA ) {
+		_vcard_sw(rsp, GSM_SW_BAD_CLA);
+		return;
+	}
+
+	switch(apdu[1]) {
+	case GSM_INS_SELECT:
+		do_select(g, apdu, len, rsp);
+		break;
+	case GSM_INS_STATUS:
+		do_status(g, apdu, len, rsp);
+		break;
+	case GSM_INS_GET_RESPONSE:
+		if ( len < 5 )
+			_vcard_sw(rsp, GSM_SW_BAD_P3);
+		else if ( !_vcard_get_response(card, apdu[4], rsp) )
+			_vcard_sw(rsp, GSM_SW_TECH);
+		break;
+	case GSM_INS_READ_BINARY:
+	case GSM_INS_UPDATE_BINARY:
+		do_binary(g, apdu, len, rsp);
+		break;
+	case GSM_INS_READ_RECORD:
+	case GSM_INS_UPDATE_RECORD:
+		do_record(g, apdu, len, rsp);
+		break;
+	default:
+		_vcard_sw(rsp, GSM_SW_BAD_INS);
+		break;
+	}
+}
+
+static void gsm_dtor(struct _vcard *card)
+{
+	struct gsm_card *g = gsm_card(card);
+	unsigned int i;
+
+	for(i = 0; i < g->g_num_files; i++)
+		free(g->g_file[i].f_data);
+	free(g->g_file);
+}
+
+static const struct _vcard_ops gsm_ops = {
+	.reset = gsm_reset,
+	.apdu = gsm_apdu,
+	.dtor = gsm_dtor,
+};
+
+static struct gsm_file *add_file(struct gsm_card *g, uint16_t parent,
+					uint16_t id, uint8_t type)
+{
+	struct gsm_file *f;
+	unsigned int i, p = GSM_NONE;
+
+	for(i = 0; i < g->g_num_files; i++) {
+		f = g->g_file + i;
+		if ( is_df(f) && f->f_id == parent ) {
+			p = i;
+			break;
+		}
+	}
+
+	if ( g->g_num_files && p == GSM_NONE )
+		return NULL;
+
+	/* no duplicates within a DF */
+	for(i = 0; i < g->g_num_files; i++) {
+		f = g->g_file + i;
+		if ( f->f_id == id && f->f_parent == p )
+			return NULL;
+	}
+
+	f = realloc(g->g_file, (g->g_num_files + 1) * sizeof(*f));
+	if ( NULL == f )
+		return NULL;
+
+	g->g_file = f;
+	f = g->g_file + g->g_num_files++;
+	memset(f, 0, sizeof(*f));
+	f->f_parent = p;
+	f->f_id = id;
+	f->f_type = type;
+	return f;
+}
+
+/** Create a virtual GSM SIM card.
+ * \ingroup g_vcard
+ *
+ * The card starts out with only an empty MF, use vcard_gsm_add_df() and
+ * vcard_gsm_add_ef() to populate it.
+ *
+ * @return NULL on failure, valid \ref vcard_t object otherwise.
+ */
+vcard_t vcard_gsm_new(void)
+{
+	struct gsm_card *g;
+
+	g = calloc(1, sizeof(*g));
+	if ( NULL == g )
+		return NULL;
+
+	_vcard_init(&g->g_card, &gsm_ops, gsm_atr, sizeof(gsm_atr));
+
+	if ( NULL == add_file(g, 0, GSM_MF, GSM_TYPE_MF) ) {
+		free(g);
+		return NULL;
+	}
+
+	gsm_reset(&g->g_card);
+	return &g->g_card;
+}
+
+/** Add a dedicated file to a virtual GSM SIM card.
+ * \ingroup g_vcard
+ * @param card The \ref vcard_t to add to, from vcard_gsm_new().
+ * @param parent File ID of the parent DF, or 0x3f00 for the MF.
+ * @param id File ID of the new DF.
+ *
+ * @return zero on error.
+ */
+int vcard_gsm_add_df(vcard_t card, uint16_t parent, uint16_t id)
+{
+	if ( card->v_ops != &gsm_ops )
+		return 0;
+	return NULL != add_file(gsm_card(card), parent, id, GSM_TYPE_DF);
+}
+
+/** Add an elementary file to a virtual GSM SIM card.
+ * \ingroup g_vcard
+ * @param card The \ref vcard_t to add to, from vcard_gsm_new().
+ * @param parent File ID of the parent DF, or 0x3f00 for the MF.
+ * @param id File ID of the new EF.
+ * @param structure One of VCARD_EF_(TRANSPARENT|LINEAR|CYCLIC).
+ * @param reclen Record length for linear and cyclic files.
+ * @param data Initial contents of the file, copied.
+ * @param len Size of the file in bytes, a multiple of reclen for record
+ *            structured files.
+ *
+ * @return zero on error.
+ */
+int vcard_gsm_add_ef(vcard_t card, uint16_t parent, uint16_t id,
+			unsigned int structure, uint8_t reclen,
+			const uint8_t *data, size_t len)
+{
+	struct gsm_file *f;
+	uint8_t *buf;
+
+	if ( card->v_ops != &gsm_ops || !len || len > 0xffff )
+		return 0;
+
+	switch(structure) {
+	case VCARD_EF_TRANSPARENT:
+		reclen = 0;
+		break;
+	case VCARD_EF_LINEAR:
+	case VCARD_EF_CYCLIC:
+		if ( !reclen || len % reclen )
+			return 0;
+		break;
+	default:
+		return 0;
+	}
+
+	buf = malloc(len);
+	if ( NULL == buf )
+		return 0;
+	memcpy(buf, data, len);
+
+	f = add_file(gsm_card(card), parent, id, GSM_TYPE_EF);
+	if ( NULL == f ) {
+		free(buf);
+		return 0;
+	}
+
+	f->f_struct = structure;
+	f->f_reclen = reclen;
+	f->f_data = buf;
+	f->f_len = len;
+	return 1;
+}
@@ -0,0 +1,507 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Virtual CCID. A transport which implements the reader side of the
+ * PC_to_RDR message set in-process and passes APDUs on to software chip
+ * cards, so that everything above the CCID layer can be driven without USB.
+*/
+
+#include <ccid.h>
+#include <vcard.h>
+
+#include <time.h>
+
+#include "ccid-internal.h"
+#include "vcard-internal.h"
+
+/* Enough for any short APDU exchange */
+#define VCCID_MAX_MSG		(sizeof(struct ccid_msg) + 261)
+#define VCCID_MAX_PACKET	64
+
+struct vslot {
+	struct _vcard		*s_card;
+	struct _ccid_cmd	*s_cmd;
+	uint64_t		s_order;
+	struct ccid_t0		s_t0;
+	uint8_t			s_active;
+	uint8_t			s_stopped;
+	uint8_t			s_changed;
+};
+
+struct vccid {
+	struct vslot		v_slot[CCID_MAX_SLOTS];
+	uint64_t		v_order;
+};
+
+static const struct ccid_t0 default_t0 = {
+	.bmFindexDindex = 0x11,
+	.bWaitingIntegerT0 = 0x0a,
+};
+
+static uint8_t icc_status(const struct vslot *s)
+{
+	if ( NULL == s || NULL == s->s_card )
+		return CCID_STATUS_ICC_NOT_PRESENT;
+	if ( !s->s_active )
+		return CCID_STATUS_ICC_PRESENT;
+	return CCID_STATUS_ICC_ACTIVE;
+}
+
+static size_t xfr_block(struct vslot *s, const uint8_t *data, size_t dlen,
+			uint8_t *buf, size_t max, uint8_t *err)
+{
+	struct _vcard_rsp rsp;
+
+	if ( NULL == s->s_card || !s->s_active || s->s_stopped ) {
+		*err = CCID_ERR_MUTE;
+		return 0;
+	}
+
+	rsp.r_buf = buf;
+	rsp.r_len = 0;
+	rsp.r_max = max;
+	_vcard_apdu(s->s_card, data, dlen, &rsp);
+	return rsp.r_len;
+}
+
+static size_t params(struct vslot *s, const struct ccid_msg *req,
+			const uint8_t *data, size_t dlen,
+			uint8_t *buf, uint8_t *err)
+{
+	if ( NULL == s->s_card ) {
+		*err = CCID_ERR_MUTE;
+		return 0;
+	}
+
+	switch(req->bMessageType) {
+	case PC_to_RDR_SetParameters:
+		if ( req->out.bApp[0] != CCID_PROTOCOL_T0 ) {
+			*err = CCID_ERR_BAD_PROTOCOL;
+			return 0;
+		}
+		if ( dlen > sizeof(s->s_t0) )
+			dlen = sizeof(s->s_t0);
+		memcpy(&s->s_t0, data, dlen);
+		break;
+	case PC_to_RDR_ResetParameters:
+		s->s_t0 = default_t0;
+		break;
+	default:
+		break;
+	}
+
+	memcpy(buf, &s->s_t0, sizeof(s->s_t0));
+	return sizeof(s->s_t0);
+}
+
+/* Execute a PC_to_RDR message and build the response in d_rxbuf */
+static size_t do_msg(struct _ccid *ccid, struct vccid *v,
+			const struct ccid_msg *req, const uint8_t *data)
+{
+	struct ccid_msg *rsp = (struct ccid_msg *)ccid->d_rxbuf;
+	uint8_t *buf = ccid->d_rxbuf + sizeof(*rsp);
+	size_t max = ccid->d_rxmax - sizeof(*rsp);
+	size_t dlen = le32toh(req->dwLength);
+	struct vslot *s = NULL;
+	uint8_t err = 0;
+	size_t len = 0;
+
+	if ( req->bSlot < ccid->d_num_slots )
+		s = v->v_slot + req->bSlot;
+
+	memset(rsp, 0, sizeof(*rsp));
+	rsp->bSlot = req->bSlot;
+	rsp->bSeq = req->bSeq;
+
+	switch(req->bMessageType) {
+	case PC_to_RDR_IccPowerOn:
+		rsp->bMessageType = RDR_to_PC_DataBlock;
+		if ( NULL == s || NULL == s->s_card ) {
+			err = CCID_ERR_MUTE;
+			break;
+		}
+		_vcard_reset(s->s_card);
+		s->s_t0 = default_t0;
+		s->s_active = 1;
+		s->s_stopped = 0;
+		len = s->s_card->v_atr_len;
+		memcpy(buf, s->s_card->v_atr, len);
+		break;
+	case PC_to_RDR_IccPowerOff:
+		rsp->bMessageType = RDR_to_PC_SlotStatus;
+		if ( s ) {
+			s->s_active = 0;
+			s->s_stopped = 0;
+		}
+		break;
+	case PC_to_RDR_IccClock:
+		rsp->bMessageType = RDR_to_PC_SlotStatus;
+		if ( NULL == s || NULL == s->s_card || !s->s_active ) {
+			err = CCID_ERR_MUTE;
+			break;
+		}
+		s->s_stopped = (req->out.bApp[0] == CCID_CLOCK_CMD_STOP);
+		break;
+	case PC_to_RDR_GetSlotStatus:
+		rsp->bMessageType = RDR_to_PC_SlotStatus;
+		break;
+	case PC_to_RDR_XfrBlock:
+		rsp->bMessageType = RDR_to_PC_DataBlock;
+		if ( NULL == s ) {
+			err = CCID_ERR_BAD_SLOT;
+			break;
+		}
+		len = xfr_block(s, data, dlen, buf, max, &err);
+		break;
+	case PC_to_RDR_GetParameters:
+	case PC_to_RDR_SetParameters:
+	case PC_to_RDR_ResetParameters:
+		rsp->bMessageType = RDR_to_PC_Parameters;
+		if ( NULL == s ) {
+			err = CCID_ERR_BAD_SLOT;
+			break;
+		}
+		rsp->in.bApp = CCID_PROTOCOL_T0;
+		len = params(s, req, data, dlen, buf, &err);
+		break;
+	case PC_to_RDR_Escape:
+		/* loopback, for measuring the cost of the layers above */
+		rsp->bMessageType = RDR_to_PC_Escape;
+		len = (dlen < max) ? dlen : max;
+		memcpy(buf, data, len);
+		break;
+	default:
+		rsp->bMessageType = RDR_to_PC_SlotStatus;
+		err = CCID_ERR_CMD_UNSUPPORTED;
+		break;
+	}
+
+	if ( NULL == s && req->bMessageType != PC_to_RDR_Escape )
+		err = CCID_ERR_BAD_SLOT;
+
+	rsp->in.bStatus = icc_status(s);
+	if ( err ) {
+		rsp->in.bStatus |= CCID_RESULT_ERROR;
+		rsp->in.bError = err;
+		len = 0;
+	}else if ( rsp->bMessageType == RDR_to_PC_SlotStatus ) {
+		/* bClockStatus */
+		if ( !s->s_active )
+			rsp->in.bApp = 0x03;
+		else
+			rsp->in.bApp = (s->s_stopped) ? 0x01 : 0x00;
+	}
+
+	rsp->dwLength = htole32(len);
+	return sizeof(*rsp) + len;
+}
+
+static int vccid_send(struct _ccid *ccid, struct _ccid_cmd *cmd)
+{
+	struct vccid *v = ccid->d_xport_priv;
+	struct vslot *s = v->v_slot + cmd->c_slot;
+
+	/* processed in submission order when someone waits */
+	s->s_cmd = cmd;
+	s->s_order = v->v_order++;
+	return 1;
+}
+
+static void deliver(struct _ccid *ccid, struct vccid *v, struct vslot *s)
+{
+	struct _ccid_cmd *cmd = s->s_cmd;
+	struct _xfr *xfr = cmd->c_xfr;
+	size_t len;
+
+	s->s_cmd = NULL;
+	_ccid_tx_done(ccid, cmd, 1);
+
+	len = do_msg(ccid, v, xfr->x_txhdr, xfr->x_txbuf);
+	_ccid_rx_msg(ccid, len);
+}
+
+/* Whichever thread waits runs the next command, for any slot. Picking it
+ * and running it is done under the bus lock so that no other waiter sees a
+ * command which is neither pending nor complete.
+ */
+static void vccid_wait(struct _ccid *ccid, struct _ccid_cmd *cmd)
+{
+	struct vccid *v = ccid->d_xport_priv;
+	struct vslot *s, *next;
+	unsigned int i;
+
+	while ( !__atomic_load_n(&cmd->c_complete, __ATOMIC_ACQUIRE) ) {
+		_ccid_lock(ccid);
+		for(next = NULL, i = 0; i < CCID_MAX_SLOTS; i++) {
+			s = v->v_slot + i;
+			if ( NULL == s->s_cmd )
+				continue;
+			if ( NULL == next || s->s_order < next->s_order )
+				next = s;
+		}
+
+		if ( next )
+			deliver(ccid, v, next);
+		_ccid_unlock(ccid);
+
+		if ( NULL == next )
+			break;
+	}
+}
+
+/* Report insertions and removals since last time as a NotifySlotChange,
+ * nothing else can happen so just sleep if there weren't any.
+ */
+static int vccid_wait_intr(struct _ccid *ccid)
+{
+	struct timespec ts = {0, 250000000};
+	struct vccid *v = ccid->d_xport_priv;
+	uint8_t buf[1 + CCID_MAX_SLOTS / 4];
+	unsigned int i, changed = 0;
+	struct vslot *s;
+
+	memset(buf, 0, sizeof(buf));
+	buf[0] = RDR_to_PC_NotifySlotChange;
+
+	_ccid_lock(ccid);
+	for(i = 0; i < ccid->d_num_slots; i++) {
+		s = v->v_slot + i;
+		if ( s->s_card )
+			buf[1 + (i >> 2)] |= 1 << ((i & 0x3) << 1);
+		if ( s->s_changed )
+			buf[1 + (i >> 2)] |= 2 << ((i & 0x3) << 1);
+		changed |= s->s_changed;
+		s->s_changed = 0;
+	}
+
+	if ( changed )
+		_ccid_intr_msg(ccid, buf, 1 + ((ccid->d_num_slots + 3) >> 2));
+	_ccid_unlock(ccid);
+
+	if ( !changed )
+		nanosleep(&ts, NULL);
+	return 1;
+}
+
+static void vccid_cancel(struct _ccid *ccid, struct _ccid_cmd *cmd)
+{
+	struct vccid *v = ccid->d_xport_priv;
+	struct vslot *s = v->v_slot + cmd->c_slot;
+
+	if ( s->s_cmd != cmd )
+		return;
+
+	s->s_cmd = NULL;
+	if ( cmd->c_state == CMD_TX )
+		_ccid_tx_done(ccid, cmd, 0);
+}
+
+static void vccid_drain(struct _ccid *ccid)
+{
+	struct vccid *v = ccid->d_xport_priv;
+	struct _ccid_cmd *cmd;
+	unsigned int i;
+
+	for(i = 0; i < CCID_MAX_SLOTS; i++) {
+		cmd = v->v_slot[i].s_cmd;
+		if ( NULL == cmd )
+			continue;
+		v->v_slot[i].s_cmd = NULL;
+		_ccid_cmd_abort(ccid, cmd);
+	}
+}
+
+static void vccid_dtor(struct _ccid *ccid)
+{
+	struct vccid *v = ccid->d_xport_priv;
+	unsigned int i;
+
+	if ( NULL == v )
+		return;
+
+	for(i = 0; i < CCID_MAX_SLOTS; i++) {
+		if ( v->v_slot[i].s_card )
+			v->v_slot[i].s_card->v_inserted = 0;
+	}
+	free(v);
+}
+
+const struct _ccid_xport _vccid_xport = {
+	.send = vccid_send,
+	.wait = vccid_wait,
+	.cancel = vccid_cancel,
+	.wait_intr = vccid_wait_intr,
+	.drain = vccid_drain,
+	.dtor = vccid_dtor,
+};
+
+static void fill_desc(struct ccid_desc *d, unsigned int num_slots)
+{
+	memset(d, 0, sizeof(*d));
+	d->bLength = sizeof(*d);
+	d->bDescriptorType = CCID_DT;
+	d->bcdCCID = htole16(0x0110);
+	d->bMaxSlotIndex = num_slots - 1;
+	d->bVoltageSupport = CCID_5V | CCID_3V | CCID_1_8V;
+	d->dwProtocols = htole32(CCID_T0);
+	d->dwDefaultClock = htole32(3580);
+	d->dwMaximumClock = htole32(3580);
+	d->dwDataRate = htole32(9600);
+	d->dwMaxDataRate = htole32(9600);
+	d->dwMaxIFSD = htole32(254);
+	d->dwFeatures = htole32(CCID_VOLTAGE | CCID_FREQ | CCID_BAUD |
+				CCID_PPS_AUTO | CCID_CLOCK_STOP |
+				CCID_T1_APDU);
+	d->dwMaxCCIDMessageLength = htole32(VCCID_MAX_MSG);
+	d->bClassGetResponse = 0xff;
+	d->bClassEnvelope = 0xff;
+	d->bMaxCCIDBusySlots = num_slots;
+}
+
+/** Create a virtual chip card device.
+ * \ingroup g_vcard
+ * @param num_slots Number of contact card slots, 1 to 16.
+ * @param tracefile filename to open for trace logging (or NULL).
+ * @param flags Bitmask of CCID_TRACE_* flags.
+ *
+ * The device speaks T=0 at the short APDU level and its slots start out
+ * empty, use ccid_virtual_insert() to put cards in them. Commands are
+ * executed when their results are waited for, in the order that they were
+ * submitted. PC_to_RDR_Escape messages are looped back.
+ *
+ * @return NULL on failure, valid \ref ccid_t object otherwise.
+ */
+ccid_t ccid_virtual(unsigned int num_slots, const char *tracefile,
+			unsigned int flags)
+{
+	struct ccid_desc desc;
+	struct _ccid *ccid;
+	struct vccid *v;
+	unsigned int i;
+
+	if ( num_slots < 1 || num_slots > CCID_MAX_SLOTS )
+		return NULL;
+
+	v = calloc(1, sizeof(*v));
+	if ( NULL == v )
+		return NULL;
+
+	for(i = 0; i < CCID_MAX_SLOTS; i++)
+		v->v_slot[i].s_t0 = default_t0;
+
+	ccid = _ccid_new(tracefile, flags);
+	if ( NULL == ccid ) {
+		free(v);
+		return NULL;
+	}
+
+	ccid->d_xport = &_vccid_xport;
+	ccid->d_xport_priv = v;
+
+	trace(ccid, "Virtual CCI with %u slots\n", num_slots);
+
+	ccid->d_max_in = VCCID_MAX_PACKET;
+	ccid->d_max_out = VCCID_MAX_PACKET;
+	ccid->d_name = strdup("Virtual CCID");
+	if ( NULL == ccid->d_name )
+		goto err;
+
+	fill_desc(&desc, num_slots);
+	if ( !_ccid_fill_desc(ccid, (uint8_t *)&desc, sizeof(desc)) )
+		goto err;
+
+	if ( !_ccid_start(ccid, 0) )
+		goto err;
+
+	return ccid;
+
+err:
+	ccid_close(ccid);
+	return NULL;
+}
+
+static struct vslot *get_slot(struct _ccid *ccid, unsigned int slot)
+{
+	struct vccid *v = ccid->d_xport_priv;
+
+	if ( ccid->d_xport != &_vccid_xport ) {
+		_ccid_set_error(ccid, CCID_ERROR_IN_VALUE);
+		return NULL;
+	}
+
+	if ( slot >= ccid->d_num_slots ) {
+		_ccid_set_error(ccid, CCID_ERROR_IN_VALUE);
+		return NULL;
+	}
+
+	return v->v_slot + slot;
+}
+
+/** Insert a virtual chip card in to a slot of a virtual CCID.
+ * \ingroup g_vcard
+ * @param ccid Virtual \ref ccid_t, from ccid_virtual().
+ * @param slot Index of an empty slot.
+ * @param card The \ref vcard_t to insert, it must not already be inserted.
+ *
+ * The card is left unpowered and the insertion is reported to
+ * cci_wait_for_card() and any slot event callback.
+ *
+ * @return zero on error.
+ */
+int ccid_virtual_insert(ccid_t ccid, unsigned int slot, vcard_t card)
+{
+	struct vslot *s;
+
+	s = get_slot(ccid, slot);
+	if ( NULL == s )
+		return 0;
+
+	_ccid_lock(ccid);
+	if ( s->s_card || card->v_inserted ) {
+		_ccid_unlock(ccid);
+		_ccid_set_error(ccid, CCID_ERROR_IN_VALUE);
+		return 0;
+	}
+
+	trace(ccid, "Virtual card inserted in slot %u\n", slot);
+	card->v_inserted = 1;
+	s->s_card = card;
+	s->s_active = 0;
+	s->s_changed = 1;
+	_ccid_unlock(ccid);
+	return 1;
+}
+
+/** Remove the card from a slot of a virtual CCID.
+ * \ingroup g_vcard
+ * @param ccid Virtual \ref ccid_t, from ccid_virtual().
+ * @param slot Index of the slot.
+ *
+ * Any command not yet executed on the slot will fail as if the card had
+ * been pulled out.
+ *
+ * @return The card which was removed, or NULL if the slot was empty.
+ */
+vcard_t ccid_virtual_remove(ccid_t ccid, unsigned int slot)
+{
+	struct _vcard *card;
+	struct vslot *s;
+
+	s = get_slot(ccid, slot);
+	if ( NULL == s )
+		return NULL;
+
+	_ccid_lock(ccid);
+	card = s->s_card;
+	if ( card ) {
+		trace(ccid, "Virtual card removed from slot %u\n", slot);
+		card->v_inserted = 0;
+		s->s_card = NULL;
+		s->s_active = 0;
+		s->s_changed = 1;
+	}
+	_ccid_unlock(ccid);
+	return card;
+}
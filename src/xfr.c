@@ -12,14 +12,36 @@
 
 #define MIN_RESP_LEN 2U
 
+/* Cache line aligned and padded, so buffers in use by different threads
+ * never share a line.
+ */
+static void *zalloc_aligned(size_t len)
+{
+	void *ptr;
+
+	len = (len + XFR_ALIGN - 1) & ~(size_t)(XFR_ALIGN - 1);
+	if ( posix_memalign(&ptr, XFR_ALIGN, len) )
+		return NULL;
+
+	memset(ptr, 0, len);
+	return ptr;
+}
+
+/* Header and data must be contiguous on both sides, since they go to and
+ * from the wire as one message. The transmit side lives with the xfr, the
+ * receive side is allocated separately so that it can grow.
+ */
 struct _xfr *_xfr_do_alloc(size_t txbuf, size_t rxbuf)
 {
 	uint8_t *ptr;
 	struct _xfr *xfr;
 	size_t tot_len;
 
-	tot_len = sizeof(*xfr) + txbuf + rxbuf + sizeof(*xfr->x_txhdr) * 2;
-	ptr = calloc(1, tot_len);
+	if ( rxbuf < MIN_RESP_LEN )
+		rxbuf = MIN_RESP_LEN;
+
+	tot_len = sizeof(*xfr) + txbuf + sizeof(*xfr->x_txhdr);
+	ptr = zalloc_aligned(tot_len);
 	if ( NULL == ptr )
 		return NULL;
 	
@@ -27,26 +49,63 @@ struct _xfr *_xfr_do_alloc(size_t txbuf, size_t rxbuf)
 	ptr += sizeof(*xfr);
 
 	xfr->x_txmax = txbuf;
-	xfr->x_rxmax = txbuf;
-
 	xfr->x_txhdr = (struct ccid_msg *)ptr;
 	ptr += sizeof(*xfr->x_txhdr);
-
 	xfr->x_txbuf = ptr;
-	ptr += txbuf;
 
-	xfr->x_rxhdr = (struct ccid_msg *)ptr;
-	ptr += sizeof(*xfr->x_rxhdr);
+	ptr = zalloc_aligned(sizeof(*xfr->x_rxhdr) + rxbuf);
+	if ( NULL == ptr ) {
+		free(xfr);
+		return NULL;
+	}
 
-	xfr->x_rxbuf = ptr;
+	xfr->x_rxmax = rxbuf;
+	xfr->x_rxhdr = (struct ccid_msg *)ptr;
+	xfr->x_rxbuf = ptr + sizeof(*xfr->x_rxhdr);
+	xfr->x_flags = XFR_RX_GROW;
 
 	return xfr;
 }
 
+/* Make room for at least len bytes of receive data, keeping what's there */
+int _xfr_rx_grow(struct _xfr *xfr, size_t len)
+{
+	uint8_t *ptr;
+	size_t max;
+
+	if ( len <= xfr->x_rxmax )
+		return 1;
+	if ( !(xfr->x_flags & XFR_RX_GROW) || len > XFR_RX_LIMIT )
+		return 0;
+
+	/* double, so that reassembling a long chain isn't quadratic */
+	max = xfr->x_rxmax * 2;
+	if ( max < len )
+		max = len;
+	if ( max > XFR_RX_LIMIT )
+		max = XFR_RX_LIMIT;
+
+	/* not realloc, which wouldn't keep the alignment */
+	ptr = zalloc_aligned(sizeof(*xfr->x_rxhdr) + max);
+	if ( NULL == ptr )
+		return 0;
+
+	memcpy(ptr, xfr->x_rxhdr, sizeof(*xfr->x_rxhdr) + xfr->x_rxmax);
+	free((void *)xfr->x_rxhdr);
+
+	xfr->x_rxmax = max;
+	xfr->x_rxhdr = (struct ccid_msg *)ptr;
+	xfr->x_rxbuf = ptr + sizeof(*xfr->x_rxhdr);
+	return 1;
+}
+
 /** Allocate a transaction buffer.
  * \ingroup g_xfr
  * @param txbuf Size of transmit buffer in bytes.
- * @param rxbuf Size of receive buffer in bytes.
+ * @param rxbuf Initial size of receive buffer in bytes.
+ *
+ * The receive buffer grows as needed to hold larger responses, so rxbuf
+ * need only be big enough for the usual case.
  *
  * @return \ref xfr_t representing the transaction buffer.
  */
@@ -105,6 +164,62 @@ int xfr_tx_buf(xfr_t xfr, const uint8_t *ptr, size_t len)
 	return 1;
 }
 
+/** Reserve space at the end of the transmit buffer.
+ * \ingroup g_xfr
+ * @param xfr \ref xfr_t representing the transaction buffer.
+ * @param len Number of bytes to reserve.
+ *
+ * The returned bytes are part of the message which goes out on the wire, so
+ * the caller can lay out an APDU header (CLA, INS, P1, P2, Lc) in place
+ * rather than appending it a byte at a time. They count as appended as soon
+ * as this function returns.
+ *
+ * @return NULL on error, pointer to len bytes of transmit buffer otherwise.
+*/
+uint8_t *xfr_tx_reserve(xfr_t xfr, size_t len)
+{
+	uint8_t *ret;
+
+	if ( xfr->x_txlen + len > xfr->x_txmax )
+		return NULL;
+
+	ret = xfr->x_txbuf + xfr->x_txlen;
+	xfr->x_txlen += len;
+
+	return ret;
+}
+
+/** Append a scatter/gather list of buffers to the transmit buffer.
+ * \ingroup g_xfr
+ * @param xfr \ref xfr_t representing the transaction buffer.
+ * @param iov Array of buffers to append, in order.
+ * @param cnt Number of elements in iov.
+ *
+ * Either all of the buffers are appended or none of them are.
+ *
+ * @return zero on error.
+*/
+int xfr_tx_iov(xfr_t xfr, const struct iovec *iov, unsigned int cnt)
+{
+	unsigned int i;
+	uint8_t *ptr;
+	size_t len;
+
+	for(len = i = 0; i < cnt; i++)
+		len += iov[i].iov_len;
+
+	ptr = xfr_tx_reserve(xfr, len);
+	if ( NULL == ptr )
+		return 0;
+
+	for(i = 0; i < cnt; i++) {
+		memcpy(ptr, iov[i].iov_base, iov[i].iov_len);
+		ptr += iov[i].iov_len;
+	}
+
+	return 1;
+}
+
 /** Retrieve status word 1 from the receive buffer.
  * \ingroup g_xfr
  * @param xfr \ref xfr_t representing the transaction buffer.
@@ -138,9 +253,8 @@ uint8_t xfr_rx_sw2(xfr_t xfr)
  * @param xfr \ref xfr_t representing the transaction buffer.
  * @param len Pointer to size_t in which to store length of buffer.
  *
- * Return value is only valid after a successful transaction, the contents
- * of the buffer may be overwritten with new data after an other transaction
- * has been processed on xfr.
+ * Return value is only valid after a successful transaction, the buffer
+ * may be overwritten or moved by an other transaction on xfr.
  *
  * @return NULL on error, pointer to data bytes on error.
 */
@@ -154,9 +268,24 @@ const uint8_t *xfr_rx_data(xfr_t xfr, size_t *len)
 
 void _xfr_do_free(struct _xfr *xfr)
 {
+	if ( NULL == xfr )
+		return;
+	free((void *)xfr->x_rxhdr);
 	free(xfr);
 }
 
+/* Append to the receive buffer, for reassembling chained responses */
+int _xfr_rx_append(struct _xfr *xfr, const uint8_t *ptr, size_t len)
+{
+	if ( !_xfr_rx_grow(xfr, xfr->x_rxlen + len) )
+		return 0;
+
+	memcpy(xfr->x_rxbuf + xfr->x_rxlen, ptr, len);
+	xfr->x_rxlen += len;
+
+	return 1;
+}
+
 /** Free a transaction buffer.
  * \ingroup g_xfr
  * @param xfr \ref xfr_t representing the transaction buffer.
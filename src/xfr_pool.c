@@ -0,0 +1,185 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Per-thread caches of transaction buffers, so that sessions which come
+ * and go at a high rate don't go to the allocator each time. Buffers are
+ * recycled by transmit size class, powers of two from POOL_MIN up to
+ * POOL_MAX bytes.
+*/
+
+#include <ccid.h>
+#include <pthread.h>
+
+#include "ccid-internal.h"
+
+#define POOL_MIN_SHIFT	6
+#define POOL_MAX_SHIFT	16
+#define POOL_NUM_CLASS	(POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_MIN	(1U << POOL_MIN_SHIFT)
+#define POOL_MAX	(1U << POOL_MAX_SHIFT)
+
+/* Free buffers kept per class, and the largest receive buffer worth
+ * keeping, anything bigger was grown for a one off
+ */
+#define POOL_MAX_FREE	8
+#define POOL_MAX_RX	(1U << 12)
+
+struct xfr_cache {
+	struct _xfr	*c_free[POOL_NUM_CLASS];
+	unsigned int	c_count[POOL_NUM_CLASS];
+};
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static int have_key;
+
+static void flush(struct xfr_cache *c)
+{
+	struct _xfr *xfr;
+	unsigned int i;
+
+	for(i = 0; i < POOL_NUM_CLASS; i++) {
+		while( (xfr = c->c_free[i]) ) {
+			c->c_free[i] = xfr->x_next;
+			_xfr_do_free(xfr);
+		}
+		c->c_count[i] = 0;
+	}
+}
+
+static void cache_dtor(void *priv)
+{
+	struct xfr_cache *c = priv;
+
+	flush(c);
+	free(c);
+}
+
+static void key_init(void)
+{
+	have_key = !pthread_key_create(&key, cache_dtor);
+}
+
+static struct xfr_cache *thread_cache(int create)
+{
+	struct xfr_cache *c;
+
+	pthread_once(&once, key_init);
+	if ( !have_key )
+		return NULL;
+
+	c = pthread_getspecific(key);
+	if ( NULL == c && create ) {
+		c = calloc(1, sizeof(*c));
+		if ( c && pthread_setspecific(key, c) ) {
+			free(c);
+			c = NULL;
+		}
+	}
+
+	return c;
+}
+
+/* Smallest class which holds len bytes, or -1 if it's too big for any */
+static int size_class(size_t len)
+{
+	unsigned int i;
+
+	for(i = 0; i < POOL_NUM_CLASS; i++) {
+		if ( len <= (POOL_MIN << i) )
+			return i;
+	}
+
+	return -1;
+}
+
+/** Get a transaction buffer from the calling thread's pool.
+ * \ingroup g_xfr
+ * @param txbuf Minimum size of transmit buffer in bytes.
+ * @param rxbuf Minimum initial size of receive buffer in bytes.
+ *
+ * As for xfr_alloc() except that a buffer previously returned with
+ * xfr_pool_put() is re-used if one of the right size is to hand. The
+ * transmit buffer may be larger than asked for.
+ *
+ * @return \ref xfr_t representing the transaction buffer, or NULL.
+ */
+xfr_t xfr_pool_get(size_t txbuf, size_t rxbuf)
+{
+	struct xfr_cache *c;
+	struct _xfr *xfr;
+	int idx;
+
+	idx = size_class(txbuf);
+	if ( idx < 0 )
+		return _xfr_do_alloc(txbuf, rxbuf);
+
+	c = thread_cache(0);
+	if ( NULL == c || NULL == c->c_free[idx] )
+		return _xfr_do_alloc(POOL_MIN << idx, rxbuf);
+
+	xfr = c->c_free[idx];
+	c->c_free[idx] = xfr->x_next;
+	c->c_count[idx]--;
+
+	/* too small a receive buffer is no reason to fail */
+	if ( !_xfr_rx_grow(xfr, rxbuf) ) {
+		_xfr_do_free(xfr);
+		return _xfr_do_alloc(POOL_MIN << idx, rxbuf);
+	}
+
+	xfr->x_next = NULL;
+	xfr_reset(xfr);
+	return xfr;
+}
+
+/** Return a transaction buffer to the calling thread's pool.
+ * \ingroup g_xfr
+ * @param xfr \ref xfr_t to recycle, may be NULL.
+ *
+ * Any buffer may be returned, including one from xfr_alloc() or from
+ * another thread's pool. Those which don't fit a size class, or which the
+ * pool has no room for, are freed.
+ */
+void xfr_pool_put(xfr_t xfr)
+{
+	struct xfr_cache *c;
+	int idx;
+
+	if ( NULL == xfr )
+		return;
+
+	idx = size_class(xfr->x_txmax);
+	if ( idx < 0 || xfr->x_txmax != (POOL_MIN << idx) ||
+			!(xfr->x_flags & XFR_RX_GROW) ||
+			xfr->x_rxmax > POOL_MAX_RX )
+		goto free;
+
+	c = thread_cache(1);
+	if ( NULL == c || c->c_count[idx] >= POOL_MAX_FREE )
+		goto free;
+
+	xfr->x_next = c->c_free[idx];
+	c->c_free[idx] = xfr;
+	c->c_count[idx]++;
+	return;
+
+free:
+	_xfr_do_free(xfr);
+}
+
+/** Free all buffers held in the calling thread's pool.
+ * \ingroup g_xfr
+ *
+ * This happens anyway when the thread exits.
+ */
+void xfr_pool_flush(void)
+{
+	struct xfr_cache *c;
+
+	c = thread_cache(0);
+	if ( c )
+		flush(c);
+}